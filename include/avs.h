@@ -46,6 +46,7 @@ extern "C" {
 #include "avs_media.h"
 #include "avs_msystem.h"
 #include "avs_nevent.h"
+#include "avs_packetpool.h"
 #include "avs_packetqueue.h"
 #include "avs_serial.h"
 #include "avs_store.h"
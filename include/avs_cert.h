@@ -19,3 +19,28 @@
 
 int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name);
 int cert_enable_ecdh(struct tls *tls);
+
+
+/*
+ * Certificate cache
+ */
+
+struct store;
+
+int cert_tls_load(struct tls *tls, struct store *st, const char *id,
+		  uint32_t max_age, uint64_t *createdp);
+int cert_tls_save(const struct tls *tls, struct store *st, const char *id);
+
+
+/*
+ * Precomputed ECDSA signing nonces
+ */
+
+struct cert_presign;
+
+int  cert_presign_alloc(struct cert_presign **psp, const char *curve_name,
+			size_t size);
+int  cert_tls_set_presign(struct tls *tls, struct cert_presign *ps);
+void cert_presign_stats(const struct cert_presign *ps, size_t *readyp,
+			uint64_t *usedp, uint64_t *missp);
+int  cert_presign_debug(struct re_printf *pf, const struct cert_presign *ps);
@@ -19,6 +19,8 @@
 #ifndef AVS_CONF_POS_H
 #define AVS_CONF_POS_H    1
 
+struct conf_roster;
+
 struct conf_part {
 	char *uid;
 	void *data;
@@ -26,6 +28,8 @@ struct conf_part {
 	uint32_t pos;
 
 	struct le le;
+	struct le hle;               /* member of roster hash, by uid */
+	struct conf_roster *roster;  /* set if part of a roster */
 };
 
 
@@ -46,4 +50,18 @@ void conf_pos_sort(struct list *partl);
 
 int conf_pos_print(struct re_printf *pf, const struct list *partl);
 
+
+/*
+ * Roster of participants, kept in position order as they come and go.
+ * The part is removed from the roster when it is dereferenced.
+ */
+
+int conf_roster_alloc(struct conf_roster **rosterp);
+int conf_roster_add(struct conf_part **cpp, struct conf_roster *roster,
+		    const char *uid, void *data);
+struct conf_part *conf_roster_find(const struct conf_roster *roster,
+				   const char *uid);
+const struct list *conf_roster_list(const struct conf_roster *roster);
+uint32_t conf_roster_count(const struct conf_roster *roster);
+
 #endif // #ifndef AVS_CONF_POS_H
@@ -29,6 +29,7 @@ typedef void (dce_close_chan_h)(int sid,
 				const char *label, const char *protocol,
 				void *arg);
 typedef void (dce_data_h)(int sid, uint8_t *data, size_t len, void *arg);
+typedef void (dce_dry_h)(void *arg);
 
 int  dce_init(void);
 void dce_close(void);
@@ -56,4 +57,14 @@ int  dce_status(struct re_printf *pf, struct dce *dce);
 int  dce_send(struct dce *dce, struct dce_channel *ch, const void *data, size_t len);
 void dce_recv_pkt(struct dce *dce, const uint8_t *pkt, size_t len);
 bool dce_snd_dry(struct dce *dce);
+void dce_channel_set_dry_handler(struct dce_channel *ch, dce_dry_h *dryh);
 bool dce_is_chan_open(const struct dce_channel *ch);
+
+struct dce_rx_stats {
+	uint64_t events;     /* delivered to the handlers */
+	uint64_t drains;     /* mqueue wakeups for the ring */
+	uint64_t overflow;   /* passed as payloads, the ring was full */
+	uint64_t push_errors; /* mqueue wakeups that failed */
+};
+
+void dce_rx_stats(struct dce_rx_stats *stats);
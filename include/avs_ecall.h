@@ -23,6 +23,7 @@ struct ecall;
 struct ecall_conf {
 	struct econn_conf econf;
 	int trace;
+	bool prewarm;  /* get ICE ready while an incoming call rings */
 };
 
 
@@ -55,6 +56,7 @@ int ecall_msg_recv(struct ecall *ecall,
 		   const char *userid_sender,
 		   const char *clientid_sender,
 		   struct econn_message *msg);
+int  ecall_reject(struct ecall *ecall);
 void ecall_end(struct ecall *ecall);
 void ecall_set_peer_userid(struct ecall *ecall, const char *userid);
 void ecall_set_peer_clientid(struct ecall *ecall, const char *clientid);
@@ -72,6 +74,8 @@ int ecall_media_start(struct ecall *ecall);
 void ecall_media_stop(struct ecall *ecall);
 int ecall_set_video_send_state(struct ecall *ecall, enum icall_vstate vstate);
 int ecall_set_group_mode(struct ecall *ecall, bool active);
+void ecall_set_turn_pool(struct ecall *ecall, struct turn_pool *pool);
+void ecall_set_udp_mux(struct ecall *ecall, struct udp_mux *mux);
 bool ecall_is_answered(const struct ecall *ecall);
 bool ecall_has_video(const struct ecall *ecall);
 int ecall_propsync_request(struct ecall *ecall);
@@ -112,6 +116,13 @@ int ecall_user_data_register_ft_handlers(struct ecall *ecall,
                 ecall_user_data_file_rcv_h *f_rcv_h,
                 ecall_user_data_file_snd_h *f_snd_h);
 
+/* for the tests, in place of the data channel */
+int ecall_user_data_recv(struct ecall *ecall,
+                const uint8_t *msg,
+                size_t len);
+int ecall_user_data_channel_changed(struct ecall *ecall, bool open);
+int ecall_user_data_debug(struct re_printf *pf, const struct ecall *ecall);
+
 int ecall_set_quality_interval(struct ecall *ecall,
 			       uint64_t interval);
 
@@ -24,3 +24,9 @@ int econn_message_encode(char **strp, const struct econn_message *msg);
 int econn_message_decode(struct econn_message **msgp,
 			 uint64_t curr_time, uint64_t msg_time,
 			 const char *str, size_t len);
+
+/* The same, through a jzon DOM */
+int econn_message_encode_jzon(char **strp, const struct econn_message *msg);
+int econn_message_decode_jzon(struct econn_message **msgp,
+			      uint64_t curr_time, uint64_t msg_time,
+			      const char *str, size_t len);
@@ -43,7 +43,14 @@ void log_register_handler(struct log *log);
 void log_unregister_handler(struct log *log);
 void log_set_min_level(enum log_level level);
 enum log_level log_get_min_level(void);
+int  log_set_module_level(const char *module, enum log_level level);
+void log_reset_module_levels(void);
+bool log_level_enabled(enum log_level level);
 void log_enable_stderr(bool enable);
+int  log_set_file(const char *path, size_t max_size, unsigned max_files);
+int  log_async_start(size_t capacity);
+void log_async_stop(void);
+uint64_t log_async_dropped(void);
 void vlog(enum log_level level, const char *fmt, va_list ap);
 void loglv(enum log_level level, const char *fmt, ...);
 void vloglv(enum log_level level, const char *fmt, va_list ap);
@@ -52,6 +59,27 @@ void info(const char *fmt, ...);
 void warning(const char *fmt, ...);
 void error(const char *fmt, ...);
 
+/*
+ * Logging on hot paths, such as once per packet. Nothing is evaluated
+ * unless the level is enabled, and building with AVS_LOG_STRIP_HOT
+ * removes these lines altogether.
+ */
+#ifdef AVS_LOG_STRIP_HOT
+#define debug_hot(...) do {} while (0)
+#define info_hot(...)  do {} while (0)
+#else
+#define debug_hot(...)					\
+	do {						\
+		if (log_level_enabled(LOG_LEVEL_DEBUG))	\
+			debug(__VA_ARGS__);		\
+	} while (0)
+#define info_hot(...)					\
+	do {						\
+		if (log_level_enabled(LOG_LEVEL_INFO))	\
+			info(__VA_ARGS__);		\
+	} while (0)
+#endif
+
 /* anonymous IDs */
 #define ANON_ID_LEN 9
 #define ANON_CLIENT_LEN 5
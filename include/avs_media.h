@@ -118,6 +118,7 @@ int mediaflow_add_data(struct mediaflow *mf);
 void mediaflow_set_gather_handler(struct mediaflow *mf,
 				  mediaflow_gather_h *gatherh);
 
+int mediaflow_prewarm(struct mediaflow *mf);
 int mediaflow_start_ice(struct mediaflow *mf);
 
 int mediaflow_start_media(struct mediaflow *mf);
@@ -145,6 +146,9 @@ int mediaflow_send_raw_rtp(struct mediaflow *mf,
 			   const uint8_t *buf, size_t len);
 int mediaflow_send_raw_rtcp(struct mediaflow *mf,
 			    const uint8_t *buf, size_t len);
+int mediaflow_send_reserve(struct mediaflow *mf, struct mbuf **mbp);
+int mediaflow_send_commit(struct mediaflow *mf, struct mbuf *mb);
+void mediaflow_send_cancel(struct mediaflow *mf);
 bool mediaflow_is_ready(const struct mediaflow *mf);
 int mediaflow_gather_stun(struct mediaflow *mf, const struct sa *stun_srv);
 int mediaflow_gather_turn(struct mediaflow *mf, const struct sa *turn_srv,
@@ -209,6 +213,7 @@ void mediaflow_set_local_eoc(struct mediaflow *mf);
 bool mediaflow_have_eoc(const struct mediaflow *mf);
 void mediaflow_enable_privacy(struct mediaflow *mf, bool enabled);
 void mediaflow_enable_group_mode(struct mediaflow *mf, bool enabled);
+void mediaflow_enable_batch_io(struct mediaflow *mf, bool enabled);
 
 const char *mediaflow_lcand_name(const struct mediaflow *mf);
 const char *mediaflow_rcand_name(const struct mediaflow *mf);
@@ -234,3 +239,91 @@ int mediaflow_add_turnserver(struct mediaflow *mf,
 			     struct zapi_ice_server *turn);
 int mediaflow_gather_all_turn(struct mediaflow *mf);
 
+struct turn_pool;
+
+int  mediaflow_turnpool_alloc(struct turn_pool **poolp);
+void mediaflow_set_turn_pool(struct mediaflow *mf, struct turn_pool *pool);
+
+
+
+/*
+ * SRTP batch
+ */
+
+int srtp_batch_encrypt(struct srtp *srtp, struct mbuf **mbv, size_t n,
+		       int *errv);
+int srtp_batch_decrypt(struct srtp *srtp, struct mbuf **mbv, size_t n,
+		       int *errv);
+
+
+/*
+ * Media I/O thread
+ */
+
+struct media_thread;
+
+typedef int (media_thread_h)(void *arg);
+
+int  media_thread_alloc(struct media_thread **mtp, const char *name);
+int  media_thread_call(struct media_thread *mt, media_thread_h *h, void *arg);
+bool media_thread_is_current(const struct media_thread *mt);
+int  media_thread_debug(struct re_printf *pf, const struct media_thread *mt);
+
+void mediaflow_set_media_thread(struct mediaflow *mf,
+				struct media_thread *mt);
+
+
+/*
+ * Shared UDP socket, for all the mediaflows of a group call
+ */
+
+struct udp_mux;
+struct udp_mux_peer;
+
+struct udp_mux_stats {
+	unsigned long long rx;
+	unsigned long long by_addr;
+	unsigned long long by_ssrc;
+	unsigned long long by_match;
+	unsigned long long dropped;
+};
+
+/* does a packet from an unknown sender belong to this peer? */
+typedef bool (udp_mux_match_h)(const struct sa *src, struct mbuf *mb,
+			       void *arg);
+
+int  udp_mux_alloc(struct udp_mux **muxp);
+int  udp_mux_sock(struct udp_sock **usp, struct udp_mux *mux,
+		  const struct sa *laddr);
+int  udp_mux_attach(struct udp_mux_peer **peerp, struct udp_mux *mux,
+		    const struct udp_sock *us, udp_mux_match_h *matchh,
+		    udp_recv_h *recvh, void *arg);
+void udp_mux_confirm(struct udp_mux_peer *peer, const struct sa *src,
+		     const struct mbuf *mb);
+const struct udp_mux_stats *udp_mux_stats(const struct udp_mux *mux);
+int  udp_mux_debug(struct re_printf *pf, const struct udp_mux *mux);
+
+void mediaflow_set_udp_mux(struct mediaflow *mf, struct udp_mux *mux);
+
+
+/*
+ * RTCP compound packet iterator, looks at the packets in place
+ */
+
+struct rtcp_iter {
+	const uint8_t *p;
+	size_t left;
+	int err;             /* set if the compound packet is malformed */
+};
+
+struct rtcp_iter_pkt {
+	uint8_t pt;          /* RTCP packet type */
+	uint8_t count;       /* count or feedback message type */
+	const uint8_t *body; /* after the 4 byte header */
+	size_t body_len;
+};
+
+void rtcp_iter_init(struct rtcp_iter *it, const uint8_t *buf, size_t len);
+bool rtcp_iter_next(struct rtcp_iter *it, struct rtcp_iter_pkt *pkt);
+bool rtcp_iter_app(const struct rtcp_iter_pkt *pkt, const uint8_t **namep,
+		   const uint8_t **datap, size_t *lenp);
@@ -28,16 +28,39 @@ struct msystem;
 
 struct msystem_config {
 	bool data_channel;
+
+	/* reuse the DTLS certificate from here, if set */
+	struct store *cert_store;
+	uint32_t cert_max_age;    /* seconds, 0 for the default */
+
+	/* bring up DTLS, the engines and the data channel on the
+	 * first call, with msystem_prepare() */
+	bool lazy_init;
+};
+
+/* time spent in each step of the init */
+struct msystem_trace {
+	struct {
+		const char *name;
+		uint64_t usec;
+	} stepv[8];
+	size_t stepc;
 };
 
 int msystem_get(struct msystem **msysp, const char *msysname,
 		struct msystem_config *config);
 bool msystem_is_initialized(struct msystem *msys);
+int  msystem_prepare(struct msystem *msys);
+bool msystem_is_prepared(const struct msystem *msys);
+const struct msystem_trace *msystem_trace(const struct msystem *msys);
+int  msystem_trace_debug(struct re_printf *pf, const struct msystem *msys);
 struct tls *msystem_dtls(struct msystem *msys);
 struct list *msystem_aucodecl(struct msystem *msys);
 struct list *msystem_vidcodecl(struct msystem *msys);
 bool msystem_get_loopback(struct msystem *msys);
 bool msystem_get_privacy(struct msystem *msys);
+bool msystem_get_batch_io(struct msystem *msys);
+bool msystem_get_shared_socket(struct msystem *msys);
 const char *msystem_get_interface(struct msystem *msys);
 void msystem_start(struct msystem *msys);
 void msystem_stop(struct msystem *msys);
@@ -46,12 +69,16 @@ int  msystem_push(struct msystem *msys, int op, void *arg);
 bool msystem_is_using_voe(struct msystem *msys);
 void msystem_enable_loopback(struct msystem *msys, bool enable);
 void msystem_enable_privacy(struct msystem *msys, bool enable);
+void msystem_enable_batch_io(struct msystem *msys, bool enable);
+void msystem_enable_shared_socket(struct msystem *msys, bool enable);
+int  msystem_enable_media_threads(struct msystem *msys, unsigned n);
+struct media_thread *msystem_media_thread(struct msystem *msys);
 void msystem_enable_kase(struct msystem *msys, bool enable);
 bool msystem_have_kase(const struct msystem *msys);
 void msystem_set_ifname(struct msystem *msys, const char *ifname);
 int  msystem_enable_datachannel(struct msystem *msys, bool enable);
 bool msystem_have_datachannel(const struct msystem *msys);
-int msystem_update_conf_parts(struct list *partl);
+int msystem_update_conf_parts(const struct list *partl);
 struct dnsc *msystem_dnsc(void);
 
 
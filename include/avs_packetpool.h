@@ -0,0 +1,61 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AVS_PACKET_POOL_H
+#define AVS_PACKET_POOL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Pool of fixed-size packet buffers (struct mbuf)
+ *
+ * A buffer taken from the pool is returned to the pool when the caller
+ * drops its last reference to the mbuf with mem_deref(), on any thread.
+ * If all buffers are in use, a fresh mbuf is allocated and counted as a
+ * miss.
+ */
+
+struct packet_pool;
+
+struct packet_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t allocs;         /* heap allocations after packet_pool_alloc */
+	size_t nbufs;
+	size_t bufsz;
+};
+
+int packet_pool_alloc(struct packet_pool **poolp, size_t nbufs,
+		      size_t bufsz);
+struct mbuf *packet_pool_get(struct packet_pool *pool, size_t headroom);
+void packet_pool_stats(const struct packet_pool *pool,
+		       struct packet_pool_stats *stats);
+int packet_pool_debug(struct re_printf *pf, const struct packet_pool *pool);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //AVS_PACKET_POOL_H
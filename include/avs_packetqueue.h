@@ -22,26 +22,48 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
-typedef struct locked_queue_t packet_queue_t;
-
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+
+/*
+ * Bounded lock-free packet queue
+ *
+ * Packets are copied into fixed-size slots inside a ring buffer, so
+ * pushing and popping does not allocate. The queue has one consumer and
+ * either one (SPSC) or several (MPSC) producers. In blocking mode the
+ * consumer sleeps when the queue is empty, and a producer only wakes it
+ * up when it is actually parked.
+ */
+
+enum {
+	PACKET_QUEUE_SLOT_SIZE = 1500,
+	PACKET_QUEUE_CAPACITY  = 256,
+};
+
 typedef enum {
 	PACKET_TYPE_RTP = 0,
 	PACKET_TYPE_RTCP = 1
 } packet_type_t;
 
+enum packet_queue_mode {
+	PACKET_QUEUE_SPSC = 0,
+	PACKET_QUEUE_MPSC = 1
+};
+
 struct packet_queue_item_t {
-	struct le list_elem;
 	packet_type_t packet_type;
-	uint8_t *packet_data;
 	size_t packet_size;
+	uint8_t packet_data[PACKET_QUEUE_SLOT_SIZE];
 };
 
+typedef struct packet_queue packet_queue_t;
+
 int packet_queue_alloc(packet_queue_t **pqp, bool blocking);
+int packet_queue_alloc_ext(packet_queue_t **pqp, enum packet_queue_mode mode,
+			   size_t capacity, bool blocking);
 
 int packet_queue_push(packet_queue_t *q, packet_type_t packet_type,
 		      const uint8_t *packet_data, size_t packet_size);
@@ -49,6 +71,14 @@ int packet_queue_push(packet_queue_t *q, packet_type_t packet_type,
 int packet_queue_pop(packet_queue_t *q, packet_type_t *packet_type,
 		      uint8_t **packet_data, size_t *packet_size);
 
+size_t packet_queue_pop_batch(packet_queue_t *q,
+			      const struct packet_queue_item_t **itemv,
+			      size_t max);
+void packet_queue_release(packet_queue_t *q, size_t count);
+
+size_t packet_queue_count(const packet_queue_t *q);
+uint64_t packet_queue_dropped(const packet_queue_t *q);
+
 #ifdef __cplusplus
 }
 #endif
@@ -98,3 +98,29 @@ int sobject_read_pl(struct pl *pl, struct sobject *so);
 
 int store_mkdirf(mode_t mode, const char *fmt, ...);
 int store_remove_pathf(const char *fmt, ...);
+
+
+/*** File sink ***/
+
+/* Writes buffers to a file from a background thread.
+ *
+ * The handler is called on the re thread with the number of bytes
+ * written so far, at most once per wakeup of the re thread. It is
+ * called with *done* set after file_sink_finish(), when the file has
+ * been closed. A non-zero *err* is the first failed write, later
+ * buffers are dropped.
+ */
+
+#define FILE_SINK_MAX_QUEUED (32*1024*1024)
+
+struct file_sink;
+
+typedef void (file_sink_h)(uint64_t written, bool done, int err, void *arg);
+
+int file_sink_alloc(struct file_sink **fsp, const char *path,
+		    file_sink_h *h, void *arg);
+int file_sink_write(struct file_sink *fs, uint64_t off,
+		    const uint8_t *buf, size_t len);
+int file_sink_finish(struct file_sink *fs);
+size_t file_sink_queued(const struct file_sink *fs);
+int file_sink_debug(struct re_printf *pf, const struct file_sink *fs);
@@ -88,6 +88,28 @@ bool turnconn_is_one_allocated(const struct list *turnconnl);
 bool turnconn_are_all_allocated(const struct list *turnconnl);
 bool turnconn_are_all_failed(const struct list *turnconnl);
 int turnconn_debug(struct re_printf *pf, const struct turn_conn *conn);
+int turnconn_handover(struct turn_conn *conn, struct list *connl,
+		      turnconn_estab_h *estabh, turnconn_data_h *datah,
+		      turnconn_error_h *errorh, void *arg);
+
+
+/*
+ * TURN allocation pool
+ */
+
+struct turn_pool;
+
+int  turnpool_alloc(struct turn_pool **poolp, int layer_stun, int layer_turn);
+int  turnpool_add(struct turn_pool *pool, const char *url,
+		  const char *username, const char *password);
+bool turnpool_find(const struct turn_pool *pool, const char *url);
+void turnpool_start(struct turn_pool *pool, int af);
+void turnpool_stop(struct turn_pool *pool);
+int  turnpool_take(struct turn_pool *pool, struct turn_conn **connp,
+		   struct list *connl, const char *url, int af,
+		   turnconn_estab_h *estabh, turnconn_data_h *datah,
+		   turnconn_error_h *errorh, void *arg);
+int  turnpool_debug(struct re_printf *pf, const struct turn_pool *pool);
 
 
 /*
@@ -197,6 +197,8 @@ typedef int (wcall_config_req_h)(void *wuser, void *arg);
 
 int wcall_init(void);
 void wcall_close(void);
+void wcall_enable_lazy_init(int enabled);
+void wcall_enable_prewarm(int enabled);
 
 void *wcall_create(const char *userid,
 	       const char *clientid,
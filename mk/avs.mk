@@ -119,6 +119,9 @@ endif
 ifneq ($(HAVE_CRYPTOBOX),)
 AVS_CPPFLAGS += -DHAVE_CRYPTOBOX=1
 endif
+ifneq ($(AVS_LOG_STRIP_HOT),)
+AVS_CPPFLAGS += -DAVS_LOG_STRIP_HOT=1
+endif
 
 AVS_DEPS := $(CONTRIB_LIBRE_TARGET) \
 	$(CONTRIB_OPUS_TARGET) \
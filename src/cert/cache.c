@@ -0,0 +1,202 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_store.h"
+#include "avs_cert.h"
+
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+
+
+/*
+ * Certificate cache
+ *
+ * The certificate and private key of a TLS context are kept as PEM
+ * in a global store object, together with the time they were made.
+ * The store directory is only readable by the user. An entry older
+ * than max_age is not used, so that the key is rotated every now
+ * and then.
+ */
+
+
+#define CERT_TYPE "cert"
+
+enum {
+	CERT_VERSION = 1,
+};
+
+
+static int bio_pl(struct pl *pl, BIO *bio)
+{
+	char *p;
+	long n;
+
+	n = BIO_get_mem_data(bio, &p);
+	if (n <= 0)
+		return ENOENT;
+
+	pl->p = p;
+	pl->l = n;
+
+	return 0;
+}
+
+
+/**
+ * Load a cached certificate and key into a TLS context
+ *
+ * Returns ENOENT if there is none, and ETIMEDOUT if it is older than
+ * max_age seconds.
+ */
+int cert_tls_load(struct tls *tls, struct store *st, const char *id,
+		  uint32_t max_age, uint64_t *createdp)
+{
+	struct sobject *so = NULL;
+	char *cert = NULL, *key = NULL;
+	uint32_t version;
+	uint64_t created, now;
+	int err;
+
+	if (!tls || !st || !id)
+		return EINVAL;
+
+	err = store_global_open(&so, st, CERT_TYPE, id, "rb");
+	if (err)
+		return err;
+
+	err = sobject_read_u32(&version, so);
+	if (err)
+		goto out;
+
+	if (version != CERT_VERSION) {
+		err = EPROTO;
+		goto out;
+	}
+
+	/* stop at the first error, a bad length makes the rest garbage */
+	err = sobject_read_u64(&created, so);
+	if (!err)
+		err = sobject_read_lenstr(&cert, so);
+	if (!err)
+		err = sobject_read_lenstr(&key, so);
+	if (err)
+		goto out;
+
+	if (!cert || !key) {
+		err = EPROTO;
+		goto out;
+	}
+
+	now = (uint64_t)time(NULL);
+	if (max_age && (created > now || now - created > max_age)) {
+		info("cert: cached '%s' has expired\n", id);
+		err = ETIMEDOUT;
+		goto out;
+	}
+
+	err = tls_set_certificate_pem(tls, cert, str_len(cert),
+				      key, str_len(key));
+	if (err) {
+		warning("cert: cached '%s' cannot be used (%m)\n", id, err);
+		goto out;
+	}
+
+	if (createdp)
+		*createdp = created;
+
+ out:
+	mem_deref(so);
+	mem_deref(cert);
+	mem_deref(key);
+
+	return err;
+}
+
+
+/**
+ * Save the certificate and key of a TLS context in the store
+ */
+int cert_tls_save(const struct tls *tls, struct store *st, const char *id)
+{
+	struct sobject *so = NULL;
+	BIO *cbio = NULL, *kbio = NULL;
+	struct pl cert, key;
+	SSL_CTX *ctx;
+	int err;
+
+	if (!tls || !st || !id)
+		return EINVAL;
+
+	ctx = tls_openssl_context(tls);
+	if (!ctx) {
+		warning("cert: no openssl context\n");
+		return ENOENT;
+	}
+
+	cbio = BIO_new(BIO_s_mem());
+	kbio = BIO_new(BIO_s_mem());
+	if (!cbio || !kbio) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (!PEM_write_bio_X509(cbio, SSL_CTX_get0_certificate(ctx)) ||
+	    !PEM_write_bio_PrivateKey(kbio, SSL_CTX_get0_privatekey(ctx),
+				      NULL, NULL, 0, NULL, NULL)) {
+		warning("cert: cannot encode '%s'\n", id);
+		err = EPROTO;
+		goto out;
+	}
+
+	err  = bio_pl(&cert, cbio);
+	err |= bio_pl(&key, kbio);
+	if (err)
+		goto out;
+
+	err = store_global_open(&so, st, CERT_TYPE, id, "wb");
+	if (err)
+		goto out;
+
+	err  = sobject_write_u32(so, CERT_VERSION);
+	err |= sobject_write_u64(so, (uint64_t)time(NULL));
+	err |= sobject_write_pl(so, &cert);
+	err |= sobject_write_pl(so, &key);
+	if (err) {
+		warning("cert: cannot save '%s' (%m)\n", id, err);
+		goto out;
+	}
+
+ out:
+	mem_deref(so);
+	if (cbio)
+		BIO_free(cbio);
+	if (kbio)
+		BIO_free(kbio);
+
+	if (err) {
+		ERR_clear_error();
+		(void)store_global_unlink(st, CERT_TYPE, id);
+	}
+
+	return err;
+}
@@ -3,5 +3,7 @@
 #
 
 AVS_SRCS += \
-	cert/cert.c
+	cert/cache.c \
+	cert/cert.c \
+	cert/presign.c
 
@@ -0,0 +1,426 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_cert.h"
+
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+
+
+/*
+ * Precomputed ECDSA signing nonces
+ *
+ * Most of the cost of an ECDSA signature is the scalar multiplication
+ * k*G, which does not depend on the message or the private key. A
+ * background thread keeps a pool of (k^-1, r) pairs ready, and the
+ * signatures of the DTLS handshake take one pair each, leaving only a
+ * few field operations on the calling thread. When the pool is empty
+ * the signature is done the normal way.
+ *
+ * Every pair is used for one signature only.
+ */
+
+
+struct nonce {
+	BIGNUM *kinv;
+	BIGNUM *r;
+};
+
+struct cert_presign {
+	pthread_t tid;
+	bool started;
+	bool run;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	EC_KEY *eckey;          /* of the same curve, worker only */
+	struct nonce *noncev;
+	size_t size;
+	size_t count;
+
+	uint64_t n_used;
+	uint64_t n_miss;
+};
+
+
+static EC_KEY_METHOD *presign_meth;
+static int presign_idx = -1;
+
+static ECDSA_SIG *(*default_sign_sig)(const unsigned char *dgst, int dlen,
+				      const BIGNUM *in_kinv,
+				      const BIGNUM *in_r, EC_KEY *eckey);
+
+
+static void nonce_free(struct nonce *nonce)
+{
+	BN_clear_free(nonce->kinv);
+	BN_clear_free(nonce->r);
+	nonce->kinv = NULL;
+	nonce->r = NULL;
+}
+
+
+static void *presign_thread(void *arg)
+{
+	struct cert_presign *ps = arg;
+
+	pthread_mutex_lock(&ps->mutex);
+
+	while (ps->run) {
+		struct nonce nonce = {NULL, NULL};
+		bool ok;
+
+		if (ps->count >= ps->size) {
+			pthread_cond_wait(&ps->cond, &ps->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&ps->mutex);
+
+		ok = ECDSA_sign_setup(ps->eckey, NULL, &nonce.kinv, &nonce.r);
+		if (!ok)
+			ERR_clear_error();
+
+		pthread_mutex_lock(&ps->mutex);
+
+		if (!ok) {
+			warning("cert: presign: sign setup failed\n");
+			break;
+		}
+
+		if (ps->run && ps->count < ps->size)
+			ps->noncev[ps->count++] = nonce;
+		else
+			nonce_free(&nonce);
+	}
+
+	pthread_mutex_unlock(&ps->mutex);
+
+	return NULL;
+}
+
+
+static bool presign_take(struct cert_presign *ps, struct nonce *nonce)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&ps->mutex);
+
+	if (ps->count) {
+		*nonce = ps->noncev[--ps->count];
+		++ps->n_used;
+		found = true;
+
+		pthread_cond_signal(&ps->cond);
+	}
+	else {
+		++ps->n_miss;
+	}
+
+	pthread_mutex_unlock(&ps->mutex);
+
+	return found;
+}
+
+
+static ECDSA_SIG *presign_sign_sig(const unsigned char *dgst, int dlen,
+				   const BIGNUM *in_kinv, const BIGNUM *in_r,
+				   EC_KEY *eckey)
+{
+	struct cert_presign *ps;
+	struct nonce nonce;
+	ECDSA_SIG *sig;
+
+	ps = EC_KEY_get_ex_data(eckey, presign_idx);
+
+	if (in_kinv || !ps || !presign_take(ps, &nonce))
+		return default_sign_sig(dgst, dlen, in_kinv, in_r, eckey);
+
+	sig = default_sign_sig(dgst, dlen, nonce.kinv, nonce.r, eckey);
+
+	nonce_free(&nonce);
+
+	/* very unlikely, s was zero for this nonce */
+	if (!sig) {
+		ERR_clear_error();
+		sig = default_sign_sig(dgst, dlen, NULL, NULL, eckey);
+	}
+
+	return sig;
+}
+
+
+static void presign_ex_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+			    int idx, long argl, void *argp)
+{
+	(void)parent;
+	(void)ad;
+	(void)idx;
+	(void)argl;
+	(void)argp;
+
+	mem_deref(ptr);
+}
+
+
+static int presign_meth_init(void)
+{
+	int (*sign)(int type, const unsigned char *dgst, int dlen,
+		    unsigned char *sig, unsigned int *siglen,
+		    const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey);
+	int (*sign_setup)(EC_KEY *eckey, BN_CTX *ctx,
+			  BIGNUM **kinvp, BIGNUM **rp);
+
+	if (presign_meth)
+		return 0;
+
+	presign_idx = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL,
+					      presign_ex_free);
+	if (presign_idx < 0)
+		return ENOMEM;
+
+	presign_meth = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+	if (!presign_meth)
+		return ENOMEM;
+
+	EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(),
+			       &sign, &sign_setup, &default_sign_sig);
+	EC_KEY_METHOD_set_sign(presign_meth,
+			       sign, sign_setup, presign_sign_sig);
+
+	return 0;
+}
+
+
+static void destructor(void *arg)
+{
+	struct cert_presign *ps = arg;
+	size_t i;
+
+	if (ps->started) {
+		pthread_mutex_lock(&ps->mutex);
+		ps->run = false;
+		pthread_cond_signal(&ps->cond);
+		pthread_mutex_unlock(&ps->mutex);
+
+		pthread_join(ps->tid, NULL);
+	}
+
+	for (i = 0; i < ps->count; i++)
+		nonce_free(&ps->noncev[i]);
+
+	mem_deref(ps->noncev);
+
+	if (ps->eckey)
+		EC_KEY_free(ps->eckey);
+
+	pthread_cond_destroy(&ps->cond);
+	pthread_mutex_destroy(&ps->mutex);
+}
+
+
+/**
+ * Start a background thread that keeps `size' signing nonces ready
+ * for keys on the curve `curve_name'
+ */
+int cert_presign_alloc(struct cert_presign **psp, const char *curve_name,
+		       size_t size)
+{
+	struct cert_presign *ps;
+	int nid, err;
+
+	if (!psp || !curve_name || !size)
+		return EINVAL;
+
+	nid = OBJ_txt2nid(curve_name);
+	if (nid == NID_undef) {
+		warning("cert: presign: curve not supported: %s\n",
+			curve_name);
+		return ENOTSUP;
+	}
+
+	ps = mem_zalloc(sizeof(*ps), destructor);
+	if (!ps)
+		return ENOMEM;
+
+	err = pthread_mutex_init(&ps->mutex, NULL);
+	if (err)
+		goto out;
+
+	err = pthread_cond_init(&ps->cond, NULL);
+	if (err)
+		goto out;
+
+	ps->noncev = mem_zalloc(size * sizeof(*ps->noncev), NULL);
+	if (!ps->noncev) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	ps->size = size;
+
+	/* the nonces only depend on the curve, any key of it will do */
+	ps->eckey = EC_KEY_new_by_curve_name(nid);
+	if (!ps->eckey || !EC_KEY_generate_key(ps->eckey)) {
+		warning("cert: presign: cannot generate key\n");
+		ERR_clear_error();
+		err = ENOMEM;
+		goto out;
+	}
+
+	ps->run = true;
+
+	err = pthread_create(&ps->tid, NULL, presign_thread, ps);
+	if (err) {
+		warning("cert: presign: cannot create thread (%m)\n", err);
+		goto out;
+	}
+
+	ps->started = true;
+
+ out:
+	if (err)
+		mem_deref(ps);
+	else
+		*psp = ps;
+
+	return err;
+}
+
+
+/**
+ * Sign with nonces from the pool, for the ECDSA key of a TLS context.
+ * The key must be set, and stays as it is if this fails.
+ */
+int cert_tls_set_presign(struct tls *tls, struct cert_presign *ps)
+{
+	EVP_PKEY *pkey = NULL;
+	EC_KEY *eckey = NULL;
+	struct cert_presign *old;
+	SSL_CTX *ctx;
+	int err;
+
+	if (!tls || !ps)
+		return EINVAL;
+
+	ctx = tls_openssl_context(tls);
+	if (!ctx) {
+		warning("cert: no openssl context\n");
+		return ENOENT;
+	}
+
+	err = presign_meth_init();
+	if (err)
+		return err;
+
+	eckey = EVP_PKEY_get1_EC_KEY(SSL_CTX_get0_privatekey(ctx));
+	if (!eckey) {
+		warning("cert: presign: no ECDSA key\n");
+		err = ENOENT;
+		goto out;
+	}
+
+	old = EC_KEY_get_ex_data(eckey, presign_idx);
+	if (!EC_KEY_set_ex_data(eckey, presign_idx, ps)) {
+		err = ENOMEM;
+		goto out;
+	}
+	mem_ref(ps);
+	mem_deref(old);
+
+	/* a key with its own method makes OpenSSL use the method */
+	if (!EC_KEY_set_method(eckey, presign_meth)) {
+		err = EPROTO;
+		goto out;
+	}
+
+	pkey = EVP_PKEY_new();
+	if (!pkey) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (!EVP_PKEY_assign_EC_KEY(pkey, eckey)) {
+		err = EPROTO;
+		goto out;
+	}
+
+	/* ownership of eckey was assigned, don't free it. */
+	eckey = NULL;
+
+	if (1 != SSL_CTX_use_PrivateKey(ctx, pkey)) {
+		warning("cert: presign: SSL_CTX_use_PrivateKey error\n");
+		err = EPROTO;
+		goto out;
+	}
+
+ out:
+	if (eckey)
+		EC_KEY_free(eckey);
+	if (pkey)
+		EVP_PKEY_free(pkey);
+
+	if (err)
+		ERR_clear_error();
+
+	return err;
+}
+
+
+void cert_presign_stats(const struct cert_presign *ps, size_t *readyp,
+			uint64_t *usedp, uint64_t *missp)
+{
+	struct cert_presign *ps_rw = (struct cert_presign *)ps;
+
+	if (!ps)
+		return;
+
+	pthread_mutex_lock(&ps_rw->mutex);
+
+	if (readyp)
+		*readyp = ps->count;
+	if (usedp)
+		*usedp = ps->n_used;
+	if (missp)
+		*missp = ps->n_miss;
+
+	pthread_mutex_unlock(&ps_rw->mutex);
+}
+
+
+int cert_presign_debug(struct re_printf *pf, const struct cert_presign *ps)
+{
+	size_t ready = 0;
+	uint64_t used = 0, miss = 0;
+
+	if (!ps)
+		return 0;
+
+	cert_presign_stats(ps, &ready, &used, &miss);
+
+	return re_hprintf(pf, "presign: ready=%zu/%zu used=%llu miss=%llu",
+			  ready, ps->size,
+			  (unsigned long long)used, (unsigned long long)miss);
+}
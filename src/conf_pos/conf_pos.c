@@ -20,17 +20,33 @@
 #include "avs_conf_pos.h"
 
 
+struct conf_roster {
+	struct list partl;         /* in position order, highest first */
+	struct hash *ht;           /* by uid */
+
+	struct conf_part **sortv;  /* same order as partl */
+	uint32_t sortc;
+	uint32_t sortsz;
+};
+
+
+static void roster_remove(struct conf_roster *roster, struct conf_part *cp);
+
+
 static void cp_destructor(void *arg)
 {
 	struct conf_part *cp = arg;
 
+	if (cp->roster)
+		roster_remove(cp->roster, cp);
+
 	list_unlink(&cp->le);
+	hash_unlink(&cp->hle);
 	mem_deref(cp->uid);
 }
 
 
-int conf_part_add(struct conf_part **cpp, struct list *partl,
-		  const char *userid, void *data)
+static int part_alloc(struct conf_part **cpp, const char *userid, void *data)
 {
 	struct conf_part *cp;
 	int err;
@@ -41,20 +57,35 @@ int conf_part_add(struct conf_part **cpp, struct list *partl,
 
 	cp->data = data;
 	err = str_dup(&cp->uid, userid);
-	if (err)
-		goto out;
+	if (err) {
+		mem_deref(cp);
+		return err;
+	}
 
 	cp->pos = conf_pos_calc(userid);
 
-	list_append(partl, &cp->le, cp);
+	*cpp = cp;
 
- out:
+	return 0;
+}
+
+
+int conf_part_add(struct conf_part **cpp, struct list *partl,
+		  const char *userid, void *data)
+{
+	struct conf_part *cp;
+	int err;
+
+	err = part_alloc(&cp, userid, data);
 	if (err)
-		mem_deref(cp);
-	else if (cpp)
+		return err;
+
+	list_append(partl, &cp->le, cp);
+
+	if (cpp)
 		*cpp = cp;
 
-	return err;
+	return 0;
 }
 
 
@@ -94,6 +125,7 @@ uint32_t conf_pos_calc(const char *uid)
 {
 	uint32_t hp;
 
+	/* also the key of the roster hash table */
 	hp = hash_joaat_str_ci(uid);
 
 	return hp;
@@ -161,3 +193,198 @@ int conf_pos_print(struct re_printf *pf, const struct list *partl)
 
 	return err;
 }
+
+
+static void roster_destructor(void *arg)
+{
+	struct conf_roster *roster = arg;
+	uint32_t i;
+
+	/* the parts may outlive the roster */
+	for (i = 0; i < roster->sortc; i++) {
+		struct conf_part *cp = roster->sortv[i];
+
+		list_unlink(&cp->le);
+		hash_unlink(&cp->hle);
+		cp->roster = NULL;
+	}
+
+	mem_deref(roster->sortv);
+	mem_deref(roster->ht);
+}
+
+
+int conf_roster_alloc(struct conf_roster **rosterp)
+{
+	struct conf_roster *roster;
+	int err;
+
+	if (!rosterp)
+		return EINVAL;
+
+	roster = mem_zalloc(sizeof(*roster), roster_destructor);
+	if (!roster)
+		return ENOMEM;
+
+	list_init(&roster->partl);
+
+	err = hash_alloc(&roster->ht, 64);
+	if (err)
+		goto out;
+
+ out:
+	if (err)
+		mem_deref(roster);
+	else
+		*rosterp = roster;
+
+	return err;
+}
+
+
+/* index of the first part that goes after pos (highest pos first) */
+static uint32_t upper_bound(const struct conf_roster *roster, uint32_t pos)
+{
+	uint32_t lo = 0, hi = roster->sortc;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (roster->sortv[mid]->pos >= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/* index of the first part with the same or a lower pos */
+static uint32_t lower_bound(const struct conf_roster *roster, uint32_t pos)
+{
+	uint32_t lo = 0, hi = roster->sortc;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (roster->sortv[mid]->pos > pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static void roster_remove(struct conf_roster *roster, struct conf_part *cp)
+{
+	uint32_t i;
+
+	for (i = lower_bound(roster, cp->pos); i < roster->sortc; i++) {
+
+		if (roster->sortv[i] == cp) {
+			memmove(&roster->sortv[i], &roster->sortv[i + 1],
+				(roster->sortc - i - 1) * sizeof(cp));
+			--roster->sortc;
+			break;
+		}
+
+		if (roster->sortv[i]->pos != cp->pos)
+			break;
+	}
+
+	list_unlink(&cp->le);
+	hash_unlink(&cp->hle);
+	cp->roster = NULL;
+}
+
+
+/*
+ * The part is put in place with a binary search, and a participant
+ * joining or leaving does not touch the position of the others.
+ */
+int conf_roster_add(struct conf_part **cpp, struct conf_roster *roster,
+		    const char *uid, void *data)
+{
+	struct conf_part *cp;
+	uint32_t idx;
+	int err;
+
+	if (!roster || !uid)
+		return EINVAL;
+
+	if (roster->sortc == roster->sortsz) {
+
+		uint32_t sz = roster->sortsz ? roster->sortsz * 2 : 16;
+		struct conf_part **sortv;
+
+		sortv = mem_reallocarray(roster->sortv, sz, sizeof(*sortv),
+					 NULL);
+		if (!sortv)
+			return ENOMEM;
+
+		roster->sortv = sortv;
+		roster->sortsz = sz;
+	}
+
+	err = part_alloc(&cp, uid, data);
+	if (err)
+		return err;
+
+	idx = upper_bound(roster, cp->pos);
+
+	if (idx < roster->sortc) {
+		list_insert_before(&roster->partl, &roster->sortv[idx]->le,
+				   &cp->le, cp);
+	}
+	else {
+		list_append(&roster->partl, &cp->le, cp);
+	}
+
+	memmove(&roster->sortv[idx + 1], &roster->sortv[idx],
+		(roster->sortc - idx) * sizeof(cp));
+	roster->sortv[idx] = cp;
+	++roster->sortc;
+
+	hash_append(roster->ht, cp->pos, &cp->hle, cp);
+	cp->roster = roster;
+
+	if (cpp)
+		*cpp = cp;
+
+	return 0;
+}
+
+
+static bool uid_cmp_handler(struct le *le, void *arg)
+{
+	const struct conf_part *cp = le->data;
+	const char *uid = arg;
+
+	return 0 == str_casecmp(cp->uid, uid);
+}
+
+
+struct conf_part *conf_roster_find(const struct conf_roster *roster,
+				   const char *uid)
+{
+	if (!roster || !uid)
+		return NULL;
+
+	return list_ledata(hash_lookup(roster->ht, conf_pos_calc(uid),
+				       uid_cmp_handler, (void *)uid));
+}
+
+
+const struct list *conf_roster_list(const struct conf_roster *roster)
+{
+	return roster ? &roster->partl : NULL;
+}
+
+
+uint32_t conf_roster_count(const struct conf_roster *roster)
+{
+	return roster ? roster->sortc : 0;
+}
@@ -57,6 +57,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -104,34 +105,95 @@ enum mq_type {
 	CH_ESTAB,
 	CH_OPEN,
 	CH_CLOSE,
-	CH_DATA
+	CH_DATA,
+	SND_DRY,
+	RX_DRAIN
 };
 
-struct payload {
-	struct le le;
+/* must be a power of two */
+#define RX_RING_SIZE 256
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+
+#define RX_PUSH_TRIES 3
+
+struct dce_event {
 	enum mq_type type;
-	struct dce *dce;           /* pointer */
+	uintptr_t handle;          /* of the dce */
 	struct dce_channel *ch;    /* pointer */
-	uint32_t magic;
+	uint16_t sid;              /* CH_OPEN */
+	uint8_t *buf;              /* CH_DATA, from usrsctp, owned */
+	size_t len;
+};
 
-	union {
-		struct {
-			uint16_t sid;
-		} chopen;
+struct payload {
+	struct le le;
+	struct dce_event ev;
+	uint32_t magic;
+};
 
-		struct {
-			uint8_t *buf;
-			size_t len;
-		} chdata;
-	} v;
+/*
+ * Events to the re thread
+ *
+ * Events are put in a ring, and the first event after a drain pushes
+ * one RX_DRAIN to the mqueue, which delivers everything in the ring.
+ * The ring is MPSC with a sequence number per slot:
+ *
+ *   seq == pos                 slot is free for the producer at pos
+ *   seq == pos + 1             slot holds the event at pos
+ *   seq == pos + RX_RING_SIZE  slot was consumed
+ *
+ * The data of a message is not copied, the buffer from usrsctp is
+ * handed over to the ring and freed after the data handler.
+ *
+ * When the ring is full, events go to the mqueue as payloads instead,
+ * and keep doing so until all of them have been delivered, so that
+ * the order of the events is kept.
+ */
+struct rx_slot {
+	size_t seq;
+	struct dce_event ev;
 };
 
+/*
+ * Handle table
+ *
+ * usrsctp knows a dce by its handle, the index of a slot in this
+ * table tagged with a generation. A lookup is O(1) and lock-free: the
+ * user count of the slot is raised before the handle is compared, and
+ * the destructor clears the handle before it waits for the users to
+ * leave. A stale handle never matches again.
+ */
+#define DCE_MAX_HANDLES 1024
+#define HANDLE_SHIFT 16
+#define HANDLE_MASK ((1 << HANDLE_SHIFT) - 1)
+
+struct dce_slot {
+	uintptr_t handle;   /* 0 if not in use */
+	struct dce *dce;
+	unsigned gen;
+	int users;
+};
 
 static struct {
-	struct lock *lock;
-	struct list dcel;
+	struct lock *lock;         /* slot allocation */
+	struct dce_slot handlev[DCE_MAX_HANDLES];
+	size_t next_handle;
+
 	struct list pendingl;
 	struct mqueue *mqueue;
+
+	struct {
+		struct rx_slot slotv[RX_RING_SIZE];
+		size_t head;        /* re thread */
+		size_t tail;        /* producers */
+		int drain;          /* a RX_DRAIN is queued */
+		int overflow;       /* payloads in the mqueue */
+
+		uint64_t n_events;
+		uint64_t n_drains;
+		uint64_t n_overflow;
+		uint64_t n_push_errors;
+	} rx;
 } g_dce = {
 	.lock = NULL
 };
@@ -169,6 +231,7 @@ struct dce_channel {
 	dce_open_chan_h *openh;
 	dce_close_chan_h *closeh;
 	dce_data_h *datah;
+	dce_dry_h *dryh;
 	int id;
 	void *arg;
 };
@@ -183,7 +246,7 @@ struct dce {
 	bool snd_dry_event;
 	void *arg;
 
-	struct le le; /* member of global active list */
+	uintptr_t handle;
 
 	uint32_t magic;
 };
@@ -254,20 +317,11 @@ static void payload_destructor(void *arg)
 
 	list_unlink(&pld->le);
 
-	switch (pld->type) {
-
-	case CH_DATA:
-		mem_deref(pld->v.chdata.buf);
-		break;
-
-	default:
-		break;
-	}
+	free(pld->ev.buf);
 }
 
 
-static struct payload *payload_new(struct dce *dce, struct dce_channel *ch,
-				   enum mq_type type)
+static struct payload *payload_new(const struct dce_event *ev)
 {
 	struct payload *pld;
 
@@ -276,9 +330,7 @@ static struct payload *payload_new(struct dce *dce, struct dce_channel *ch,
 		return NULL;
 
 	pld->magic = PAYLOAD_MAGIC;
-	pld->type = type;
-	pld->dce = dce;
-	pld->ch = ch;
+	pld->ev = *ev;
 
 	list_append(&g_dce.pendingl, &pld->le, pld);
 
@@ -286,18 +338,235 @@ static struct payload *payload_new(struct dce *dce, struct dce_channel *ch,
 }
 
 
-static bool exist_dce(struct list *dcel, struct dce *dce)
+static struct rx_slot *rx_claim(size_t *posp)
 {
-	bool found = false;
-	struct le *le;
+	struct rx_slot *slot;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&g_dce.rx.tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		slot = &g_dce.rx.slotv[pos & RX_RING_MASK];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&g_dce.rx.tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				*posp = pos;
+				return slot;
+			}
+		}
+		else if ((ssize_t)(seq - pos) < 0) {
+			return NULL;  /* full */
+		}
+		else {
+			pos = __atomic_load_n(&g_dce.rx.tail,
+					      __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+static bool rx_take(struct dce_event *ev)
+{
+	size_t pos = g_dce.rx.head;
+	struct rx_slot *slot = &g_dce.rx.slotv[pos & RX_RING_MASK];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+
+	*ev = slot->ev;
+
+	__atomic_store_n(&slot->seq, pos + RX_RING_SIZE, __ATOMIC_RELEASE);
+	g_dce.rx.head = pos + 1;
+
+	return true;
+}
+
+
+static int rx_push(int id, void *data)
+{
+	int i, err = 0;
+
+	for (i = 0; i < RX_PUSH_TRIES; i++) {
+
+		err = mqueue_push(g_dce.mqueue, id, data);
+		if (!err)
+			return 0;
+
+		sched_yield();
+	}
+
+	warning("dce: mqueue_push failed (%m)\n", err);
+	__atomic_fetch_add(&g_dce.rx.n_push_errors, 1, __ATOMIC_RELAXED);
+
+	return err;
+}
+
+
+/* Pass an event to the re thread, the buffer is handed over */
+static void event_post(struct dce *dce, struct dce_channel *ch,
+		       enum mq_type type, uint16_t sid,
+		       uint8_t *buf, size_t len)
+{
+	struct dce_event ev;
+	struct rx_slot *slot = NULL;
+	struct payload *pld;
+	size_t pos;
+
+	ev.type = type;
+	ev.handle = dce->handle;
+	ev.ch = ch;
+	ev.sid = sid;
+	ev.buf = buf;
+	ev.len = len;
+
+	if (!__atomic_load_n(&g_dce.rx.overflow, __ATOMIC_ACQUIRE))
+		slot = rx_claim(&pos);
+
+	if (slot) {
+		slot->ev = ev;
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+		/* the event stays in the ring, the next one tries again */
+		if (!__atomic_exchange_n(&g_dce.rx.drain, 1,
+					 __ATOMIC_ACQ_REL)) {
+			if (rx_push(RX_DRAIN, NULL))
+				__atomic_store_n(&g_dce.rx.drain, 0,
+						 __ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+
+	pld = payload_new(&ev);
+	if (!pld) {
+		free(buf);
+		return;
+	}
+
+	__atomic_fetch_add(&g_dce.rx.overflow, 1, __ATOMIC_ACQ_REL);
+	__atomic_fetch_add(&g_dce.rx.n_overflow, 1, __ATOMIC_RELAXED);
 
-	le = dcel->head;
-	while (le && !found) {
-		found = le->data == (void *)dce;
-		le = le->next;
+	if (rx_push(type, pld)) {
+		mem_deref(pld);
+		__atomic_fetch_sub(&g_dce.rx.overflow, 1, __ATOMIC_ACQ_REL);
 	}
+}
+
+
+static int handle_alloc(struct dce *dce)
+{
+	struct dce_slot *slot = NULL;
+	size_t i, idx = 0;
+	int err = 0;
+
+	lock_write_get(g_dce.lock);
+
+	/* round robin, so that a slot is not reused right away */
+	for (i = 0; i < DCE_MAX_HANDLES; i++) {
+
+		idx = (g_dce.next_handle + i) % DCE_MAX_HANDLES;
+
+		/* 0 is not a valid handle */
+		if (idx == 0)
+			continue;
+
+		if (!g_dce.handlev[idx].dce) {
+			slot = &g_dce.handlev[idx];
+			break;
+		}
+	}
+
+	if (!slot) {
+		warning("dce: no free handles (%d in use)\n",
+			DCE_MAX_HANDLES - 1);
+		err = ENOSPC;
+		goto out;
+	}
+
+	g_dce.next_handle = idx + 1;
+
+	if (++slot->gen > (UINTPTR_MAX >> HANDLE_SHIFT))
+		slot->gen = 1;
+
+	slot->dce = dce;
+	dce->handle = ((uintptr_t)slot->gen << HANDLE_SHIFT) | idx;
+
+	__atomic_store_n(&slot->handle, dce->handle, __ATOMIC_SEQ_CST);
 
-	return found;
+ out:
+	lock_rel(g_dce.lock);
+
+	return err;
+}
+
+
+static void handle_free(struct dce *dce)
+{
+	struct dce_slot *slot;
+
+	if (!dce->handle)
+		return;
+
+	slot = &g_dce.handlev[dce->handle & HANDLE_MASK];
+
+	__atomic_store_n(&slot->handle, 0, __ATOMIC_SEQ_CST);
+
+	/* the send and receive callbacks are short */
+	while (__atomic_load_n(&slot->users, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	lock_write_get(g_dce.lock);
+	slot->dce = NULL;
+	lock_rel(g_dce.lock);
+}
+
+
+/* The dce stays valid until handle_release() */
+static struct dce *handle_acquire(uintptr_t handle)
+{
+	struct dce_slot *slot;
+	size_t idx = handle & HANDLE_MASK;
+
+	if (!handle || idx >= DCE_MAX_HANDLES)
+		return NULL;
+
+	slot = &g_dce.handlev[idx];
+
+	__atomic_fetch_add(&slot->users, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&slot->handle, __ATOMIC_SEQ_CST) != handle) {
+		__atomic_fetch_sub(&slot->users, 1, __ATOMIC_SEQ_CST);
+		return NULL;
+	}
+
+	return slot->dce;
+}
+
+
+static void handle_release(uintptr_t handle)
+{
+	struct dce_slot *slot = &g_dce.handlev[handle & HANDLE_MASK];
+
+	__atomic_fetch_sub(&slot->users, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* On the re thread, where the dce is destroyed */
+static struct dce *handle_lookup(uintptr_t handle)
+{
+	size_t idx = handle & HANDLE_MASK;
+
+	if (!handle || idx >= DCE_MAX_HANDLES)
+		return NULL;
+
+	if (__atomic_load_n(&g_dce.handlev[idx].handle,
+			    __ATOMIC_ACQUIRE) != handle)
+		return NULL;
+
+	return g_dce.handlev[idx].dce;
 }
 
 static int sctp_header_decode(struct sctp_header *hdr, struct mbuf *mb)
@@ -960,17 +1229,10 @@ handle_open_request_message(struct dce *dce,
 		ch = get_dce_channel(dce, channel->label);
 
 		if(ch){
-			struct payload *pld;
-
 			ch->id = channel->id;
 
-			pld = payload_new(dce, ch, CH_OPEN);
-			if (!pld)
-				return;
-
-			pld->v.chopen.sid = channel->o_stream;
-
-			mqueue_push(g_dce.mqueue, pld->type, pld);
+			event_post(dce, ch, CH_OPEN, channel->o_stream,
+				   NULL, 0);
 		}
 	}
 }
@@ -1000,17 +1262,9 @@ handle_open_ack_message(struct dce *dce,
 	struct dce_channel *ch = NULL;
 	ch = get_dce_channel(dce, channel->label);
 	if(ch) {
-		struct payload *pld;
-
 		ch->id = channel->id;
 
-		pld = payload_new(dce, ch, CH_OPEN);
-		if (!pld)
-			return;
-
-		pld->v.chopen.sid = channel->i_stream;
-
-		mqueue_push(g_dce.mqueue, pld->type, pld);
+		event_post(dce, ch, CH_OPEN, channel->i_stream, NULL, 0);
 	}
 	return;
 }
@@ -1022,17 +1276,19 @@ handle_unknown_message(char *msg, size_t length, uint16_t i_stream)
 	return;
 }
 
-static void
+/* Returns true if the buffer was handed over */
+static bool
 handle_data_message(struct dce *dce,
                     char *buffer, size_t length, uint16_t i_stream)
 {
 	struct peer_connection *pc = &dce->pc;
 	struct channel *channel;
+	bool taken = false;
 
 	channel = find_channel_by_i_stream(pc, i_stream);
 	if (channel == NULL) {
 		/* XXX: Some error handling */
-		return;
+		return false;
 	}
 	if (channel->state == DATA_CHANNEL_CONNECTING) {
 		/* Implicit ACK */
@@ -1041,7 +1297,7 @@ handle_data_message(struct dce *dce,
 	if (channel->state != DATA_CHANNEL_OPEN) {
 		/* XXX: What about other states? */
 		/* XXX: Some error handling */
-		return;
+		return false;
 	} else {
 		debug("dce: message received of length %zu on chan: %d\n",
 		      length, channel->id);
@@ -1052,17 +1308,9 @@ handle_data_message(struct dce *dce,
 		ch = get_dce_channel(dce, channel->label);
 
 		if (ch) {
-			struct payload *pld;
-
-			pld = payload_new(dce, ch, CH_DATA);
-			if (!pld)
-				return;
-
-			pld->v.chdata.buf = mem_alloc(length, NULL);
-			memcpy(pld->v.chdata.buf, buffer, length);
-			pld->v.chdata.len = length;
-
-			mqueue_push(g_dce.mqueue, pld->type, pld);
+			event_post(dce, ch, CH_DATA, 0,
+				   (uint8_t *)buffer, length);
+			taken = true;
 		}
 
 		lock_peer_connection(&dce->pc);		
@@ -1070,10 +1318,11 @@ handle_data_message(struct dce *dce,
 		/* Assuming DATA_CHANNEL_PPID_DOMSTRING */
 		/* XXX: Protect for non 0 terminated buffer */
 	}
-	return;
+	return taken;
 }
 
-static void
+/* Returns true if the buffer was handed over */
+static bool
 handle_message(struct dce *dce,
 	       char *buffer, size_t length, uint32_t ppid, uint16_t i_stream)
 {
@@ -1083,14 +1332,14 @@ handle_message(struct dce *dce,
 	switch (ppid) {
 	case DATA_CHANNEL_PPID_CONTROL:
 		if (length < sizeof(struct rtcweb_datachannel_ack)) {
-			return;
+			return false;
 		}
 		msg = (struct rtcweb_datachannel_ack *)buffer;
 		switch (msg->msg_type) {
 		case DATA_CHANNEL_OPEN_REQUEST:
 			if (length < sizeof(struct rtcweb_datachannel_open_request_fixed)) {
 				/* XXX: error handling? */
-				return;
+				return false;
 			}
 			req = (struct rtcweb_datachannel_open_request *)buffer;
 			handle_open_request_message(dce, req, length, i_stream);
@@ -1098,7 +1347,7 @@ handle_message(struct dce *dce,
 		case DATA_CHANNEL_OPEN_ACK:
 			if (length < sizeof(struct rtcweb_datachannel_ack)) {
 				/* XXX: error handling? */
-				return;
+				return false;
 			}
 			ack = (struct rtcweb_datachannel_ack *)buffer;
 			handle_open_ack_message(dce, ack, length, i_stream);
@@ -1113,14 +1362,15 @@ handle_message(struct dce *dce,
 
 	case DATA_CHANNEL_PPID_DOMSTRING:
 	case DATA_CHANNEL_PPID_BINARY:
-		handle_data_message(dce, buffer, length, i_stream);
-		break;
+		return handle_data_message(dce, buffer, length, i_stream);
 
 	default:
 		debug("dce: msg len=%zu, PPID %u on stream %u received.\n",
 		       length, ppid, i_stream);
 		break;
 	}
+
+	return false;
 }
 
 
@@ -1137,22 +1387,13 @@ handle_association_change_event(struct dce *dce,
             
 		if (dce) {            
 			struct le *le;
-			struct payload *pld;
-
-			pld = payload_new(dce, NULL, ESTAB);
-			if (!pld)
-				return;
 
-			mqueue_push(g_dce.mqueue, pld->type, pld);
+			event_post(dce, NULL, ESTAB, 0, NULL, 0);
 
 			LIST_FOREACH(&dce->channell, le) {
 				struct dce_channel *ch = le->data;
                 
-				pld = payload_new(dce, ch, CH_ESTAB);
-				if (!pld)
-					return;
-
-				mqueue_push(g_dce.mqueue, pld->type, pld);
+				event_post(dce, ch, CH_ESTAB, 0, NULL, 0);
 			}
 		}
 		lock_peer_connection(&dce->pc);		
@@ -1365,13 +1606,7 @@ handle_stream_reset_event(struct dce *dce, struct sctp_stream_reset_event *strrs
 			ch = get_dce_channel(dce, channel->label);
 
 			if (ch) {
-				struct payload *pld;
-
-				pld = payload_new(dce, ch, CH_CLOSE);
-				if (!pld)
-					return;
-
-				mqueue_push(g_dce.mqueue, pld->type, pld);
+				event_post(dce, ch, CH_CLOSE, 0, NULL, 0);
 			}
 		}
 	}
@@ -1493,6 +1728,7 @@ handle_notification(struct dce *dce,
 		break;
 	case SCTP_SENDER_DRY_EVENT:
 		dce->snd_dry_event = true;
+		event_post(dce, NULL, SND_DRY, 0, NULL, 0);
 		break;
 	case SCTP_NOTIFICATIONS_STOPPED_EVENT:
 		break;
@@ -1631,53 +1867,50 @@ static int
 receive_cb(struct socket *sock, union sctp_sockstore addr, void *data,
            size_t datalen, struct sctp_rcvinfo rcv, int flags, void *ulp_info)
 {
-	struct dce *dce = ulp_info;
-	int err = 0;
+	uintptr_t handle = (uintptr_t)ulp_info;
+	struct dce *dce;
 
-	if (!dce) {
-		warning("dce: receive_cb: dce == NULL\n");
+	if (!handle) {
+		warning("dce: receive_cb: no dce handle\n");
 		return 1;
 	}
 
-	debug("sock=%p dce=%p dce->pc=%p\n", sock, dce, &dce->pc);
-
-	lock_write_get(g_dce.lock);
-	if (!exist_dce(&g_dce.dcel, dce)) {
-		warning("dce: receive_cb: dce(%p) not active\n", dce);
-		err = ENOSYS;
-	}
-	else {
-		assert(DCE_MAGIC == dce->magic);
-		/* Make sure we have a ref to the dce */
-		mem_ref(dce);
+	dce = handle_acquire(handle);
+	if (!dce) {
+		warning("dce: receive_cb: dce handle 0x%llx not active\n",
+			(unsigned long long)handle);
+		return 1;
 	}
-	lock_rel(g_dce.lock);
 
-	if (err)
-		return 1;
+	assert(DCE_MAGIC == dce->magic);
+
+	debug("sock=%p dce=%p dce->pc=%p\n", sock, dce, &dce->pc);
 	
 	if (data) {
+		bool taken = false;
+
 		lock_peer_connection(&dce->pc);
 		if (flags & MSG_NOTIFICATION) {
 			handle_notification(dce,
 				  (union sctp_notification *)data, datalen);
 		} else {
-			handle_message(dce,
-				       data, datalen,
-				       ntohl(rcv.rcv_ppid), rcv.rcv_sid);
+			taken = handle_message(dce,
+					       data, datalen,
+					       ntohl(rcv.rcv_ppid),
+					       rcv.rcv_sid);
 		}
 		unlock_peer_connection(&dce->pc);
 
-		free(data);
+		if (!taken)
+			free(data);
 	}
 	else {
-		usrsctp_deregister_address(dce);
-		if (dce)
-			dce->sock = NULL;
+		usrsctp_deregister_address((void *)handle);
+		dce->sock = NULL;
 		usrsctp_close(sock);
 	}
 
-	mem_deref(dce);
+	handle_release(handle);
 
 	return 1;
 }
@@ -1720,7 +1953,7 @@ int dce_connect(struct dce *dce, bool dtls_role_active)
 	sconn.sconn_len = sizeof(struct sockaddr_conn);
 #endif
 	sconn.sconn_port = htons(port);
-	sconn.sconn_addr = dce;
+	sconn.sconn_addr = (void *)dce->handle;
 	
 	sctp_err = usrsctp_connect(dce->sock, (struct sockaddr *)&sconn,
 				   sizeof(sconn));
@@ -1819,7 +2052,7 @@ void dce_recv_pkt(struct dce *dce, const uint8_t *pkt, size_t len)
 		}
 	}
 
-	usrsctp_conninput(dce, pkt, len, 0);
+	usrsctp_conninput((void *)dce->handle, pkt, len, 0);
 }
 
 
@@ -1850,6 +2083,20 @@ bool dce_snd_dry(struct dce *dce)
 	return dce->snd_dry_event;
 }
 
+
+/*
+ * Called on the re thread when all data that was sent on the
+ * association has been acknowledged, so that a sender that found the
+ * send buffer full can go on.
+ */
+void dce_channel_set_dry_handler(struct dce_channel *ch, dce_dry_h *dryh)
+{
+	if (!ch)
+		return;
+
+	ch->dryh = dryh;
+}
+
 static
 void
 debug_printf(const char *format, ...)
@@ -1866,9 +2113,8 @@ static void dce_destructor(void *arg)
 {
 	struct dce *dce = arg;
 
-	lock_write_get(g_dce.lock);
-	list_unlink(&dce->le);
-	lock_rel(g_dce.lock);
+	/* no callbacks from usrsctp after this */
+	handle_free(dce);
 
 	assert(DCE_MAGIC == dce->magic);
     
@@ -1884,7 +2130,7 @@ static void dce_destructor(void *arg)
 	}
 #endif
 
-	usrsctp_deregister_address(dce);
+	usrsctp_deregister_address((void *)dce->handle);
 	if (dce->sock) {
 		struct socket *sock = dce->sock;
 		dce->sock = NULL;
@@ -1900,19 +2146,20 @@ static void dce_destructor(void *arg)
 static int usrsctp_send_handler(void *addr, void *buf, size_t len,
 				uint8_t tos, uint8_t set_df)
 {
-	struct dce *dce = addr;
+	uintptr_t handle = (uintptr_t)addr;
+	struct dce *dce;
 	struct sctp_header hdr;
 	struct mbuf mb;
 	int err;
     
-	if (!dce)
+	if (!handle)
 		return EINVAL;
 
-	lock_write_get(g_dce.lock);
-	if (!exist_dce(&g_dce.dcel, dce)) {
-		debug("dce: send: dce(%p) not active\n", dce);
-		err = ENOSYS;
-		goto out;
+	dce = handle_acquire(handle);
+	if (!dce) {
+		debug("dce: send: dce handle 0x%llx not active\n",
+		      (unsigned long long)handle);
+		return 1;
 	}
 
 	assert(DCE_MAGIC == dce->magic);
@@ -1940,42 +2187,31 @@ static int usrsctp_send_handler(void *addr, void *buf, size_t len,
 	}
 
  out:
-	lock_rel(g_dce.lock);
+	handle_release(handle);
 
 	return err ? 1 : 0;
 }
 
 
-static void dce_mqueue_handler(int id, void *data, void *arg)
+static void event_handle(struct dce_event *ev)
 {
-	struct payload *pld = data;
 	struct dce_channel *ch;
-	bool valid;
-	(void)arg;
-
-	info("dce: mqueue_handler:  id=%d <dce=%p>\n", id, pld->dce);
-
-	if (PAYLOAD_MAGIC != pld->magic) {
-		warning("dce: invalid payload magic\n");
-		return;
-	}
-
-	lock_write_get(g_dce.lock);
-	valid = exist_dce(&g_dce.dcel, pld->dce);
-	lock_rel(g_dce.lock);
+	struct dce *dce;
 
-	if (!valid) {
-		warning("dce: mqueue_recv: dce(%p) not valid\n", pld->dce);
+	dce = handle_lookup(ev->handle);
+	if (!dce) {
+		warning("dce: event: dce handle 0x%llx not valid\n",
+			(unsigned long long)ev->handle);
 		goto out;
 	}
 
-	ch = pld->ch;
+	ch = ev->ch;
 
-	switch (id) {
+	switch (ev->type) {
 
 	case ESTAB:
-		if (pld->dce->estabh)
-			pld->dce->estabh(pld->dce->arg);
+		if (dce->estabh)
+			dce->estabh(dce->arg);
 		break;
 
 	case CH_ESTAB:
@@ -1985,7 +2221,7 @@ static void dce_mqueue_handler(int id, void *data, void *arg)
 
 	case CH_OPEN:
 		if (ch->openh) {
-			ch->openh(pld->v.chopen.sid, ch->label,
+			ch->openh(ev->sid, ch->label,
 				  ch->protocol, ch->arg);
 		}
 		break;
@@ -2000,24 +2236,99 @@ static void dce_mqueue_handler(int id, void *data, void *arg)
 
 	case CH_DATA:
 		if (ch->datah) {
-			ch->datah(ch->id,
-				  pld->v.chdata.buf, pld->v.chdata.len,
-				  ch->arg);
+			ch->datah(ch->id, ev->buf, ev->len, ch->arg);
 		}
 		break;
 
+	case SND_DRY: {
+		struct le *le = dce->channell.head;
+
+		while (le) {
+			ch = le->data;
+			le = le->next;
+
+			if (ch->dryh)
+				ch->dryh(ch->arg);
+		}
+	}
+		break;
+
 	default:
-		warning("dce: mqueue: ignored event %d\n", id);
+		warning("dce: ignored event %d\n", ev->type);
 		break;
 	}
 
  out:
+	free(ev->buf);
+	ev->buf = NULL;
+}
+
+
+static void rx_drain(void)
+{
+	struct dce_event ev;
+	uint64_t n = 0;
+
+	/* cleared first, an event from now on queues another drain */
+	__atomic_store_n(&g_dce.rx.drain, 0, __ATOMIC_SEQ_CST);
+
+	while (rx_take(&ev)) {
+		event_handle(&ev);
+		++n;
+	}
+
+	g_dce.rx.n_events += n;
+	++g_dce.rx.n_drains;
+}
+
+
+static void dce_mqueue_handler(int id, void *data, void *arg)
+{
+	struct payload *pld = data;
+	(void)arg;
+
+	if (id == RX_DRAIN) {
+		rx_drain();
+		return;
+	}
+
+	info("dce: mqueue_handler: id=%d <handle=0x%llx>\n",
+	     id, (unsigned long long)pld->ev.handle);
+
+	if (PAYLOAD_MAGIC != pld->magic) {
+		warning("dce: invalid payload magic\n");
+		return;
+	}
+
+	/* the ring only has events from before this one */
+	rx_drain();
+
+	event_handle(&pld->ev);
+	++g_dce.rx.n_events;
+
 	mem_deref(pld);
+
+	__atomic_fetch_sub(&g_dce.rx.overflow, 1, __ATOMIC_ACQ_REL);
+}
+
+
+void dce_rx_stats(struct dce_rx_stats *stats)
+{
+	if (!stats)
+		return;
+
+	stats->events = g_dce.rx.n_events;
+	stats->drains = g_dce.rx.n_drains;
+	stats->overflow = __atomic_load_n(&g_dce.rx.n_overflow,
+					  __ATOMIC_RELAXED);
+	stats->push_errors = __atomic_load_n(&g_dce.rx.n_push_errors,
+					     __ATOMIC_RELAXED);
 }
 
 
 int dce_init(void)
 {
+	size_t i;
 	int err;
 
 	debug("dce_init: inited=%d\n", dce_inited);
@@ -2027,7 +2338,8 @@ int dce_init(void)
 
 	memset(&g_dce, 0, sizeof(g_dce));
 
-	list_init(&g_dce.dcel);
+	for (i = 0; i < RX_RING_SIZE; i++)
+		g_dce.rx.slotv[i].seq = i;
 
 	err = lock_alloc(&g_dce.lock);
 	if (err)
@@ -2047,6 +2359,7 @@ int dce_init(void)
 
 void dce_close(void)
 {
+	struct dce_event ev;
 	int tries = 60;
 	
 	debug("dce_close: inited=%d\n", dce_inited);
@@ -2063,6 +2376,9 @@ void dce_close(void)
 
 	g_dce.mqueue = mem_deref(g_dce.mqueue);
 
+	while (rx_take(&ev))
+		free(ev.buf);
+
 	if (!list_isempty(&g_dce.pendingl)) {
 		debug("dce: flush pending events: %u\n",
 			  list_count(&g_dce.pendingl));
@@ -2114,15 +2430,25 @@ int dce_alloc(struct dce **dcep,
 	dce->estabh = estabh;
 	dce->arg = arg;
 
+	dce->snd_dry_event = true;
+	list_init(&dce->channell);
+
+	/* usrsctp threads may find it as soon as the handle is in use */
+	dce->magic = DCE_MAGIC;
+
 #ifdef SCTP_DEBUG
 	usrsctp_sysctl_set_sctp_debug_on(SCTP_DEBUG_ALL);
 #endif
 	usrsctp_sysctl_set_sctp_blackhole(2);
 
-	usrsctp_register_address(dce);
+	err = handle_alloc(dce);
+	if (err)
+		goto out;
+
+	usrsctp_register_address((void *)dce->handle);
 
 	dce->sock = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP,
-				   receive_cb, NULL, 0, dce);
+				   receive_cb, NULL, 0, (void *)dce->handle);
 	
 	if (dce->sock == NULL) {
 		warning("dce: alloc: failed to create socket\n");
@@ -2217,7 +2543,7 @@ int dce_alloc(struct dce **dcep,
 	sconn.sconn_len = sizeof(sconn);
 #endif
 	sconn.sconn_port = htons(port);
-	sconn.sconn_addr = dce;
+	sconn.sconn_addr = (void *)dce->handle;
 	info("dce: alloc: binding: %p:%d\n", dce, port);
 	sctp_err = usrsctp_bind(dce->sock,
 				(struct sockaddr *)&sconn, sizeof(sconn));
@@ -2233,16 +2559,6 @@ int dce_alloc(struct dce **dcep,
 	dce->pc.sock = dce->sock;
 	unlock_peer_connection(&dce->pc);
 
-	dce->snd_dry_event = true;
-    
-	list_init(&dce->channell);
-    
-	dce->magic = DCE_MAGIC;
-
-	lock_write_get(g_dce.lock);
-	list_append(&g_dce.dcel, &dce->le, dce);
-	lock_rel(g_dce.lock);
-    
  out:
 	if (err)
 		mem_deref(dce);
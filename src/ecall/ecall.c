@@ -184,6 +184,22 @@ static void econn_conn_handler(struct econn *econn,
 		goto error;
 	}
 
+	/* get ICE and TURN ready while the call is ringing. The offer is
+	 * kept to set up the media again, if it is dropped on reject.
+	 */
+	ecall->sdp.offer = mem_deref(ecall->sdp.offer);
+	if (ecall->conf.prewarm) {
+		err = mediaflow_prewarm(ecall->mf);
+		if (err) {
+			warning("ecall(%p): conn_handler: prewarm failed"
+				" (%m)\n", ecall, err);
+		}
+
+		err = str_dup(&ecall->sdp.offer, sdp);
+		if (err)
+			goto error;
+	}
+
 	if (!mediaflow_has_data(ecall->mf)) {
 		warning("ecall: conn_handler: remote peer does not"
 			" support datachannels (%s|%s)\n",
@@ -552,6 +568,8 @@ static void ecall_destructor(void *data)
 		mem_deref(ecall->conf_part);
 	}
 	mem_deref(ecall->mf);
+	mem_deref(ecall->turn_pool);
+	mem_deref(ecall->mux);
 	mem_deref(ecall->userid_self);
 	mem_deref(ecall->userid_peer);
 	mem_deref(ecall->clientid_self);
@@ -562,6 +580,7 @@ static void ecall_destructor(void *data)
 
 	mem_deref(ecall->props_remote);
 	mem_deref(ecall->props_local);
+	mem_deref(ecall->sdp.offer);
 
 	mem_deref(ecall->econn);
 
@@ -1441,12 +1460,21 @@ static int alloc_mediaflow(struct ecall *ecall)
 	struct sa laddr;
 	char tag[64] = "";
 	bool enable_kase = msystem_have_kase(ecall->msys);
+	struct media_thread *mt;
 	enum media_crypto cryptos = 0;
 	char userid_anon[ANON_ID_LEN];
 	char clientid_anon[ANON_CLIENT_LEN];
 	size_t i;
 	int err;
 
+	/* with lazy init, the media system comes up on the first call */
+	err = msystem_prepare(ecall->msys);
+	if (err) {
+		warning("ecall(%p): alloc_mediaflow: media system"
+			" not ready (%m)\n", ecall, err);
+		goto out;
+	}
+
 	/*
 	 * NOTE: v4 has presedence over v6 for now
 	 */
@@ -1499,6 +1527,8 @@ static int alloc_mediaflow(struct ecall *ecall)
 	for(i = 0; i < ecall->turnc; ++i) {
 		mediaflow_add_turnserver(ecall->mf, &ecall->turnv[i]);
 	}
+	mediaflow_set_turn_pool(ecall->mf, ecall->turn_pool);
+	mediaflow_set_udp_mux(ecall->mf, ecall->mux);
 
 	if (enable_kase) {
 		mediaflow_set_fallback_crypto(ecall->mf, CRYPTO_KASE);
@@ -1516,6 +1546,19 @@ static int alloc_mediaflow(struct ecall *ecall)
 		mediaflow_enable_privacy(ecall->mf, true);
 	}
 
+	if (msystem_get_batch_io(ecall->msys)) {
+		info("ecall(%p): alloc_mediaflow: enable batched I/O\n",
+		     ecall);
+		mediaflow_enable_batch_io(ecall->mf, true);
+	}
+
+	mt = msystem_media_thread(ecall->msys);
+	if (mt) {
+		info("ecall(%p): alloc_mediaflow: receive on media thread\n",
+		     ecall);
+		mediaflow_set_media_thread(ecall->mf, mt);
+	}
+
 	mediaflow_set_gather_handler(ecall->mf, mf_gather_handler);
 
 	mediaflow_enable_group_mode(ecall->mf, ecall->group_mode);
@@ -1685,6 +1728,41 @@ int ecall_start(struct ecall *ecall, enum icall_call_type call_type, bool audio_
 }
 
 
+static int alloc_prewarmed(struct ecall *ecall)
+{
+	int err;
+
+	err = alloc_mediaflow(ecall);
+	if (err) {
+		warning("ecall(%p): alloc_mediaflow failed (%m)\n",
+			ecall, err);
+		return err;
+	}
+
+	mediaflow_set_remote_userclientid(ecall->mf,
+					  econn_userid_remote(ecall->econn),
+					  econn_clientid_remote(ecall->econn));
+
+	err = mediaflow_handle_offer(ecall->mf, ecall->sdp.offer);
+	if (err) {
+		warning("ecall(%p): handle_offer error (%m)\n", ecall, err);
+		goto out;
+	}
+
+	if (ecall->conf.prewarm)
+		err = mediaflow_prewarm(ecall->mf);
+
+ out:
+	if (err) {
+		ecall->dce = NULL;
+		ecall->dce_ch = NULL;
+		ecall->mf = mem_deref(ecall->mf);
+	}
+
+	return err;
+}
+
+
 int ecall_answer(struct ecall *ecall, enum icall_call_type call_type, bool audio_cbr,
 	void *extcodec_arg)
 {
@@ -1706,6 +1784,13 @@ int ecall_answer(struct ecall *ecall, enum icall_call_type call_type, bool audio
 		return EPROTO;
 	}
 
+	/* rejected before, set up the media again */
+	if (!ecall->mf && ecall->sdp.offer) {
+		err = alloc_prewarmed(ecall);
+		if (err)
+			return err;
+	}
+
 	if (!ecall->mf) {
 		warning("ecall: answer: no mediaflow\n");
 		return EPROTO;
@@ -1728,12 +1813,46 @@ int ecall_answer(struct ecall *ecall, enum icall_call_type call_type, bool audio
 	ecall->audio_setup_time = -1;
 	ecall->call_estab_time = -1;
 	ecall->ts_answered = tmr_jiffies();
+	ecall->sdp.offer = mem_deref(ecall->sdp.offer);
 
  out:
 	return err;
 }
 
 
+/*
+ * The call was rejected on this device. The media that was set up
+ * while ringing is released, but the call is kept so that it can
+ * still be answered, or ended by the caller.
+ */
+int ecall_reject(struct ecall *ecall)
+{
+	if (!ecall)
+		return EINVAL;
+
+	if (ecall->answered ||
+	    ECONN_PENDING_INCOMING != econn_current_state(ecall->econn)) {
+		info("ecall(%p): reject: invalid state (%s)\n", ecall,
+		     econn_state_name(econn_current_state(ecall->econn)));
+		return EPROTO;
+	}
+
+	if (!ecall->mf)
+		return 0;
+
+	info("ecall(%p): reject: releasing mediaflow %p\n",
+	     ecall, ecall->mf);
+
+	if (ecall->conf_part)
+		ecall->conf_part->data = NULL;
+	ecall->dce = NULL;
+	ecall->dce_ch = NULL;
+	ecall->mf = mem_deref(ecall->mf);
+
+	return 0;
+}
+
+
 int ecall_msg_recv(struct ecall *ecall,
 		   uint32_t curr_time, /* in seconds */
 		   uint32_t msg_time, /* in seconds */
@@ -1997,6 +2116,29 @@ int ecall_set_video_send_state(struct ecall *ecall, enum icall_vstate vstate)
 }
 
 
+void ecall_set_turn_pool(struct ecall *ecall, struct turn_pool *pool)
+{
+	if (!ecall)
+		return;
+
+	mem_deref(ecall->turn_pool);
+	ecall->turn_pool = mem_ref(pool);
+
+	mediaflow_set_turn_pool(ecall->mf, pool);
+}
+
+
+/* must be set before the mediaflow is allocated */
+void ecall_set_udp_mux(struct ecall *ecall, struct udp_mux *mux)
+{
+	if (!ecall)
+		return;
+
+	mem_deref(ecall->mux);
+	ecall->mux = mem_ref(mux);
+}
+
+
 int ecall_set_group_mode(struct ecall *ecall, bool active)
 {
 	int err = 0;
@@ -51,6 +51,11 @@ struct conf_part;
 #define USER_MESSAGE_FILE_STATUS_ACK    4
 #define USER_MESSAGE_FILE_END           5
 #define USER_MESSAGE_FILE_END_ACK       6
+#define USER_MESSAGE_FILE_CHUNK         7
+#define USER_MESSAGE_FILE_CAPS          8
+
+/* in FILE_CAPS, what the sender of it can receive */
+#define USER_FILE_CAP_CHUNK  (1u << 0)   /* FILE_CHUNK and FILE_STATUS */
 
 #define MAX_FILE_NAME_SIZE 128
 
@@ -79,7 +84,7 @@ struct user_data_message{
 } ECALL_PACKED;
 
 struct file_status {
-	FILE *fp;
+	struct file_sink *sink;   /* receiving side */
 	uint32_t nblocks;
 	uint32_t block_cnt;
 	uint32_t byte_cnt;
@@ -87,9 +92,27 @@ struct file_status {
 	char path[MAX_FILE_NAME_SIZE];
 	char name[MAX_FILE_NAME_SIZE];
 	bool active;
+	bool paused;              /* receiving side, the writer is behind */
+	bool resync;              /* blocks were dropped, wait for the sender */
 	struct ztime start_time;
 };
 
+/* the sending side of a file transfer, the file is read with pread */
+struct file_window {
+	int fd;
+	size_t size;
+	size_t hashed;          /* bytes in the file_snd hash */
+	uint32_t next;          /* next message, 0 is FILE_START */
+	uint32_t burst;         /* messages per run of the sender */
+	uint32_t delay;         /* ms between runs, 0 when not paced */
+	bool wait_dry;          /* SCTP send buffer was full */
+	bool paused;            /* channel closed, wait for FILE_STATUS */
+	bool wait_ack;          /* all sent, the ack is due once dry */
+	bool chunked;           /* FILE_CHUNK, else the old FILE framing */
+	uint32_t n_full;
+	uint32_t n_resume;
+};
+
 struct user_data {
 	struct dce_channel *dce_ch;
 	ecall_user_data_ready_h *ready_h;
@@ -103,6 +126,11 @@ struct user_data {
 	int32_t ft_chunk_size;
 	uint8_t pending_msg_buf[sizeof(struct user_data_message)];
 	size_t pending_msg_len;
+	uint8_t ft_msg_buf[sizeof(struct user_data_message)];
+	struct file_window ft_win;
+	uint32_t peer_caps;     /* from FILE_CAPS */
+	struct list ctl_msgl;   /* FILE_STATUS etc. waiting to be sent */
+	struct tmr ctl_tmr;
 	struct file_status file_snd;
 	struct file_status file_rcv;
 };
@@ -139,6 +167,7 @@ struct ecall {
 
 	struct {
 		enum async_sdp async;
+		char *offer;    /* incoming, kept until answered */
 	} sdp;
 
 	struct econn *econn_pending;
@@ -181,6 +210,8 @@ struct ecall {
 	struct zapi_ice_server turnv[MAX_TURN_SERVERS];
 	size_t turnc;
 	bool turn_added;
+	struct turn_pool *turn_pool;
+	struct udp_mux *mux;
 };
 
 
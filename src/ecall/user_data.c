@@ -16,10 +16,63 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <re.h>
 #include "avs.h"
 #include "ecall.h"
 
+
+/*
+ * File transfer
+ *
+ * The file is read with pread(2) and sent as FILE_START, FILE_CHUNK ...
+ * and FILE_END, numbered from 0. The sender keeps writing into the SCTP
+ * send buffer until it is full, and goes on when the association is
+ * dry again. Every chunk has its number and a CRC, FILE_END has the
+ * SHA256 of the whole file.
+ *
+ * When the channel is opened again, the receiver tells how far it got
+ * with FILE_STATUS and the sender goes on from there.
+ *
+ * The receiver writes the file from a background thread. When that falls
+ * behind, it drops the blocks that come in and, once it has caught up,
+ * sends FILE_STATUS for the sender to go back to the first one dropped.
+ * The old framing cannot go back, the transfer fails with FILE_END_ACK.
+ *
+ * Once all is in the send buffer the sender waits for FILE_END_ACK. The
+ * ack timeout runs from when the association is dry, a large buffer on
+ * a slow path may take longer than that to get out.
+ *
+ * Both sides send FILE_CAPS when the channel opens. A peer that has not
+ * sent it gets the old framing, plain FILE messages, which it knows.
+ */
+
+enum {
+    FT_BURST = 16,                 /* messages per run of the sender */
+    FT_PACE_MS = 10,               /* between messages, when paced */
+    FT_DRY_TIMEOUT_MS = 1000,
+    FT_ACK_TIMEOUT_MS = 5000,
+    FT_RESUME_TIMEOUT_MS = 30000,
+    FT_CTL_RETRY_MS = 10,
+    FT_SINK_HIGH = FILE_SINK_MAX_QUEUED / 2,  /* queued, stop taking blocks */
+    FT_SINK_LOW = FILE_SINK_MAX_QUEUED / 8,   /* and take them again */
+};
+
+/* A control message of the file transfer, with its own queue */
+struct ctl_msg {
+    struct le le;
+    size_t len;
+    uint8_t buf[1 + sizeof(uint32_t)];
+};
+
+static void send_file_window(struct ecall *ecall);
+static void wait_for_ft_ack_timeout(void *arg);
+static void send_end_recieved_ack(struct ecall *ecall);
+static void send_file_status(struct ecall *ecall);
+static void file_window_close(struct user_data *usrd);
+
 static void read_u8(uint8_t **buf, size_t len, uint8_t out[])
 {
     uint8_t *ptr = *buf;
@@ -54,55 +107,208 @@ static void write_u32(uint8_t **buf, uint32_t in)
 }
 
 
-static void handle_file_start_recieved(struct user_data *usrd, uint8_t *data, size_t len)
+static void rcv_file_path(const struct user_data *usrd, char *buf, size_t sz)
+{
+    if (str_isset(usrd->file_rcv.path)) {
+        re_snprintf(buf, sz, "%s/%s", usrd->file_rcv.path, usrd->file_rcv.name);
+    }
+    else {
+        re_snprintf(buf, sz, "%s", usrd->file_rcv.name);
+    }
+}
+
+static void file_rcv_abort(struct user_data *usrd)
+{
+    usrd->file_rcv.sink = mem_deref(usrd->file_rcv.sink);
+    usrd->file_rcv.active = false;
+    usrd->file_rcv.paused = false;
+    usrd->file_rcv.resync = false;
+}
+
+/* Progress of the file writer, on the re thread */
+static void file_sink_handler(uint64_t written, bool done, int err, void *arg)
+{
+    struct ecall *ecall = arg;
+    struct user_data *usrd = ecall->usrd;
+    
+    if(err){
+        warning("user_data: writing %s failed (%m) \n", usrd->file_rcv.name, err);
+        file_rcv_abort(usrd);
+        
+        /* The block count tells the sender that it failed */
+        usrd->file_rcv.block_cnt = 0;
+        send_end_recieved_ack(ecall);
+        return;
+    }
+    
+    debug("user_data: written %llu of %u bytes \n",
+          (unsigned long long)written, usrd->file_rcv.byte_cnt);
+    
+    /* Caught up, the sender goes back to the first dropped block */
+    if(usrd->file_rcv.paused
+       && file_sink_queued(usrd->file_rcv.sink) <= FT_SINK_LOW){
+        info("user_data: resuming file transfer at %u \n",
+             usrd->file_rcv.block_cnt);
+        usrd->file_rcv.paused = false;
+        send_file_status(ecall);
+    }
+    
+    if(!done){
+        return;
+    }
+    
+    usrd->file_rcv.sink = mem_deref(usrd->file_rcv.sink);
+    
+    if(usrd->f_rcv_h){
+        char buf[sizeof(usrd->file_rcv.path) + sizeof(usrd->file_rcv.name) + 1];
+        rcv_file_path(usrd, buf, sizeof(buf));
+        usrd->f_rcv_h(buf, usrd->arg);
+    }
+    
+    send_end_recieved_ack(ecall);
+}
+
+/* Queue data for the file writer at the next offset */
+static int file_rcv_write(struct user_data *usrd, const uint8_t *data, size_t len)
 {
-        uint8_t *ptr = data;
+    int err = file_sink_write(usrd->file_rcv.sink, usrd->file_rcv.byte_cnt, data, len);
+    if(err){
+        warning("user_data: cannot write %s (%m) \n", usrd->file_rcv.name, err);
+        return err;
+    }
+    
+    SHA256_Update(&usrd->file_rcv.sha256_hash, data, len);
+    usrd->file_rcv.byte_cnt += len;
+    
+    return 0;
+}
+
+static void handle_file_start_recieved(struct ecall *ecall, uint8_t *data, size_t len)
+{
+    struct user_data *usrd = ecall->usrd;
+    uint8_t *ptr = data;
+    
+    if(len < sizeof(uint32_t) + MAX_FILE_NAME_SIZE){
+        return;
+    }
+    
+    file_rcv_abort(usrd);
+    
     uint32_t nblocks = read_u32(&ptr);
     usrd->file_rcv.nblocks = ntohl(nblocks);
     memcpy(usrd->file_rcv.name, ptr, MAX_FILE_NAME_SIZE);
+    usrd->file_rcv.name[MAX_FILE_NAME_SIZE - 1] = '\0';
     ptr += MAX_FILE_NAME_SIZE;
 
     if (!str_isset(usrd->file_rcv.name)) {
         error("user_data: No file name recieved \n");
         return;
     }
-    char buf[strlen(usrd->file_rcv.path) + strlen(usrd->file_rcv.name)];
-    if (str_isset(usrd->file_rcv.path)) {
-        sprintf(buf, "%s/%s", usrd->file_rcv.path, usrd->file_rcv.name);
-    }
-    else {
-        sprintf(buf, "%s", usrd->file_rcv.name);
-    }
-    usrd->file_rcv.fp = fopen(buf,"wb");
-    if(!usrd->file_rcv.fp){
+    char buf[sizeof(usrd->file_rcv.path) + sizeof(usrd->file_rcv.name) + 1];
+    rcv_file_path(usrd, buf, sizeof(buf));
+    
+    int err = file_sink_alloc(&usrd->file_rcv.sink, buf, file_sink_handler, ecall);
+    if(err){
         error("user_data: cannot open file %s \n", buf);
         return;
     }
     
     size_t data_size = len - (size_t)(ptr - data);
     
-    fwrite(ptr, sizeof(uint8_t), data_size, usrd->file_rcv.fp);
-    
     SHA256_Init(&usrd->file_rcv.sha256_hash);
-    SHA256_Update(&usrd->file_rcv.sha256_hash, ptr, data_size);
+    usrd->file_rcv.byte_cnt = 0;
+    usrd->file_rcv.active = true;
+    
+    if(file_rcv_write(usrd, ptr, data_size)){
+        file_rcv_abort(usrd);
+        return;
+    }
     
     usrd->file_rcv.block_cnt = 1;
 }
 
-static void handle_file_chunk_recieved(struct user_data *usrd, uint8_t *data, size_t len){
-    if(!usrd->file_rcv.fp){
-        return;
+static int handle_file_chunk_recieved(struct user_data *usrd, uint8_t *data, size_t len){
+    if(!usrd->file_rcv.active){
+        return 0;
     }
     
-    fwrite(data, sizeof(uint8_t), len, usrd->file_rcv.fp);
-    SHA256_Update(&usrd->file_rcv.sha256_hash, data, len);
+    int err = file_rcv_write(usrd, data, len);
+    if(err){
+        return err;
+    }
     
     usrd->file_rcv.block_cnt++;
+    
+    return 0;
 }
 
-static bool handle_file_end_recieved(struct user_data *usrd, uint8_t *data, size_t len){
-    if(!usrd->file_rcv.fp){
-        return false;
+static int handle_file_block_recieved(struct user_data *usrd, uint8_t *data, size_t len){
+    if(!usrd->file_rcv.active){
+        return 0;
+    }
+    if(len < 2 * sizeof(uint32_t)){
+        return EPROTO;
+    }
+    
+    uint8_t *ptr = data;
+    uint32_t block = ntohl(read_u32(&ptr));
+    uint32_t crc = ntohl(read_u32(&ptr));
+    size_t data_size = len - 2 * sizeof(uint32_t);
+    
+    /* Sent again after a resume */
+    if(block < usrd->file_rcv.block_cnt){
+        return 0;
+    }
+    if(usrd->file_rcv.paused){
+        return 0;
+    }
+    if(block > usrd->file_rcv.block_cnt){
+        /* Sent before the sender went back */
+        if(usrd->file_rcv.resync){
+            return 0;
+        }
+        warning("user_data: expected block %u got %u \n",
+                usrd->file_rcv.block_cnt, block);
+        return EPROTO;
+    }
+    if(crc32(0, ptr, (uint32_t)data_size) != crc){
+        warning("user_data: block %u is corrupt \n", block);
+        return EBADMSG;
+    }
+    
+    /* Stop well before the writer does not take any more */
+    if(file_sink_queued(usrd->file_rcv.sink) + data_size > FT_SINK_HIGH){
+        info("user_data: writer is behind, pausing at block %u \n", block);
+        usrd->file_rcv.paused = true;
+        usrd->file_rcv.resync = true;
+        return 0;
+    }
+    
+    int err = file_rcv_write(usrd, ptr, data_size);
+    if(err){
+        return err;
+    }
+    
+    usrd->file_rcv.resync = false;
+    usrd->file_rcv.block_cnt++;
+    
+    return 0;
+}
+
+/* The file is acked once the writer has closed it */
+static int handle_file_end_recieved(struct user_data *usrd, uint8_t *data, size_t len){
+    if(!usrd->file_rcv.active){
+        return 0;
+    }
+    if(len < SHA256_DIGEST_LENGTH){
+        return EPROTO;
+    }
+    
+    /* Sent before the sender went back */
+    if(usrd->file_rcv.paused
+       || (usrd->file_rcv.resync
+           && usrd->file_rcv.block_cnt != usrd->file_rcv.nblocks)){
+        return 0;
     }
     
     uint8_t rcv_sha[SHA256_DIGEST_LENGTH];
@@ -110,24 +316,56 @@ static bool handle_file_end_recieved(struct user_data *usrd, uint8_t *data, size
     data += SHA256_DIGEST_LENGTH;
     size_t data_size = len - SHA256_DIGEST_LENGTH;
     
-    fwrite(data, sizeof(uint8_t), data_size, usrd->file_rcv.fp);
-    
-    SHA256_Update(&usrd->file_rcv.sha256_hash, data, data_size);
+    int err = file_rcv_write(usrd, data, data_size);
+    if(err){
+        return err;
+    }
     SHA256_Final(rcv_sha, &usrd->file_rcv.sha256_hash);
     
+    if(memcmp(rcv_sha, snd_sha, SHA256_DIGEST_LENGTH) != 0){
+        warning("user_data: %s does not match its hash \n", usrd->file_rcv.name);
+        return EBADMSG;
+    }
+    
     usrd->file_rcv.block_cnt++;
+    usrd->file_rcv.active = false;
     
-    bool success = true;
-    for(int i = 0; i < SHA256_DIGEST_LENGTH; i++){
-        if(rcv_sha[i] != snd_sha[i]){
-            success = false;
-            break;
-        }
+    file_sink_finish(usrd->file_rcv.sink);
+
+    return 0;
+}
+
+static void file_window_close(struct user_data *usrd)
+{
+    struct file_window *win = &usrd->ft_win;
+    
+    if(win->fd >= 0){
+        close(win->fd);
     }
-    fclose(usrd->file_rcv.fp);
-    usrd->file_rcv.fp = NULL;
+    memset(win, 0, sizeof(*win));
+    win->fd = -1;
+}
 
-    return success;
+/* The file may be truncated while it is sent, a short read fails */
+static int file_window_read(struct file_window *win, uint8_t *buf,
+                            size_t off, size_t cnt)
+{
+    size_t pos = 0;
+    
+    while(pos < cnt){
+        ssize_t n = pread(win->fd, buf + pos, cnt - pos, (off_t)(off + pos));
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        if(n == 0){
+            return EIO;
+        }
+        pos += (size_t)n;
+    }
+    
+    return 0;
 }
 
 static bool handle_file_end_ack_recieved(struct user_data *usrd, uint8_t *data, size_t len){
@@ -140,6 +378,10 @@ static bool handle_file_end_ack_recieved(struct user_data *usrd, uint8_t *data,
     
     usrd->file_snd.active = false;
     tmr_cancel(&usrd->ft_tmr);
+    
+    info("user_data: file sent, send buffer full %u times, resumed %u times \n",
+         usrd->ft_win.n_full, usrd->ft_win.n_resume);
+    file_window_close(usrd);
 
     struct ztime now;
     ztime_get(&now);
@@ -156,6 +398,41 @@ static bool handle_file_end_ack_recieved(struct user_data *usrd, uint8_t *data,
     }
 }
 
+static void handle_file_status_recieved(struct ecall *ecall, uint8_t *data, size_t len)
+{
+    struct user_data *usrd = ecall->usrd;
+    struct file_window *win = &usrd->ft_win;
+    
+    if(len < sizeof(uint32_t)){
+        return;
+    }
+    
+    uint8_t *ptr = data;
+    uint32_t block_cnt = ntohl(read_u32(&ptr));
+    
+    if(!usrd->file_snd.active){
+        return;
+    }
+    /* The old framing has no numbers to go on from */
+    if(!win->chunked){
+        return;
+    }
+    if(block_cnt == 0 || block_cnt > usrd->file_snd.nblocks){
+        warning("user_data: file status %u out of range \n", block_cnt);
+        return;
+    }
+    
+    info("user_data: resuming file transfer at %u/%u \n",
+         block_cnt, usrd->file_snd.nblocks);
+    
+    win->next = block_cnt;
+    win->paused = false;
+    win->wait_dry = false;
+    win->n_resume++;
+    
+    send_file_window(ecall);
+}
+
 static void resend_handler(void *arg)
 {
     struct ecall *ecall = arg;
@@ -222,16 +499,90 @@ static int ecall_user_data_send_internal(struct ecall *ecall, const void *data,
     }
 }
 
-static void send_end_recieved_ack(struct ecall *ecall)
+static void ctl_tmr_handler(void *arg);
+
+/* Send the queued control messages in order, the rest when there is room */
+static void send_ctl_pending(struct ecall *ecall)
 {
     struct user_data *usrd = ecall->usrd;
+    struct le *le;
     
-    uint8_t buf[sizeof(uint32_t)];
-    uint8_t *ptr = buf;
+    tmr_cancel(&usrd->ctl_tmr);
     
-    write_u32(&ptr, htonl(usrd->file_rcv.block_cnt));
+    while((le = list_head(&usrd->ctl_msgl))){
+        struct ctl_msg *msg = le->data;
+        
+        /* Sent when the channel is open again */
+        if(!ecall->dce || !usrd->channel_open || !usrd->dce_ch){
+            return;
+        }
+        
+        int ret = dce_send(ecall->dce, usrd->dce_ch, msg->buf, msg->len);
+        if(ret){
+            tmr_start(&usrd->ctl_tmr, FT_CTL_RETRY_MS, ctl_tmr_handler, ecall);
+            return;
+        }
+        
+        list_unlink(le);
+        mem_deref(msg);
+    }
+}
+
+static void ctl_tmr_handler(void *arg)
+{
+    struct ecall *ecall = arg;
     
-    ecall_user_data_send_internal(ecall, buf, sizeof(buf), USER_MESSAGE_FILE_END_ACK);
+    if(!ecall->usrd)
+        return;
+    
+    send_ctl_pending(ecall);
+}
+
+/*
+ * Control messages do not go through pending_msg_buf, so they are
+ * neither dropped nor held up by user data that is waiting there.
+ */
+static int send_ctl_msg(struct ecall *ecall, uint8_t type, uint32_t val)
+{
+    struct user_data *usrd = ecall->usrd;
+    struct ctl_msg *msg;
+    uint8_t *ptr;
+    
+    msg = mem_zalloc(sizeof(*msg), NULL);
+    if(!msg)
+        return ENOMEM;
+    
+    ptr = msg->buf;
+    *ptr++ = type;
+    write_u32(&ptr, htonl(val));
+    msg->len = (size_t)(ptr - msg->buf);
+    
+    list_append(&usrd->ctl_msgl, &msg->le, msg);
+    send_ctl_pending(ecall);
+    
+    return 0;
+}
+
+static void send_end_recieved_ack(struct ecall *ecall)
+{
+    send_ctl_msg(ecall, USER_MESSAGE_FILE_END_ACK, ecall->usrd->file_rcv.block_cnt);
+}
+
+static void send_file_status(struct ecall *ecall)
+{
+    send_ctl_msg(ecall, USER_MESSAGE_FILE_STATUS, ecall->usrd->file_rcv.block_cnt);
+}
+
+static void handle_file_caps_recieved(struct user_data *usrd, uint8_t *data, size_t len)
+{
+    if(len < sizeof(uint32_t)){
+        return;
+    }
+    
+    uint8_t *ptr = data;
+    usrd->peer_caps = ntohl(read_u32(&ptr));
+    
+    info("user_data(%p): peer file caps 0x%x \n", usrd, usrd->peer_caps);
 }
 
 static void data_estab_handler(void *arg)
@@ -250,6 +601,10 @@ static void data_channel_handler(int chid, uint8_t *data,
     
     uint8_t type;
     
+    if(len < 1){
+        return;
+    }
+    
     uint8_t *ptr = data;
     read_u8(&ptr, 1, &type);
     len = len - 1;
@@ -266,24 +621,40 @@ static void data_channel_handler(int chid, uint8_t *data,
 
         case USER_MESSAGE_FILE_START:
         {
-            handle_file_start_recieved(usrd, ptr, len);
+            handle_file_start_recieved(ecall, ptr, len);
         }
         break;
             
         case USER_MESSAGE_FILE:
         {
-            handle_file_chunk_recieved(usrd, ptr, len);
+            if(handle_file_chunk_recieved(usrd, ptr, len)){
+                file_rcv_abort(usrd);
+                send_end_recieved_ack(ecall);
+            }
         }
         break;
             
-        case USER_MESSAGE_FILE_END:
+        case USER_MESSAGE_FILE_CHUNK:
         {
-            bool success = handle_file_end_recieved(usrd, ptr, len);
-            if(success && usrd->f_rcv_h){
-                char buf[strlen(usrd->file_rcv.path) + strlen(usrd->file_rcv.name)];
-                sprintf(buf, "%s/%s", usrd->file_rcv.path, usrd->file_rcv.name);
-                usrd->f_rcv_h(buf, usrd->arg);
+            if(handle_file_block_recieved(usrd, ptr, len)){
+                file_rcv_abort(usrd);
                 
+                /* The block count tells the sender that it failed */
+                send_end_recieved_ack(ecall);
+            }
+        }
+        break;
+            
+        case USER_MESSAGE_FILE_STATUS:
+        {
+            handle_file_status_recieved(ecall, ptr, len);
+        }
+        break;
+            
+        case USER_MESSAGE_FILE_END:
+        {
+            if(handle_file_end_recieved(usrd, ptr, len)){
+                file_rcv_abort(usrd);
                 send_end_recieved_ack(ecall);
             }
         }
@@ -296,6 +667,13 @@ static void data_channel_handler(int chid, uint8_t *data,
                 usrd->f_snd_h(usrd->file_snd.name, success, usrd->arg);
             }
         }
+        break;
+            
+        case USER_MESSAGE_FILE_CAPS:
+        {
+            handle_file_caps_recieved(usrd, ptr, len);
+        }
+        break;
             
         default:
             
@@ -316,6 +694,11 @@ static void data_channel_open_handler(int chid, const char *label,
         if(usrd->ready_h){
             usrd->ready_h(MAX_USER_DATA_SIZE, usrd->arg);
         }
+        send_ctl_msg(ecall, USER_MESSAGE_FILE_CAPS, USER_FILE_CAP_CHUNK);
+        /* When paused it is sent once the writer has caught up */
+        if(usrd->file_rcv.active && !usrd->file_rcv.paused){
+            send_file_status(ecall);
+        }
     }
     
 }
@@ -331,22 +714,58 @@ static void data_channel_closed_handler(int chid, const char *label,
     
     if (strcmp(label, "wire-user-data") == 0) {
         usrd->channel_open = false;
+        
+        /* Wait for the receiver to tell where to go on, with the
+         * old framing the sender just goes on when it is open again */
+        if(usrd->file_snd.active && usrd->ft_win.chunked){
+            usrd->ft_win.paused = true;
+            usrd->ft_win.wait_dry = false;
+            usrd->ft_win.wait_ack = false;
+            tmr_start(&usrd->ft_tmr, FT_RESUME_TIMEOUT_MS,
+                      wait_for_ft_ack_timeout, ecall);
+        }
     }
 }
 
+static void data_dry_handler(void *arg)
+{
+    struct ecall *ecall = arg;
+    struct user_data *usrd = ecall->usrd;
+    
+    if(!usrd){
+        return;
+    }
+    
+    if(!list_isempty(&usrd->ctl_msgl)){
+        send_ctl_pending(ecall);
+    }
+    
+    /* Everything has left, the ack is due from now on */
+    if(usrd->ft_win.wait_ack){
+        tmr_start(&usrd->ft_tmr, FT_ACK_TIMEOUT_MS,
+                  wait_for_ft_ack_timeout, ecall);
+        return;
+    }
+    
+    if(!usrd->ft_win.wait_dry){
+        return;
+    }
+    
+    usrd->ft_win.wait_dry = false;
+    send_file_window(ecall);
+}
+
 static void user_data_destructor(void *arg)
 {
     struct user_data *usrd = arg;
     
     tmr_cancel(&usrd->tmr);
     tmr_cancel(&usrd->ft_tmr);
+    tmr_cancel(&usrd->ctl_tmr);
+    list_flush(&usrd->ctl_msgl);
     
-    if(usrd->file_snd.fp){
-        fclose(usrd->file_snd.fp);
-    }
-    if(usrd->file_rcv.fp){
-        fclose(usrd->file_rcv.fp); // Maybe delete it as it is not complete
-    }
+    file_window_close(usrd);
+    mem_deref(usrd->file_rcv.sink); // Maybe delete it as it is not complete
 }
 
 int ecall_add_user_data(struct ecall *ecall,
@@ -368,6 +787,7 @@ int ecall_add_user_data(struct ecall *ecall,
     usrd->ready_h = ready_h;
     usrd->rcv_h = rcv_h;
     usrd->arg = arg;
+    usrd->ft_win.fd = -1;
     
     ecall->usrd = usrd;
     
@@ -394,6 +814,8 @@ int ecall_add_user_data_channel(struct ecall *ecall, bool should_open)
         goto out;
     }
     
+    dce_channel_set_dry_handler(ecall->usrd->dce_ch, data_dry_handler);
+    
     if(should_open){
         err = dce_open_chan(ecall->dce, ecall->usrd->dce_ch);
         if (err) {
@@ -410,120 +832,194 @@ int ecall_user_data_send(struct ecall *ecall, const void *data, size_t len)
     return ecall_user_data_send_internal(ecall, data, len, USER_MESSAGE_DATA);
 }
 
-static void handle_last_chunk(struct user_data *usrd)
+/*
+ * Message k of the file in ft_msg_buf. The data is read into its place
+ * in the message first, the header that depends on it is filled in after.
+ */
+static int build_file_msg(struct user_data *usrd, uint32_t k, size_t *lenp)
 {
-    if(!usrd->file_snd.fp){
-        return;
+    struct file_window *win = &usrd->ft_win;
+    uint8_t *ptr = usrd->ft_msg_buf;
+    uint8_t *hdr;
+    size_t off, cnt = 0;
+
+    if(k == 0){
+        *ptr++ = USER_MESSAGE_FILE_START;
+        write_u32(&ptr, htonl(usrd->file_snd.nblocks));
+        memcpy(ptr, usrd->file_snd.name, MAX_FILE_NAME_SIZE);
+        ptr += MAX_FILE_NAME_SIZE;
+        *lenp = (size_t)(ptr - usrd->ft_msg_buf);
+        return 0;
     }
-    uint8_t *ptr = usrd->pending_msg_buf;
-    *ptr++ = USER_MESSAGE_FILE_END;
-    uint8_t *sha = ptr;
-    ptr += SHA256_DIGEST_LENGTH;
-    int cnt = fread( ptr, sizeof(uint8_t), usrd->ft_chunk_size, usrd->file_snd.fp);
-    SHA256_Update(&usrd->file_snd.sha256_hash, ptr, cnt);
-    SHA256_Final(sha, &usrd->file_snd.sha256_hash);
-    ptr += cnt;
-    usrd->pending_msg_len = (size_t)(ptr - usrd->pending_msg_buf);
-    fclose(usrd->file_snd.fp);
-    usrd->file_snd.fp = NULL;
-    usrd->file_snd.byte_cnt += cnt;
-}
 
-static void handle_chunk(struct user_data *usrd)
-{
-    if(!usrd->file_snd.fp){
-        return;
+    off = (size_t)(k - 1) * usrd->ft_chunk_size;
+    if(off < win->size){
+        cnt = min(win->size - off, (size_t)usrd->ft_chunk_size);
+    }
+
+    if(k == usrd->file_snd.nblocks){
+        *ptr++ = USER_MESSAGE_FILE_END;
+        hdr = ptr;
+        ptr += SHA256_DIGEST_LENGTH;
+    } else if(win->chunked){
+        *ptr++ = USER_MESSAGE_FILE_CHUNK;
+        hdr = ptr;
+        ptr += 2 * sizeof(uint32_t);
+    } else {
+        *ptr++ = USER_MESSAGE_FILE;
+        hdr = ptr;
+    }
+
+    if(cnt > 0){
+        int err = file_window_read(win, ptr, off, cnt);
+        if(err){
+            return err;
+        }
+    }
+
+    /* The file hash is kept up to date with the first sending of every chunk */
+    if(off == win->hashed && cnt > 0){
+        SHA256_Update(&usrd->file_snd.sha256_hash, ptr, cnt);
+        win->hashed += cnt;
+    }
+
+    if(k == usrd->file_snd.nblocks){
+        SHA256_CTX sha256_hash = usrd->file_snd.sha256_hash;
+
+        SHA256_Final(hdr, &sha256_hash);
+    } else if(win->chunked){
+        write_u32(&hdr, htonl(k));
+        write_u32(&hdr, htonl(crc32(0, ptr, (uint32_t)cnt)));
     }
-    uint8_t *ptr = usrd->pending_msg_buf;
-    *ptr++ = USER_MESSAGE_FILE;
-    int cnt = fread( ptr, sizeof(uint8_t), usrd->ft_chunk_size, usrd->file_snd.fp);
-    SHA256_Update(&usrd->file_snd.sha256_hash, ptr, cnt);
+
     ptr += cnt;
-    usrd->pending_msg_len = (size_t)(ptr - usrd->pending_msg_buf);
-    usrd->file_snd.byte_cnt += cnt;
+    *lenp = (size_t)(ptr - usrd->ft_msg_buf);
+
+    return 0;
 }
 
 static void wait_for_ft_ack_timeout(void *arg)
 {
     struct ecall *ecall = arg;
-    
+
     if(!ecall->usrd)
         return;
-    
+
     struct user_data *usrd = ecall->usrd;
-    
+
     warning("user_data: timeout waiting for ack \n");
-    
+
     if(usrd->f_snd_h){
         usrd->f_snd_h(NULL, false, usrd->arg);
     }
     usrd->file_snd.active = false;
+    file_window_close(usrd);
 }
 
-static void send_file_chunk_handler(void *arg)
+static void send_file_timeout(void *arg)
 {
     struct ecall *ecall = arg;
-    
-    if(!ecall || !ecall->dce || !ecall->usrd)
+
+    if(!ecall->usrd)
         return;
-    
+
+    ecall->usrd->ft_win.wait_dry = false;
+    send_file_window(ecall);
+}
+
+/*
+ * Send as many messages as the SCTP send buffer takes, a burst at a
+ * time so that the re thread is not held up by a large file.
+ */
+static void send_file_window(struct ecall *ecall)
+{
     struct user_data *usrd = ecall->usrd;
-    
-    if(usrd->channel_open && usrd->dce_ch && usrd->pending_msg_len > 0){
+    struct file_window *win = &usrd->ft_win;
+    uint32_t n = 0;
+
+    tmr_cancel(&usrd->ft_tmr);
+    win->wait_ack = false;
+
+    if(!usrd->file_snd.active || win->paused)
+        return;
+
+    while(win->next <= usrd->file_snd.nblocks){
+
+        if(!ecall->dce || !usrd->channel_open || !usrd->dce_ch){
+            tmr_start(&usrd->ft_tmr, FT_DRY_TIMEOUT_MS,
+                      send_file_timeout, ecall);
+            return;
+        }
+        if(n >= win->burst){
+            tmr_start(&usrd->ft_tmr, win->delay,
+                      send_file_timeout, ecall);
+            return;
+        }
+
+        size_t len;
+        int err = build_file_msg(usrd, win->next, &len);
+        if(err){
+            warning("user_data: cannot read %s (%m) \n", usrd->file_snd.name, err);
+            usrd->file_snd.active = false;
+            file_window_close(usrd);
+            if(usrd->f_snd_h){
+                usrd->f_snd_h(usrd->file_snd.name, false, usrd->arg);
+            }
+            return;
+        }
+
         int ret = dce_send(ecall->dce, usrd->dce_ch,
-                           (void*)&usrd->pending_msg_buf,
-                           usrd->pending_msg_len);
+                           usrd->ft_msg_buf, len);
         if(ret){
-            info("user_data: failed to send blob \n");
-        } else {
-            usrd->pending_msg_len = 0;
-            
-            if(usrd->file_snd.fp){
-                usrd->file_snd.block_cnt++;
-                if(usrd->file_snd.block_cnt == usrd->file_snd.nblocks){
-                    handle_last_chunk(usrd);
-                } else {
-                    handle_chunk(usrd);
-                }
-            }
+            /* The send buffer is full, go on when it is dry */
+            win->wait_dry = true;
+            win->n_full++;
+            tmr_start(&usrd->ft_tmr, FT_DRY_TIMEOUT_MS,
+                      send_file_timeout, ecall);
+            return;
         }
+
+        win->next++;
+        usrd->file_snd.block_cnt = win->next;
+        n++;
     }
-    if(usrd->pending_msg_len > 0 ){
-        tmr_start(&usrd->ft_tmr, 10, send_file_chunk_handler, ecall);
-    } else {
-        /* Wait for the ack from the recieving side */
-        tmr_start(&usrd->ft_tmr, 5000, wait_for_ft_ack_timeout, ecall);
-    }
+
+    /* Wait for the ack from the recieving side, the ack timeout starts
+     * when the association is dry. Until then this keeps the sender
+     * from waiting forever for a dry event that does not come. */
+    win->wait_ack = true;
+    tmr_start(&usrd->ft_tmr, FT_RESUME_TIMEOUT_MS,
+              wait_for_ft_ack_timeout, ecall);
 }
 
 int ecall_user_data_send_file(struct ecall *ecall, const char *file, const char *name, int speed_kbps)
 {
     if(!ecall || !ecall->dce || !ecall->usrd)
         return EINVAL;
-    
+
     struct user_data *usrd = ecall->usrd;
-    
+    struct file_window *win = &usrd->ft_win;
+
     if(usrd->file_snd.active){
         error("user_data: file transfer in progress \n");
         return -1;
     }
-    usrd->file_snd.active = true;
-    
-    if(!(usrd->channel_open && usrd->dce_ch && usrd->pending_msg_len <= 0)){
+
+    if(!(usrd->channel_open && usrd->dce_ch)){
         error("user_data: cannot start file transfer \n");
         return -1;
     }
-    
+
     if(strlen(name) > MAX_FILE_NAME_SIZE){
         error("user_data: filename too long \n");
         return -1;
     }
-    
+
     if(speed_kbps < 1){
-        // Default is 10 mbps
+        // Default is as fast as SCTP goes
         usrd->ft_chunk_size = MAX_USER_DATA_SIZE;
     } else {
-        usrd->ft_chunk_size = (speed_kbps * 10)/8;
+        usrd->ft_chunk_size = (speed_kbps * FT_PACE_MS)/8;
     }
     if(usrd->ft_chunk_size > MAX_USER_DATA_SIZE){
         usrd->ft_chunk_size = MAX_USER_DATA_SIZE;
@@ -531,44 +1027,54 @@ int ecall_user_data_send_file(struct ecall *ecall, const char *file, const char
     if(usrd->ft_chunk_size < 100){
         usrd->ft_chunk_size = 100; // 80 kbps is minimum
     }
-    
-    FILE *fp = fopen(file,"rb");
-    if(!fp){
+
+    int fd = open(file, O_RDONLY);
+    if(fd < 0){
         error("user_data: cannot open %s \n", file);
-        usrd->file_snd.active = false;
         return -1;
     }
-    fseek(fp, 0L, SEEK_END);
-    int sz = ftell(fp);
-    fclose(fp);
-    
-    usrd->file_snd.nblocks = sz / usrd->ft_chunk_size;
-    if(usrd->ft_chunk_size * (int)usrd->file_snd.nblocks < sz){
-        usrd->file_snd.nblocks += 1;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0){
+        error("user_data: cannot stat %s \n", file);
+        close(fd);
+        return -1;
     }
-    
-    usrd->file_snd.fp = fopen(file,"rb");
-    
-    uint8_t *ptr = usrd->pending_msg_buf;
-    *ptr++ = USER_MESSAGE_FILE_START;
-    write_u32(&ptr, htonl(usrd->file_snd.nblocks));
+
+    file_window_close(usrd);
+    win->fd = fd;
+    win->size = (size_t)st.st_size;
+    win->chunked = (usrd->peer_caps & USER_FILE_CAP_CHUNK) != 0;
+
+    /* An empty file still has its FILE_END */
+    usrd->file_snd.nblocks = (uint32_t)((win->size + usrd->ft_chunk_size - 1) / usrd->ft_chunk_size);
+    if(usrd->file_snd.nblocks == 0){
+        usrd->file_snd.nblocks = 1;
+    }
+
+    if(speed_kbps < 1){
+        win->burst = FT_BURST;
+        win->delay = 0;
+    } else {
+        win->burst = 1;
+        win->delay = FT_PACE_MS;
+    }
+
+    memset(usrd->file_snd.name, 0, sizeof(usrd->file_snd.name));
     memcpy(usrd->file_snd.name, name, strlen(name));
-    memcpy(ptr, name, strlen(name));
-    ptr += MAX_FILE_NAME_SIZE;
-    int cnt = fread( ptr, sizeof(uint8_t), usrd->ft_chunk_size, usrd->file_snd.fp);
     SHA256_Init(&usrd->file_snd.sha256_hash);
-    SHA256_Update(&usrd->file_snd.sha256_hash, ptr, cnt);
-    ptr += cnt;
-    usrd->pending_msg_len = (size_t)(ptr - usrd->pending_msg_buf);
-    usrd->file_snd.block_cnt = 1;
-    if(cnt < usrd->ft_chunk_size){
-        fclose(usrd->file_snd.fp);
-        usrd->file_snd.fp = NULL;
-    }
-    tmr_start(&usrd->ft_tmr, 1, send_file_chunk_handler, ecall);
-    
+    usrd->file_snd.block_cnt = 0;
+    usrd->file_snd.byte_cnt = (uint32_t)win->size;
+    usrd->file_snd.active = true;
+
+    info("user_data: sending %s, %zu bytes in %u blocks%s \n",
+         name, win->size, usrd->file_snd.nblocks,
+         win->chunked ? "" : " with the old framing");
+
     ztime_get(&usrd->file_snd.start_time);
-    
+
+    send_file_window(ecall);
+
     return 0;
 }
 
@@ -595,5 +1101,66 @@ int ecall_user_data_register_ft_handlers(struct ecall *ecall,
 }
 
 
+/*
+ * The tests stand in for the data channel: a message as it came from
+ * the peer, and the channel going down and up again.
+ */
+int ecall_user_data_recv(struct ecall *ecall, const uint8_t *msg, size_t len)
+{
+    if(!ecall || !ecall->usrd || !msg)
+        return EINVAL;
+    
+    data_channel_handler(0, (uint8_t *)msg, len, ecall);
+    
+    return 0;
+}
 
+int ecall_user_data_channel_changed(struct ecall *ecall, bool open)
+{
+    if(!ecall || !ecall->usrd)
+        return EINVAL;
+    
+    if(open){
+        data_channel_open_handler(0, "wire-user-data", "", ecall);
+    }
+    else {
+        data_channel_closed_handler(0, "wire-user-data", "", ecall);
+    }
+    
+    return 0;
+}
 
+int ecall_user_data_debug(struct re_printf *pf, const struct ecall *ecall)
+{
+    const struct user_data *usrd;
+    struct le *le;
+    int err;
+    
+    if(!ecall || !ecall->usrd)
+        return 0;
+    
+    usrd = ecall->usrd;
+    
+    err = re_hprintf(pf, "user_data: open=%d caps=0x%x"
+                     " rcv=%s block=%u/%u bytes=%u"
+                     " snd=%s block=%u/%u ctl=[",
+                     usrd->channel_open, usrd->peer_caps,
+                     usrd->file_rcv.active ? "on" : "off",
+                     usrd->file_rcv.block_cnt, usrd->file_rcv.nblocks,
+                     usrd->file_rcv.byte_cnt,
+                     usrd->file_snd.active ? "on" : "off",
+                     usrd->file_snd.block_cnt, usrd->file_snd.nblocks);
+    
+    /* type:value of the control messages not sent yet */
+    for(le = list_head(&usrd->ctl_msgl); le; le = le->next){
+        const struct ctl_msg *msg = le->data;
+        uint8_t *ptr = (uint8_t *)msg->buf + 1;
+        
+        err |= re_hprintf(pf, "%s%u:%u", le == list_head(&usrd->ctl_msgl) ? "" : " ",
+                          msg->buf[0], ntohl(read_u32(&ptr)));
+    }
+    
+    err |= re_hprintf(pf, "]");
+    
+    return err;
+}
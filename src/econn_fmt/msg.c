@@ -50,7 +50,10 @@ static int econn_props_encode(struct json_object *jobj,
 }
 
 
-int econn_message_encode(char **strp, const struct econn_message *msg)
+/*
+ * The jzon codec, for the messages the streaming codec does not take
+ */
+int econn_message_encode_jzon(char **strp, const struct econn_message *msg)
 {
 	struct json_object *jobj = NULL;
 	char *str = NULL;
@@ -213,9 +216,9 @@ static int econn_props_decode(struct econn_props **props,
 }
 
 
-int econn_message_decode(struct econn_message **msgp,
-			 uint64_t curr_time, uint64_t msg_time,
-			 const char *str, size_t len)
+int econn_message_decode_jzon(struct econn_message **msgp,
+			      uint64_t curr_time, uint64_t msg_time,
+			      const char *str, size_t len)
 {
 	struct econn_message *msg = NULL;
 	struct json_object *jobj = NULL;
@@ -0,0 +1,862 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_jzon.h"
+#include "avs_uuid.h"
+#include "avs_zapi.h"
+#include "avs_media.h"
+#include "avs_econn.h"
+#include "avs_econn_fmt.h"
+
+
+/*
+ * Streaming econn codec
+ *
+ * Decoding scans the JSON once, straight into the fields of the
+ * message, without building a DOM. The strings are referenced in the
+ * input and only copied where the message keeps them, the SDP is
+ * unescaped directly into its own buffer. Encoding prints the message
+ * into one buffer, sized up front.
+ *
+ * Only what the calling code sends is handled here. Anything else,
+ * such as unknown value types, nested objects other than props,
+ * duplicate or missing fields, returns ENOTSUP internally and the
+ * message goes through the jzon codec, so that errors and corner
+ * cases behave exactly as before.
+ */
+
+
+#define PROPS_HASH_SIZE 16
+
+
+struct scan {
+	const char *p;
+	const char *end;
+};
+
+struct str_field {
+	struct pl pl;
+	bool esc;
+	bool uni;       /* has unicode escapes */
+	bool set;
+};
+
+struct fields {
+	struct str_field version;
+	struct str_field type;
+	struct str_field sessid;
+	struct str_field dest_userid;
+	struct str_field dest_clientid;
+	struct str_field sdp;
+	struct str_field descr;
+	struct pl level;
+	bool has_level;
+	bool resp;
+	bool has_resp;
+	struct odict *props;
+};
+
+
+static inline void skip_ws(struct scan *sc)
+{
+	while (sc->p < sc->end) {
+		const char c = *sc->p;
+
+		if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+			break;
+		++sc->p;
+	}
+}
+
+
+static inline bool expect(struct scan *sc, char c)
+{
+	skip_ws(sc);
+
+	if (sc->p >= sc->end || *sc->p != c)
+		return false;
+
+	++sc->p;
+
+	return true;
+}
+
+
+/* The contents of a string, between the quotes */
+static bool scan_string(struct scan *sc, struct str_field *f)
+{
+	const char *p;
+
+	skip_ws(sc);
+
+	if (sc->p >= sc->end || *sc->p != '"')
+		return false;
+
+	f->esc = false;
+	f->uni = false;
+
+	for (p = sc->p + 1; p < sc->end; p++) {
+
+		const char c = *p;
+
+		if (c == '"') {
+			f->pl.p = sc->p + 1;
+			f->pl.l = p - f->pl.p;
+			f->set = true;
+			sc->p = p + 1;
+			return true;
+		}
+		else if (c == '\\') {
+			f->esc = true;
+			if (++p < sc->end && *p == 'u')
+				f->uni = true;
+		}
+		else if ((uint8_t)c < 0x20) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+
+/* A number, true, false or null */
+static bool scan_token(struct scan *sc, struct pl *pl)
+{
+	const char *p;
+
+	skip_ws(sc);
+
+	for (p = sc->p; p < sc->end; p++) {
+
+		const char c = *p;
+
+		if (!(('0' <= c && c <= '9') || ('a' <= c && c <= 'z') ||
+		      c == '-' || c == '+' || c == '.' || c == 'E'))
+			break;
+	}
+
+	if (p == sc->p)
+		return false;
+
+	pl->p = sc->p;
+	pl->l = p - sc->p;
+	sc->p = p;
+
+	return true;
+}
+
+
+static bool is_uint(const struct pl *pl)
+{
+	size_t i;
+
+	if (!pl->l || pl->l > 9)
+		return false;
+
+	for (i = 0; i < pl->l; i++) {
+		if (pl->p[i] < '0' || pl->p[i] > '9')
+			return false;
+	}
+
+	return true;
+}
+
+
+/* A flat object of plain strings */
+static int scan_props(struct odict **dictp, struct scan *sc)
+{
+	struct odict *dict;
+	char key[64];
+	int err;
+
+	if (!expect(sc, '{'))
+		return ENOTSUP;
+
+	err = odict_alloc(&dict, PROPS_HASH_SIZE);
+	if (err)
+		return err;
+
+	skip_ws(sc);
+	if (sc->p < sc->end && *sc->p == '}') {
+		++sc->p;
+		goto out;
+	}
+
+	for (;;) {
+		struct str_field k = {{NULL, 0}, false, false, false};
+		struct str_field v = {{NULL, 0}, false, false, false};
+		char *val;
+
+		if (!scan_string(sc, &k) || k.esc || k.pl.l >= sizeof(key) ||
+		    !expect(sc, ':') ||
+		    !scan_string(sc, &v) || v.esc) {
+			err = ENOTSUP;
+			goto out;
+		}
+
+		pl_strcpy(&k.pl, key, sizeof(key));
+		if (odict_lookup(dict, key)) {
+			err = ENOTSUP;
+			goto out;
+		}
+
+		err = pl_strdup(&val, &v.pl);
+		if (err)
+			goto out;
+
+		err = odict_entry_add(dict, key, ODICT_STRING, val);
+		mem_deref(val);
+		if (err)
+			goto out;
+
+		if (expect(sc, ','))
+			continue;
+		if (expect(sc, '}'))
+			break;
+
+		err = ENOTSUP;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(dict);
+	else
+		*dictp = dict;
+
+	return err;
+}
+
+
+static int scan_field(struct str_field *f, struct scan *sc)
+{
+	if (f->set)
+		return ENOTSUP;
+
+	return scan_string(sc, f) ? 0 : ENOTSUP;
+}
+
+
+static int scan_message(struct fields *f, struct scan *sc)
+{
+	int err = 0;
+
+	if (!expect(sc, '{'))
+		return ENOTSUP;
+
+	skip_ws(sc);
+	if (sc->p < sc->end && *sc->p == '}') {
+		++sc->p;
+		goto out;
+	}
+
+	for (;;) {
+		struct str_field key = {{NULL, 0}, false, false, false};
+		struct pl tok;
+
+		if (!scan_string(sc, &key) || key.esc || !expect(sc, ':'))
+			return ENOTSUP;
+
+		if (0 == pl_strcmp(&key.pl, "version")) {
+			err = scan_field(&f->version, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "type")) {
+			err = scan_field(&f->type, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "sessid")) {
+			err = scan_field(&f->sessid, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "dest_userid")) {
+			err = scan_field(&f->dest_userid, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "dest_clientid")) {
+			err = scan_field(&f->dest_clientid, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "sdp")) {
+			err = scan_field(&f->sdp, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "descr")) {
+			err = scan_field(&f->descr, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "props")) {
+			if (f->props)
+				return ENOTSUP;
+			err = scan_props(&f->props, sc);
+		}
+		else if (0 == pl_strcmp(&key.pl, "resp")) {
+			if (f->has_resp || !scan_token(sc, &tok))
+				return ENOTSUP;
+
+			if (0 == pl_strcmp(&tok, "true"))
+				f->resp = true;
+			else if (0 == pl_strcmp(&tok, "false"))
+				f->resp = false;
+			else
+				return ENOTSUP;
+
+			f->has_resp = true;
+		}
+		else if (0 == pl_strcmp(&key.pl, "level")) {
+			if (f->has_level || !scan_token(sc, &f->level) ||
+			    !is_uint(&f->level))
+				return ENOTSUP;
+
+			f->has_level = true;
+		}
+		else {
+			struct str_field skip = {{NULL, 0}, false, false, false};
+
+			/* unknown keys with plain values are ignored */
+			skip_ws(sc);
+			if (sc->p < sc->end && *sc->p == '"') {
+				if (!scan_string(sc, &skip))
+					return ENOTSUP;
+			}
+			else if (!scan_token(sc, &tok)) {
+				return ENOTSUP;
+			}
+		}
+		if (err)
+			return err;
+
+		if (expect(sc, ','))
+			continue;
+		if (expect(sc, '}'))
+			break;
+
+		return ENOTSUP;
+	}
+
+ out:
+	/* only white space, or the terminating zero */
+	while (sc->p < sc->end) {
+		skip_ws(sc);
+		if (sc->p < sc->end && *sc->p != '\0')
+			return ENOTSUP;
+		if (sc->p < sc->end)
+			++sc->p;
+	}
+
+	return 0;
+}
+
+
+/* As utf8_decode() does it, for strings without unicode escapes */
+static void unescape(char *dst, const struct pl *pl)
+{
+	const char *p = pl->p, *end = pl->p + pl->l;
+	char *d = dst;
+
+	while (p < end) {
+		const char *bs = memchr(p, '\\', end - p);
+		size_t n = (bs ? bs : end) - p;
+		char ch;
+
+		memcpy(d, p, n);
+		d += n;
+		p += n;
+
+		if (!bs || ++p >= end)
+			break;
+
+		ch = *p++;
+
+		switch (ch) {
+
+		case 'b': ch = '\b'; break;
+		case 'f': ch = '\f'; break;
+		case 'n': ch = '\n'; break;
+		case 'r': ch = '\r'; break;
+		case 't': ch = '\t'; break;
+		default:  break;
+		}
+
+		*d++ = ch;
+	}
+
+	*d = '\0';
+}
+
+
+/* A copy of the string in its own buffer, unescaped on the way */
+static int field_strdup(char **strp, const struct str_field *f)
+{
+	char *str;
+
+	if (!f->esc)
+		return pl_strdup(strp, &f->pl);
+
+	/* the unescaped string is never longer */
+	str = mem_alloc(f->pl.l + 1, NULL);
+	if (!str)
+		return ENOMEM;
+
+	if (!f->uni) {
+		unescape(str, &f->pl);
+	}
+	else if (re_snprintf(str, f->pl.l + 1, "%H",
+			     utf8_decode, &f->pl) < 0) {
+		mem_deref(str);
+		return ENOTSUP;
+	}
+
+	*strp = str;
+
+	return 0;
+}
+
+
+static int field_strcpy(char *str, size_t size, const struct str_field *f)
+{
+	if (!f->set) {
+		str[0] = '\0';
+		return 0;
+	}
+	if (f->esc)
+		return ENOTSUP;
+
+	return pl_strcpy(&f->pl, str, size);
+}
+
+
+static const enum econn_msg msg_types[] = {
+	ECONN_SETUP,
+	ECONN_UPDATE,
+	ECONN_CANCEL,
+	ECONN_HANGUP,
+	ECONN_REJECT,
+	ECONN_PROPSYNC,
+	ECONN_GROUP_START,
+	ECONN_GROUP_LEAVE,
+	ECONN_GROUP_CHECK,
+	ECONN_GROUP_SETUP,
+	ECONN_DEVPAIR_ACCEPT,
+	ECONN_ALERT,
+};
+
+
+static int msg_type(enum econn_msg *typep, const struct str_field *f)
+{
+	size_t i;
+
+	if (!f->set || f->esc)
+		return ENOTSUP;
+
+	for (i = 0; i < ARRAY_SIZE(msg_types); i++) {
+
+		if (0 == pl_strcasecmp(&f->pl, econn_msg_name(msg_types[i]))) {
+			*typep = msg_types[i];
+			return 0;
+		}
+	}
+
+	return ENOTSUP;
+}
+
+
+static int stream_decode(struct econn_message **msgp,
+			 const char *str, size_t len)
+{
+	struct econn_message *msg = NULL;
+	struct fields f;
+	struct scan sc;
+	enum econn_msg type;
+	int err;
+
+	memset(&f, 0, sizeof(f));
+	sc.p = str;
+	sc.end = str + len;
+
+	err = scan_message(&f, &sc);
+	if (err)
+		goto out;
+
+	if (!f.version.set || f.version.esc ||
+	    0 != pl_strcasecmp(&f.version.pl, econn_proto_version) ||
+	    !f.sessid.set || !f.has_resp) {
+		err = ENOTSUP;
+		goto out;
+	}
+
+	err = msg_type(&type, &f.type);
+	if (err)
+		goto out;
+
+	msg = econn_message_alloc();
+	if (!msg) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err  = field_strcpy(msg->sessid_sender, sizeof(msg->sessid_sender),
+			    &f.sessid);
+	err |= field_strcpy(msg->dest_userid, sizeof(msg->dest_userid),
+			    &f.dest_userid);
+	err |= field_strcpy(msg->dest_clientid, sizeof(msg->dest_clientid),
+			    &f.dest_clientid);
+	if (err) {
+		err = ENOTSUP;
+		goto out;
+	}
+
+	msg->resp = f.resp;
+	msg->msg_type = type;
+
+	switch (type) {
+
+	case ECONN_SETUP:
+	case ECONN_GROUP_SETUP:
+	case ECONN_UPDATE:
+		if (!f.sdp.set) {
+			err = ENOTSUP;
+			goto out;
+		}
+
+		if (!f.props) {
+			if (type != ECONN_UPDATE) {
+				err = ENOTSUP;
+				goto out;
+			}
+			info("econn: decode UPDATE: no props\n");
+		}
+		else {
+			err = econn_props_alloc(&msg->u.setup.props, f.props);
+			if (err)
+				goto out;
+		}
+
+		err = field_strdup(&msg->u.setup.sdp_msg, &f.sdp);
+		if (err)
+			goto out;
+		break;
+
+	case ECONN_PROPSYNC:
+		if (!f.props) {
+			err = ENOTSUP;
+			goto out;
+		}
+
+		err = econn_props_alloc(&msg->u.propsync.props, f.props);
+		if (err)
+			goto out;
+		break;
+
+	case ECONN_GROUP_START:
+		if (f.props) {
+			err = econn_props_alloc(&msg->u.groupstart.props,
+						f.props);
+			if (err)
+				goto out;
+		}
+		else {
+			info("econn: decode GROUPSTART: no props\n");
+		}
+		break;
+
+	case ECONN_DEVPAIR_ACCEPT:
+		if (!f.sdp.set) {
+			err = ENOTSUP;
+			goto out;
+		}
+
+		err = field_strdup(&msg->u.devpair_accept.sdp, &f.sdp);
+		if (err)
+			goto out;
+		break;
+
+	case ECONN_ALERT:
+		if (!f.has_level || !f.descr.set) {
+			err = ENOTSUP;
+			goto out;
+		}
+
+		msg->u.alert.level = pl_u32(&f.level);
+
+		err = field_strdup(&msg->u.alert.descr, &f.descr);
+		if (err)
+			goto out;
+		break;
+
+	default:
+		break;
+	}
+
+ out:
+	mem_deref(f.props);
+	if (err)
+		mem_deref(msg);
+	else
+		*msgp = msg;
+
+	return err;
+}
+
+
+int econn_message_decode(struct econn_message **msgp,
+			 uint64_t curr_time, uint64_t msg_time,
+			 const char *str, size_t len)
+{
+	struct econn_message *msg = NULL;
+	int err;
+
+	if (!msgp || !str)
+		return EINVAL;
+
+	err = stream_decode(&msg, str, len);
+	if (err == ENOTSUP) {
+		return econn_message_decode_jzon(msgp, curr_time, msg_time,
+						 str, len);
+	}
+	else if (err)
+		return err;
+
+	msg->time = msg_time;
+	msg->age = (msg_time > curr_time) ? 0 : curr_time - msg_time;
+
+	*msgp = msg;
+
+	return 0;
+}
+
+
+static inline bool must_escape(uint8_t c)
+{
+	return c < ' ' || c == '"' || c == '\\' || c == '/';
+}
+
+
+/* As utf8_encode() does it, straight into the buffer */
+static int write_escaped(struct mbuf *mb, const char *str)
+{
+	static const char hex_chars[] = "0123456789ABCDEF";
+	const char *p = str;
+	int err = 0;
+
+	while (*p) {
+		const char *run = p;
+		char ebuf[6] = "\\u00";
+		size_t elen = 2;
+		uint8_t c;
+
+		while (*p && !must_escape((uint8_t)*p))
+			++p;
+
+		if (p > run)
+			err |= mbuf_write_mem(mb, (const uint8_t *)run, p - run);
+		if (!*p)
+			break;
+
+		c = (uint8_t)*p++;
+
+		switch (c) {
+
+		case '"':  ebuf[1] = '"';  break;
+		case '\\': ebuf[1] = '\\'; break;
+		case '/':  ebuf[1] = '/';  break;
+		case '\b': ebuf[1] = 'b';  break;
+		case '\f': ebuf[1] = 'f';  break;
+		case '\n': ebuf[1] = 'n';  break;
+		case '\r': ebuf[1] = 'r';  break;
+		case '\t': ebuf[1] = 't';  break;
+		default:
+			ebuf[4] = hex_chars[(c>>4) & 0xf];
+			ebuf[5] = hex_chars[c & 0xf];
+			elen = 6;
+			break;
+		}
+
+		err |= mbuf_write_mem(mb, (const uint8_t *)ebuf, elen);
+	}
+
+	return err;
+}
+
+
+static int write_str(struct mbuf *mb, const char *key, const char *val)
+{
+	int err;
+
+	err  = mbuf_write_str(mb, ",\"");
+	err |= mbuf_write_str(mb, key);
+	err |= mbuf_write_str(mb, "\":\"");
+	err |= write_escaped(mb, val);
+	err |= mbuf_write_u8(mb, '"');
+
+	return err;
+}
+
+
+static int write_props(struct mbuf *mb, const struct econn_props *props)
+{
+	return mbuf_printf(mb, ",\"props\":%H", json_encode_odict, props->dict);
+}
+
+
+static int write_message(struct mbuf *mb, const struct econn_message *msg)
+{
+	int err;
+
+	err  = mbuf_write_str(mb, "{\"version\":\"");
+	err |= write_escaped(mb, econn_proto_version);
+	err |= mbuf_write_str(mb, "\",\"type\":\"");
+	err |= write_escaped(mb, econn_msg_name(msg->msg_type));
+	err |= mbuf_write_u8(mb, '"');
+	err |= write_str(mb, "sessid", msg->sessid_sender);
+
+	if (str_isset(msg->dest_userid))
+		err |= write_str(mb, "dest_userid", msg->dest_userid);
+	if (str_isset(msg->dest_clientid))
+		err |= write_str(mb, "dest_clientid", msg->dest_clientid);
+
+	err |= mbuf_write_str(mb, msg->resp ? ",\"resp\":true"
+				       : ",\"resp\":false");
+	if (err)
+		return err;
+
+	switch (msg->msg_type) {
+
+	case ECONN_SETUP:
+	case ECONN_GROUP_SETUP:
+	case ECONN_UPDATE:
+		if (!msg->u.setup.sdp_msg)
+			return EINVAL;
+
+		err = write_str(mb, "sdp", msg->u.setup.sdp_msg);
+
+		/* props is optional for SETUP */
+		if (msg->u.setup.props)
+			err |= write_props(mb, msg->u.setup.props);
+		break;
+
+	case ECONN_CANCEL:
+	case ECONN_HANGUP:
+	case ECONN_REJECT:
+	case ECONN_GROUP_LEAVE:
+	case ECONN_GROUP_CHECK:
+		break;
+
+	case ECONN_PROPSYNC:
+
+		/* props is mandatory for PROPSYNC */
+		if (!msg->u.propsync.props) {
+			warning("propsync: missing props\n");
+			return EINVAL;
+		}
+
+		err = write_props(mb, msg->u.propsync.props);
+		break;
+
+	case ECONN_GROUP_START:
+		/* props is optional for GROUPSTART */
+		if (msg->u.groupstart.props)
+			err = write_props(mb, msg->u.groupstart.props);
+		break;
+
+	case ECONN_DEVPAIR_ACCEPT:
+		if (!msg->u.devpair_accept.sdp)
+			return EINVAL;
+
+		err = write_str(mb, "sdp", msg->u.devpair_accept.sdp);
+		break;
+
+	case ECONN_ALERT:
+		if (!msg->u.alert.descr)
+			return EINVAL;
+
+		/* the level goes out as int32, as it did with jzon */
+		err  = mbuf_printf(mb, ",\"level\":%lld",
+				   (long long)(int32_t)msg->u.alert.level);
+		err |= write_str(mb, "descr", msg->u.alert.descr);
+		break;
+
+	default:
+		warning("econn: dont know how to encode %d\n", msg->msg_type);
+		return EBADMSG;
+	}
+	if (err)
+		return err;
+
+	return mbuf_write_str(mb, "}");
+}
+
+
+static size_t encoded_size(const struct econn_message *msg)
+{
+	size_t sz = 256;
+
+	switch (msg->msg_type) {
+
+	case ECONN_SETUP:
+	case ECONN_GROUP_SETUP:
+	case ECONN_UPDATE:
+		/* room for the escaped line endings, and props */
+		sz += str_len(msg->u.setup.sdp_msg) * 9 / 8 + 256;
+		break;
+
+	case ECONN_DEVPAIR_ACCEPT:
+		sz += str_len(msg->u.devpair_accept.sdp) * 9 / 8;
+		break;
+
+	case ECONN_ALERT:
+		sz += str_len(msg->u.alert.descr) * 9 / 8;
+		break;
+
+	default:
+		break;
+	}
+
+	return sz;
+}
+
+
+int econn_message_encode(char **strp, const struct econn_message *msg)
+{
+	struct mbuf *mb;
+	int err;
+
+	if (!strp || !msg)
+		return EINVAL;
+
+	/* ICE servers are only done by the jzon codec */
+	if (msg->msg_type == ECONN_DEVPAIR_PUBLISH)
+		return econn_message_encode_jzon(strp, msg);
+
+	mb = mbuf_alloc(encoded_size(msg));
+	if (!mb)
+		return ENOMEM;
+
+	err = write_message(mb, msg);
+	if (err)
+		goto out;
+
+	err = mbuf_write_u8(mb, '\0');
+	if (err)
+		goto out;
+
+	/* the string is the buffer of the mbuf */
+	*strp = mem_ref(mb->buf);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
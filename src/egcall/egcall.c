@@ -32,14 +32,17 @@
 struct media_entry {
 	struct ecall *ecall;
 	bool started;
+	bool removed;   /* ecall_remove()'d, not found by peer any more */
 
 	struct le le;
+	struct le hle;  /* member of ecallh, by peer userid */
 };
 
 struct egcall {
 	struct icall icall;
 	struct list ecalll;
 	struct list media_startl;
+	struct hash *ecallh;
 	enum egcall_state state;
 	char *convid;
 	char *userid_self;
@@ -49,11 +52,13 @@ struct egcall {
 
 	struct dict *roster;
 	struct {
-		struct list partl;
+		struct conf_roster *parts;
 	} conf_pos;
 
 	struct zapi_ice_server turnv[MAX_TURN_SERVERS];
 	size_t turnc;
+	struct turn_pool *turn_pool;   /* allocations ready for new ecalls */
+	struct udp_mux *mux;           /* shared socket, optional */
 	
 	/* TODO replace this with an ONGOING state */
 	bool is_call_answered;
@@ -93,6 +98,7 @@ static void media_entry_destructor(void *arg)
 	struct media_entry *me = arg;
 
 	list_unlink(&me->le);
+	hash_unlink(&me->hle);
 }
 
 
@@ -111,20 +117,103 @@ static bool all_media_stopped(struct egcall *egcall)
 }
 
 
+static uint32_t userid_hash(const char *userid)
+{
+	return userid ? hash_joaat_str_ci(userid) : 0;
+}
+
+
+static bool ecall_cmp_handler(struct le *le, void *arg)
+{
+	const struct media_entry *me = le->data;
+
+	return me->ecall == arg;
+}
+
+
+static bool userid_cmp_handler(struct le *le, void *arg)
+{
+	const struct media_entry *me = le->data;
+
+	return !me->removed &&
+		0 == str_casecmp(ecall_get_peer_userid(me->ecall), arg);
+}
+
+
+struct peer {
+	const char *userid;
+	const char *clientid;
+};
+
+
+static bool peer_cmp_handler(struct le *le, void *arg)
+{
+	const struct media_entry *me = le->data;
+	const struct peer *peer = arg;
+
+	return !me->removed &&
+		0 == str_casecmp(ecall_get_peer_userid(me->ecall),
+				 peer->userid) &&
+		0 == str_cmp(ecall_get_peer_clientid(me->ecall),
+			     peer->clientid);
+}
+
+
 static struct media_entry *lookup_media_entry(struct egcall *egcall,
 					      struct ecall *ecall)
 {
-	struct media_entry *me = NULL;
-	struct le *le;
+	const char *userid = ecall_get_peer_userid(ecall);
 
-	for(le = egcall->media_startl.head; le && me == NULL; le = le->next) {
-		me = le->data;
+	return list_ledata(hash_lookup(egcall->ecallh, userid_hash(userid),
+				       ecall_cmp_handler, ecall));
+}
 
-		if (me->ecall != ecall)
-			me = NULL;
-	}
 
-	return me;
+/* there is at most one ecall per peer user, see add_ecall() */
+static struct ecall *find_ecall(struct egcall *egcall, const char *userid)
+{
+	struct media_entry *me;
+
+	if (!userid)
+		return NULL;
+
+	me = list_ledata(hash_lookup(egcall->ecallh, userid_hash(userid),
+				     userid_cmp_handler, (void *)userid));
+
+	return me ? me->ecall : NULL;
+}
+
+
+static struct ecall *find_ecall_client(struct egcall *egcall,
+				       const char *userid,
+				       const char *clientid)
+{
+	struct media_entry *me;
+	struct peer peer = {userid, clientid};
+
+	if (!userid || !clientid)
+		return NULL;
+
+	me = list_ledata(hash_lookup(egcall->ecallh, userid_hash(userid),
+				     peer_cmp_handler, &peer));
+
+	return me ? me->ecall : NULL;
+}
+
+
+/*
+ * Take the ecall out of the call while it is ending. It is destroyed
+ * by its close handler, until then it must not be found by its peer.
+ */
+static void remove_ecall(struct egcall *egcall, struct ecall *ecall)
+{
+	struct media_entry *me;
+
+	me = lookup_media_entry(egcall, ecall);
+	if (me)
+		me->removed = true;
+
+	ecall_remove(ecall);
 }
 
 
@@ -177,9 +266,9 @@ static void update_conf_pos(struct egcall *egcall)
 
 	info("egcall(%p): update_conf_pos called\n", egcall );
 
-	conf_pos_sort(&egcall->conf_pos.partl);
-
-	err = msystem_update_conf_parts(&egcall->conf_pos.partl);
+	/* the roster is always in position order */
+	err = msystem_update_conf_parts(
+		conf_roster_list(egcall->conf_pos.parts));
 	if (err) {
 		warning("egcall: msystem_update_conf_parts error (%m)\n", err);
 	}
@@ -267,7 +356,7 @@ static void roster_remove(struct egcall *egcall, const char* userid,
 	     anon_id(userid_anon, userid), anon_client(clientid_anon, clientid),
 	     dict_count(egcall->roster));
 
-	ecall = ecall_find_userid(&egcall->ecalll, userid);
+	ecall = find_ecall(egcall, userid);
 	if (ecall) {
 		ecall_set_conf_part(ecall, NULL);
 		update_conf_pos(egcall);
@@ -308,6 +397,10 @@ static void destructor(void *arg)
 	tmr_cancel(&egcall->roster_timer);
 	list_flush(&egcall->media_startl);
 	list_flush(&egcall->ecalll);
+	mem_deref(egcall->ecallh);
+	mem_deref(egcall->conf_pos.parts);
+	mem_deref(egcall->turn_pool);
+	mem_deref(egcall->mux);
 	mem_deref(egcall->convid);
 	mem_deref(egcall->userid_self);
 	mem_deref(egcall->clientid_self);
@@ -345,6 +438,21 @@ const char *egcall_state_name(enum egcall_state state)
 	}
 }
 
+/* same address family as the mediaflows, see alloc_mediaflow() */
+static void turnpool_run(struct egcall *egcall)
+{
+	struct sa laddr;
+	int af;
+
+	if (0 == net_default_source_addr_get(AF_INET, &laddr))
+		af = AF_INET;
+	else
+		af = AF_INET6;
+
+	turnpool_start(egcall->turn_pool, af);
+}
+
+
 static void set_state(struct egcall* egcall, enum egcall_state state)
 {
 	info("egcall(%p): State changed: `%s' --> `%s'\n",
@@ -358,9 +466,11 @@ static void set_state(struct egcall* egcall, enum egcall_state state)
 	case EGCALL_STATE_IDLE:
 		tmr_cancel(&egcall->call_timer);
 		tmr_cancel(&egcall->roster_timer);
+		turnpool_stop(egcall->turn_pool);
 		break;
 
 	case EGCALL_STATE_OUTGOING:
+		turnpool_run(egcall);
 		egcall->is_call_answered = true;
 		tmr_start(&egcall->call_timer, EGCALL_START_TIMEOUT,
 			egcall_start_timeout, egcall);
@@ -374,6 +484,7 @@ static void set_state(struct egcall* egcall, enum egcall_state state)
 		break;
 
 	case EGCALL_STATE_ANSWERED:
+		turnpool_run(egcall);
 		egcall->is_call_answered = true;
 		tmr_start(&egcall->call_timer, EGCALL_ANSWER_TIMEOUT,
 			egcall_answer_timeout, egcall);
@@ -535,7 +646,23 @@ int egcall_alloc(struct egcall **egcallp,
 	if (err)
 		goto out;
 
-	list_init(&egcall->conf_pos.partl);
+	err = hash_alloc(&egcall->ecallh, 32);
+	if (err)
+		goto out;
+
+	err = conf_roster_alloc(&egcall->conf_pos.parts);
+	if (err)
+		goto out;
+
+	err = mediaflow_turnpool_alloc(&egcall->turn_pool);
+	if (err)
+		goto out;
+
+	if (msystem_get_shared_socket(flowmgr_msystem())) {
+		err = udp_mux_alloc(&egcall->mux);
+		if (err)
+			goto out;
+	}
 	
 	err = str_dup(&egcall->convid, convid);
 	err |= str_dup(&egcall->userid_self, userid_self);
@@ -546,8 +673,6 @@ int egcall_alloc(struct egcall **egcallp,
 	egcall->conf = conf;
 	egcall->state = EGCALL_STATE_IDLE;
 
-	list_init(&egcall->conf_pos.partl);
-	
 	tmr_init(&egcall->call_timer);
 	tmr_init(&egcall->roster_timer);
 
@@ -596,6 +721,14 @@ int egcall_add_turnserver(struct icall *icall,
 	egcall->turnv[egcall->turnc] = *srv;
 	++egcall->turnc;
 
+	err = turnpool_add(egcall->turn_pool, srv->url,
+			   srv->username, srv->credential);
+	if (err) {
+		warning("egcall(%p): add_turnserver: not pooled (%m)\n",
+			egcall, err);
+		err = 0;
+	}
+
 	return err;
 }
 
@@ -746,7 +879,7 @@ static void ecall_setup_handler(struct icall *icall,
 	(void)icall; /* not really used, revise code below and use directly */
 	(void)should_ring;
 
-	ecall0 = ecall_find_userid(&egcall->ecalll, userid_sender);
+	ecall0 = find_ecall(egcall, userid_sender);
 	
 	info("ecall_setup_h user=%s ecall=%p ecall0=%p\n",
 	     anon_id(userid_anon, userid_sender), icall, ecall0);
@@ -825,10 +958,10 @@ static void ecall_audio_estab_handler(struct icall *icall, const char *userid,
 
 			int err;
 
-			err = conf_part_add(&cp,
-					    &egcall->conf_pos.partl,
-					    userid,
-					    mf);
+			err = conf_roster_add(&cp,
+					      egcall->conf_pos.parts,
+					      userid,
+					      mf);
 			if (!err) {
 				ecall_set_conf_part(ecall, cp);
 				update_conf_pos(egcall);
@@ -972,8 +1105,7 @@ static int add_ecall(struct ecall **ecallp, struct egcall *egcall,
 	size_t i;
 	int err = 0;
 
-	ecall = ecall_find_userid(&egcall->ecalll,
-				  userid_peer);
+	ecall = find_ecall(egcall, userid_peer);
 	if (ecall) {
 		destroy_ecall(egcall, ecall);
 	}
@@ -1019,6 +1151,7 @@ static int add_ecall(struct ecall **ecallp, struct egcall *egcall,
 	me->ecall = ecall;
 	me->started = false;
 	list_append(&egcall->media_startl, &me->le, me);
+	hash_append(egcall->ecallh, userid_hash(userid_peer), &me->hle, me);
 
 	ecall_set_quality_interval(ecall, egcall->quality.interval);
 	
@@ -1026,6 +1159,8 @@ static int add_ecall(struct ecall **ecallp, struct egcall *egcall,
 	ecall_set_peer_clientid(ecall, clientid_peer);
 	ecall_set_video_send_state(ecall, egcall->video.send_state);
 	ecall_set_group_mode(ecall, true);
+	ecall_set_turn_pool(ecall, egcall->turn_pool);
+	ecall_set_udp_mux(ecall, egcall->mux);
 
 	for (i = 0; i < egcall->turnc; ++i) {
 		err = ecall_add_turnserver(ecall, &egcall->turnv[i]);
@@ -1110,7 +1245,7 @@ static void recv_start(struct egcall *egcall,
 			break;
 		}
 
-		ecall = ecall_find_userid(&egcall->ecalll, userid_sender);
+		ecall = find_ecall(egcall, userid_sender);
 		if (ecall &&
 			(ECONN_UPDATE_SENT == ecall_state(ecall) ||
 			ECONN_UPDATE_RECV == ecall_state(ecall))) {
@@ -1125,7 +1260,7 @@ static void recv_start(struct egcall *egcall,
 					econn_state_name(ecall_state(ecall)));
 
 				ecall_end(ecall);
-				ecall_remove(ecall);
+				remove_ecall(egcall, ecall);
 				ecall = NULL;
 			}
 		}
@@ -1173,7 +1308,6 @@ static void recv_leave(struct egcall* egcall,
 	char userid_anon[ANON_ID_LEN];
 	char clientid_anon[ANON_CLIENT_LEN];
 	struct ecall *ecall;
-	const char *rcid;
 
 	info("egcall(%p): recv_leave u: %s c: %s r: %s\n", egcall,
 	     anon_id(userid_anon, userid_sender), 
@@ -1182,13 +1316,10 @@ static void recv_leave(struct egcall* egcall,
 
 	roster_remove(egcall, userid_sender, clientid_sender);
 
-	ecall = ecall_find_userid(&egcall->ecalll, userid_sender);
+	ecall = find_ecall_client(egcall, userid_sender, clientid_sender);
 	if (ecall) {
-		rcid = ecall_get_peer_clientid(ecall);
-		if (strcmp(rcid, clientid_sender) == 0) {
-			ecall_end(ecall);
-			ecall_remove(ecall);
-		}
+		ecall_end(ecall);
+		remove_ecall(egcall, ecall);
 	}
 
 	if (egcall->state == EGCALL_STATE_INCOMING
@@ -1311,8 +1442,7 @@ int egcall_msg_recv(struct icall *icall,
 			if (msg->msg_type == ECONN_GROUP_SETUP)
 				msg->msg_type = ECONN_SETUP;
 
-			ecall = ecall_find_userid(&egcall->ecalll,
-						  userid_sender);
+			ecall = find_ecall(egcall, userid_sender);
 			if (!ecall && msg->msg_type == ECONN_SETUP
 			    && econn_message_isrequest(msg)
 			    && (egcall->state == EGCALL_STATE_OUTGOING ||
@@ -1406,6 +1536,10 @@ int egcall_debug(struct re_printf *pf, const struct icall *arg)
 			  dict_count(egcall->roster));
 	dict_apply(egcall->roster, roster_debug_handler, pf);
 
+	err |= re_hprintf(pf, "\t\t%H", turnpool_debug, egcall->turn_pool);
+	if (egcall->mux)
+		err |= re_hprintf(pf, "\t\t%H", udp_mux_debug, egcall->mux);
+
 	/* ecall info */
 	LIST_FOREACH(&egcall->ecalll, le) {
 		struct ecall *ecall = le->data;
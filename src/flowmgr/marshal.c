@@ -16,7 +16,7 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdlib.h>
-#include <unistd.h>
+#include <pthread.h>
 
 #include <re/re.h>
 #include <avs.h>
@@ -24,10 +24,19 @@
 #include "flowmgr.h"
 
 
+/*
+ * The calls wait for their element on one condition variable shared by
+ * all callers, as Darwin semaphores are not suitable for short-lived
+ * per-call objects.
+ */
 struct {
 	struct mqueue *mq;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
 } marshal = {
-	.mq = NULL
+	.mq = NULL,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
 };
 
 
@@ -229,18 +238,19 @@ static void mqueue_handler(int id, void *data, void *arg)
             
 	}
 
+	pthread_mutex_lock(&marshal.mutex);
 	me->handled = true;
+	pthread_cond_broadcast(&marshal.cond);
+	pthread_mutex_unlock(&marshal.mutex);
 }
 
 
 static void marshal_wait(struct marshal_elem *me)
 {
-	/* Using a semaphore would be more efficient,
-	 * but the Darwin implementation of it is really
-	 * not suitable for short-lived semaphores
-	 */
-	while(!me->handled)
-		usleep(40000);
+	pthread_mutex_lock(&marshal.mutex);
+	while (!me->handled)
+		pthread_cond_wait(&marshal.cond, &marshal.mutex);
+	pthread_mutex_unlock(&marshal.mutex);
 }
 
 
@@ -266,14 +276,25 @@ void marshal_close(void)
 static void marshal_send(void *arg)
 {
 	struct marshal_elem *me = arg;
+	int err;
+
+	me->handled = false;
+	me->ret = 0;
 
 	if (!marshal.mq) {
 		warning("flowmgr: marshal_send: no mq\n");
+		me->ret = ENOENT;
+		return;
+	}
+
+	err = mqueue_push(marshal.mq, me->id, me);
+	if (err) {
+		warning("flowmgr: marshal_send: mqueue_push failed (%m)\n",
+			err);
+		me->ret = err;
 		return;
 	}
 
-	me->handled = false;
-	mqueue_push(marshal.mq, me->id, me);
 	marshal_wait(me);
 }
 
@@ -16,28 +16,156 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <re.h>
 #include "avs_log.h"
-#include <string.h>
+#include "avs_packetqueue.h"
 
 
+enum {
+	LOG_MAX_MODULES = 16,
+	LOG_BUF_SIZE    = 1024,
+	LOG_BATCH       = 32,
+	LOG_RECORD_STOP = 0xff,
+};
+
+struct log_module {
+	char name[32];
+	size_t len;
+	enum log_level level;
+};
+
 static struct {
 	struct list logl;
 	enum log_level min_level;
+	enum log_level threshold;  /* lowest level of all modules */
+	struct log_module modv[LOG_MAX_MODULES];
+	size_t modc;
 	bool stder;
+
+	/* handlers and file, taken by whoever writes the lines out */
+	pthread_mutex_t mutex;
+
+	/* rotating log file */
+	struct {
+		FILE *f;
+		char *path;
+		size_t size;
+		size_t max_size;
+		unsigned max_files;
+	} file;
+
+	/* asynchronous mode: records are written by a background thread */
+	struct {
+		packet_queue_t *q;
+		pthread_t tid;
+		bool running;
+		int users;          /* threads that may be pushing to q */
+		uint64_t dropped;   /* reported so far */
+	} async;
 } lg = {
 	.logl  = LIST_INIT,
 	.min_level = LOG_LEVEL_WARN,
+	.threshold = LOG_LEVEL_WARN,
+	.modc  = 0,
 	.stder = true
 };
 
+static pthread_once_t lg_once = PTHREAD_ONCE_INIT;
+
+
+/* recursive, a log handler may log itself */
+static void lg_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&lg.mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+
+static void lg_lock(void)
+{
+	pthread_once(&lg_once, lg_init);
+	pthread_mutex_lock(&lg.mutex);
+}
+
+
+static void lg_unlock(void)
+{
+	pthread_mutex_unlock(&lg.mutex);
+}
+
+
+static void update_threshold(void)
+{
+	size_t i;
+
+	lg.threshold = lg.min_level;
+
+	for (i = 0; i < lg.modc; i++) {
+		if (lg.modv[i].level < lg.threshold)
+			lg.threshold = lg.modv[i].level;
+	}
+}
+
+
+/*
+ * The module of a log line is the name it starts with, as in
+ * "mediaflow(%p): ...", taken from the format string so that
+ * nothing needs to be formatted to find it.
+ */
+static const struct log_module *module_find(const char *fmt)
+{
+	size_t i;
+
+	for (i = 0; i < lg.modc; i++) {
+
+		const struct log_module *mod = &lg.modv[i];
+		char c;
+
+		if (0 != strncmp(fmt, mod->name, mod->len))
+			continue;
+
+		c = fmt[mod->len];
+		if (c == '(' || c == ':' || c == ' ' || c == '.')
+			return mod;
+	}
+
+	return NULL;
+}
+
+
+static bool level_enabled(enum log_level level, const char *fmt)
+{
+	const struct log_module *mod;
+
+	if (level < lg.threshold)
+		return false;
+
+	if (!lg.modc || !fmt)
+		return level >= lg.min_level;
+
+	mod = module_find(fmt);
+
+	return level >= (mod ? mod->level : lg.min_level);
+}
+
 
 void log_register_handler(struct log *log)
 {
 	if (!log)
 		return;
 
+	lg_lock();
 	list_append(&lg.logl, &log->le, log);
+	lg_unlock();
 }
 
 
@@ -46,13 +174,16 @@ void log_unregister_handler(struct log *log)
 	if (!log)
 		return;
 
+	lg_lock();
 	list_unlink(&log->le);
+	lg_unlock();
 }
 
 
 void log_set_min_level(enum log_level level)
 {
 	lg.min_level = level;
+	update_threshold();
 }
 
 
@@ -62,31 +193,124 @@ enum log_level log_get_min_level(void)
 }
 
 
+/*
+ * Set the log level of one module, overriding the minimum level.
+ * Should be done at startup, before other threads are logging.
+ */
+int log_set_module_level(const char *module, enum log_level level)
+{
+	struct log_module *mod = NULL;
+	size_t i, len;
+
+	len = str_len(module);
+	if (!len || len >= sizeof(mod->name))
+		return EINVAL;
+
+	for (i = 0; i < lg.modc; i++) {
+		if (0 == str_casecmp(lg.modv[i].name, module)) {
+			mod = &lg.modv[i];
+			break;
+		}
+	}
+
+	if (!mod) {
+		if (lg.modc >= LOG_MAX_MODULES)
+			return ENOSPC;
+
+		mod = &lg.modv[lg.modc++];
+		str_ncpy(mod->name, module, sizeof(mod->name));
+		mod->len = len;
+	}
+
+	mod->level = level;
+	update_threshold();
+
+	return 0;
+}
+
+
+void log_reset_module_levels(void)
+{
+	lg.modc = 0;
+	update_threshold();
+}
+
+
+/* true if a log line of this level would be logged by some module */
+bool log_level_enabled(enum log_level level)
+{
+	return level >= lg.threshold;
+}
+
+
 void log_enable_stderr(bool enable)
 {
 	lg.stder = enable;
 }
 
 
+static void log_write(enum log_level level, const char *fmt, va_list ap);
+
+
 void vloglv(enum log_level level, const char *fmt, va_list ap)
 {
-	if (lg.min_level > level)
+	/* nothing is formatted unless the line is logged */
+	if (!level_enabled(level, fmt))
 		return;
 
-	vlog(level, fmt, ap);
+	log_write(level, fmt, ap);
 }
 
 
-void vlog(enum log_level level, const char *fmt, va_list ap)
+static void file_rotate(void)
 {
-	struct le *le;
-	char *msg;
-	int err;
+	char from[256], to[256];
+	unsigned i;
 
-	err = re_vsdprintf(&msg, fmt, ap);
-	if (err)
+	fclose(lg.file.f);
+	lg.file.f = NULL;
+
+	for (i = lg.file.max_files; i > 1; i--) {
+		re_snprintf(from, sizeof(from), "%s.%u", lg.file.path, i - 1);
+		re_snprintf(to, sizeof(to), "%s.%u", lg.file.path, i);
+		(void)rename(from, to);
+	}
+
+	if (lg.file.max_files) {
+		re_snprintf(to, sizeof(to), "%s.1", lg.file.path);
+		(void)rename(lg.file.path, to);
+	}
+	else {
+		(void)unlink(lg.file.path);
+	}
+
+	lg.file.f = fopen(lg.file.path, "w");
+	lg.file.size = 0;
+}
+
+
+static void file_write(const char *msg)
+{
+	size_t len = str_len(msg);
+
+	if (!lg.file.f)
 		return;
 
+	if (1 != fwrite(msg, len, 1, lg.file.f))
+		return;
+
+	lg.file.size += len;
+
+	if (lg.file.max_size && lg.file.size >= lg.file.max_size)
+		file_rotate();
+}
+
+
+/* write out a formatted line, on the calling or the logging thread */
+static void emit(enum log_level level, char *msg)
+{
+	struct le *le;
+
 	log_mask_ipaddr(msg);
 
 	if (lg.stder) {
@@ -103,6 +327,10 @@ void vlog(enum log_level level, const char *fmt, va_list ap)
 			(void)re_fprintf(stderr, "\x1b[;m");
 	}
 
+	lg_lock();
+
+	file_write(msg);
+
 	le = lg.logl.head;
 
 	while (le) {
@@ -114,7 +342,243 @@ void vlog(enum log_level level, const char *fmt, va_list ap)
 			log->h(level, msg, log->arg);
 	}
 
-	mem_deref(msg);
+	lg_unlock();
+}
+
+
+/*
+ * Put a record on the queue of the writer thread, unless it is being
+ * stopped. log_async_stop() waits until no thread is in here.
+ */
+static bool async_push(enum log_level level, char *buf)
+{
+	bool pushed = false;
+
+	if (!__atomic_load_n(&lg.async.running, __ATOMIC_RELAXED))
+		return false;
+
+	__atomic_add_fetch(&lg.async.users, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&lg.async.running, __ATOMIC_SEQ_CST)) {
+
+		/* a line that is too long is cut, never block here.
+		 * the packet type is not used for log records
+		 */
+		buf[0] = (char)level;
+		(void)packet_queue_push(lg.async.q, PACKET_TYPE_RTP,
+					(uint8_t *)buf,
+					1 + str_len(&buf[1]) + 1);
+		pushed = true;
+	}
+
+	__atomic_sub_fetch(&lg.async.users, 1, __ATOMIC_RELEASE);
+
+	return pushed;
+}
+
+
+static void log_write(enum log_level level, const char *fmt, va_list ap)
+{
+	char buf[LOG_BUF_SIZE];
+	char *msg = buf + 1, *dmsg = NULL;
+	va_list aq;
+	int n;
+
+	if (!lg.stder && !lg.file.f && list_isempty(&lg.logl))
+		return;
+
+	/* the first byte is for the level of an async record */
+	va_copy(aq, ap);
+	n = re_vsnprintf(msg, sizeof(buf) - 1, fmt, aq);
+	va_end(aq);
+
+	if (async_push(level, buf))
+		return;
+
+	/* too long for the stack buffer */
+	if (n < 0) {
+		if (re_vsdprintf(&dmsg, fmt, ap))
+			return;
+		msg = dmsg;
+	}
+
+	emit(level, msg);
+
+	mem_deref(dmsg);
+}
+
+
+/* not filtered by the log levels */
+void vlog(enum log_level level, const char *fmt, va_list ap)
+{
+	log_write(level, fmt, ap);
+}
+
+
+static void report_dropped(void)
+{
+	uint64_t dropped = packet_queue_dropped(lg.async.q);
+	char msg[128];
+
+	if (dropped == lg.async.dropped)
+		return;
+
+	re_snprintf(msg, sizeof(msg), "log: %llu lines dropped\n",
+		    (unsigned long long)(dropped - lg.async.dropped));
+	lg.async.dropped = dropped;
+
+	emit(LOG_LEVEL_WARN, msg);
+}
+
+
+static void *log_thread(void *arg)
+{
+	const struct packet_queue_item_t *itemv[LOG_BATCH];
+	bool stop = false;
+	(void)arg;
+
+	while (!stop) {
+
+		size_t i, n;
+
+		n = packet_queue_pop_batch(lg.async.q, itemv, LOG_BATCH);
+
+		for (i = 0; i < n; i++) {
+
+			uint8_t *rec = (uint8_t *)itemv[i]->packet_data;
+
+			if (rec[0] == LOG_RECORD_STOP) {
+				stop = true;
+				continue;
+			}
+
+			emit((enum log_level)rec[0], (char *)&rec[1]);
+		}
+
+		packet_queue_release(lg.async.q, n);
+
+		report_dropped();
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Write log lines from a background thread. Logging then only formats
+ * the line and puts it on a lock-free queue, so that real-time threads
+ * never wait for stderr, the log file or the log handlers. When the
+ * queue is full, lines are dropped and counted. Lines longer than a
+ * queue slot are cut.
+ */
+int log_async_start(size_t capacity)
+{
+	int err;
+
+	if (lg.async.running)
+		return EALREADY;
+
+	err = packet_queue_alloc_ext(&lg.async.q, PACKET_QUEUE_MPSC,
+				     capacity ? capacity
+					      : PACKET_QUEUE_CAPACITY,
+				     true);
+	if (err)
+		return err;
+
+	lg.async.dropped = 0;
+
+	err = pthread_create(&lg.async.tid, NULL, log_thread, NULL);
+	if (err) {
+		lg.async.q = mem_deref(lg.async.q);
+		return err;
+	}
+
+	__atomic_store_n(&lg.async.running, true, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+
+/*
+ * Write out what is queued and go back to synchronous logging. Other
+ * threads may go on logging, their lines are written synchronously
+ * once the queue is closed for them.
+ */
+void log_async_stop(void)
+{
+	const uint8_t rec = LOG_RECORD_STOP;
+
+	if (!lg.async.running)
+		return;
+
+	__atomic_store_n(&lg.async.running, false, __ATOMIC_SEQ_CST);
+
+	/* loggers that saw it running finish their push */
+	while (__atomic_load_n(&lg.async.users, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	/* let the writer catch up, then wake it up to exit */
+	while (packet_queue_count(lg.async.q))
+		usleep(1000);
+
+	while (packet_queue_push(lg.async.q, PACKET_TYPE_RTP, &rec, 1))
+		usleep(1000);
+
+	pthread_join(lg.async.tid, NULL);
+
+	lg.async.dropped = packet_queue_dropped(lg.async.q);
+	lg.async.q = mem_deref(lg.async.q);
+}
+
+
+/* lines dropped since log_async_start() */
+uint64_t log_async_dropped(void)
+{
+	if (!lg.async.q)
+		return lg.async.dropped;
+
+	return packet_queue_dropped(lg.async.q);
+}
+
+
+/*
+ * Log to a file as well. When it grows beyond max_size, it is renamed
+ * to path.1 (and path.1 to path.2 and so on) and a new one is started,
+ * keeping max_files old files. A NULL path closes the file.
+ */
+int log_set_file(const char *path, size_t max_size, unsigned max_files)
+{
+	int err = 0;
+
+	lg_lock();
+
+	if (lg.file.f)
+		fclose(lg.file.f);
+	lg.file.f = NULL;
+	lg.file.path = mem_deref(lg.file.path);
+
+	if (!path)
+		goto out;
+
+	err = str_dup(&lg.file.path, path);
+	if (err)
+		goto out;
+
+	lg.file.f = fopen(path, "a");
+	if (!lg.file.f) {
+		err = errno;
+		lg.file.path = mem_deref(lg.file.path);
+		goto out;
+	}
+
+	lg.file.size = (size_t)ftell(lg.file.f);
+	lg.file.max_size = max_size;
+	lg.file.max_files = max_files;
+
+ out:
+	lg_unlock();
+
+	return err;
 }
 
 
@@ -122,11 +586,11 @@ void loglv(enum log_level level, const char *fmt, ...)
 {
 	va_list ap;
 
-	if (level < lg.min_level)
+	if (level < lg.threshold)
 		return;
 
 	va_start(ap, fmt);
-	vlog(level, fmt, ap);
+	vloglv(level, fmt, ap);
 	va_end(ap);
 }
 
@@ -135,11 +599,11 @@ void debug(const char *fmt, ...)
 {
 	va_list ap;
 
-	if (lg.min_level > LOG_LEVEL_DEBUG)
+	if (lg.threshold > LOG_LEVEL_DEBUG)
 		return;
 
 	va_start(ap, fmt);
-	vlog(LOG_LEVEL_DEBUG, fmt, ap);
+	vloglv(LOG_LEVEL_DEBUG, fmt, ap);
 	va_end(ap);
 }
 
@@ -148,11 +612,11 @@ void info(const char *fmt, ...)
 {
 	va_list ap;
 
-	if (lg.min_level > LOG_LEVEL_INFO)
+	if (lg.threshold > LOG_LEVEL_INFO)
 		return;
 
 	va_start(ap, fmt);
-	vlog(LOG_LEVEL_INFO, fmt, ap);
+	vloglv(LOG_LEVEL_INFO, fmt, ap);
 	va_end(ap);
 }
 
@@ -161,11 +625,11 @@ void warning(const char *fmt, ...)
 {
 	va_list ap;
 
-	if (lg.min_level > LOG_LEVEL_WARN)
+	if (lg.threshold > LOG_LEVEL_WARN)
 		return;
 
 	va_start(ap, fmt);
-	vlog(LOG_LEVEL_WARN, fmt, ap);
+	vloglv(LOG_LEVEL_WARN, fmt, ap);
 	va_end(ap);
 }
 
@@ -175,7 +639,7 @@ void error(const char *fmt, ...)
 	va_list ap;
 
 	va_start(ap, fmt);
-	vlog(LOG_LEVEL_ERROR, fmt, ap);
+	vloglv(LOG_LEVEL_ERROR, fmt, ap);
 	va_end(ap);
 }
 
@@ -0,0 +1,247 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_semaphore.h"
+#include "avs_zapi.h"
+#include "avs_media.h"
+
+
+/*
+ * Media I/O thread
+ *
+ * A thread with its own re main-loop, for file descriptors and timers
+ * that should not wait behind the signaling work on the main thread.
+ * Control is passed in with media_thread_call(), which runs a handler
+ * on the thread and waits for it to return.
+ */
+
+
+enum {
+	MT_CALL = 1,
+};
+
+struct media_thread {
+	pthread_t tid;
+	bool running;
+	char name[32];
+
+	struct mqueue *mq;            /* owned by the thread */
+	pthread_mutex_t mutex;        /* one caller at a time */
+	struct avs_sem *sem;
+	int err;
+
+	uint64_t ncalls;
+};
+
+struct call {
+	media_thread_h *h;
+	void *arg;
+	int err;
+};
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct media_thread *mt = arg;
+	struct call *call = data;
+
+	switch (id) {
+
+	case MT_CALL:
+		call->err = call->h(call->arg);
+		avs_sem_post(mt->sem);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static void *media_thread(void *arg)
+{
+	struct media_thread *mt = arg;
+	int err;
+
+	err = re_thread_init();
+	if (err) {
+		warning("media_thread(%s): re_thread_init failed (%m)\n",
+			mt->name, err);
+		goto out;
+	}
+
+	err = mqueue_alloc(&mt->mq, mqueue_handler, mt);
+	if (err) {
+		warning("media_thread(%s): cannot allocate mqueue (%m)\n",
+			mt->name, err);
+		re_thread_close();
+		goto out;
+	}
+
+	info("media_thread(%s): started\n", mt->name);
+
+	mt->err = 0;
+	avs_sem_post(mt->sem);
+
+	re_main(NULL);
+
+	info("media_thread(%s): exiting\n", mt->name);
+
+	mt->mq = mem_deref(mt->mq);
+	re_thread_close();
+
+	return NULL;
+
+ out:
+	mt->err = err;
+	avs_sem_post(mt->sem);
+
+	return NULL;
+}
+
+
+static int stop_handler(void *arg)
+{
+	(void)arg;
+
+	re_cancel();
+
+	return 0;
+}
+
+
+static void destructor(void *arg)
+{
+	struct media_thread *mt = arg;
+
+	if (mt->running) {
+		media_thread_call(mt, stop_handler, NULL);
+		pthread_join(mt->tid, NULL);
+	}
+
+	mem_deref(mt->sem);
+	pthread_mutex_destroy(&mt->mutex);
+}
+
+
+int media_thread_alloc(struct media_thread **mtp, const char *name)
+{
+	struct media_thread *mt;
+	int err;
+
+	if (!mtp)
+		return EINVAL;
+
+	mt = mem_zalloc(sizeof(*mt), destructor);
+	if (!mt)
+		return ENOMEM;
+
+	str_ncpy(mt->name, name ? name : "media", sizeof(mt->name));
+
+	err = pthread_mutex_init(&mt->mutex, NULL);
+	if (err)
+		goto out;
+
+	err = avs_sem_alloc(&mt->sem, 0);
+	if (err)
+		goto out;
+
+	err = pthread_create(&mt->tid, NULL, media_thread, mt);
+	if (err) {
+		warning("media_thread(%s): cannot create thread (%m)\n",
+			mt->name, err);
+		goto out;
+	}
+
+	/* wait until the thread is ready to take calls */
+	avs_sem_wait(mt->sem);
+
+	err = mt->err;
+	if (err) {
+		pthread_join(mt->tid, NULL);
+		goto out;
+	}
+
+	mt->running = true;
+
+ out:
+	if (err)
+		mem_deref(mt);
+	else
+		*mtp = mt;
+
+	return err;
+}
+
+
+/*
+ * Run a handler on the media thread and wait for it to return.
+ * Returns the result of the handler.
+ */
+int media_thread_call(struct media_thread *mt, media_thread_h *h, void *arg)
+{
+	struct call call;
+	int err;
+
+	if (!mt || !h)
+		return EINVAL;
+
+	/* already there, no need to wait for ourselves */
+	if (media_thread_is_current(mt))
+		return h(arg);
+
+	call.h = h;
+	call.arg = arg;
+	call.err = 0;
+
+	pthread_mutex_lock(&mt->mutex);
+
+	err = mqueue_push(mt->mq, MT_CALL, &call);
+	if (!err) {
+		avs_sem_wait(mt->sem);
+		err = call.err;
+		++mt->ncalls;
+	}
+
+	pthread_mutex_unlock(&mt->mutex);
+
+	return err;
+}
+
+
+bool media_thread_is_current(const struct media_thread *mt)
+{
+	if (!mt || !mt->running)
+		return false;
+
+	return pthread_equal(pthread_self(), mt->tid);
+}
+
+
+int media_thread_debug(struct re_printf *pf, const struct media_thread *mt)
+{
+	if (!mt)
+		return 0;
+
+	return re_hprintf(pf, "media_thread(%s): calls=%llu",
+			  mt->name, (unsigned long long)mt->ncalls);
+}
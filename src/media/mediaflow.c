@@ -32,6 +32,7 @@
 #include "avs_media.h"
 #include "avs_vidcodec.h"
 #include "avs_network.h"
+#include "avs_packetpool.h"
 #include "avs_kase.h"
 #include "priv_mediaflow.h"
 #include "avs_mediastats.h"
@@ -65,6 +66,10 @@ enum {
 	ICE_INTERVAL   = 50,    /* milliseconds */
 	PORT_DISCARD   = 9,     /* draft-ietf-ice-trickle-05 */
 	UDP_SOCKBUF_SIZE = 160*1024,  /* same as Android */
+	TX_BUF_SIZE    = 1600,  /* headroom + MTU + SRTP trailer */
+	TX_POOL_SIZE   = 32,
+	UDP_BATCH_SIZE = 32,
+	TX_FLUSH_MS    = 5,     /* longest a held packet waits */
 };
 
 enum {
@@ -87,6 +92,19 @@ enum sdp_state {
 enum {
 	MQ_ERR = 0,
 	MQ_RTP_START = 1,
+	MQ_RTP_RECV,
+	MQ_VIDEO_RECV,
+	MQ_PACKET,
+	MQ_APP_PACKET,
+	MQ_TX_FLUSH,
+};
+
+/* where to dispatch incoming RTP/RTCP packets */
+enum pt_sink {
+	PT_SINK_NONE = 0,
+	PT_SINK_AUDIO,
+	PT_SINK_VIDEO,
+	PT_SINK_RTCP,
 };
 
 struct interface {
@@ -97,6 +115,14 @@ struct interface {
 	struct sa addr;
 	char ifname[64];
 	bool is_default;
+	struct udp_batch *batch;        /* batched I/O, optional */
+	struct udp_mux_peer *mux_peer;  /* on a shared socket, optional */
+
+	/* RTP/RTCP of the current read batch, decrypted together */
+	struct mbuf *rxmbv[UDP_BATCH_SIZE];
+	struct sa rxsrcv[UDP_BATCH_SIZE];
+	enum packet rxpktv[UDP_BATCH_SIZE];
+	size_t rxc;
 };
 
 struct auformat {
@@ -133,6 +159,7 @@ struct mediaflow {
 	struct rtp_stats video_stats_rcv;
 	struct rtp_stats video_stats_snd;
 	struct aucodec_stats codec_stats;
+	uint8_t ptmap[256];  /* 2nd header byte -> enum pt_sink */
 
 	struct tmr tmr_rtp;
 	struct tmr tmr_got_rtp;
@@ -157,11 +184,13 @@ struct mediaflow {
 	struct ice_candpair *sel_pair;    /* chosen candidate-pair */
 	struct udp_sock *us_stun;
 	struct list turnconnl;
+	struct turn_pool *turn_pool;      /* shared, optional */
 	struct tmr tmr_error;
 
 	char ice_ufrag[16];
 	char ice_pwd[32];
 	bool ice_ready;
+	bool ice_prewarmed;
 	char *peer_software;
 	uint64_t ts_nat_start;
 
@@ -198,6 +227,12 @@ struct mediaflow {
 	struct auenc_state *aes;
 	struct audec_state *ads;
 	pthread_mutex_t mutex_enc;  /* protect the encoder state */
+	pthread_mutex_t mutex_rx;   /* protect the SRTP receive pipeline */
+	struct packet_pool *pool;   /* send buffers */
+	struct mbuf *mb_tx;         /* reserved send buffer */
+	size_t tx_headroom;
+	bool tx_flush_pending;      /* tmr_tx_flush is (being) started */
+	struct tmr tmr_tx_flush;
 	bool started;
 	bool hold;
 
@@ -246,7 +281,8 @@ struct mediaflow {
 	mediaflow_gather_h *gatherh;
 	void *arg;
 
-	struct {
+	/* tx is guarded by mutex_enc, rx and the SRTP counters by mutex_rx */
+	struct mf_stat {
 		struct {
 			uint64_t ts_first;
 			uint64_t ts_last;
@@ -260,12 +296,17 @@ struct mediaflow {
 
 	bool sent_rtp;
 	bool got_rtp;
+	bool rtp_recv_posted;       /* MQ_RTP_RECV is pushed only once */
+	bool video_recv_posted;     /* MQ_VIDEO_RECV is pushed only once */
 
 	struct list interfacel;
 
 	struct mediaflow_stats mf_stats;
 	bool privacy_mode;
 	bool group_mode;
+	bool batch_io;
+	struct media_thread *mt;        /* receive on this thread, optional */
+	struct udp_mux *mux;            /* shared host socket, optional */
 
 	struct {
 		void *arg;
@@ -339,9 +380,10 @@ static void add_turn_permission(struct mediaflow *mf,
 static void add_permission_to_remotes(struct mediaflow *mf);
 static void add_permission_to_remotes_ds(struct mediaflow *mf,
 					 struct turn_conn *conn);
-static void external_rtp_recv(struct mediaflow *mf,
-			      const struct sa *src, struct mbuf *mb);
+static void external_rtp_recv(struct mediaflow *mf, struct mbuf *mb);
 static bool headroom_via_turn(size_t headroom);
+static void mt_packet_handler(struct mediaflow *mf, void *data);
+static void stop_media_thread(struct mediaflow *mf);
 
 #if 0
 static void mf_log(const struct mediaflow *mf, enum log_level level,
@@ -616,6 +658,25 @@ static void update_rx_stats(struct mediaflow *mf, size_t len)
 }
 
 
+/* Take a copy of the counters, which the media threads update */
+static void stat_get(const struct mediaflow *mf, struct mf_stat *stat)
+{
+	struct mediaflow *mfw = (struct mediaflow *)mf;
+
+	pthread_mutex_lock(&mfw->mutex_enc);
+	stat->tx = mf->stat.tx;
+	pthread_mutex_unlock(&mfw->mutex_enc);
+
+	pthread_mutex_lock(&mfw->mutex_rx);
+	stat->rx = mf->stat.rx;
+	stat->n_srtp_dropped = mf->stat.n_srtp_dropped;
+	stat->n_srtp_error = mf->stat.n_srtp_error;
+	pthread_mutex_unlock(&mfw->mutex_rx);
+
+	stat->n_sdp_recv = mf->stat.n_sdp_recv;
+}
+
+
 static void auenc_error_handler(int err, const char *msg, void *arg)
 {
 	struct mediaflow *mf = arg;
@@ -1065,7 +1126,11 @@ static void timeout_rtp(void *arg)
 
 	if (mediaflow_is_rtpstarted(mf)) {
 
-		int diff = tmr_jiffies() - mf->stat.rx.ts_last;
+		struct mf_stat stat;
+		int diff;
+
+		stat_get(mf, &stat);
+		diff = tmr_jiffies() - stat.rx.ts_last;
 
 		if (diff > RTP_TIMEOUT_MS) {
 
@@ -1122,13 +1187,78 @@ static void mediaflow_established_handler(struct mediaflow *mf)
 }
 
 
+static struct interface *interface_find_sock(const struct list *interfacel,
+					     const struct udp_sock *us)
+{
+	struct le *le;
+
+	for (le = list_head(interfacel); le; le = le->next) {
+		struct interface *ifc = le->data;
+
+		if (ifc->lcand && ifc->lcand->us == us)
+			return ifc;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * The batched socket of the selected candidate pair, if any, and the
+ * remote address to send to. RTP/RTCP that goes there is encrypted when
+ * the batch is flushed.
+ */
+static struct udp_batch *tx_batch(const struct mediaflow *mf,
+				  struct sa *dst)
+{
+	struct ice_candpair *pair = mf->sel_pair;
+	struct interface *ifc;
+	void *sock;
+
+	if (!mf->batch_io || !mf->ice_ready || !pair)
+		return NULL;
+
+	sock = trice_lcand_sock(mf->trice, pair->lcand);
+	if (!sock)
+		return NULL;
+
+	ifc = interface_find_sock(&mf->interfacel, sock);
+	if (!ifc || !ifc->batch)
+		return NULL;
+
+	*dst = pair->rcand->attr.addr;
+
+	return ifc->batch;
+}
+
+
+static void send_batched(struct mediaflow *mf, struct udp_batch *batch,
+			 const struct sa *dst, struct mbuf *mb);
+
+
+/*
+ * RTP/RTCP is either queued on the batched socket here, to be encrypted
+ * when the batch is flushed, or encrypted here. The lower layers never
+ * see it in plain text.
+ */
 static bool udp_helper_send_handler_srtp(int *err, struct sa *dst,
 					 struct mbuf *mb, void *arg)
 {
 	struct mediaflow *mf = arg;
+	struct udp_batch *batch;
+	struct sa bdst;
 	(void)dst;
 
-	if (packet_is_rtp_or_rtcp(mb) && mf->srtp_tx) {
+	if (!packet_is_rtp_or_rtcp(mb))
+		return false;
+
+	batch = tx_batch(mf, &bdst);
+	if (batch) {
+		send_batched(mf, batch, &bdst, mb);
+		return true;
+	}
+
+	if (mf->srtp_tx) {
 
 		if (packet_is_rtcp_packet(mb)) {
 
@@ -1169,17 +1299,16 @@ static int send_packet(struct mediaflow *mf, size_t headroom,
 	if (!mf)
 		return EINVAL;
 
-	info("mediaflow(%p): send_packet `%s' (%zu bytes) via %s to %J\n",
-	     mf,
-	     packet_classify_name(pkt),
-	     mbuf_get_left(mb_pkt),
-	     sock_prefix(headroom), raddr);
+	info_hot("mediaflow(%p): send_packet `%s' (%zu bytes) via %s to %J\n",
+		 mf,
+		 packet_classify_name(pkt),
+		 mbuf_get_left(mb_pkt),
+		 sock_prefix(headroom), raddr);
 
-	mb = mbuf_alloc(headroom + len);
+	mb = packet_pool_get(mf->pool, headroom);
 	if (!mb)
 		return ENOMEM;
 
-	mb->pos = headroom;
 	mbuf_write_mem(mb, mbuf_buf(mb_pkt), len);
 	mb->pos = headroom;
 
@@ -1207,14 +1336,14 @@ static int send_packet(struct mediaflow *mf, size_t headroom,
 						  ICE_CAND_TYPE_HOST,
 						  AF_INET6);
 			if (lcand) {
-				info("mediaflow(%p): send_packet: \n",
-				     " using local IPv6 socket\n", mf);
+				info_hot("mediaflow(%p): send_packet:"
+					 " using local IPv6 socket\n", mf);
 				sock = lcand->us;
 			}
 		}
 
-		debug("mediaflow(%p): send helper: udp_send: "
-		      "sock=%p raddr=%p mb=%p\n", sock, raddr, mb);
+		debug_hot("mediaflow(%p): send helper: udp_send: "
+			  "sock=%p raddr=%J mb=%p\n", mf, sock, raddr, mb);
 		err = udp_send(sock, raddr, mb);
 		if (err) {
 			warning("mediaflow(%p): send helper error"
@@ -1261,13 +1390,13 @@ static bool send_dtls_handler(int *err, struct sa *dst_unused,
 
 		mb_pkt->pos = start;
 
-		info("mediaflow(%p): dtls_helper: send DTLS packet #%u"
-		     " to %H (%zu bytes)"
-		     " \n",
-		     mf,
-		     mf->mf_stats.dtls_pkt_sent,
-		     dtls_peer_print, dtls_peer,
-		     mbuf_get_left(mb_pkt));
+		info_hot("mediaflow(%p): dtls_helper: send DTLS packet #%u"
+			 " to %H (%zu bytes)"
+			 " \n",
+			 mf,
+			 mf->mf_stats.dtls_pkt_sent,
+			 dtls_peer_print, dtls_peer,
+			 mbuf_get_left(mb_pkt));
 
 		rc = send_packet(mf, dtls_peer->headroom,
 				 &dtls_peer->addr, mb_pkt, pkt);
@@ -1287,6 +1416,114 @@ static bool send_dtls_handler(int *err, struct sa *dst_unused,
 }
 
 
+static int flush_batched(struct mediaflow *mf, struct udp_batch *batch)
+{
+	struct mbuf **mbv;
+	int errv[UDP_BATCH_SIZE];
+	size_t i, n;
+
+	mbv = udp_batch_txq(batch, &n);
+
+	if (mf->srtp_tx && n && n <= UDP_BATCH_SIZE) {
+
+		srtp_batch_encrypt(mf->srtp_tx, mbv, n, errv);
+
+		for (i = 0; i < n; i++) {
+
+			if (!errv[i])
+				continue;
+
+			warning("mediaflow(%p): srtp_batch_encrypt()"
+				" [%zu bytes] failed (%m)\n",
+				mf, mbuf_get_left(mbv[i]), errv[i]);
+
+			/* not sent */
+			mbv[i]->pos = mbv[i]->end;
+		}
+	}
+
+	return udp_batch_flush(batch);
+}
+
+
+/*
+ * Packets held back for a video frame are not kept longer than this.
+ * All interfaces are flushed, the selected pair may have changed since
+ * the packets were queued.
+ */
+static void tmr_tx_flush_handler(void *arg)
+{
+	struct mediaflow *mf = arg;
+	struct le *le;
+	int err;
+
+	pthread_mutex_lock(&mf->mutex_enc);
+
+	mf->tx_flush_pending = false;
+
+	for (le = list_head(&mf->interfacel); le; le = le->next) {
+		struct interface *ifc = le->data;
+
+		if (!ifc->batch)
+			continue;
+
+		err = flush_batched(mf, ifc->batch);
+		if (err) {
+			warning("mediaflow(%p): batched flush failed (%m)\n",
+				mf, err);
+		}
+	}
+
+	pthread_mutex_unlock(&mf->mutex_enc);
+}
+
+
+/*
+ * Queue an outgoing packet on the batched socket. The packets of a
+ * video frame are sent together when its last packet (marker bit set)
+ * is queued, everything else is sent right away. Should the end of the
+ * frame not come, the held packets are sent after TX_FLUSH_MS by a
+ * timer on the mediaflow thread. RTP/RTCP is encrypted in one go just
+ * before the batch is sent.
+ *
+ * Called with the encoder lock held.
+ */
+static void send_batched(struct mediaflow *mf, struct udp_batch *batch,
+			 const struct sa *dst, struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	bool flush = true;
+	size_t n;
+	int lerr = 0;
+
+	/* drop short RTCP packets */
+	if (mf->srtp_tx && packet_is_rtcp_packet(mb) &&
+	    mbuf_get_left(mb) <= 8)
+		return;
+
+	if (mf->ptmap[p[1]] == PT_SINK_VIDEO && !(p[1] & 0x80))
+		flush = false;
+
+	/* make room, so that every queued packet gets encrypted */
+	(void)udp_batch_txq(batch, &n);
+	if (n >= UDP_BATCH_SIZE)
+		lerr = flush_batched(mf, batch);
+
+	lerr |= udp_batch_send(batch, dst, mb);
+	if (!lerr && flush)
+		lerr = flush_batched(mf, batch);
+	if (lerr) {
+		warning("mediaflow(%p): helper: batched send failed"
+			" to %J (%m)\n", mf, dst, lerr);
+	}
+
+	if (!flush && !mf->tx_flush_pending) {
+		if (0 == mqueue_push(mf->mq, MQ_TX_FLUSH, NULL))
+			mf->tx_flush_pending = true;
+	}
+}
+
+
 /* For Dual-stack only */
 static bool udp_helper_send_handler_trice(int *err, struct sa *dst,
 					 struct mbuf *mb, void *arg)
@@ -1505,9 +1742,11 @@ static void dtls_estab_handler(void *arg)
 		goto error;
 	}
 
+	pthread_mutex_lock(&mf->mutex_rx);
 	err = srtp_alloc(&mf->srtp_rx, suite,
 			 mf->setup_local == SETUP_ACTIVE ? srv_key : cli_key,
 			 master_key_len, 0);
+	pthread_mutex_unlock(&mf->mutex_rx);
 	if (err) {
 		warning("mediaflow(%p): dtls: failed to allocate SRTP for RX"
 			" (%m)\n",
@@ -1863,8 +2102,10 @@ static int handle_kase(struct mediaflow *mf)
 		goto out;
 	}
 
+	pthread_mutex_lock(&mf->mutex_rx);
 	err = srtp_alloc(&mf->srtp_rx, SRTP_AES_CM_128_HMAC_SHA1_80,
 			 session_rx, 30, 0);
+	pthread_mutex_unlock(&mf->mutex_rx);
 	if (err) {
 		warning("mediaflow(%p): kase: failed to allocate SRTP for RX"
 			" (%m)\n",
@@ -1940,211 +2181,331 @@ static void handle_dtls_packet(struct mediaflow *mf, const struct sa *src,
 }
 
 
-static bool udp_helper_recv_handler_srtp(struct sa *src, struct mbuf *mb,
-					 void *arg)
+/* tell the mediaflow thread, but not for every packet */
+static void post_once(struct mediaflow *mf, bool *posted, int id)
 {
-	struct mediaflow *mf = arg;
-	size_t len = mbuf_get_left(mb);
-	const enum packet pkt = packet_classify_packet_type(mb);
-	int err;
+	if (__atomic_exchange_n(posted, true, __ATOMIC_RELAXED))
+		return;
 
-	if (pkt == PACKET_DTLS) {
-		handle_dtls_packet(mf, src, mb);
-		return true;
+	if (mqueue_push(mf->mq, id, NULL))
+		__atomic_store_n(posted, false, __ATOMIC_RELAXED);
+}
+
+
+static void rtp_recv_first(struct mediaflow *mf)
+{
+	info("mediaflow(%p): first RTP packet received\n", mf);
+
+	mf->got_rtp = true;
+	tmr_cancel(&mf->tmr_got_rtp);
+	check_rtpstart(mf);
+}
+
+
+/*
+ * Pass a decrypted RTP/RTCP packet on to the decoders. The data of
+ * an RTCP APP packet for the data channel is returned in *appp instead,
+ * pointing into the packet.
+ */
+static void srtp_recv(struct mediaflow *mf, struct mbuf *mb,
+		      enum packet pkt, const uint8_t **appp, size_t *app_lenp)
+{
+	if (pkt == PACKET_RTCP) {
+
+		struct rtcp_iter it;
+		struct rtcp_iter_pkt rp;
+		const uint8_t *name;
+
+		rtcp_iter_init(&it, mbuf_buf(mb), mbuf_get_left(mb));
+
+		if (!rtcp_iter_next(&it, &rp)) {
+			warning("mediaflow(%p): failed to decode"
+				" incoming RTCP"
+				" packet (%m)\n", mf, it.err ? it.err : EBADMSG);
+		}
+		else if (rtcp_iter_app(&rp, &name, appp, app_lenp)) {
+
+			if (0 == memcmp(name, app_label, 4))
+				return;
+
+			warning("mediaflow(%p): "
+				"invalid app name '%b'\n",
+				mf, name, (size_t)4);
+			*appp = NULL;
+		}
+	}
+
+	/* If external RTP is enabled, forward RTP/RTCP packets
+	 * to the relevant au/vid-codec.
+	 *
+	 * otherwise just pass it up to internal RTP-stack
+	 */
+	external_rtp_recv(mf, mb);
+}
+
+
+static void app_recv(struct mediaflow *mf, const uint8_t *data, size_t len,
+		     bool defer)
+{
+	struct mbuf *mb;
+
+	if (!mf->mt && !defer) {
+		if (mf->data.dce)
+			dce_recv_pkt(mf->data.dce, data, len);
+		return;
+	}
+
+	/* the data channel lives on the main thread */
+	mb = mbuf_alloc(len);
+	if (!mb)
+		return;
+
+	(void)mbuf_write_mem(mb, data, len);
+	mb->pos = 0;
+
+	if (mqueue_push(mf->mq, MQ_APP_PACKET, mb))
+		mem_deref(mb);
+}
+
+
+/*
+ * Handle incoming RTP/RTCP packets, classified by the caller. They are
+ * decrypted in one go. With defer_app, RTCP APP data is passed on to
+ * the data channel from the mqueue, as the data channel handler might
+ * deref the mediaflow. The senders of packets that passed SRTP are
+ * confirmed to the mux peer, if any.
+ */
+static void handle_srtp_packets(struct mediaflow *mf, const struct sa *srcv,
+				struct mbuf **mbv, const enum packet *pktv,
+				size_t n, bool defer_app,
+				struct udp_mux_peer *mux_peer)
+{
+	const uint8_t *appv[UDP_BATCH_SIZE];
+	size_t app_lenv[UDP_BATCH_SIZE];
+	size_t lenv[UDP_BATCH_SIZE];
+	int errv[UDP_BATCH_SIZE];
+	size_t i;
+
+	if (n > UDP_BATCH_SIZE)
+		n = UDP_BATCH_SIZE;
+
+	for (i = 0; i < n; i++) {
+		appv[i] = NULL;
+		app_lenv[i] = 0;
+		lenv[i] = mbuf_get_left(mbv[i]);
+		errv[i] = 0;
 	}
 
-	if (packet_is_rtp_or_rtcp(mb)) {
+	pthread_mutex_lock(&mf->mutex_rx);
+
+	/* the SRTP is not ready yet .. */
+	if (!mf->srtp_rx)
+		mf->stat.n_srtp_dropped += n;
+	else
+		srtp_batch_decrypt(mf->srtp_rx, mbv, n, errv);
+
+	for (i = 0; i < n; i++) {
+
+		if (!errv[i]) {
+			if (mf->srtp_rx)
+				udp_mux_confirm(mux_peer, &srcv[i], mbv[i]);
 
-		/* the SRTP is not ready yet .. */
-		if (!mf->srtp_rx) {
-			mf->stat.n_srtp_dropped++;
-			goto next;
+			srtp_recv(mf, mbv[i], pktv[i],
+				  &appv[i], &app_lenv[i]);
+			continue;
 		}
 
-		if (packet_is_rtcp_packet(mb)) {
+		mf->stat.n_srtp_error++;
 
-			err = srtcp_decrypt(mf->srtp_rx, mb);
-			if (err) {
-				mf->stat.n_srtp_error++;
-				warning("mediaflow(%p): srtcp_decrypt failed"
-					" [%zu bytes] (%m)\n", mf, len, err);
-				return true;
-			}
+		if (pktv[i] == PACKET_RTCP) {
+			warning("mediaflow(%p): srtcp_decrypt failed"
+				" [%zu bytes] (%m)\n", mf, lenv[i], errv[i]);
 		}
-		else {
-			err = srtp_decrypt(mf->srtp_rx, mb);
-			if (err) {
-				mf->stat.n_srtp_error++;
-				if (err != EALREADY) {
-					warning("mediaflow(%p): srtp_decrypt"
-						" failed"
-						" [%zu bytes from %J] (%m)\n",
-						mf, len, src, err);
-				}
-				return true;
-			}
+		else if (errv[i] != EALREADY) {
+			warning("mediaflow(%p): srtp_decrypt"
+				" failed"
+				" [%zu bytes from %J] (%m)\n",
+				mf, lenv[i], &srcv[i], errv[i]);
 		}
+	}
 
-		if (packet_is_rtcp_packet(mb)) {
+	pthread_mutex_unlock(&mf->mutex_rx);
 
-			struct rtcp_msg *msg = NULL;
-			size_t pos = mb->pos;
-			bool is_app = false;
-			int r;
-
-			r = rtcp_decode(&msg, mb);
-			if (r) {
-				warning("mediaflow(%p): failed to decode"
-					" incoming RTCP"
-					" packet (%m)\n", mf, r);
-				goto done;
-			}
-			mb->pos = pos;
+	for (i = 0; i < n; i++) {
+
+		if (!appv[i])
+			continue;
 
-			if (msg->hdr.pt == RTCP_APP) {
+		app_recv(mf, appv[i], app_lenv[i], defer_app);
+	}
+}
 
-				if (0 != memcmp(msg->r.app.name,
-						app_label, 4)) {
 
-					warning("mediaflow(%p): "
-						"invalid app name '%b'\n",
-						mf, msg->r.app.name, (size_t)4);
-					goto done;
-				}
+/* handle an incoming RTP/RTCP packet, classified by the caller */
+static bool handle_srtp_packet(struct mediaflow *mf, const struct sa *src,
+			       struct mbuf *mb, enum packet pkt)
+{
+	/* NOTE: dce handler might deref mediaflow */
+	handle_srtp_packets(mf, src, &mb, &pkt, 1, false, NULL);
 
-				is_app = true;
+	return true; /* handled */
+}
 
-				if (mf->data.dce) {
-					dce_recv_pkt(mf->data.dce,
-						     msg->r.app.data,
-						     msg->r.app.data_len);
-				}
-			}
 
-		done:
-			mem_deref(msg);
+static bool udp_helper_recv_handler_srtp(struct sa *src, struct mbuf *mb,
+					 void *arg)
+{
+	struct mediaflow *mf = arg;
+	const enum packet pkt = packet_classify_packet_type(mb);
 
-			/* NOTE: dce handler might deref mediaflow */
-			if (is_app)
-				return true;
-		}
+	switch (pkt) {
+
+	case PACKET_DTLS:
+		handle_dtls_packet(mf, src, mb);
+		return true;
+
+	case PACKET_RTP:
+	case PACKET_RTCP:
+		return handle_srtp_packet(mf, src, mb, pkt);
+
+	default:
+		return false;
 	}
+}
 
- next:
-	if (packet_is_rtp_or_rtcp(mb)) {
 
-		/* If external RTP is enabled, forward RTP/RTCP packets
-		 * to the relevant au/vid-codec.
-		 *
-		 * otherwise just pass it up to internal RTP-stack
-		 */
-		external_rtp_recv(mf, src, mb);
-		return true; /* handled */
+/*
+ * Build the dispatch table for incoming packets. It is indexed with the
+ * second byte of the RTP/RTCP header (marker bit + payload type), so one
+ * lookup tells RTCP, audio and video apart, no matter how many formats
+ * were negotiated.
+ */
+static void update_ptmap(struct mediaflow *mf)
+{
+	uint8_t ptmap[ARRAY_SIZE(mf->ptmap)];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(ptmap); i++) {
+
+		const int pt = i & 0x7f;
+
+		/* same range as packet_is_rtcp_packet() */
+		if (64 <= pt && pt <= 95)
+			ptmap[i] = PT_SINK_RTCP;
+		else if (sdp_media_lformat(mf->audio.sdpm, pt))
+			ptmap[i] = PT_SINK_AUDIO;
+		else if (sdp_media_lformat(mf->video.sdpm, pt))
+			ptmap[i] = PT_SINK_VIDEO;
+		else
+			ptmap[i] = PT_SINK_NONE;
 	}
 
-	return false;
+	/* read by the send path with mutex_enc held and by the receive
+	 * path with mutex_rx held. The decoders may send RTCP with
+	 * mutex_rx held, so mutex_rx is taken first.
+	 */
+	pthread_mutex_lock(&mf->mutex_rx);
+	pthread_mutex_lock(&mf->mutex_enc);
+	memcpy(mf->ptmap, ptmap, sizeof(ptmap));
+	pthread_mutex_unlock(&mf->mutex_enc);
+	pthread_mutex_unlock(&mf->mutex_rx);
 }
 
 
 /*
- * UDP helper to intercept incoming RTP/RTCP packets:
+ * Intercept incoming RTP/RTCP packets:
  *
  * -- send to decoder if supported by it
  */
-static void external_rtp_recv(struct mediaflow *mf,
-			      const struct sa *src, struct mbuf *mb)
+static void external_rtp_recv(struct mediaflow *mf, struct mbuf *mb)
 {
 	const struct aucodec *ac;
 	const struct vidcodec *vc;
-	struct rtp_header hdr;
-	const struct sdp_format *fmt;
-	size_t start = mb->pos;
-	int err;
+	const uint8_t *pkt = mbuf_buf(mb);
+	const size_t len = mbuf_get_left(mb);
 
 	if (!mf->started) {
 		return;
 	}
 
+	if (len < 2)
+		return;
+
 	ac = audec_get(mf->ads);
 	vc = viddec_get(mf->video.vds);
 
-	if (!packet_is_rtcp_packet(mb)) {
-		update_rx_stats(mf, mbuf_get_left(mb));
-	}
-	else {
+	switch (mf->ptmap[pkt[1]]) {
+
+	case PT_SINK_RTCP:
 		/* RTCP is sent to both audio+video */
 
-		if (ac && ac->dec_rtcph) {
-			mb->pos = start;
-			ac->dec_rtcph(mf->ads,
-				      mbuf_buf(mb), mbuf_get_left(mb));
-		}
-		if (vc && vc->dec_rtcph) {
-			mb->pos = start;
-			vc->dec_rtcph(mf->video.vds,
-				      mbuf_buf(mb), mbuf_get_left(mb));
-		}
-		goto out;
+		if (ac && ac->dec_rtcph)
+			ac->dec_rtcph(mf->ads, pkt, len);
+		if (vc && vc->dec_rtcph)
+			vc->dec_rtcph(mf->video.vds, pkt, len);
+		return;
+
+	default:
+		break;
 	}
 
+	update_rx_stats(mf, len);
+
 	if (!mf->got_rtp) {
-		info("mediaflow(%p): first RTP packet received (%zu bytes)\n",
-		     mf, mbuf_get_left(mb));
-		mf->got_rtp = true;
-		tmr_cancel(&mf->tmr_got_rtp);
-		check_rtpstart(mf);
+		if (mf->mt)
+			post_once(mf, &mf->rtp_recv_posted, MQ_RTP_RECV);
+		else
+			rtp_recv_first(mf);
 	}
 
-	err = rtp_hdr_decode(&hdr, mb);
-	mb->pos = start;
-	if (err) {
-		warning("mediaflow(%p): rtp header decode (%m)\n", mf, err);
-		goto out;
+	if (len < RTP_HEADER_SIZE) {
+		warning("mediaflow(%p): rtp header decode (%m)\n",
+			mf, EBADMSG);
+		return;
 	}
 
-	fmt = sdp_media_lformat(mf->audio.sdpm, hdr.pt);
-	if (fmt) {
+	switch (mf->ptmap[pkt[1]]) {
 
+	case PT_SINK_AUDIO:
 		/* now, pass on the raw RTP/RTCP packet to the decoder */
 
 		if (ac && ac->dec_rtph) {
-			ac->dec_rtph(mf->ads,
-				     mbuf_buf(mb), mbuf_get_left(mb));
+			ac->dec_rtph(mf->ads, pkt, len);
 
 			mediastats_rtp_stats_update(&mf->audio_stats_rcv,
-					 mbuf_buf(mb), mbuf_get_left(mb), 0);
+						    pkt, len, 0);
 		}
+		break;
 
-		goto out;
-	}
-
-	fmt = sdp_media_lformat(mf->video.sdpm, hdr.pt);
-	if (fmt) {
+	case PT_SINK_VIDEO:
 		if (!mf->video.has_rtp) {
-			mf->video.has_rtp = true;
-			check_rtpstart(mf);
+			if (mf->mt) {
+				post_once(mf, &mf->video_recv_posted,
+					  MQ_VIDEO_RECV);
+			}
+			else {
+				mf->video.has_rtp = true;
+				check_rtpstart(mf);
+			}
 		}
 		if (vc && vc->dec_rtph) {
-			vc->dec_rtph(mf->video.vds,
-				     mbuf_buf(mb), mbuf_get_left(mb));
-
 			uint32_t bwalloc = 0;
+
+			vc->dec_rtph(mf->video.vds, pkt, len);
+
 			if (vc->dec_bwalloch) {
 				bwalloc = vc->dec_bwalloch(mf->video.vds);
 			}
 			mediastats_rtp_stats_update(&mf->video_stats_rcv,
-					 mbuf_buf(mb),mbuf_get_left(mb),
-						    bwalloc);
+						    pkt, len, bwalloc);
 		}
+		break;
 
-		goto out;
+	default:
+		info("mediaflow(%p): recv: no SDP format found"
+		     " for payload type %d\n", mf, pkt[1] & 0x7f);
+		break;
 	}
-
-	info("mediaflow(%p): recv: no SDP format found"
-	     " for payload type %d\n", mf, hdr.pt);
-
- out:
-	return;  /* stop packet here */
 }
 
 
@@ -2190,13 +2551,16 @@ int mediaflow_summary(struct re_printf *pf, const struct mediaflow *mf)
 	char cid_local_anon[ANON_CLIENT_LEN];
 	char cid_remote_anon[ANON_CLIENT_LEN];
 	char uid_remote_anon[ANON_ID_LEN];
+	struct mf_stat stat;
 	int err = 0;
 
 	if (!mf)
 		return 0;
 
-	dur_tx = (double)(mf->stat.tx.ts_last - mf->stat.tx.ts_first) / 1000.0;
-	dur_rx = (double)(mf->stat.rx.ts_last - mf->stat.rx.ts_first) / 1000.0;
+	stat_get(mf, &stat);
+
+	dur_tx = (double)(stat.tx.ts_last - stat.tx.ts_first) / 1000.0;
+	dur_rx = (double)(stat.rx.ts_last - stat.rx.ts_first) / 1000.0;
 
 	err |= re_hprintf(pf,
 			  "mediaflow(%p): ------------- mediaflow summary -------------\n", mf);
@@ -2273,21 +2637,23 @@ int mediaflow_summary(struct re_printf *pf, const struct mediaflow *mf)
 	err |= re_hprintf(pf, "RTP packets:\n");
 	err |= re_hprintf(pf, "bytes sent:  %zu (%.1f bit/s)"
 			  " for %.2f sec\n",
-		  mf->stat.tx.bytes,
-		  dur_tx ? 8.0 * (double)mf->stat.tx.bytes / dur_tx : 0,
+		  stat.tx.bytes,
+		  dur_tx ? 8.0 * (double)stat.tx.bytes / dur_tx : 0,
 		  dur_tx);
 	err |= re_hprintf(pf, "bytes recv:  %zu (%.1f bit/s)"
 			  " for %.2f sec\n",
-		  mf->stat.rx.bytes,
-		  dur_rx ? 8.0 * (double)mf->stat.rx.bytes / dur_rx : 0,
+		  stat.rx.bytes,
+		  dur_rx ? 8.0 * (double)stat.rx.bytes / dur_rx : 0,
 		  dur_rx);
 
 	err |= re_hprintf(pf, "\n");
-	err |= re_hprintf(pf, "SDP recvd:       %zu\n", mf->stat.n_sdp_recv);
+	err |= re_hprintf(pf, "SDP recvd:       %zu\n", stat.n_sdp_recv);
 	err |= re_hprintf(pf, "SRTP dropped:    %zu\n",
-			  mf->stat.n_srtp_dropped);
+			  stat.n_srtp_dropped);
 	err |= re_hprintf(pf, "SRTP errors:     %zu\n",
-			  mf->stat.n_srtp_error);
+			  stat.n_srtp_error);
+	err |= re_hprintf(pf, "Packet pool:     %H\n",
+			  packet_pool_debug, mf->pool);
 
 	err |= re_hprintf(pf, "\naudio_active: %d\n", !mf->audio.disabled);
 	err |= re_hprintf(pf, "\nvideo_media:  %d\n", mf->video.has_media);
@@ -2312,6 +2678,16 @@ int mediaflow_summary(struct re_printf *pf, const struct mediaflow *mf)
 		err |= re_hprintf(pf, "...%s..%s|%j\n",
 				  ifc->is_default ? "*" : ".",
 				  ifc->ifname, &ifc->addr);
+		if (ifc->batch) {
+			err |= re_hprintf(pf, "      %H\n",
+					  udp_batch_debug, ifc->batch);
+		}
+	}
+	if (mf->mt) {
+		err |= re_hprintf(pf, "%H\n", media_thread_debug, mf->mt);
+	}
+	if (mf->mux) {
+		err |= re_hprintf(pf, "%H", udp_mux_debug, mf->mux);
 	}
 
 	err |= re_hprintf(pf,
@@ -2451,6 +2827,10 @@ static void destructor(void *arg)
 
 	mf->terminated = true;
 
+	/* nothing is received on the media thread after this */
+	if (mf->mt)
+		stop_media_thread(mf);
+
 	mf->estabh = NULL;
 	mf->closeh = NULL;
 	mf->restarth = NULL;
@@ -2470,6 +2850,7 @@ static void destructor(void *arg)
 	tmr_cancel(&mf->tmr_rtp);
 	tmr_cancel(&mf->tmr_got_rtp);	
 	tmr_cancel(&mf->tmr_error);
+	tmr_cancel(&mf->tmr_tx_flush);
 
 	/* XXX: voe is calling to mediaflow_xxx here */
 	/* deref the encoders/decodrs first, as they may be multithreaded,
@@ -2505,6 +2886,8 @@ static void destructor(void *arg)
 	mf->trice_stun = mem_deref(mf->trice_stun);
 	mem_deref(mf->us_stun);
 	list_flush(&mf->turnconnl);
+	mem_deref(mf->turn_pool);
+	mem_deref(mf->mux);
 
 	mem_deref(mf->dtls_sock);
 
@@ -2516,6 +2899,8 @@ static void destructor(void *arg)
 
 	mem_deref(mf->srtp_tx);
 	mem_deref(mf->srtp_rx);
+	mem_deref(mf->mb_tx);
+	mem_deref(mf->pool);
 	mem_deref(mf->dtls);
 	mem_deref(mf->ct_gather);
 	mem_deref(mf->kase);
@@ -2586,6 +2971,38 @@ static void mq_callback(int id, void *data, void *arg)
 			check_rtpstart(mf);
 		}
 		break;
+
+	case MQ_RTP_RECV:
+		if (!mf->got_rtp)
+			rtp_recv_first(mf);
+		break;
+
+	case MQ_VIDEO_RECV:
+		if (!mf->video.has_rtp) {
+			mf->video.has_rtp = true;
+			check_rtpstart(mf);
+		}
+		break;
+
+	case MQ_PACKET:
+		mt_packet_handler(mf, data);
+		mem_deref(data);
+		break;
+
+	case MQ_APP_PACKET:
+		if (mf->data.dce) {
+			struct mbuf *mb = data;
+
+			dce_recv_pkt(mf->data.dce,
+				     mbuf_buf(mb), mbuf_get_left(mb));
+		}
+		mem_deref(data);
+		break;
+
+	case MQ_TX_FLUSH:
+		tmr_start(&mf->tmr_tx_flush, TX_FLUSH_MS,
+			  tmr_tx_flush_handler, mf);
+		break;
 	}
 }
 
@@ -2758,6 +3175,14 @@ int mediaflow_alloc(struct mediaflow **mfp, const char *clientid_local,
 	if (err)
 		goto out;
 
+	err = pthread_mutex_init(&mf->mutex_rx, NULL);
+	if (err)
+		goto out;
+
+	err = packet_pool_alloc(&mf->pool, TX_POOL_SIZE, TX_BUF_SIZE);
+	if (err)
+		goto out;
+
 	rand_str(mf->ice_ufrag, sizeof(mf->ice_ufrag));
 	rand_str(mf->ice_pwd, sizeof(mf->ice_pwd));
 
@@ -3430,11 +3855,11 @@ static void demux_packet(struct mediaflow *mf, const struct sa *src,
 		if (!trice_rcand_find(mf->trice, ICE_COMPID_RTP,
 				      IPPROTO_UDP, src)) {
 
-			debug("mediaflow(%p): demux: unauthorized"
-			      " %s packet from %J"
-			      " (rcand-list=%u)\n",
-			      mf, packet_classify_name(pkt), src,
-			      list_count(trice_rcandl(mf->trice)));
+			debug_hot("mediaflow(%p): demux: unauthorized"
+				  " %s packet from %J"
+				  " (rcand-list=%u)\n",
+				  mf, packet_classify_name(pkt), src,
+				  list_count(trice_rcandl(mf->trice)));
 		}
 	}
 
@@ -3442,7 +3867,7 @@ static void demux_packet(struct mediaflow *mf, const struct sa *src,
 
 	case PACKET_RTP:
 	case PACKET_RTCP:
-		hdld = udp_helper_recv_handler_srtp((struct sa *)src, mb, mf);
+		hdld = handle_srtp_packet(mf, src, mb, pkt);
 		if (!hdld) {
 			warning("mediaflow(%p): rtp packet not handled\n", mf);
 		}
@@ -3473,16 +3898,333 @@ static void trice_udp_recv_handler(const struct sa *src, struct mbuf *mb,
 }
 
 
+static void interface_batch_stop(struct interface *ifc);
+
+
+static void rx_clear(struct interface *ifc)
+{
+	size_t i;
+
+	for (i = 0; i < ifc->rxc; i++)
+		mem_deref(ifc->rxmbv[i]);
+
+	ifc->rxc = 0;
+}
+
+
+static void rx_flush(struct interface *ifc)
+{
+	if (!ifc->rxc)
+		return;
+
+	handle_srtp_packets((struct mediaflow *)ifc->mf, ifc->rxsrcv,
+			    ifc->rxmbv, ifc->rxpktv, ifc->rxc, true, NULL);
+
+	rx_clear(ifc);
+}
+
+
+static void rx_queue(struct interface *ifc, const struct sa *src,
+		     struct mbuf *mb, enum packet pkt)
+{
+	if (ifc->rxc >= ARRAY_SIZE(ifc->rxmbv))
+		rx_flush(ifc);
+
+	ifc->rxmbv[ifc->rxc]  = mem_ref(mb);
+	ifc->rxsrcv[ifc->rxc] = *src;
+	ifc->rxpktv[ifc->rxc] = pkt;
+	++ifc->rxc;
+}
+
+
 static void interface_destructor(void *data)
 {
 	struct interface *ifc = data;
 
 	list_unlink(&ifc->le);
 	/*mem_deref(ifc->lcand);*/
+	mem_deref(ifc->mux_peer);
+	interface_batch_stop(ifc);
+	rx_clear(ifc);
+}
+
+
+/* end of a read batch, decrypt the RTP/RTCP that was queued */
+static void batch_done_handler(void *arg)
+{
+	struct interface *ifc = arg;
+
+	rx_flush(ifc);
+}
+
+
+/* incoming packets on a batched socket, bypassing the udp helpers */
+static void batch_recv_handler(const struct sa *src, struct mbuf *mb,
+			       void *arg)
+{
+	struct interface *ifc = arg;
+	struct mediaflow *mf = (struct mediaflow *)ifc->mf;
+	const enum packet pkt = packet_classify_packet_type(mb);
+
+	switch (pkt) {
+
+	case PACKET_STUN:
+		/* forward packet to ICE */
+		trice_lcand_recv_packet((struct ice_lcand *)ifc->lcand,
+					src, mb);
+		break;
+
+	case PACKET_RTP:
+	case PACKET_RTCP:
+		rx_queue(ifc, src, mb, pkt);
+		break;
+
+	default:
+		demux_packet(mf, src, mb);
+		break;
+	}
+}
+
+
+/* incoming packets for this mediaflow on a shared socket */
+static void mux_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	struct interface *ifc = arg;
+	struct mediaflow *mf = (struct mediaflow *)ifc->mf;
+	enum packet pkt;
+
+	pkt = packet_classify_packet_type(mb);
+
+	switch (pkt) {
+
+	case PACKET_STUN:
+		/* forward packet to ICE */
+		trice_lcand_recv_packet((struct ice_lcand *)ifc->lcand,
+					src, mb);
+		break;
+
+	case PACKET_RTP:
+	case PACKET_RTCP:
+		/* the mux learns the sender once SRTP has passed it */
+		handle_srtp_packets(mf, src, &mb, &pkt, 1, false,
+				    ifc->mux_peer);
+		break;
+
+	default:
+		demux_packet(mf, src, mb);
+		break;
+	}
+}
+
+
+/*
+ * A packet from an unknown sender on a shared socket is ours if the
+ * sender is one of our remote candidates, or if it is a connectivity
+ * check for our ufrag (the USERNAME is "<our ufrag>:<their ufrag>").
+ */
+static bool mux_match_handler(const struct sa *src, struct mbuf *mb,
+			      void *arg)
+{
+	struct interface *ifc = arg;
+	struct mediaflow *mf = (struct mediaflow *)ifc->mf;
+	struct stun_msg *msg = NULL;
+	struct stun_attr *attr;
+	struct pl lufrag;
+	bool match = false;
+
+	if (trice_rcand_find(mf->trice, ICE_COMPID_RTP, IPPROTO_UDP, src))
+		return true;
+
+	if (PACKET_STUN != packet_classify_packet_type(mb))
+		return false;
+
+	if (stun_msg_decode(&msg, mb, NULL))
+		return false;
+
+	attr = stun_msg_attr(msg, STUN_ATTR_USERNAME);
+	if (attr && 0 == re_regex(attr->v.username,
+				  str_len(attr->v.username),
+				  "[^:]+:", &lufrag)) {
+
+		match = 0 == pl_strcmp(&lufrag, mf->ice_ufrag);
+	}
+
+	mem_deref(msg);
+
+	return match;
+}
+
+
+/* a packet from the media thread, to be handled on the main thread */
+struct mt_packet {
+	const struct interface *ifc;  /* not referenced, looked up again */
+	struct sa src;
+	struct mbuf *mb;
+};
+
+
+static void mt_packet_destructor(void *data)
+{
+	struct mt_packet *mtp = data;
+
+	mem_deref(mtp->mb);
 }
 
 
-static int interface_add(struct mediaflow *mf, struct ice_lcand *lcand,
+/*
+ * Incoming packets on the media thread. RTP and RTCP are decrypted and
+ * decoded here at the end of the read batch, everything else (ICE, DTLS)
+ * is copied and passed on to the main thread.
+ */
+static void mt_recv_handler(const struct sa *src, struct mbuf *mb,
+			    void *arg)
+{
+	struct interface *ifc = arg;
+	struct mediaflow *mf = (struct mediaflow *)ifc->mf;
+	const enum packet pkt = packet_classify_packet_type(mb);
+	struct mt_packet *mtp;
+
+	switch (pkt) {
+
+	case PACKET_RTP:
+	case PACKET_RTCP:
+		rx_queue(ifc, src, mb, pkt);
+		return;
+
+	default:
+		break;
+	}
+
+	mtp = mem_zalloc(sizeof(*mtp), mt_packet_destructor);
+	if (!mtp)
+		return;
+
+	mtp->ifc = ifc;
+	mtp->src = *src;
+	mtp->mb = mbuf_alloc(mbuf_get_left(mb));
+	if (!mtp->mb) {
+		mem_deref(mtp);
+		return;
+	}
+
+	(void)mbuf_write_mem(mtp->mb, mbuf_buf(mb), mbuf_get_left(mb));
+	mtp->mb->pos = 0;
+
+	if (mqueue_push(mf->mq, MQ_PACKET, mtp))
+		mem_deref(mtp);
+}
+
+
+static void mt_packet_handler(struct mediaflow *mf, void *data)
+{
+	struct mt_packet *mtp = data;
+	struct le *le;
+
+	/* the interface might be gone in the meantime */
+	for (le = list_head(&mf->interfacel); le; le = le->next) {
+		if (le->data == mtp->ifc)
+			break;
+	}
+	if (!le)
+		return;
+
+	batch_recv_handler(&mtp->src, mtp->mb, le->data);
+}
+
+
+static int mt_batch_start(void *arg)
+{
+	struct interface *ifc = arg;
+	int err;
+
+	err = udp_batch_alloc(&ifc->batch, ifc->lcand->us,
+			      sa_af(&ifc->addr), UDP_BATCH_SIZE,
+			      mt_recv_handler, ifc);
+	if (err)
+		return err;
+
+	udp_batch_set_done_handler(ifc->batch, batch_done_handler);
+
+	return 0;
+}
+
+
+static int mt_batch_stop(void *arg)
+{
+	struct interface *ifc = arg;
+
+	udp_batch_detach(ifc->batch);
+	ifc->batch = mem_deref(ifc->batch);
+	rx_clear(ifc);
+
+	return 0;
+}
+
+
+static int interface_batch_start(struct interface *ifc)
+{
+	const struct mediaflow *mf = ifc->mf;
+	int err;
+
+	if (ifc->batch || !ifc->lcand || !ifc->lcand->us)
+		return 0;
+
+	/* a shared socket is read by the mux, for all its mediaflows */
+	if (mf->mux)
+		return 0;
+
+	if (mf->mt) {
+		struct udp_sock *us = ifc->lcand->us;
+
+		/* move the socket from this thread to the media thread */
+		fd_close(udp_sock_fd(us, sa_af(&ifc->addr)));
+
+		err = media_thread_call(mf->mt, mt_batch_start, ifc);
+		if (err)
+			udp_thread_attach(us);
+	}
+	else {
+		err = udp_batch_alloc(&ifc->batch, ifc->lcand->us,
+				      sa_af(&ifc->addr), UDP_BATCH_SIZE,
+				      batch_recv_handler, ifc);
+		if (!err) {
+			udp_batch_set_done_handler(ifc->batch,
+						   batch_done_handler);
+		}
+	}
+	if (err) {
+		warning("mediaflow(%p): batched I/O on %s|%j"
+			" not available (%m)\n",
+			ifc->mf, ifc->ifname, &ifc->addr, err);
+	}
+
+	return err;
+}
+
+
+static void interface_batch_stop(struct interface *ifc)
+{
+	const struct mediaflow *mf = ifc->mf;
+
+	if (!ifc->batch)
+		return;
+
+	if (mf->mt) {
+		media_thread_call(mf->mt, mt_batch_stop, ifc);
+
+		/* back to this thread */
+		udp_thread_attach(ifc->lcand->us);
+	}
+	else {
+		ifc->batch = mem_deref(ifc->batch);
+		rx_clear(ifc);
+	}
+}
+
+
+static int interface_add(struct interface **ifcp, struct mediaflow *mf,
+			 struct ice_lcand *lcand,
 			 const char *ifname, const struct sa *addr)
 {
 	struct interface *ifc;
@@ -3501,6 +4243,12 @@ static int interface_add(struct mediaflow *mf, struct ice_lcand *lcand,
 
 	list_append(&mf->interfacel, &ifc->le, ifc);
 
+	if (mf->batch_io || mf->mt)
+		(void)interface_batch_start(ifc);
+
+	if (ifcp)
+		*ifcp = ifc;
+
 	return 0;
 }
 
@@ -3570,7 +4318,9 @@ int mediaflow_add_local_host_candidate(struct mediaflow *mf,
 				       const struct sa *addr)
 {
 	struct ice_lcand *lcand = NULL;
+	struct udp_sock *sock = NULL;
 	struct interface *ifc;
+	struct sa laddr = *addr;
 	const uint16_t lpref = calc_local_preference(ifname, sa_af(addr));
 	const uint32_t prio = ice_cand_calc_prio(ICE_CAND_TYPE_HOST, lpref, 1);
 	int err = 0;
@@ -3598,14 +4348,28 @@ int mediaflow_add_local_host_candidate(struct mediaflow *mf,
 		return 0;
 	}
 
+	if (!mf->privacy_mode && mf->mux) {
+
+		/* the host candidate is on the socket of the mux */
+		err = udp_mux_sock(&sock, mf->mux, addr);
+		if (err) {
+			warning("mediaflow(%p): add_local_host[%j]"
+				" no shared socket (%m)\n",
+				mf, addr, err);
+			return err;
+		}
+
+		udp_local_get(sock, &laddr);
+	}
+
 	if (!mf->privacy_mode) {
 		err = trice_lcand_add(&lcand, mf->trice,
 				      ICE_COMPID_RTP,
-				      IPPROTO_UDP, prio, addr, NULL,
+				      IPPROTO_UDP, prio, &laddr, NULL,
 				      ICE_CAND_TYPE_HOST, NULL,
 				      0,     /* tcptype */
-				      NULL,  /* sock */
-				      0);
+				      sock,
+				      sock ? LAYER_ICE : 0);
 		if (err) {
 			warning("mediaflow(%p): add_local_host[%j]"
 				" failed (%m)\n",
@@ -3615,9 +4379,11 @@ int mediaflow_add_local_host_candidate(struct mediaflow *mf,
 
 		/* hijack the UDP-socket of the local candidate
 		 *
-		 * NOTE: this must be done for all local candidates
+		 * NOTE: this must be done for all local candidates,
+		 *       except on a shared socket, which is read by the mux
 		 */
-		udp_handler_set(lcand->us, trice_udp_recv_handler, mf);
+		if (!sock)
+			udp_handler_set(lcand->us, trice_udp_recv_handler, mf);
 
 		err = sdp_media_set_lattr(mf->audio.sdpm, false,
 					  "candidate",
@@ -3634,10 +4400,21 @@ int mediaflow_add_local_host_candidate(struct mediaflow *mf,
 		udp_sockbuf_set(lcand->us, UDP_SOCKBUF_SIZE);
 	}
 
-	err = interface_add(mf, lcand, ifname, addr);
+	err = interface_add(&ifc, mf, lcand, ifname, addr);
 	if (err)
 		return err;
 
+	if (sock) {
+		err = udp_mux_attach(&ifc->mux_peer, mf->mux, sock,
+				     mux_match_handler, mux_recv_handler, ifc);
+		if (err) {
+			warning("mediaflow(%p): add_local_host[%j]"
+				" mux attach failed (%m)\n",
+				mf, addr, err);
+			return err;
+		}
+	}
+
 	return err;
 }
 
@@ -3798,6 +4575,8 @@ static int post_sdp_decode(struct mediaflow *mf)
 		return EPROTO;
 	}
 
+	update_ptmap(mf);
+
 	tool = sdp_session_rattr(mf->sdp, "tool");
 	if (tool) {
 		str_ncpy(mf->sdp_rtool, tool, sizeof(mf->sdp_rtool));
@@ -4158,149 +4937,165 @@ void mediaflow_sdpstate_reset(struct mediaflow *mf)
 }
 
 
-int mediaflow_send_rtp(struct mediaflow *mf, const struct rtp_header *hdr,
-		       const uint8_t *pld, size_t pldlen)
+/*
+ * Reserve a send buffer from the packet pool of the mediaflow. The buffer
+ * has room for the TURN/ICE headroom in front and the SRTP trailer at the
+ * end, so the caller can write one RTP/RTCP packet directly into it and
+ * SRTP can encrypt it in place.
+ *
+ * NOTE: the encoder lock is held until mediaflow_send_commit() or
+ *       mediaflow_send_cancel() is called
+ */
+int mediaflow_send_reserve(struct mediaflow *mf, struct mbuf **mbp)
 {
 	struct mbuf *mb;
-	size_t headroom = 0;
-	int err = 0;
 
-	if (!mf || !pld || !pldlen || !hdr)
+	if (!mf || !mbp)
 		return EINVAL;
 
 	MAGIC_CHECK(mf);
 
 	/* check if media-stream is ready for sending */
 	if (!mediaflow_is_ready(mf)) {
-		warning("mediaflow(%p): send_rtp: not ready\n", mf);
+		warning("mediaflow(%p): send_reserve: not ready"
+			" [ice=%d, crypto=%d]\n",
+			mf, mf->ice_ready, mf->crypto_ready);
 		return EINTR;
 	}
 
-	headroom = get_headroom(mf);
+	pthread_mutex_lock(&mf->mutex_enc);
+
+	mf->tx_headroom = get_headroom(mf);
 
-	mb = mbuf_alloc(headroom + 256);
-	if (!mb)
+	mb = packet_pool_get(mf->pool, mf->tx_headroom);
+	if (!mb) {
+		pthread_mutex_unlock(&mf->mutex_enc);
 		return ENOMEM;
+	}
 
-	mb->pos = headroom;
-	err  = rtp_hdr_encode(mb, hdr);
-	err |= mbuf_write_mem(mb, pld, pldlen);
-	if (err)
-		goto out;
+	mf->mb_tx = mb;
+	*mbp = mb;
 
-	mb->pos = headroom;
+	return 0;
+}
 
-	update_tx_stats(mf, pldlen); /* This INCLUDES the rtp header! */
+
+/* Send the packet written into the reserved buffer */
+int mediaflow_send_commit(struct mediaflow *mf, struct mbuf *mb)
+{
+	int err;
+
+	if (!mf || !mb)
+		return EINVAL;
+
+	/* the encoder lock is only held with a reserved buffer */
+	if (!mf->mb_tx)
+		return EINVAL;
+
+	if (mb != mf->mb_tx) {
+		warning("mediaflow(%p): send_commit: buffer not reserved\n",
+			mf);
+		mediaflow_send_cancel(mf);
+		return EINVAL;
+	}
+
+	mb->pos = mf->tx_headroom;
 
 	err = udp_send(mf->rtp, &mf->sel_pair->rcand->attr.addr, mb);
-	if (err)
-		goto out;
 
- out:
-	mem_deref(mb);
+	/* back to the pool, unless a send helper kept a reference */
+	mf->mb_tx = mem_deref(mf->mb_tx);
+
+	pthread_mutex_unlock(&mf->mutex_enc);
 
 	return err;
 }
 
 
-/* NOTE: might be called from different threads */
-int mediaflow_send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
-			   size_t len)
+/* Drop the reserved buffer, does nothing if none is reserved */
+void mediaflow_send_cancel(struct mediaflow *mf)
+{
+	if (!mf || !mf->mb_tx)
+		return;
+
+	mf->mb_tx = mem_deref(mf->mb_tx);
+
+	pthread_mutex_unlock(&mf->mutex_enc);
+}
+
+
+int mediaflow_send_rtp(struct mediaflow *mf, const struct rtp_header *hdr,
+		       const uint8_t *pld, size_t pldlen)
 {
 	struct mbuf *mb;
-	size_t headroom;
-	int err;
+	int err = 0;
 
-	if (!mf || !buf)
+	if (!mf || !pld || !pldlen || !hdr)
 		return EINVAL;
 
-	MAGIC_CHECK(mf);
+	err = mediaflow_send_reserve(mf, &mb);
+	if (err)
+		return err;
 
-	/* check if media-stream is ready for sending */
-	if (!mediaflow_is_ready(mf)) {
-		warning("mediaflow(%p): send_raw_rtp(%zu bytes): not ready"
-			" [ice=%d, crypto=%d]\n",
-			mf, len, mf->ice_ready, mf->crypto_ready);
-		return EINTR;
+	err  = rtp_hdr_encode(mb, hdr);
+	err |= mbuf_write_mem(mb, pld, pldlen);
+	if (err) {
+		mediaflow_send_cancel(mf);
+		return err;
 	}
 
-	pthread_mutex_lock(&mf->mutex_enc);
+	update_tx_stats(mf, pldlen); /* This INCLUDES the rtp header! */
 
-	headroom = get_headroom(mf);
+	return mediaflow_send_commit(mf, mb);
+}
 
-	mb = mbuf_alloc(headroom + len);
-	if (!mb) {
-		err = ENOMEM;
-		goto out;
-	}
 
-	mb->pos = headroom;
-	err = mbuf_write_mem(mb, buf, len);
-	if (err)
-		goto out;
-	mb->pos = headroom;
+/* NOTE: might be called from different threads */
+int mediaflow_send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
+			   size_t len)
+{
+	struct mbuf *mb;
+	int err;
 
-	if (len >= RTP_HEADER_SIZE)
-		update_tx_stats(mf, len - RTP_HEADER_SIZE);
+	if (!mf || !buf)
+		return EINVAL;
 
-	err = udp_send(mf->rtp, &mf->sel_pair->rcand->attr.addr, mb);
+	err = mediaflow_send_reserve(mf, &mb);
 	if (err)
-		goto out;
+		return err;
 
- out:
-	mem_deref(mb);
+	err = mbuf_write_mem(mb, buf, len);
+	if (err) {
+		mediaflow_send_cancel(mf);
+		return err;
+	}
 
-	pthread_mutex_unlock(&mf->mutex_enc);
+	if (len >= RTP_HEADER_SIZE)
+		update_tx_stats(mf, len - RTP_HEADER_SIZE);
 
-	return err;
+	return mediaflow_send_commit(mf, mb);
 }
 
 int mediaflow_send_raw_rtcp(struct mediaflow *mf,
 			    const uint8_t *buf, size_t len)
 {
 	struct mbuf *mb;
-	size_t headroom;
 	int err;
 
 	if (!mf || !buf || !len)
 		return EINVAL;
 
-	MAGIC_CHECK(mf);
-
-	/* check if media-stream is ready for sending */
-	if (!mediaflow_is_ready(mf)) {
-		warning("mediaflow(%p): send_raw_rtcp(%zu bytes): not ready"
-			" [ice=%d, crypto=%d]\n",
-			mf, len, mf->ice_ready, mf->crypto_ready);
-		return EINTR;
-	}
-
-	pthread_mutex_lock(&mf->mutex_enc);
-
-	headroom = get_headroom(mf);
-
-	mb = mbuf_alloc(headroom + 256);
-	if (!mb) {
-		err = ENOMEM;
-		goto out;
-	}
-
-	mb->pos = headroom;
-	err = mbuf_write_mem(mb, buf, len);
+	err = mediaflow_send_reserve(mf, &mb);
 	if (err)
-		goto out;
-	mb->pos = headroom;
-
-	err = udp_send(mf->rtp, &mf->sel_pair->rcand->attr.addr, mb);
-	if (err)
-		goto out;
-
- out:
-	mem_deref(mb);
+		return err;
 
-	pthread_mutex_unlock(&mf->mutex_enc);
+	err = mbuf_write_mem(mb, buf, len);
+	if (err) {
+		mediaflow_send_cancel(mf);
+		return err;
+	}
 
-	return err;
+	return mediaflow_send_commit(mf, mb);
 }
 
 
@@ -4456,17 +5251,9 @@ static void trice_failed_handler(int err, uint16_t scode,
  * this should be called after SDP exchange is complete. we will now
  * start sending ICE connectivity checks to all known remote candidates
  */
-int mediaflow_start_ice(struct mediaflow *mf)
+static void add_remote_candidates(struct mediaflow *mf)
 {
 	struct le *le;
-	int err;
-
-	if (!mf)
-		return EINVAL;
-
-	MAGIC_CHECK(mf);
-
-	mf->ts_nat_start = tmr_jiffies();
 
 	sdp_media_rattr_apply(mf->audio.sdpm, "candidate",
 			      rcandidate_handler, mf);
@@ -4479,6 +5266,55 @@ int mediaflow_start_ice(struct mediaflow *mf)
 			add_permission_to_remotes_ds(mf, conn);
 		}
 	}
+}
+
+
+/*
+ * Take the remote candidates of the offer before the call is answered.
+ *
+ * TURN permissions are created for them now, or as soon as the TURN
+ * allocations are done, so they are in place when the checklist is
+ * started. Nothing is sent to the remote peer until
+ * mediaflow_start_ice() is called.
+ */
+int mediaflow_prewarm(struct mediaflow *mf)
+{
+	if (!mf)
+		return EINVAL;
+
+	MAGIC_CHECK(mf);
+
+	if (!mf->got_sdp) {
+		warning("mediaflow(%p): prewarm: no remote SDP\n", mf);
+		return EPROTO;
+	}
+
+	add_remote_candidates(mf);
+	mf->ice_prewarmed = true;
+
+	info("mediaflow(%p): prewarm: %u remote candidates\n",
+	     mf, list_count(trice_rcandl(mf->trice)));
+
+	return 0;
+}
+
+
+int mediaflow_start_ice(struct mediaflow *mf)
+{
+	int err;
+
+	if (!mf)
+		return EINVAL;
+
+	MAGIC_CHECK(mf);
+
+	mf->ts_nat_start = tmr_jiffies();
+
+	/* after mediaflow_prewarm() the candidates and their TURN
+	 * permissions are in place, or are added as the TURN
+	 * allocations complete */
+	if (!mf->ice_prewarmed)
+		add_remote_candidates(mf);
 
 	info("mediaflow(%p): start_ice: starting ICE checklist with"
 	     " %u remote candidates\n",
@@ -4734,6 +5570,7 @@ void mediaflow_stop_media(struct mediaflow *mf)
 	tmr_cancel(&mf->tmr_rtp);
 	mf->sent_rtp = false;
 	mf->got_rtp = false;
+	__atomic_store_n(&mf->rtp_recv_posted, false, __ATOMIC_RELAXED);
 
 	if (mf->stoppedh)
 		mf->stoppedh(mf->arg);
@@ -4748,9 +5585,12 @@ void mediaflow_reset_media(struct mediaflow *mf)
 
 	mf->mctx = NULL;
 	
+	/* the decoders might be in use on the media thread */
+	pthread_mutex_lock(&mf->mutex_rx);
 	p = mf->ads;
 	mf->ads = NULL;
 	mem_deref(p);
+	pthread_mutex_unlock(&mf->mutex_rx);
 
 	p = mf->aes;
 	mf->aes = NULL;
@@ -4761,9 +5601,11 @@ void mediaflow_reset_media(struct mediaflow *mf)
 	mf->video.ves = NULL;
 	mem_deref(p);
 
+	pthread_mutex_lock(&mf->mutex_rx);
 	p = mf->video.vds;
 	mf->video.vds = NULL;
 	mem_deref(p);
+	pthread_mutex_unlock(&mf->mutex_rx);
 
 	mf->video.mctx = NULL;
 }
@@ -5406,13 +6248,19 @@ struct viddec_state *mediaflow_video_decoder(const struct mediaflow *mf)
 int mediaflow_debug(struct re_printf *pf, const struct mediaflow *mf)
 {
 	struct ice_rcand *rcand = NULL;
+	struct mf_stat stat;
 	int err = 0;
 	char nat_letter = ' ';
 
 	if (!mf)
 		return 0;
 
-	nat_letter = mf->ice_ready ? 'I' : ' ';
+	stat_get(mf, &stat);
+
+	if (mf->ice_ready)
+		nat_letter = 'I';
+	else if (mf->ice_prewarmed)
+		nat_letter = 'i';
 
 	if (mf->sel_pair)
 		rcand = mf->sel_pair->rcand;
@@ -5427,8 +6275,8 @@ int mediaflow_debug(struct re_printf *pf, const struct mediaflow *mf)
 			 rcand ? ice_cand_type2name(rcand->attr.type) : "?",
 			 rcand ? &rcand->attr.addr : NULL,
 			 mf->peer_software,
-			 mf->stat.tx.bytes,
-			 mf->stat.rx.bytes);
+			 stat.tx.bytes,
+			 stat.rx.bytes);
 
 	return err;
 }
@@ -5649,10 +6497,14 @@ const struct mediaflow_stats *mediaflow_stats_get(const struct mediaflow *mf)
 
 int32_t mediaflow_get_media_time(const struct mediaflow *mf)
 {
+	struct mf_stat stat;
+
 	if (!mf)
 		return -1;
-    
-	int dur_rx = (mf->stat.rx.ts_last - mf->stat.rx.ts_first);
+
+	stat_get(mf, &stat);
+
+	int dur_rx = (stat.rx.ts_last - stat.rx.ts_first);
     
 	return dur_rx;
 }
@@ -5687,6 +6539,115 @@ void mediaflow_enable_privacy(struct mediaflow *mf, bool enabled)
 }
 
 
+/*
+ * Use recvmmsg/sendmmsg on the sockets of the local host candidates.
+ * Not available on all platforms.
+ */
+void mediaflow_enable_batch_io(struct mediaflow *mf, bool enabled)
+{
+	struct le *le;
+
+	if (!mf)
+		return;
+
+	pthread_mutex_lock(&mf->mutex_enc);
+
+	mf->batch_io = enabled;
+
+	/* the media thread always receives in batches */
+	for (le = list_head(&mf->interfacel); le && !mf->mt; le = le->next) {
+		struct interface *ifc = le->data;
+
+		if (enabled)
+			(void)interface_batch_start(ifc);
+		else
+			interface_batch_stop(ifc);
+	}
+
+	pthread_mutex_unlock(&mf->mutex_enc);
+}
+
+
+static void stop_media_thread(struct mediaflow *mf)
+{
+	struct le *le;
+
+	for (le = list_head(&mf->interfacel); le; le = le->next)
+		interface_batch_stop(le->data);
+
+	mf->mt = mem_deref(mf->mt);
+}
+
+
+/*
+ * Receive and decrypt RTP/RTCP of the host candidates on a media
+ * thread, instead of the main thread. ICE and DTLS are passed back
+ * to the main thread.
+ */
+/*
+ * Use a TURN pool shared with other mediaflows for the TURN servers
+ * that it has an allocation ready for.
+ */
+void mediaflow_set_turn_pool(struct mediaflow *mf, struct turn_pool *pool)
+{
+	if (!mf)
+		return;
+
+	mem_deref(mf->turn_pool);
+	mf->turn_pool = mem_ref(pool);
+}
+
+
+int mediaflow_turnpool_alloc(struct turn_pool **poolp)
+{
+	return turnpool_alloc(poolp, LAYER_STUN, LAYER_TURN);
+}
+
+
+void mediaflow_set_media_thread(struct mediaflow *mf,
+				struct media_thread *mt)
+{
+	struct le *le;
+
+	if (!mf || mf->mt == mt)
+		return;
+
+	pthread_mutex_lock(&mf->mutex_enc);
+
+	stop_media_thread(mf);
+
+	mf->mt = mem_ref(mt);
+
+	for (le = list_head(&mf->interfacel); le; le = le->next) {
+		if (mf->batch_io || mf->mt)
+			(void)interface_batch_start(le->data);
+	}
+
+	pthread_mutex_unlock(&mf->mutex_enc);
+}
+
+
+/*
+ * Put the host candidates on the shared sockets of a mux, it must be
+ * set before the local candidates are added. Batched I/O and the media
+ * thread are not used for a shared socket.
+ */
+void mediaflow_set_udp_mux(struct mediaflow *mf, struct udp_mux *mux)
+{
+	if (!mf)
+		return;
+
+	if (!list_isempty(&mf->interfacel)) {
+		warning("mediaflow(%p): set_udp_mux: interfaces"
+			" already added\n", mf);
+		return;
+	}
+
+	mem_deref(mf->mux);
+	mf->mux = mem_ref(mux);
+}
+
+
 void mediaflow_enable_group_mode(struct mediaflow *mf, bool enabled)
 {
 	if (!mf)
@@ -6019,6 +6980,18 @@ int mediaflow_gather_all_turn(struct mediaflow *mf)
 		int err;
 
 		turn = &mf->turnv[i];
+
+		/* an allocation that is ready, no DNS or TURN round trip */
+		err = turnpool_take(mf->turn_pool, NULL, &mf->turnconnl,
+				    turn->url, mf->af,
+				    turnconn_estab_handler,
+				    turnconn_data_handler,
+				    turnconn_error_handler, mf);
+		if (!err) {
+			info("mediaflow(%p): gather_all_turn: %s from pool\n",
+			     mf, turn->url);
+			continue;
+		}
 	
 		err = stun_uri_decode(&uri, turn->url);
 		if (err) {
@@ -4,6 +4,10 @@
 
 AVS_SRCS += \
 	media/dtls.c \
+	media/media_thread.c \
 	media/mediaflow.c \
 	media/packet.c \
-	media/sdp.c
+	media/sdp.c \
+	media/srtp_batch.c \
+	media/udp_batch.c \
+	media/udp_mux.c
@@ -119,3 +119,79 @@ const char *packet_classify_name(enum packet pkt)
 	default: return "???";
 	}
 }
+
+
+/*
+ * RTCP compound packet iterator
+ *
+ * Walks the RTCP packets of a compound packet without decoding them,
+ * for callers that only need the packet type or the APP name. Use
+ * rtcp_decode() on the packet when the content is needed.
+ */
+
+
+enum {
+	RTCP_HDR_SIZE = 4,
+};
+
+
+void rtcp_iter_init(struct rtcp_iter *it, const uint8_t *buf, size_t len)
+{
+	if (!it)
+		return;
+
+	it->p = buf;
+	it->left = buf ? len : 0;
+	it->err = 0;
+}
+
+
+bool rtcp_iter_next(struct rtcp_iter *it, struct rtcp_iter_pkt *pkt)
+{
+	size_t len;
+
+	if (!it || !pkt || it->err)
+		return false;
+
+	if (it->left < RTCP_HDR_SIZE)
+		return false;
+
+	if ((it->p[0] >> 6) != RTCP_VERSION) {
+		it->err = EBADMSG;
+		return false;
+	}
+
+	len = (size_t)((it->p[2] << 8) | it->p[3]) * 4;
+	if (it->left - RTCP_HDR_SIZE < len) {
+		it->err = EBADMSG;
+		return false;
+	}
+
+	pkt->pt       = it->p[1];
+	pkt->count    = it->p[0] & 0x1f;
+	pkt->body     = it->p + RTCP_HDR_SIZE;
+	pkt->body_len = len;
+
+	it->p    += RTCP_HDR_SIZE + len;
+	it->left -= RTCP_HDR_SIZE + len;
+
+	return true;
+}
+
+
+/* The name and application data of an APP packet, see RFC 3550 6.7 */
+bool rtcp_iter_app(const struct rtcp_iter_pkt *pkt, const uint8_t **namep,
+		   const uint8_t **datap, size_t *lenp)
+{
+	if (!pkt || pkt->pt != RTCP_APP || pkt->body_len < 8)
+		return false;
+
+	if (namep)
+		*namep = pkt->body + 4;
+	if (datap)
+		*datap = pkt->body + 8;
+	if (lenp)
+		*lenp = pkt->body_len - 8;
+
+	return true;
+}
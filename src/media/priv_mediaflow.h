@@ -26,6 +26,7 @@ enum {
 	LAYER_ICE  = -10,
 	LAYER_TURN = -20,       /* must be below ICE */
 	LAYER_STUN = -30,       /* must be below TURN */
+	LAYER_MUX  = -40,       /* shared socket, below everything */
 };
 
 
@@ -58,6 +59,43 @@ enum packet packet_classify_packet_type(const struct mbuf *mb);
 const char *packet_classify_name(enum packet pkt);
 
 
+/*
+ * Batched UDP I/O
+ */
+
+struct udp_batch;
+
+/* receive latency buckets, from < 64us doubling up to >= 64ms */
+#define UDP_BATCH_LAT_BUCKETS 12
+
+struct udp_batch_stats {
+	unsigned long long rx_calls;
+	unsigned long long rx_pkts;
+	unsigned long long tx_calls;
+	unsigned long long tx_msgs;
+	unsigned long long tx_pkts;
+
+	/* time from kernel receive to the handler, if the OS has it */
+	unsigned long long rx_lat[UDP_BATCH_LAT_BUCKETS];
+};
+
+typedef void (udp_batch_done_h)(void *arg);
+
+int  udp_batch_alloc(struct udp_batch **ubp, struct udp_sock *us, int af,
+		     size_t batch, udp_recv_h *recvh, void *arg);
+void udp_batch_set_done_handler(struct udp_batch *ub,
+				udp_batch_done_h *doneh);
+int  udp_batch_send(struct udp_batch *ub, const struct sa *dst,
+		    struct mbuf *mb);
+struct mbuf **udp_batch_txq(struct udp_batch *ub, size_t *np);
+int  udp_batch_flush(struct udp_batch *ub);
+void udp_batch_detach(struct udp_batch *ub);
+const struct udp_batch_stats *udp_batch_stats(const struct udp_batch *ub);
+int  udp_batch_debug(struct re_printf *pf, const struct udp_batch *ub);
+int  udp_batch_lat_debug(struct re_printf *pf,
+			const struct udp_batch_stats *stats);
+
+
 /*
  * SDP
  */
@@ -0,0 +1,88 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <re.h>
+#include "avs_zapi.h"
+#include "avs_media.h"
+#include "priv_mediaflow.h"
+
+
+/*
+ * SRTP/SRTCP on an array of packets
+ *
+ * RTP and RTCP can be mixed, every packet is protected in place with
+ * its own result in errv. The packets of one call must belong to the
+ * same SRTP session, and are processed in order.
+ *
+ * This is a loop over the per-packet calls and is no faster than them,
+ * it lets the caller handle a batch under one lock.
+ *
+ * Returns the number of packets that failed.
+ */
+
+
+int srtp_batch_encrypt(struct srtp *srtp, struct mbuf **mbv, size_t n,
+		       int *errv)
+{
+	size_t i;
+	int nerr = 0;
+
+	if (!srtp || !mbv || !errv)
+		return (int)n;
+
+	for (i = 0; i < n; i++) {
+
+		struct mbuf *mb = mbv[i];
+
+		if (packet_is_rtcp_packet(mb))
+			errv[i] = srtcp_encrypt(srtp, mb);
+		else
+			errv[i] = srtp_encrypt(srtp, mb);
+
+		if (errv[i])
+			++nerr;
+	}
+
+	return nerr;
+}
+
+
+int srtp_batch_decrypt(struct srtp *srtp, struct mbuf **mbv, size_t n,
+		       int *errv)
+{
+	size_t i;
+	int nerr = 0;
+
+	if (!srtp || !mbv || !errv)
+		return (int)n;
+
+	for (i = 0; i < n; i++) {
+
+		struct mbuf *mb = mbv[i];
+
+		if (packet_is_rtcp_packet(mb))
+			errv[i] = srtcp_decrypt(srtp, mb);
+		else
+			errv[i] = srtp_decrypt(srtp, mb);
+
+		if (errv[i])
+			++nerr;
+	}
+
+	return nerr;
+}
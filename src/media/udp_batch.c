@@ -0,0 +1,650 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE 1
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#define HAVE_MMSG 1
+#endif
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_zapi.h"
+#include "avs_media.h"
+#include "priv_mediaflow.h"
+
+
+/*
+ * Batched UDP I/O on top of a libre UDP-socket
+ *
+ * The receive side takes over the socket's file descriptor and drains
+ * up to `batch' datagrams per wakeup with recvmmsg(). Note that the udp
+ * helpers of the socket are bypassed.
+ *
+ * The send side queues packets until udp_batch_flush() is called, and
+ * sends them with one sendmmsg(). Packets of the same size to the same
+ * destination are sent as one UDP GSO datagram, if the kernel has it.
+ *
+ * Where recvmmsg()/sendmmsg() are missing, the same is done with one
+ * system call per datagram.
+ */
+
+
+enum {
+	RX_BUFSZ = 2048,
+	MAX_SEGS = 32,
+};
+
+
+#ifndef HAVE_MMSG
+
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+#endif
+
+struct udp_batch {
+	struct udp_sock *us;
+	int fd;
+	bool attached;
+	size_t batch;
+
+	/* receive */
+	struct mbuf **rxmbv;
+	struct sa *srcv;
+	struct mmsghdr *rxmsgv;
+	struct iovec *rxiov;
+	uint8_t *rxctl;
+	bool rxts;
+	udp_recv_h *recvh;
+	udp_batch_done_h *doneh;
+	void *arg;
+
+	/* send */
+	struct mbuf **txmbv;
+	struct sa *dstv;
+	struct mmsghdr *txmsgv;
+	struct iovec *txiov;
+	uint8_t *txctl;
+	size_t txc;
+	bool gso;
+
+	struct udp_batch_stats stats;
+};
+
+
+#ifdef UDP_SEGMENT
+#define CTL_SIZE CMSG_SPACE(sizeof(uint16_t))
+#else
+#define CTL_SIZE 0
+#endif
+
+#ifdef SO_TIMESTAMP
+#define RX_CTL_SIZE CMSG_SPACE(sizeof(struct timeval))
+#else
+#define RX_CTL_SIZE 0
+#endif
+
+
+static int batch_recv(int fd, struct mmsghdr *msgv, unsigned int n)
+{
+#ifdef HAVE_MMSG
+	return recvmmsg(fd, msgv, n, MSG_DONTWAIT, NULL);
+#else
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+
+		ssize_t r = recvmsg(fd, &msgv[i].msg_hdr, MSG_DONTWAIT);
+		if (r < 0)
+			break;
+
+		msgv[i].msg_len = (unsigned int)r;
+	}
+
+	return (i == 0 && n > 0) ? -1 : (int)i;
+#endif
+}
+
+
+static int batch_send(int fd, struct mmsghdr *msgv, unsigned int n)
+{
+#ifdef HAVE_MMSG
+	return sendmmsg(fd, msgv, n, 0);
+#else
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+
+		ssize_t r = sendmsg(fd, &msgv[i].msg_hdr, 0);
+		if (r < 0)
+			break;
+
+		msgv[i].msg_len = (unsigned int)r;
+	}
+
+	return (i == 0 && n > 0) ? -1 : (int)i;
+#endif
+}
+
+
+static void destructor(void *arg)
+{
+	struct udp_batch *ub = arg;
+	size_t i;
+
+	/* give the file descriptor back to the UDP-socket */
+	if (ub->attached)
+		udp_thread_attach(ub->us);
+
+#ifdef SO_TIMESTAMP
+	if (ub->rxts) {
+		int off = 0;
+
+		(void)setsockopt(ub->fd, SOL_SOCKET, SO_TIMESTAMP,
+				 &off, sizeof(off));
+	}
+#endif
+
+	for (i = 0; i < ub->batch; i++) {
+		mem_deref(ub->rxmbv[i]);
+	}
+	for (i = 0; i < ub->txc; i++) {
+		mem_deref(ub->txmbv[i]);
+	}
+
+	mem_deref(ub->rxmbv);
+	mem_deref(ub->srcv);
+	mem_deref(ub->rxmsgv);
+	mem_deref(ub->rxiov);
+	mem_deref(ub->rxctl);
+	mem_deref(ub->txmbv);
+	mem_deref(ub->dstv);
+	mem_deref(ub->txmsgv);
+	mem_deref(ub->txiov);
+	mem_deref(ub->txctl);
+
+	mem_deref(ub->us);
+}
+
+
+static void rx_prepare(struct udp_batch *ub, size_t i)
+{
+	struct mbuf *mb = ub->rxmbv[i];
+	struct msghdr *hdr = &ub->rxmsgv[i].msg_hdr;
+
+	mb->pos = 0;
+	mb->end = 0;
+
+	ub->rxiov[i].iov_base = mb->buf;
+	ub->rxiov[i].iov_len  = mb->size;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name    = &ub->srcv[i].u.sa;
+	hdr->msg_namelen = sizeof(ub->srcv[i].u);
+	hdr->msg_iov     = &ub->rxiov[i];
+	hdr->msg_iovlen  = 1;
+
+	if (ub->rxts) {
+		hdr->msg_control    = &ub->rxctl[i * RX_CTL_SIZE];
+		hdr->msg_controllen = RX_CTL_SIZE;
+	}
+}
+
+
+/* the kernel receive timestamp of a datagram, in microseconds */
+static bool rx_timestamp(struct msghdr *hdr, uint64_t *usec)
+{
+#ifdef SO_TIMESTAMP
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+
+		struct timeval tv;
+
+		if (cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_TIMESTAMP)
+			continue;
+
+		memcpy(&tv, CMSG_DATA(cm), sizeof(tv));
+		*usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+		return true;
+	}
+#else
+	(void)hdr;
+	(void)usec;
+#endif
+
+	return false;
+}
+
+
+static void lat_record(struct udp_batch_stats *stats, uint64_t usec)
+{
+	uint64_t lim = 64;
+	size_t b = 0;
+
+	while (b < UDP_BATCH_LAT_BUCKETS - 1 && usec >= lim) {
+		++b;
+		lim <<= 1;
+	}
+
+	++stats->rx_lat[b];
+}
+
+
+static void read_handler(int flags, void *arg)
+{
+	struct udp_batch *ub = arg;
+	uint64_t now = 0;
+	size_t i;
+	int n;
+	(void)flags;
+
+	n = batch_recv(ub->fd, ub->rxmsgv, (unsigned)ub->batch);
+	if (n < 0) {
+		const int err = errno;
+
+		if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+			warning("udp_batch(%p): recvmmsg failed (%m)\n",
+				ub, err);
+		}
+		return;
+	}
+
+	++ub->stats.rx_calls;
+	ub->stats.rx_pkts += n;
+
+	if (ub->rxts) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	/* the handler might deref the owner, and with it this object */
+	mem_ref(ub);
+
+	for (i = 0; i < (size_t)n; i++) {
+
+		struct mbuf *mb = ub->rxmbv[i];
+		struct sa *src = &ub->srcv[i];
+
+		uint64_t ts;
+
+		src->len = ub->rxmsgv[i].msg_hdr.msg_namelen;
+		mb->end  = ub->rxmsgv[i].msg_len;
+
+		if (ub->rxts && rx_timestamp(&ub->rxmsgv[i].msg_hdr, &ts))
+			lat_record(&ub->stats, now > ts ? now - ts : 0);
+
+		if (ub->rxmsgv[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			warning("udp_batch(%p): dropping truncated"
+				" datagram from %J\n", ub, src);
+			continue;
+		}
+
+		if (mem_nrefs(ub) == 1)
+			break;
+
+		ub->recvh(src, mb, ub->arg);
+	}
+
+	if (ub->doneh && mem_nrefs(ub) > 1)
+		ub->doneh(ub->arg);
+
+	/* replace the buffers that were kept by the handler */
+	for (i = 0; i < (size_t)n; i++) {
+
+		if (mem_nrefs(ub->rxmbv[i]) > 1) {
+			mem_deref(ub->rxmbv[i]);
+			ub->rxmbv[i] = mbuf_alloc(RX_BUFSZ);
+			if (!ub->rxmbv[i]) {
+				warning("udp_batch(%p): out of memory\n", ub);
+				fd_listen(ub->fd, 0, NULL, NULL);
+				break;
+			}
+		}
+
+		rx_prepare(ub, i);
+	}
+
+	mem_deref(ub);
+}
+
+
+int udp_batch_alloc(struct udp_batch **ubp, struct udp_sock *us, int af,
+		    size_t batch, udp_recv_h *recvh, void *arg)
+{
+	struct udp_batch *ub;
+	size_t i;
+	int err = 0;
+
+	if (!ubp || !us || !batch || !recvh)
+		return EINVAL;
+
+	ub = mem_zalloc(sizeof(*ub), destructor);
+	if (!ub)
+		return ENOMEM;
+
+	ub->fd = -1;
+	ub->us = mem_ref(us);
+	ub->batch = batch;
+	ub->recvh = recvh;
+	ub->arg = arg;
+
+	ub->rxmbv  = mem_zalloc(batch * sizeof(*ub->rxmbv), NULL);
+	ub->srcv   = mem_zalloc(batch * sizeof(*ub->srcv), NULL);
+	ub->rxmsgv = mem_zalloc(batch * sizeof(*ub->rxmsgv), NULL);
+	ub->rxiov  = mem_zalloc(batch * sizeof(*ub->rxiov), NULL);
+	ub->txmbv  = mem_zalloc(batch * sizeof(*ub->txmbv), NULL);
+	ub->dstv   = mem_zalloc(batch * sizeof(*ub->dstv), NULL);
+	ub->txmsgv = mem_zalloc(batch * sizeof(*ub->txmsgv), NULL);
+	ub->txiov  = mem_zalloc(batch * sizeof(*ub->txiov), NULL);
+	ub->txctl  = mem_zalloc(batch * CTL_SIZE + 1, NULL);
+	ub->rxctl  = mem_zalloc(batch * RX_CTL_SIZE + 1, NULL);
+	if (!ub->rxmbv || !ub->srcv || !ub->rxmsgv || !ub->rxiov ||
+	    !ub->txmbv || !ub->dstv || !ub->txmsgv || !ub->txiov ||
+	    !ub->txctl || !ub->rxctl) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	ub->fd = udp_sock_fd(us, af);
+
+#ifdef SO_TIMESTAMP
+	{
+		int on = 1;
+
+		ub->rxts = 0 == setsockopt(ub->fd, SOL_SOCKET, SO_TIMESTAMP,
+					   &on, sizeof(on));
+	}
+#endif
+
+	for (i = 0; i < batch; i++) {
+
+		ub->rxmbv[i] = mbuf_alloc(RX_BUFSZ);
+		if (!ub->rxmbv[i]) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		rx_prepare(ub, i);
+	}
+
+#ifdef UDP_SEGMENT
+	{
+		int val = 0;
+		socklen_t len = sizeof(val);
+
+		ub->gso = 0 == getsockopt(ub->fd, SOL_UDP,
+					  UDP_SEGMENT, &val, &len);
+	}
+#endif
+
+	err = fd_listen(ub->fd, FD_READ, read_handler, ub);
+	if (err)
+		goto out;
+
+	ub->attached = true;
+
+ out:
+	if (err)
+		mem_deref(ub);
+	else
+		*ubp = ub;
+
+	return err;
+}
+
+
+/* called after each batch of received packets was handled */
+void udp_batch_set_done_handler(struct udp_batch *ub,
+				udp_batch_done_h *doneh)
+{
+	if (!ub)
+		return;
+
+	ub->doneh = doneh;
+}
+
+
+/*
+ * Queue a packet for sending. The packet is sent with the next
+ * udp_batch_flush(), or now if the queue is full.
+ */
+int udp_batch_send(struct udp_batch *ub, const struct sa *dst,
+		   struct mbuf *mb)
+{
+	int err = 0;
+
+	if (!ub || !dst || !mb)
+		return EINVAL;
+
+	if (ub->txc >= ub->batch)
+		err = udp_batch_flush(ub);
+
+	ub->txmbv[ub->txc] = mem_ref(mb);
+	ub->dstv[ub->txc] = *dst;
+	++ub->txc;
+
+	return err;
+}
+
+
+/*
+ * The packets queued for sending, so that the caller can process them
+ * in place before udp_batch_flush(). Empty packets are not sent.
+ */
+struct mbuf **udp_batch_txq(struct udp_batch *ub, size_t *np)
+{
+	if (!ub || !np)
+		return NULL;
+
+	*np = ub->txc;
+
+	return ub->txmbv;
+}
+
+
+/* how many packets starting at i can be sent as one GSO datagram */
+static size_t gso_count(const struct udp_batch *ub, size_t i)
+{
+	const size_t segsz = mbuf_get_left(ub->txmbv[i]);
+	size_t j = i + 1;
+
+	if (!ub->gso)
+		return 1;
+
+	while (j < ub->txc && j - i < MAX_SEGS &&
+	       sa_cmp(&ub->dstv[j], &ub->dstv[i], SA_ALL) &&
+	       mbuf_get_left(ub->txmbv[j - 1]) == segsz &&
+	       mbuf_get_left(ub->txmbv[j]) <= segsz) {
+		++j;
+	}
+
+	return j - i;
+}
+
+
+int udp_batch_flush(struct udp_batch *ub)
+{
+	size_t i, k, nmsg = 0, sent = 0;
+	int err = 0;
+
+	if (!ub)
+		return EINVAL;
+
+	/* drop the packets that were emptied by the caller */
+	for (i = 0, k = 0; i < ub->txc; i++) {
+
+		if (!mbuf_get_left(ub->txmbv[i])) {
+			ub->txmbv[i] = mem_deref(ub->txmbv[i]);
+			continue;
+		}
+
+		ub->txmbv[k] = ub->txmbv[i];
+		ub->dstv[k] = ub->dstv[i];
+		++k;
+	}
+	ub->txc = k;
+
+	if (!ub->txc)
+		return 0;
+
+	for (i = 0; i < ub->txc; i += k) {
+
+		struct msghdr *hdr = &ub->txmsgv[nmsg].msg_hdr;
+		size_t j;
+
+		k = gso_count(ub, i);
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name    = &ub->dstv[i].u.sa;
+		hdr->msg_namelen = ub->dstv[i].len;
+		hdr->msg_iov     = &ub->txiov[i];
+		hdr->msg_iovlen  = k;
+
+		for (j = i; j < i + k; j++) {
+			ub->txiov[j].iov_base = mbuf_buf(ub->txmbv[j]);
+			ub->txiov[j].iov_len  = mbuf_get_left(ub->txmbv[j]);
+		}
+
+#ifdef UDP_SEGMENT
+		if (k > 1) {
+			struct cmsghdr *cm;
+			uint16_t segsz = mbuf_get_left(ub->txmbv[i]);
+
+			hdr->msg_control    = &ub->txctl[nmsg * CTL_SIZE];
+			hdr->msg_controllen = CTL_SIZE;
+
+			cm = CMSG_FIRSTHDR(hdr);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type  = UDP_SEGMENT;
+			cm->cmsg_len   = CMSG_LEN(sizeof(segsz));
+			memcpy(CMSG_DATA(cm), &segsz, sizeof(segsz));
+		}
+#endif
+
+		++nmsg;
+	}
+
+	while (sent < nmsg) {
+
+		int n = batch_send(ub->fd, &ub->txmsgv[sent],
+				   (unsigned)(nmsg - sent));
+		if (n < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
+
+			warning("udp_batch(%p): sendmmsg %zu/%zu failed (%m)\n",
+				ub, nmsg - sent, nmsg, err);
+			break;
+		}
+
+		++ub->stats.tx_calls;
+		sent += n;
+	}
+
+	ub->stats.tx_pkts += ub->txc;
+	ub->stats.tx_msgs += sent;
+
+	for (i = 0; i < ub->txc; i++)
+		ub->txmbv[i] = mem_deref(ub->txmbv[i]);
+	ub->txc = 0;
+
+	return err;
+}
+
+
+/*
+ * Stop receiving on the current thread's main-loop. The socket is not
+ * given back to libre when the object is destroyed.
+ */
+void udp_batch_detach(struct udp_batch *ub)
+{
+	if (!ub || !ub->attached)
+		return;
+
+	fd_close(ub->fd);
+	ub->attached = false;
+}
+
+
+const struct udp_batch_stats *udp_batch_stats(const struct udp_batch *ub)
+{
+	return ub ? &ub->stats : NULL;
+}
+
+
+int udp_batch_debug(struct re_printf *pf, const struct udp_batch *ub)
+{
+	if (!ub)
+		return 0;
+
+	return re_hprintf(pf, "batch=%zu gso=%d"
+			  " rx=%llu pkts/%llu calls"
+			  " tx=%llu pkts/%llu msgs/%llu calls"
+			  " rx-latency:%H",
+			  ub->batch, ub->gso,
+			  ub->stats.rx_pkts, ub->stats.rx_calls,
+			  ub->stats.tx_pkts, ub->stats.tx_msgs,
+			  ub->stats.tx_calls,
+			  udp_batch_lat_debug, &ub->stats);
+}
+
+
+int udp_batch_lat_debug(struct re_printf *pf,
+			const struct udp_batch_stats *stats)
+{
+	uint64_t lim = 64;
+	size_t b;
+	int err = 0;
+
+	if (!stats)
+		return 0;
+
+	for (b = 0; b < UDP_BATCH_LAT_BUCKETS; b++, lim <<= 1) {
+
+		if (!stats->rx_lat[b])
+			continue;
+
+		if (b < UDP_BATCH_LAT_BUCKETS - 1) {
+			err |= re_hprintf(pf, " <%lluus:%llu",
+					  (unsigned long long)lim,
+					  stats->rx_lat[b]);
+		}
+		else {
+			err |= re_hprintf(pf, " >=%lluus:%llu",
+					  (unsigned long long)(lim >> 1),
+					  stats->rx_lat[b]);
+		}
+	}
+
+	return err;
+}
@@ -0,0 +1,546 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_zapi.h"
+#include "avs_media.h"
+#include "priv_mediaflow.h"
+
+
+/*
+ * Shared UDP socket for several peers
+ *
+ * One socket per local address carries the traffic of all the peers
+ * of a call. The mux sits below all the other udp helpers and hands
+ * every incoming packet to exactly one peer:
+ *
+ * 1. by remote address, for addresses that were seen before
+ * 2. by SSRC, for RTP/RTCP from a new address (e.g. NAT rebinding)
+ * 3. by asking each peer, whose match handler knows its remote
+ *    candidates and ICE credentials
+ *
+ * The address found in 3. is remembered for the next packet. SSRCs,
+ * and the addresses found in 2., are only remembered once the peer has
+ * authenticated a packet with udp_mux_confirm(), so that a sender that
+ * only knows an SSRC cannot take over the route.
+ * Packets that no peer wants are dropped.
+ */
+
+
+enum {
+	HASH_SIZE = 32,
+	MAX_KEYS  = 16,   /* learned addresses and SSRCs per peer */
+};
+
+struct udp_mux {
+	struct list sockl;         /* struct mux_sock */
+	struct udp_mux_stats stats;
+};
+
+struct mux_sock {
+	struct le le;
+	struct udp_mux *mux;       /* pointer to parent */
+	struct udp_sock *us;
+	struct udp_helper *uh;
+	struct sa laddr;
+	struct list peerl;         /* struct udp_mux_peer */
+	struct hash *addrh;        /* struct mux_key, by remote address */
+	struct hash *ssrch;        /* struct mux_key, by remote SSRC */
+};
+
+struct udp_mux_peer {
+	struct le le;
+	struct udp_mux *mux;       /* referenced, owns the socket */
+	struct mux_sock *ms;
+	struct list addrl;         /* learned addresses, oldest first */
+	struct list ssrcl;         /* learned SSRCs, oldest first */
+	udp_mux_match_h *matchh;
+	udp_recv_h *recvh;
+	void *arg;
+	uint64_t n_rx;
+};
+
+struct mux_key {
+	struct le hle;
+	struct le le;
+	struct udp_mux_peer *peer;
+	struct sa addr;
+	uint32_t ssrc;
+};
+
+
+static void key_destructor(void *data)
+{
+	struct mux_key *key = data;
+
+	hash_unlink(&key->hle);
+	list_unlink(&key->le);
+}
+
+
+static bool addr_cmp_handler(struct le *le, void *arg)
+{
+	const struct mux_key *key = le->data;
+
+	return sa_cmp(&key->addr, arg, SA_ALL);
+}
+
+
+static bool ssrc_cmp_handler(struct le *le, void *arg)
+{
+	const struct mux_key *key = le->data;
+
+	return key->ssrc == *(uint32_t *)arg;
+}
+
+
+static struct mux_key *key_add(struct udp_mux_peer *peer, struct list *keyl)
+{
+	struct mux_key *key;
+
+	/* forget the oldest one, the peer has moved on */
+	if (list_count(keyl) >= MAX_KEYS)
+		mem_deref(list_ledata(list_head(keyl)));
+
+	key = mem_zalloc(sizeof(*key), key_destructor);
+	if (!key)
+		return NULL;
+
+	key->peer = peer;
+	list_append(keyl, &key->le, key);
+
+	return key;
+}
+
+
+static void learn_addr(struct udp_mux_peer *peer, const struct sa *src)
+{
+	struct mux_sock *ms = peer->ms;
+	struct mux_key *key;
+
+	key = key_add(peer, &peer->addrl);
+	if (!key)
+		return;
+
+	key->addr = *src;
+	hash_append(ms->addrh, sa_hash(src, SA_ALL), &key->hle, key);
+}
+
+
+static void learn_ssrc(struct udp_mux_peer *peer, uint32_t ssrc)
+{
+	struct mux_sock *ms = peer->ms;
+	struct mux_key *key;
+
+	/* an SSRC belongs to the first peer that used it */
+	if (hash_lookup(ms->ssrch, ssrc, ssrc_cmp_handler, &ssrc))
+		return;
+
+	key = key_add(peer, &peer->ssrcl);
+	if (!key)
+		return;
+
+	key->ssrc = ssrc;
+	hash_append(ms->ssrch, ssrc, &key->hle, key);
+}
+
+
+/* the sender's SSRC of an RTP or RTCP packet */
+static bool packet_ssrc(const struct mbuf *mb, enum packet pkt,
+			uint32_t *ssrcp)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	const size_t len = mbuf_get_left(mb);
+	size_t ofs;
+
+	switch (pkt) {
+
+	case PACKET_RTP:
+		ofs = 8;
+		break;
+
+	case PACKET_RTCP:
+		ofs = 4;
+		break;
+
+	default:
+		return false;
+	}
+
+	if (len < ofs + 4)
+		return false;
+
+	*ssrcp = (uint32_t)p[ofs] << 24 | (uint32_t)p[ofs+1] << 16 |
+		(uint32_t)p[ofs+2] << 8 | (uint32_t)p[ofs+3];
+
+	return true;
+}
+
+
+static struct udp_mux_peer *lookup_addr(const struct mux_sock *ms,
+					const struct sa *src)
+{
+	struct mux_key *key;
+
+	key = list_ledata(hash_lookup(ms->addrh, sa_hash(src, SA_ALL),
+				      addr_cmp_handler, (void *)src));
+
+	return key ? key->peer : NULL;
+}
+
+
+static struct udp_mux_peer *lookup_ssrc(const struct mux_sock *ms,
+					uint32_t ssrc)
+{
+	struct mux_key *key;
+
+	key = list_ledata(hash_lookup(ms->ssrch, ssrc,
+				      ssrc_cmp_handler, &ssrc));
+
+	return key ? key->peer : NULL;
+}
+
+
+static struct udp_mux_peer *lookup_match(const struct mux_sock *ms,
+					 const struct sa *src, struct mbuf *mb)
+{
+	const size_t pos = mb->pos;
+	struct le *le;
+
+	for (le = ms->peerl.head; le; le = le->next) {
+		struct udp_mux_peer *peer = le->data;
+		bool match;
+
+		if (!peer->matchh)
+			continue;
+
+		match = peer->matchh(src, mb, peer->arg);
+		mb->pos = pos;
+
+		if (match)
+			return peer;
+	}
+
+	return NULL;
+}
+
+
+static bool mux_recv_handler(struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct mux_sock *ms = arg;
+	struct udp_mux_stats *stats = &ms->mux->stats;
+	struct udp_mux_peer *peer;
+	enum packet pkt;
+	uint32_t ssrc;
+	bool has_ssrc;
+
+	++stats->rx;
+
+	pkt = packet_classify_packet_type(mb);
+	has_ssrc = packet_ssrc(mb, pkt, &ssrc);
+
+	peer = lookup_addr(ms, src);
+	if (peer) {
+		++stats->by_addr;
+		goto out;
+	}
+
+	if (has_ssrc) {
+		peer = lookup_ssrc(ms, ssrc);
+		if (peer) {
+			++stats->by_ssrc;
+			goto out;
+		}
+	}
+
+	peer = lookup_match(ms, src, mb);
+	if (peer) {
+		++stats->by_match;
+		learn_addr(peer, src);
+		goto out;
+	}
+
+	++stats->dropped;
+	debug("udp_mux: %J: dropping %s packet from unknown peer %J\n",
+	      &ms->laddr, packet_classify_name(pkt), src);
+
+	return true;
+
+ out:
+	++peer->n_rx;
+
+	if (peer->recvh)
+		peer->recvh(src, mb, peer->arg);
+
+	return true;  /* nobody else on this socket should see it */
+}
+
+
+static void sock_destructor(void *data)
+{
+	struct mux_sock *ms = data;
+
+	list_unlink(&ms->le);
+	ms->uh = mem_deref(ms->uh);  /* note: before the socket */
+	mem_deref(ms->us);
+	mem_deref(ms->addrh);
+	mem_deref(ms->ssrch);
+}
+
+
+static int sock_alloc(struct mux_sock **msp, struct udp_mux *mux,
+		      const struct sa *laddr)
+{
+	struct mux_sock *ms;
+	struct sa addr;
+	int err;
+
+	ms = mem_zalloc(sizeof(*ms), sock_destructor);
+	if (!ms)
+		return ENOMEM;
+
+	ms->mux = mux;
+
+	sa_cpy(&addr, laddr);
+	sa_set_port(&addr, 0);
+
+	err = udp_listen(&ms->us, &addr, NULL, NULL);
+	if (err) {
+		warning("udp_mux: cannot listen on %j (%m)\n", &addr, err);
+		goto out;
+	}
+
+	err = udp_local_get(ms->us, &ms->laddr);
+	if (err)
+		goto out;
+
+	err  = hash_alloc(&ms->addrh, HASH_SIZE);
+	err |= hash_alloc(&ms->ssrch, HASH_SIZE);
+	if (err)
+		goto out;
+
+	err = udp_register_helper(&ms->uh, ms->us, LAYER_MUX,
+				  NULL, mux_recv_handler, ms);
+	if (err)
+		goto out;
+
+	list_append(&mux->sockl, &ms->le, ms);
+
+	info("udp_mux: shared socket on %J\n", &ms->laddr);
+
+ out:
+	if (err)
+		mem_deref(ms);
+	else
+		*msp = ms;
+
+	return err;
+}
+
+
+static struct mux_sock *sock_find(const struct udp_mux *mux,
+				  const struct sa *laddr,
+				  const struct udp_sock *us)
+{
+	struct le *le;
+
+	for (le = mux->sockl.head; le; le = le->next) {
+		struct mux_sock *ms = le->data;
+
+		if (us && ms->us == us)
+			return ms;
+		if (laddr && sa_cmp(&ms->laddr, laddr, SA_ADDR))
+			return ms;
+	}
+
+	return NULL;
+}
+
+
+static void mux_destructor(void *data)
+{
+	struct udp_mux *mux = data;
+
+	list_flush(&mux->sockl);
+}
+
+
+int udp_mux_alloc(struct udp_mux **muxp)
+{
+	struct udp_mux *mux;
+
+	if (!muxp)
+		return EINVAL;
+
+	mux = mem_zalloc(sizeof(*mux), mux_destructor);
+	if (!mux)
+		return ENOMEM;
+
+	*muxp = mux;
+
+	return 0;
+}
+
+
+/*
+ * The shared socket for a local address, it is opened on first use
+ * and kept until the mux is gone. Only the address portion of laddr
+ * is used. The socket is not referenced.
+ */
+int udp_mux_sock(struct udp_sock **usp, struct udp_mux *mux,
+		 const struct sa *laddr)
+{
+	struct mux_sock *ms;
+	int err;
+
+	if (!usp || !mux || !laddr)
+		return EINVAL;
+
+	ms = sock_find(mux, laddr, NULL);
+	if (!ms) {
+		err = sock_alloc(&ms, mux, laddr);
+		if (err)
+			return err;
+	}
+
+	*usp = ms->us;
+
+	return 0;
+}
+
+
+static void peer_destructor(void *data)
+{
+	struct udp_mux_peer *peer = data;
+
+	list_flush(&peer->addrl);
+	list_flush(&peer->ssrcl);
+	list_unlink(&peer->le);
+	mem_deref(peer->mux);
+}
+
+
+/*
+ * Attach a peer to a shared socket. Packets for the peer are passed
+ * to recvh; matchh is asked about packets from unknown senders, and
+ * must leave the buffer as it is.
+ */
+int udp_mux_attach(struct udp_mux_peer **peerp, struct udp_mux *mux,
+		   const struct udp_sock *us, udp_mux_match_h *matchh,
+		   udp_recv_h *recvh, void *arg)
+{
+	struct udp_mux_peer *peer;
+	struct mux_sock *ms;
+
+	if (!peerp || !mux || !us)
+		return EINVAL;
+
+	ms = sock_find(mux, NULL, us);
+	if (!ms)
+		return ENOENT;
+
+	peer = mem_zalloc(sizeof(*peer), peer_destructor);
+	if (!peer)
+		return ENOMEM;
+
+	peer->mux    = mem_ref(mux);
+	peer->ms     = ms;
+	peer->matchh = matchh;
+	peer->recvh  = recvh;
+	peer->arg    = arg;
+
+	list_append(&ms->peerl, &peer->le, peer);
+
+	*peerp = peer;
+
+	return 0;
+}
+
+
+/*
+ * The peer has authenticated an RTP/RTCP packet from src, e.g. with
+ * SRTP. Its address and SSRC are used for the next packets.
+ */
+void udp_mux_confirm(struct udp_mux_peer *peer, const struct sa *src,
+		     const struct mbuf *mb)
+{
+	struct udp_mux_peer *owner;
+	uint32_t ssrc;
+
+	if (!peer || !src || !mb)
+		return;
+
+	if (!packet_ssrc(mb, packet_classify_packet_type(mb), &ssrc))
+		return;
+
+	owner = lookup_addr(peer->ms, src);
+	if (!owner)
+		learn_addr(peer, src);
+	else if (owner != peer)
+		return;
+
+	learn_ssrc(peer, ssrc);
+}
+
+
+const struct udp_mux_stats *udp_mux_stats(const struct udp_mux *mux)
+{
+	return mux ? &mux->stats : NULL;
+}
+
+
+int udp_mux_debug(struct re_printf *pf, const struct udp_mux *mux)
+{
+	const struct udp_mux_stats *stats;
+	struct le *le;
+	int err;
+
+	if (!mux)
+		return 0;
+
+	stats = &mux->stats;
+
+	err = re_hprintf(pf, "udp_mux: sockets=%u rx=%llu addr=%llu"
+			 " ssrc=%llu match=%llu dropped=%llu\n",
+			 list_count(&mux->sockl),
+			 stats->rx, stats->by_addr, stats->by_ssrc,
+			 stats->by_match, stats->dropped);
+
+	for (le = mux->sockl.head; le; le = le->next) {
+		const struct mux_sock *ms = le->data;
+		struct le *lep;
+
+		err |= re_hprintf(pf, "    %J peers=%u\n",
+				  &ms->laddr, list_count(&ms->peerl));
+
+		for (lep = ms->peerl.head; lep; lep = lep->next) {
+			const struct udp_mux_peer *peer = lep->data;
+
+			err |= re_hprintf(pf, "        %p: rx=%llu"
+					  " addrs=%u ssrcs=%u\n",
+					  peer->arg,
+					  (unsigned long long)peer->n_rx,
+					  list_count(&peer->addrl),
+					  list_count(&peer->ssrcl));
+		}
+	}
+
+	return err;
+}
@@ -17,6 +17,8 @@
 */
 
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "re.h"
 #include "avs.h"
@@ -28,6 +30,12 @@
 #       include <TargetConditionals.h>
 #endif
 
+
+#define MAX_MEDIA_THREADS 4
+#define DTLS_PRESIGN_SIZE 16   /* about one group call join */
+#define DTLS_CERT_ID "dtls"
+#define DTLS_CERT_MAX_AGE (30*24*3600)  /* rotate every 30 days */
+
 struct msystem {
 	pthread_t tid;
 
@@ -37,15 +45,25 @@ struct msystem {
 	bool started;
 	struct dnsc *dnsc;
 	struct tls *dtls;
+	struct cert_presign *presign;
 	struct mqueue *mq;
 	struct tmr vol_tmr;
 	char *name;
 	bool using_voe;
 	bool loopback;
 	bool privacy;
+	bool batch_io;
+	bool shared_socket;
+	bool engines;
+	bool media_inited;
+	struct msystem_trace trace;
 	bool crypto_kase;
 	char ifname[256];
 
+	struct media_thread *mtv[MAX_MEDIA_THREADS];
+	size_t mtc;
+	size_t mt_next;
+
 	struct list aucodecl;
 	struct list vidcodecl;
 };
@@ -80,27 +98,40 @@ static const char *cipherv[] = {
 static struct msystem *g_msys = NULL;
 
 
+static void engines_close(struct msystem *msys)
+{
+	if (!msys->name || !msys->engines)
+		return;
+
+	if (streq(msys->name, "audummy"))
+		audummy_close();
+	else if (streq(msys->name, "extcodec")) {
+		extcodec_audio_close();
+		extcodec_video_close();
+	}
+	else if (streq(msys->name, "voe")) {
+		vie_close();
+		voe_close();
+	}
+
+	msys->engines = false;
+	msys->using_voe = false;
+}
+
+
 static void msystem_destructor(void *data)
 {
 	struct msystem *msys = data;
 
-	if (msys->name) {
-		if (streq(msys->name, "audummy"))
-			audummy_close();
-		else if (streq(msys->name, "extcodec")) {
-			extcodec_audio_close();
-			extcodec_video_close();
-		}
-		else if (streq(msys->name, "voe")) {
-			vie_close();
-			voe_close();
-		}
-	}
+	engines_close(msys);
 
 	tmr_cancel(&msys->vol_tmr);
 
+	msystem_enable_media_threads(msys, 0);
+
 	msys->mq = mem_deref(msys->mq);
 	msys->dtls = mem_deref(msys->dtls);
+	msys->presign = mem_deref(msys->presign);
 	msys->name = mem_deref(msys->name);
 	msys->dnsc = mem_deref(msys->dnsc);
 	
@@ -113,6 +144,55 @@ static void msystem_destructor(void *data)
 }
 
 
+/*
+ * The DTLS certificate is taken from the store, if there is one and
+ * it is not too old. Otherwise a new one is made, and saved there.
+ */
+static int dtls_cert_setup(struct msystem *msys,
+			   const struct msystem_config *config)
+{
+	struct store *st = config ? config->cert_store : NULL;
+	uint32_t max_age = DTLS_CERT_MAX_AGE;
+	uint64_t created;
+	int err;
+
+	if (config && config->cert_max_age)
+		max_age = config->cert_max_age;
+
+	if (st) {
+		err = cert_tls_load(msys->dtls, st, DTLS_CERT_ID, max_age,
+				    &created);
+		if (!err) {
+			info("msystem: using cached ECDSA certificate"
+			     " (%llu seconds old)\n",
+			     (unsigned long long)(time(NULL) - created));
+			return 0;
+		}
+
+		info("msystem: no cached certificate (%m)\n", err);
+	}
+
+	info("msystem: generating ECDSA certificate\n");
+	err = cert_tls_set_selfsigned_ecdsa(msys->dtls, "prime256v1");
+	if (err) {
+		warning("msystem: failed to generate ECDSA"
+			" certificate"
+			" (%m)\n", err);
+		return err;
+	}
+
+	if (st) {
+		err = cert_tls_save(msys->dtls, st, DTLS_CERT_ID);
+		if (err) {
+			warning("msystem: failed to cache certificate (%m)\n",
+				err);
+		}
+	}
+
+	return 0;
+}
+
+
 /* This is just a dummy handler fo waking up re_main() */
 static void wakeup_handler(int id, void *data, void *arg)
 {
@@ -122,48 +202,64 @@ static void wakeup_handler(int id, void *data, void *arg)
 }
 
 
-static int msystem_init(struct msystem **msysp, const char *msysname,
-			struct msystem_config *config)
+static uint64_t now_usec(void)
 {
-	struct msystem *msys;
-	int err;
+	struct timeval tv;
 
-	if (!msysp)
-		return EINVAL;
+	gettimeofday(&tv, NULL);
 
-	msys = mem_zalloc(sizeof(*msys), msystem_destructor);
-	if (!msys)
-		return ENOMEM;
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-	err = mqueue_alloc(&msys->mq, wakeup_handler, NULL);
-	if (err) {
-		warning("flowmgr: failed to create mqueue (%m)\n", err);
-		goto out;
-	}
+
+static void trace_step(struct msystem *msys, const char *name,
+		       uint64_t ts)
+{
+	struct msystem_trace *trace = &msys->trace;
+
+	if (trace->stepc >= ARRAY_SIZE(trace->stepv))
+		return;
+
+	trace->stepv[trace->stepc].name = name;
+	trace->stepv[trace->stepc].usec = now_usec() - ts;
+	++trace->stepc;
+}
+
+
+static int dtls_init(struct msystem *msys)
+{
+	int err;
 
 	err = tls_alloc(&msys->dtls, TLS_METHOD_DTLS, NULL, NULL);
 	if (err) {
 		warning("flowmgr: failed to create DTLS context (%m)\n",
 			err);
-		goto out;
+		return err;
 	}
 
 	err = cert_enable_ecdh(msys->dtls);
 	if (err)
-		goto out;
+		return err;
 
 	info("flowmgr: setting %zu ciphers for DTLS\n", ARRAY_SIZE(cipherv));
 	err = tls_set_ciphers(msys->dtls, cipherv, ARRAY_SIZE(cipherv));
 	if (err)
-		goto out;
+		return err;
 
-	info("msystem: generating ECDSA certificate\n");
-	err = cert_tls_set_selfsigned_ecdsa(msys->dtls, "prime256v1");
+	err = dtls_cert_setup(msys, &msys->config);
+	if (err)
+		return err;
+
+	/* keep the nonces of the handshake signatures ready in the
+	 * background, for a burst of handshakes when joining a call */
+	err = cert_presign_alloc(&msys->presign, "prime256v1",
+				 DTLS_PRESIGN_SIZE);
+	if (!err)
+		err = cert_tls_set_presign(msys->dtls, msys->presign);
 	if (err) {
-		warning("msystem: failed to generate ECDSA"
-			" certificate"
-			" (%m)\n", err);
-		goto out;
+		warning("msystem: no precomputed ECDSA signing (%m)\n", err);
+		msys->presign = mem_deref(msys->presign);
+		err = 0;
 	}
 
 	tls_set_verify_client(msys->dtls);
@@ -180,14 +276,20 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 	if (err) {
 		warning("flowmgr: failed to enable SRTP profile (%m)\n",
 			err);
-		goto out;
+		return err;
 	}
 
-	tmr_init(&msys->vol_tmr);
+	return 0;
+}
+
+
+static int engines_init(struct msystem *msys)
+{
+	int err = 0;
+
+	/* closed by engines_close(), also if this fails half-way */
+	msys->engines = true;
 
-	info("msystem: initializing for msys: %s\n", msysname);
-	
-	err = str_dup(&msys->name, msysname);
 	if (streq(msys->name, "audummy"))
 		err = audummy_init(&msys->aucodecl);
 	else if (streq(msys->name, "extcodec")) {
@@ -195,25 +297,25 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 		if (err) {
 			warning("msystem: extcodec audio init failed (%m)\n",
 				err);
-			goto out;
+			return err;
 		}
 		err = extcodec_video_init(&msys->vidcodecl);
 		if (err) {
 			warning("flowmgr: vie init failed (%m)\n", err);
-			goto out;
+			return err;
 		}
 	}
 	else if (streq(msys->name, "voe")) {
 		err = voe_init(&msys->aucodecl);
 		if (err) {
 			warning("flowmgr: voe init failed (%m)\n", err);
-			goto out;
+			return err;
 		}
 
 		err = vie_init(&msys->vidcodecl);
 		if (err) {
 			warning("flowmgr: vie init failed (%m)\n", err);
-			goto out;
+			return err;
 		}
 
 		msys->using_voe = true;
@@ -224,24 +326,110 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 		err = EINVAL;
 	}
 
+	return err;
+}
+
+
+/*
+ * The expensive part of the init: DTLS context and certificate, audio
+ * and video engines, and the data channel stack. It is done from
+ * msystem_init(), or on the first call with lazy init.
+ */
+static int media_init(struct msystem *msys)
+{
+	uint64_t ts, ts_start = now_usec();
+	size_t stepc = msys->trace.stepc;
+	int err;
+
+	if (msys->media_inited)
+		return 0;
+
+	ts = now_usec();
+	err = dtls_init(msys);
 	if (err)
 		goto out;
+	trace_step(msys, "dtls", ts);
 
-	info("msystem: successfully initialized\n");
+	ts = now_usec();
+	err = engines_init(msys);
+	if (err)
+		goto out;
+	trace_step(msys, "engines", ts);
 
-	msys->inited = true;
+	if (msys->config.data_channel) {
 
-	if (config) {
-		msys->config = *config;
+		ts = now_usec();
+		err = dce_init();
+		if (err)
+			goto out;
+		trace_step(msys, "dce", ts);
+	}
 
-		if (config->data_channel) {
+	msys->media_inited = true;
 
-			err = dce_init();
-			if (err)
-				goto out;
-		}
+	info("msystem: media initialized in %llu usec (%H)\n",
+	     (unsigned long long)(now_usec() - ts_start),
+	     msystem_trace_debug, msys);
+
+ out:
+	/* undo what was done, so that msystem_prepare() can retry */
+	if (err) {
+		if (msys->config.data_channel)
+			dce_close();
+		engines_close(msys);
+		msys->presign = mem_deref(msys->presign);
+		msys->dtls = mem_deref(msys->dtls);
+		msys->trace.stepc = stepc;
+	}
+
+	return err;
+}
+
+
+static int msystem_init(struct msystem **msysp, const char *msysname,
+			struct msystem_config *config)
+{
+	struct msystem *msys;
+	uint64_t ts;
+	int err;
+
+	if (!msysp)
+		return EINVAL;
+
+	msys = mem_zalloc(sizeof(*msys), msystem_destructor);
+	if (!msys)
+		return ENOMEM;
+
+	if (config)
+		msys->config = *config;
+
+	ts = now_usec();
+	err = mqueue_alloc(&msys->mq, wakeup_handler, NULL);
+	if (err) {
+		warning("flowmgr: failed to create mqueue (%m)\n", err);
+		goto out;
 	}
+	trace_step(msys, "mqueue", ts);
+
+	tmr_init(&msys->vol_tmr);
+
+	info("msystem: initializing for msys: %s%s\n", msysname,
+	     msys->config.lazy_init ? " (lazy)" : "");
 	
+	err = str_dup(&msys->name, msysname);
+	if (err)
+		goto out;
+
+	if (!msys->config.lazy_init) {
+		err = media_init(msys);
+		if (err)
+			goto out;
+	}
+
+	info("msystem: successfully initialized\n");
+
+	msys->inited = true;
+
 	g_msys = msys;
 
  out:
@@ -254,6 +442,63 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 }
 
 
+/*
+ * Finish a lazy init, this is done before the first call is set up.
+ * Does nothing if everything is up already.
+ */
+int msystem_prepare(struct msystem *msys)
+{
+	int err;
+
+	if (!msys)
+		return EINVAL;
+
+	if (msys->media_inited)
+		return 0;
+
+	err = media_init(msys);
+	if (err) {
+		warning("msystem: prepare failed (%m)\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+
+bool msystem_is_prepared(const struct msystem *msys)
+{
+	return msys ? msys->media_inited : false;
+}
+
+
+int msystem_trace_debug(struct re_printf *pf, const struct msystem *msys)
+{
+	const struct msystem_trace *trace;
+	size_t i;
+	int err = 0;
+
+	if (!msys)
+		return 0;
+
+	trace = &msys->trace;
+
+	for (i = 0; i < trace->stepc; i++) {
+		err |= re_hprintf(pf, "%s%s=%lluus", i ? " " : "",
+				  trace->stepv[i].name,
+				  (unsigned long long)trace->stepv[i].usec);
+	}
+
+	return err;
+}
+
+
+const struct msystem_trace *msystem_trace(const struct msystem *msys)
+{
+	return msys ? &msys->trace : NULL;
+}
+
+
 int msystem_get(struct msystem **msysp, const char *msysname,
 		struct msystem_config *config)
 {
@@ -346,6 +591,18 @@ bool msystem_get_privacy(struct msystem *msys)
 }
 
 
+bool msystem_get_batch_io(struct msystem *msys)
+{
+	return msys ? msys->batch_io : false;
+}
+
+
+bool msystem_get_shared_socket(struct msystem *msys)
+{
+	return msys ? msys->shared_socket : false;
+}
+
+
 const char *msystem_get_interface(struct msystem *msys)
 {
 	return msys ? msys->ifname : NULL;
@@ -409,6 +666,87 @@ void msystem_enable_privacy(struct msystem *msys, bool enable)
 }
 
 
+void msystem_enable_batch_io(struct msystem *msys, bool enable)
+{
+	if (!msys)
+		return;
+
+	msys->batch_io = enable;
+}
+
+
+/*
+ * Let the peers of a group call share one UDP socket per local
+ * address, instead of one socket per peer.
+ */
+void msystem_enable_shared_socket(struct msystem *msys, bool enable)
+{
+	if (!msys)
+		return;
+
+	msys->shared_socket = enable;
+}
+
+
+/*
+ * Receive the media of new calls on `n' dedicated threads, instead
+ * of the main thread. The calls are spread over the threads, and a
+ * call stays on its thread until it ends. 0 turns it off.
+ */
+int msystem_enable_media_threads(struct msystem *msys, unsigned n)
+{
+	size_t i;
+	int err = 0;
+
+	if (!msys)
+		return EINVAL;
+
+	if (n > MAX_MEDIA_THREADS)
+		return EINVAL;
+
+	/* running calls keep a reference to their thread */
+	for (i = 0; i < msys->mtc; i++)
+		msys->mtv[i] = mem_deref(msys->mtv[i]);
+	msys->mtc = 0;
+	msys->mt_next = 0;
+
+	for (i = 0; i < n; i++) {
+
+		char name[16];
+
+		re_snprintf(name, sizeof(name), "media%zu", i);
+
+		err = media_thread_alloc(&msys->mtv[i], name);
+		if (err) {
+			warning("msystem: media thread %zu failed (%m)\n",
+				i, err);
+			break;
+		}
+
+		++msys->mtc;
+	}
+
+	info("msystem: %zu media threads\n", msys->mtc);
+
+	return err;
+}
+
+
+/* the media thread for a new call, if enabled */
+struct media_thread *msystem_media_thread(struct msystem *msys)
+{
+	struct media_thread *mt;
+
+	if (!msys || !msys->mtc)
+		return NULL;
+
+	mt = msys->mtv[msys->mt_next % msys->mtc];
+	++msys->mt_next;
+
+	return mt;
+}
+
+
 void msystem_enable_kase(struct msystem *msys, bool enable)
 {
 	if (!msys)
@@ -448,6 +786,10 @@ int msystem_enable_datachannel(struct msystem *msys, bool enable)
 
 	msys->config.data_channel = enable;
 
+	/* with lazy init, it comes up with the rest on the first call */
+	if (!msys->media_inited)
+		return 0;
+
 	if (enable) {
 
 		err = dce_init();
@@ -468,7 +810,7 @@ bool msystem_have_datachannel(const struct msystem *msys)
 }
 
 
-int msystem_update_conf_parts(struct list *partl)
+int msystem_update_conf_parts(const struct list *partl)
 {
 	const struct audec_state **adsv;
 	struct le *le;
@@ -4,5 +4,5 @@
 
 AVS_SRCS += \
 	queue/locked_queue.c \
+	queue/packet_pool.c \
 	queue/packet_queue.c
-
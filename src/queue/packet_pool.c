@@ -0,0 +1,304 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <sched.h>
+#include <re.h>
+#include "avs_packetpool.h"
+
+
+/*
+ * Each slot owns one mbuf, allocated with the pool. The mbuf is handed
+ * out as it is, and when its user drops the last reference, the
+ * destructor takes a new reference (see mem_deref()) so that the mbuf
+ * is not freed but goes back to its slot. Getting and returning a
+ * buffer thus never calls the allocator, never takes a lock and may be
+ * done from any thread.
+ *
+ * A slot is claimed with a compare-and-swap on its state, which is only
+ * set back to free, with release ordering, once the mbuf is back.
+ *
+ * Buffers may outlive the pool. Once the pool is closing, the mbufs in
+ * its slots are freed, and those still in use are freed when their user
+ * drops them.
+ */
+
+enum slot_state {
+	SLOT_FREE = 0,
+	SLOT_USED,
+	SLOT_PARKING,            /* being given back */
+	SLOT_DEAD,
+};
+
+struct pool_slots;
+
+struct pool_mbuf {
+	struct mbuf mb;          /* must be first */
+	struct pool_slots *slots;
+	int state;
+};
+
+struct pool_slots {
+	int refs;                /* the pool, and each pool_mbuf */
+	int closing;
+	size_t nbufs;
+	size_t bufsz;
+	uint64_t allocs;
+	struct pool_mbuf *slotv[];
+};
+
+struct packet_pool {
+	struct pool_slots *slots;
+	unsigned cursor;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+
+static void slots_release(struct pool_slots *slots)
+{
+	if (__atomic_sub_fetch(&slots->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		mem_deref(slots);
+}
+
+
+static void pool_mbuf_destructor(void *arg)
+{
+	struct pool_mbuf *pm = arg;
+	struct pool_slots *slots = pm->slots;
+
+	/* the pool must see either this, or we see it closing */
+	__atomic_store_n(&pm->state, SLOT_PARKING, __ATOMIC_SEQ_CST);
+
+	if (!__atomic_load_n(&slots->closing, __ATOMIC_SEQ_CST)) {
+
+		/* back to the slot, instead of being freed */
+		mem_ref(pm);
+		__atomic_store_n(&pm->state, SLOT_FREE, __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_store_n(&pm->state, SLOT_DEAD, __ATOMIC_RELEASE);
+
+	mem_deref(pm->mb.buf);
+	slots_release(slots);
+}
+
+
+static void packet_pool_destructor(void *arg)
+{
+	struct packet_pool *pool = arg;
+	struct pool_slots *slots = pool->slots;
+	size_t i;
+
+	if (!slots)
+		return;
+
+	__atomic_store_n(&slots->closing, 1, __ATOMIC_SEQ_CST);
+
+	/* free the mbufs that are back, the others are free'd when their
+	 * user drops them */
+	for (i = 0; i < slots->nbufs; ++i) {
+
+		struct pool_mbuf *pm = slots->slotv[i];
+		int state;
+
+		if (!pm)
+			continue;
+
+		while ((state = __atomic_load_n(&pm->state, __ATOMIC_SEQ_CST))
+		       == SLOT_PARKING) {
+			sched_yield();
+		}
+
+		if (state != SLOT_FREE)
+			continue;
+
+		if (__atomic_compare_exchange_n(&pm->state, &state,
+						SLOT_USED, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			mem_deref(pm);
+		}
+	}
+
+	slots_release(slots);
+}
+
+
+int packet_pool_alloc(struct packet_pool **poolp, size_t nbufs,
+		      size_t bufsz)
+{
+	struct packet_pool *pool;
+	struct pool_slots *slots;
+	size_t i;
+	int err = 0;
+
+	if (!poolp || !nbufs || !bufsz)
+		return EINVAL;
+
+	pool = mem_zalloc(sizeof(*pool), packet_pool_destructor);
+	if (!pool)
+		return ENOMEM;
+
+	slots = mem_zalloc(sizeof(*slots) + nbufs * sizeof(*slots->slotv),
+			   NULL);
+	if (!slots) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	slots->refs = 1;
+	slots->nbufs = nbufs;
+	slots->bufsz = bufsz;
+	pool->slots = slots;
+
+	for (i = 0; i < nbufs; ++i) {
+
+		struct pool_mbuf *pm;
+
+		pm = mem_zalloc(sizeof(*pm), pool_mbuf_destructor);
+		if (!pm) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		pm->slots = slots;
+		++slots->refs;
+		slots->slotv[i] = pm;
+
+		pm->mb.buf = mem_alloc(bufsz, NULL);
+		if (!pm->mb.buf) {
+			err = ENOMEM;
+			goto out;
+		}
+		pm->mb.size = bufsz;
+	}
+
+ out:
+	if (err)
+		mem_deref(pool);
+	else
+		*poolp = pool;
+
+	return err;
+}
+
+
+static struct mbuf *slot_take(struct pool_slots *slots,
+			      struct pool_mbuf *pm)
+{
+	int expected = SLOT_FREE;
+
+	if (!__atomic_compare_exchange_n(&pm->state, &expected, SLOT_USED,
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+
+	/* mbuf_reset() may have taken the data while in use */
+	if (!pm->mb.buf) {
+		pm->mb.buf = mem_alloc(slots->bufsz, NULL);
+		if (!pm->mb.buf) {
+			pm->mb.size = 0;
+			__atomic_store_n(&pm->state, SLOT_FREE,
+					 __ATOMIC_RELEASE);
+			return NULL;
+		}
+		pm->mb.size = slots->bufsz;
+		__atomic_fetch_add(&slots->allocs, 1, __ATOMIC_RELAXED);
+	}
+
+	return &pm->mb;
+}
+
+
+/*
+ * Get a buffer from the pool, with pos and end set to headroom.
+ */
+struct mbuf *packet_pool_get(struct packet_pool *pool, size_t headroom)
+{
+	struct pool_slots *slots;
+	struct mbuf *mb = NULL;
+	unsigned start;
+	size_t i;
+
+	if (!pool)
+		return NULL;
+
+	slots = pool->slots;
+	start = __atomic_fetch_add(&pool->cursor, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < slots->nbufs; ++i) {
+
+		mb = slot_take(slots, slots->slotv[(start + i) % slots->nbufs]);
+		if (mb)
+			break;
+	}
+
+	if (mb) {
+		__atomic_fetch_add(&pool->hits, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_fetch_add(&pool->misses, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&slots->allocs, 1, __ATOMIC_RELAXED);
+
+		mb = mbuf_alloc(slots->bufsz);
+		if (!mb)
+			return NULL;
+	}
+
+	mb->pos = headroom;
+	mb->end = headroom;
+
+	return mb;
+}
+
+
+void packet_pool_stats(const struct packet_pool *pool,
+		       struct packet_pool_stats *stats)
+{
+	if (!pool || !stats)
+		return;
+
+	stats->hits   = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&pool->misses, __ATOMIC_RELAXED);
+	stats->allocs = __atomic_load_n(&pool->slots->allocs,
+					__ATOMIC_RELAXED);
+	stats->nbufs  = pool->slots->nbufs;
+	stats->bufsz  = pool->slots->bufsz;
+}
+
+
+int packet_pool_debug(struct re_printf *pf, const struct packet_pool *pool)
+{
+	struct packet_pool_stats stats;
+
+	if (!pool)
+		return 0;
+
+	packet_pool_stats(pool, &stats);
+
+	return re_hprintf(pf, "%zu x %zu bytes, hits=%llu, misses=%llu,"
+			  " allocs=%llu",
+			  stats.nbufs, stats.bufsz,
+			  (unsigned long long)stats.hits,
+			  (unsigned long long)stats.misses,
+			  (unsigned long long)stats.allocs);
+}
@@ -19,76 +19,305 @@
 #include <string.h>
 #include <re.h>
 #include "avs_packetqueue.h"
-#include "avs_lockedqueue.h"
+#include "avs_semaphore.h"
+
+
+/*
+ * Each slot carries a sequence number (Vyukov bounded queue):
+ *
+ *   seq == pos            slot is free for the producer at pos
+ *   seq == pos + 1        slot holds the packet at pos
+ *   seq == pos + capacity slot was consumed, free for the next round
+ *
+ * In SPSC mode the producer owns the tail index, in MPSC mode it is
+ * claimed with a compare-and-swap.
+ */
+
+struct slot {
+	size_t seq;
+	struct packet_queue_item_t item;
+};
+
+struct packet_queue {
+	enum packet_queue_mode mode;
+	struct slot *slotv;
+	size_t capacity;
+	size_t mask;
+
+	size_t head;       /* consumer */
+	size_t tail;       /* producer(s) */
+
+	struct avs_sem *sem;
+	int parked;        /* consumer is waiting on sem */
+
+	uint64_t dropped;
+};
+
+
+static void packet_queue_destructor(void *arg)
+{
+	struct packet_queue *q = arg;
+
+	mem_deref(q->slotv);
+	mem_deref(q->sem);
+}
+
+
+int packet_queue_alloc_ext(packet_queue_t **pqp, enum packet_queue_mode mode,
+			   size_t capacity, bool blocking)
+{
+	struct packet_queue *q;
+	size_t i, n = 1;
+	int err = 0;
+
+	if (!pqp || !capacity)
+		return EINVAL;
+
+	/* round up to a power of two */
+	while (n < capacity)
+		n <<= 1;
+
+	q = mem_zalloc(sizeof(*q), packet_queue_destructor);
+	if (!q)
+		return ENOMEM;
+
+	q->mode = mode;
+	q->capacity = n;
+	q->mask = n - 1;
+
+	q->slotv = mem_alloc(n * sizeof(*q->slotv), NULL);
+	if (!q->slotv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; ++i)
+		q->slotv[i].seq = i;
+
+	if (blocking) {
+		err = avs_sem_alloc(&q->sem, 0);
+		if (err)
+			goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(q);
+	else
+		*pqp = q;
+
+	return err;
+}
 
 
 int packet_queue_alloc(packet_queue_t **pqp, bool blocking)
 {
-	return locked_queue_alloc(pqp, blocking);
+	return packet_queue_alloc_ext(pqp, PACKET_QUEUE_SPSC,
+				      PACKET_QUEUE_CAPACITY, blocking);
 }
 
 
-static void packet_queue_item_destructor(void *arg)
+static struct slot *claim_slot(struct packet_queue *q, size_t *posp)
 {
-	struct packet_queue_item_t *i = (struct packet_queue_item_t *)arg;
+	struct slot *slot;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
 
-	if (i->packet_data) {
-		mem_deref(i->packet_data);
+	for (;;) {
+		slot = &q->slotv[pos & q->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (q->mode == PACKET_QUEUE_SPSC) {
+				__atomic_store_n(&q->tail, pos + 1,
+						 __ATOMIC_RELAXED);
+				*posp = pos;
+				return slot;
+			}
+
+			if (__atomic_compare_exchange_n(&q->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				*posp = pos;
+				return slot;
+			}
+		}
+		else if ((ssize_t)(seq - pos) < 0) {
+			return NULL;  /* full */
+		}
+		else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
 	}
 }
 
 
-int packet_queue_push(packet_queue_t* q, packet_type_t packet_type,
+static void wakeup_consumer(struct packet_queue *q)
+{
+	if (!q->sem)
+		return;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&q->parked, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&q->parked, 0, __ATOMIC_ACQ_REL)) {
+		avs_sem_post(q->sem);
+	}
+}
+
+
+int packet_queue_push(packet_queue_t *q, packet_type_t packet_type,
 		      const uint8_t *packet_data, size_t packet_size)
 {
-	struct packet_queue_item_t *item;
+	struct slot *slot;
+	size_t pos;
 
 	if (!q || !packet_data || !packet_size)
 		return EINVAL;
 
-	item = mem_zalloc(sizeof(*item), packet_queue_item_destructor);
-	if (!item)
-		return ENOMEM;
+	if (packet_size > PACKET_QUEUE_SLOT_SIZE)
+		return EOVERFLOW;
 
-	item->packet_data = (uint8_t *)mem_zalloc(packet_size, NULL);
-	if (!item->packet_data) {
-		mem_deref(item);
-		return ENOMEM;
+	slot = claim_slot(q, &pos);
+	if (!slot) {
+		__atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+		return ENOSPC;
 	}
-	item->packet_type = packet_type;
-	item->packet_size = packet_size;
-	memcpy(item->packet_data, packet_data, packet_size);
 
-	return locked_queue_push(q, &item->list_elem, item);
+	slot->item.packet_type = packet_type;
+	slot->item.packet_size = packet_size;
+	memcpy(slot->item.packet_data, packet_data, packet_size);
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	wakeup_consumer(q);
+
+	return 0;
 }
 
 
-int packet_queue_pop(packet_queue_t* q, packet_type_t *packet_type,
-		      uint8_t **packet_data, size_t *packet_size)
+static bool slot_ready(const struct packet_queue *q, size_t pos)
+{
+	const struct slot *slot = &q->slotv[pos & q->mask];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+
+static void wait_for_data(struct packet_queue *q)
+{
+	const size_t pos = q->head;
+
+	while (!slot_ready(q, pos)) {
+
+		__atomic_store_n(&q->parked, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (slot_ready(q, pos)) {
+			__atomic_store_n(&q->parked, 0, __ATOMIC_RELAXED);
+			break;
+		}
+
+		avs_sem_wait(q->sem);
+	}
+}
+
+
+/*
+ * Get up to max packets without copying them. The items stay valid
+ * until they are given back with packet_queue_release().
+ * Only one thread may consume from the queue.
+ */
+size_t packet_queue_pop_batch(packet_queue_t *q,
+			      const struct packet_queue_item_t **itemv,
+			      size_t max)
 {
-	struct le *list_elem;
-	struct packet_queue_item_t *item;
-	int err;
+	size_t n;
+
+	if (!q || !itemv)
+		return 0;
+
+	if (q->sem && max)
+		wait_for_data(q);
+
+	for (n = 0; n < max; ++n) {
+		const size_t pos = q->head + n;
+
+		if (!slot_ready(q, pos))
+			break;
+
+		itemv[n] = &q->slotv[pos & q->mask].item;
+	}
+
+	return n;
+}
+
+
+void packet_queue_release(packet_queue_t *q, size_t count)
+{
+	size_t i;
 
 	if (!q)
-		return EINVAL;
+		return;
 
-	err = locked_queue_pop(q, &list_elem);
-	if (err != 0) {
-		return err;
+	for (i = 0; i < count; ++i) {
+		const size_t pos = q->head + i;
+
+		__atomic_store_n(&q->slotv[pos & q->mask].seq,
+				 pos + q->capacity, __ATOMIC_RELEASE);
 	}
 
-	if (!list_elem) {
+	__atomic_store_n(&q->head, q->head + count, __ATOMIC_RELAXED);
+}
+
+
+int packet_queue_pop(packet_queue_t *q, packet_type_t *packet_type,
+		      uint8_t **packet_data, size_t *packet_size)
+{
+	const struct packet_queue_item_t *item;
+	uint8_t *data;
+
+	if (!q || !packet_type || !packet_data || !packet_size)
+		return EINVAL;
+
+	if (!packet_queue_pop_batch(q, &item, 1))
 		return ENODATA;
+
+	data = mem_alloc(item->packet_size, NULL);
+	if (!data) {
+		packet_queue_release(q, 1);
+		return ENOMEM;
 	}
 
-	item = (struct packet_queue_item_t*)list_elem->data;
-	*packet_size = item->packet_size;
-	*packet_data = mem_ref(item->packet_data);
+	memcpy(data, item->packet_data, item->packet_size);
+
 	*packet_type = item->packet_type;
+	*packet_size = item->packet_size;
+	*packet_data = data;
 
-	mem_deref(item);
+	packet_queue_release(q, 1);
 
 	return 0;
 }
 
+
+size_t packet_queue_count(const packet_queue_t *q)
+{
+	size_t head, tail;
+
+	if (!q)
+		return 0;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	return tail - head;
+}
+
+
+uint64_t packet_queue_dropped(const packet_queue_t *q)
+{
+	return q ? __atomic_load_n(&q->dropped, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,410 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_store.h"
+
+
+/*
+ * Asynchronous file sink
+ *
+ * Buffers are written with pwrite(2) at their own offset by a
+ * background thread, so the re thread only queues them and never
+ * waits for the disk. Progress is passed back to the re thread
+ * through an mqueue, at most one message at a time, so the handler
+ * sees the total of all writes since the last call.
+ */
+
+
+enum {
+	SINK_PROGRESS = 1,
+};
+
+struct sink_buf {
+	struct le le;
+	uint64_t off;
+	size_t len;
+	uint8_t data[];
+};
+
+struct file_sink {
+	pthread_t tid;
+	bool started;
+	bool run;
+	bool finish;                /* close the file when all is written */
+	bool have_mutex;
+	bool have_cond;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	struct list bufl;           /* struct sink_buf, under mutex */
+	size_t queued;              /* bytes in bufl */
+	int fd;
+
+	/* reported to the re thread, under mutex */
+	uint64_t written;
+	int err;
+	bool done;
+	bool notify;                /* a progress message is pending */
+
+	struct mqueue *mq;
+	file_sink_h *h;
+	void *arg;
+
+	uint64_t n_bufs;
+	uint64_t n_notify;
+};
+
+
+/* with the mutex held */
+static void notify(struct file_sink *fs)
+{
+	int err;
+
+	if (fs->notify)
+		return;
+
+	err = mqueue_push(fs->mq, SINK_PROGRESS, NULL);
+	if (err) {
+		warning("file_sink: mqueue_push failed (%m)\n", err);
+		return;
+	}
+
+	fs->notify = true;
+}
+
+
+static int write_buf(int fd, const struct sink_buf *sb)
+{
+	size_t pos = 0;
+
+	while (pos < sb->len) {
+		ssize_t n;
+
+		n = pwrite(fd, sb->data + pos, sb->len - pos,
+			   (off_t)(sb->off + pos));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (n == 0)
+			return EIO;
+
+		pos += n;
+	}
+
+	return 0;
+}
+
+
+static void *sink_thread(void *arg)
+{
+	struct file_sink *fs = arg;
+
+	pthread_mutex_lock(&fs->mutex);
+
+	while (fs->run) {
+		struct sink_buf *sb;
+		struct le *le;
+		int err;
+
+		le = list_head(&fs->bufl);
+		if (!le) {
+			if (fs->finish && !fs->done) {
+
+				if (fs->fd >= 0 && close(fs->fd) && !fs->err)
+					fs->err = errno;
+				fs->fd = -1;
+				fs->done = true;
+				notify(fs);
+			}
+			else {
+				pthread_cond_wait(&fs->cond, &fs->mutex);
+			}
+			continue;
+		}
+
+		sb = le->data;
+		list_unlink(le);
+		fs->queued -= sb->len;
+
+		/* after an error the rest is dropped */
+		if (fs->err) {
+			mem_deref(sb);
+			continue;
+		}
+
+		pthread_mutex_unlock(&fs->mutex);
+
+		err = write_buf(fs->fd, sb);
+
+		pthread_mutex_lock(&fs->mutex);
+
+		if (err)
+			fs->err = err;
+		else
+			fs->written += sb->len;
+
+		notify(fs);
+
+		mem_deref(sb);
+	}
+
+	pthread_mutex_unlock(&fs->mutex);
+
+	return NULL;
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct file_sink *fs = arg;
+	uint64_t written;
+	bool done;
+	int err;
+
+	(void)data;
+
+	if (id != SINK_PROGRESS)
+		return;
+
+	pthread_mutex_lock(&fs->mutex);
+	written = fs->written;
+	done = fs->done;
+	err = fs->err;
+	fs->notify = false;
+	pthread_mutex_unlock(&fs->mutex);
+
+	++fs->n_notify;
+
+	/* may dereference the sink */
+	if (fs->h)
+		fs->h(written, done, err, fs->arg);
+}
+
+
+static void destructor(void *arg)
+{
+	struct file_sink *fs = arg;
+
+	if (fs->started) {
+		pthread_mutex_lock(&fs->mutex);
+		fs->run = false;
+		pthread_cond_signal(&fs->cond);
+		pthread_mutex_unlock(&fs->mutex);
+
+		pthread_join(fs->tid, NULL);
+	}
+
+	list_flush(&fs->bufl);
+
+	if (fs->fd >= 0)
+		(void)close(fs->fd);
+
+	mem_deref(fs->mq);
+
+	if (fs->have_cond)
+		pthread_cond_destroy(&fs->cond);
+	if (fs->have_mutex)
+		pthread_mutex_destroy(&fs->mutex);
+}
+
+
+/**
+ * Create or truncate the file at `path' and start its writer thread.
+ * Must be called on a re thread, where `h' is called.
+ */
+int file_sink_alloc(struct file_sink **fsp, const char *path,
+		    file_sink_h *h, void *arg)
+{
+	struct file_sink *fs;
+	int err;
+
+	if (!fsp || !path)
+		return EINVAL;
+
+	fs = mem_zalloc(sizeof(*fs), destructor);
+	if (!fs)
+		return ENOMEM;
+
+	fs->fd = -1;
+	fs->h = h;
+	fs->arg = arg;
+
+	err = pthread_mutex_init(&fs->mutex, NULL);
+	if (err)
+		goto out;
+
+	fs->have_mutex = true;
+
+	err = pthread_cond_init(&fs->cond, NULL);
+	if (err)
+		goto out;
+
+	fs->have_cond = true;
+
+	err = mqueue_alloc(&fs->mq, mqueue_handler, fs);
+	if (err)
+		goto out;
+
+	fs->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fs->fd < 0) {
+		err = errno;
+		warning("file_sink: cannot open %s (%m)\n", path, err);
+		goto out;
+	}
+
+	fs->run = true;
+
+	err = pthread_create(&fs->tid, NULL, sink_thread, fs);
+	if (err) {
+		warning("file_sink: cannot create thread (%m)\n", err);
+		goto out;
+	}
+
+	fs->started = true;
+
+ out:
+	if (err)
+		mem_deref(fs);
+	else
+		*fsp = fs;
+
+	return err;
+}
+
+
+/**
+ * Queue a copy of `len' bytes to be written at offset `off'. Returns
+ * ENOBUFS if more than FILE_SINK_MAX_QUEUED bytes are waiting, and
+ * the error of an earlier write if one failed.
+ */
+int file_sink_write(struct file_sink *fs, uint64_t off,
+		    const uint8_t *buf, size_t len)
+{
+	struct sink_buf *sb;
+	int err = 0;
+
+	if (!fs || (!buf && len))
+		return EINVAL;
+
+	if (!len)
+		return 0;
+
+	sb = mem_alloc(sizeof(*sb) + len, NULL);
+	if (!sb)
+		return ENOMEM;
+
+	memset(&sb->le, 0, sizeof(sb->le));
+	sb->off = off;
+	sb->len = len;
+	memcpy(sb->data, buf, len);
+
+	pthread_mutex_lock(&fs->mutex);
+
+	if (fs->err)
+		err = fs->err;
+	else if (fs->finish)
+		err = EALREADY;
+	else if (fs->queued + len > FILE_SINK_MAX_QUEUED)
+		err = ENOBUFS;
+
+	if (!err) {
+		list_append(&fs->bufl, &sb->le, sb);
+		fs->queued += len;
+		++fs->n_bufs;
+		pthread_cond_signal(&fs->cond);
+	}
+
+	pthread_mutex_unlock(&fs->mutex);
+
+	if (err)
+		mem_deref(sb);
+
+	return err;
+}
+
+
+/**
+ * Bytes queued and not yet written. A writer that keeps well below
+ * FILE_SINK_MAX_QUEUED can stop taking data in time.
+ */
+size_t file_sink_queued(const struct file_sink *fs)
+{
+	struct file_sink *fs_rw = (struct file_sink *)fs;
+	size_t queued;
+
+	if (!fs)
+		return 0;
+
+	pthread_mutex_lock(&fs_rw->mutex);
+	queued = fs->queued;
+	pthread_mutex_unlock(&fs_rw->mutex);
+
+	return queued;
+}
+
+
+/**
+ * Close the file once everything queued is written. The handler is
+ * then called with done set.
+ */
+int file_sink_finish(struct file_sink *fs)
+{
+	if (!fs)
+		return EINVAL;
+
+	pthread_mutex_lock(&fs->mutex);
+	fs->finish = true;
+	pthread_cond_signal(&fs->cond);
+	pthread_mutex_unlock(&fs->mutex);
+
+	return 0;
+}
+
+
+int file_sink_debug(struct re_printf *pf, const struct file_sink *fs)
+{
+	struct file_sink *fs_rw = (struct file_sink *)fs;
+	uint64_t written;
+	size_t queued;
+	int err;
+
+	if (!fs)
+		return 0;
+
+	pthread_mutex_lock(&fs_rw->mutex);
+	written = fs->written;
+	queued = fs->queued;
+	err = fs->err;
+	pthread_mutex_unlock(&fs_rw->mutex);
+
+	return re_hprintf(pf, "file_sink: written=%llu queued=%zu bufs=%llu"
+			  " notify=%llu err=%d",
+			  (unsigned long long)written, queued,
+			  (unsigned long long)fs->n_bufs,
+			  (unsigned long long)fs->n_notify, err);
+}
@@ -4,5 +4,6 @@
 
 AVS_SRCS += \
 	store/store.c \
-	store/remove.c
+	store/remove.c \
+	store/file_sink.c
 
@@ -166,13 +166,50 @@ static void sobject_destructor(void *arg)
 }
 
 
+/* the open(2) flags for an fopen(3) mode */
+static int open_flags(const char *mode)
+{
+	int flags;
+
+	switch (mode[0]) {
+
+	case 'r':
+		flags = 0;
+		break;
+
+	case 'w':
+		flags = O_CREAT | O_TRUNC;
+		break;
+
+	case 'a':
+		flags = O_CREAT | O_APPEND;
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (strchr(mode, '+'))
+		flags |= O_RDWR;
+	else
+		flags |= mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+
+	return flags;
+}
+
+
 static int sobject_alloc(struct sobject **sop, const char *mode,
 			      const char *format, ...)
 {
 	struct sobject *so;
 	va_list ap;
+	int flags, fd;
 	int err;
 
+	flags = open_flags(mode);
+	if (flags < 0)
+		return EINVAL;
+
 	so = mem_zalloc(sizeof(*so), sobject_destructor);
 	if (!so)
 		return ENOMEM;
@@ -183,9 +220,24 @@ static int sobject_alloc(struct sobject **sop, const char *mode,
 	if (err)
 		goto out;
 
-	so->file = fopen(so->path, mode);
+	/* only readable by the user, like the store directories */
+	fd = open(so->path, flags, 0600);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	/* and files made before that */
+	if ((flags & O_CREAT) && fchmod(fd, 0600) < 0) {
+		err = errno;
+		close(fd);
+		goto out;
+	}
+
+	so->file = fdopen(fd, mode);
 	if (!so->file) {
 		err = errno;
+		close(fd);
 		goto out;
 	}
 
@@ -445,6 +497,23 @@ int sobject_read(struct sobject *so, uint8_t *buf, size_t size)
 }
 
 
+/* a length read from the file cannot be more than what is left of it */
+static int check_len(struct sobject *so, size_t len)
+{
+	struct stat st;
+	long pos;
+
+	pos = ftell(so->file);
+	if (pos < 0 || fstat(fileno(so->file), &st) < 0)
+		return errno;
+
+	if (st.st_size < pos || len > (uint64_t)(st.st_size - pos))
+		return EPROTO;
+
+	return 0;
+}
+
+
 int sobject_read_u8(uint8_t* v, struct sobject *so)
 {
 	return sobject_read(so, (uint8_t *)v, sizeof(*v));
@@ -490,6 +559,10 @@ int sobject_read_lenstr(char **strp, struct sobject *so)
 		return 0;
 	}
 
+	err = check_len(so, len);
+	if (err)
+		return err;
+
 	str = mem_alloc(len + 1, NULL);
 	if (!str)
 		return ENOMEM;
@@ -522,8 +595,13 @@ int sobject_read_pl(struct pl *pl, struct sobject *so)
 	if (len == (size_t) -1) {
 		pl->p = NULL;
 		pl->l = 0;
+		return 0;
 	}
 
+	err = check_len(so, len);
+	if (err)
+		return err;
+
 	str = mem_alloc(len + 1, NULL);
 	if (!str)
 		return ENOMEM;
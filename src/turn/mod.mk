@@ -2,4 +2,5 @@
 
 AVS_SRCS += \
 	turn/turnconn.c \
+	turn/turnpool.c \
 	turn/uri.c
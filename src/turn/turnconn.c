@@ -600,6 +600,48 @@ bool turnconn_are_all_failed(const struct list *turnconnl)
 }
 
 
+static void tmr_handover_handler(void *arg)
+{
+	struct turn_conn *conn = arg;
+
+	if (conn->estabh) {
+		conn->estabh(conn, &conn->relay_addr, &conn->mapped_addr,
+			     NULL, conn->arg);
+	}
+}
+
+
+/*
+ * Give an allocated connection to a new owner. The estab handler is
+ * called for the new owner from a timer, as for a new allocation.
+ */
+int turnconn_handover(struct turn_conn *conn, struct list *connl,
+		      turnconn_estab_h *estabh, turnconn_data_h *datah,
+		      turnconn_error_h *errorh, void *arg)
+{
+	if (!conn || !connl)
+		return EINVAL;
+
+	if (!conn->turn_allocated || conn->failed)
+		return EINVAL;
+
+	list_unlink(&conn->le);
+	list_append(connl, &conn->le, conn);
+
+	conn->estabh = estabh;
+	conn->datah = datah;
+	conn->errorh = errorh;
+	conn->arg = arg;
+
+	/* no round trip for the new owner */
+	conn->ts_turn_req = conn->ts_turn_resp;
+
+	tmr_start(&conn->tmr_delay, 0, tmr_handover_handler, conn);
+
+	return 0;
+}
+
+
 const char *turnconn_proto_name(const struct turn_conn *conn)
 {
 	if (!conn)
@@ -0,0 +1,452 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_network.h"
+#include "avs_turn.h"
+
+
+/*
+ * TURN allocation pool
+ *
+ * Keeps an allocated TURN/UDP connection ready for each TURN server, so
+ * that a new mediaflow can take it over instead of doing the DNS lookup
+ * and the TURN allocation itself. The pool allocates a new spare when
+ * one is taken. Permissions and channels are added by the new owner,
+ * per peer, as for its own connections.
+ */
+
+
+enum {
+	POOL_REFILL_DELAY =   100,  /* ms */
+	POOL_RETRY_MIN    =  5000,  /* ms */
+	POOL_RETRY_MAX    = 60000,  /* ms */
+};
+
+struct turn_pool {
+	struct list srvl;
+	int af;
+	int layer_stun;
+	int layer_turn;
+	bool running;
+
+	struct {
+		uint32_t hits;
+		uint32_t misses;
+	} stats;
+};
+
+struct pool_srv {
+	struct le le;
+	struct turn_pool *pool;
+
+	char *url;
+	char *username;
+	char *password;
+	struct stun_uri uri;
+	struct sa srv;
+
+	struct list connl;      /* one spare allocation */
+	struct tmr tmr;
+	bool resolving;
+	unsigned failures;
+};
+
+
+static void refill(struct pool_srv *ps, uint32_t delay);
+
+
+static void srv_destructor(void *arg)
+{
+	struct pool_srv *ps = arg;
+
+	list_unlink(&ps->le);
+	tmr_cancel(&ps->tmr);
+	list_flush(&ps->connl);
+	mem_deref(ps->url);
+	mem_deref(ps->username);
+	mem_deref(ps->password);
+}
+
+
+static void pool_destructor(void *arg)
+{
+	struct turn_pool *pool = arg;
+	struct le *le;
+
+	/* DNS lookups in progress hold a reference to their server */
+	for (le = pool->srvl.head; le; le = le->next) {
+		struct pool_srv *ps = le->data;
+
+		ps->pool = NULL;
+		tmr_cancel(&ps->tmr);
+		list_flush(&ps->connl);
+	}
+
+	list_flush(&pool->srvl);
+}
+
+
+int turnpool_alloc(struct turn_pool **poolp, int layer_stun, int layer_turn)
+{
+	struct turn_pool *pool;
+
+	if (!poolp)
+		return EINVAL;
+
+	pool = mem_zalloc(sizeof(*pool), pool_destructor);
+	if (!pool)
+		return ENOMEM;
+
+	list_init(&pool->srvl);
+	pool->af = AF_INET;
+	pool->layer_stun = layer_stun;
+	pool->layer_turn = layer_turn;
+
+	*poolp = pool;
+
+	return 0;
+}
+
+
+static void spare_estab_handler(struct turn_conn *conn,
+				const struct sa *relay_addr,
+				const struct sa *mapped_addr,
+				const struct stun_msg *msg, void *arg)
+{
+	struct pool_srv *ps = arg;
+	(void)conn;
+	(void)msg;
+
+	info("turnpool: %s: spare allocation ready (relay=%J mapped=%J)\n",
+	     ps->url, relay_addr, mapped_addr);
+
+	ps->failures = 0;
+}
+
+
+static void spare_error_handler(int err, void *arg)
+{
+	struct pool_srv *ps = arg;
+	uint32_t delay;
+
+	++ps->failures;
+
+	delay = POOL_RETRY_MIN << min(ps->failures - 1, 4u);
+	delay = min(delay, (uint32_t)POOL_RETRY_MAX);
+
+	warning("turnpool: %s: spare allocation failed, retry in %ums (%m)\n",
+		ps->url, delay, err);
+
+	/* the connection is released from the timer */
+	refill(ps, delay);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct pool_srv *ps = arg;
+	struct turn_conn *conn;
+	const struct sa *srv = &ps->srv;
+	struct sa srv6;
+	int err;
+
+	conn = list_ledata(list_head(&ps->connl));
+	if (conn && !conn->failed)
+		return;
+
+	mem_deref(conn);
+
+	if (!ps->pool || !ps->pool->running)
+		return;
+
+	/* as mediaflow_gather_turn() does, for IPv4 servers from IPv6 */
+	if (ps->pool->af != sa_af(srv)) {
+
+		err = sa_translate_nat64(&srv6, srv);
+		if (err) {
+			warning("turnpool: %s: sa_translate_nat64(%j)"
+				" failed (%m)\n", ps->url, srv, err);
+			return;
+		}
+
+		info("turnpool: %s: translate NAT64 (%J ----> %J)\n",
+		     ps->url, srv, &srv6);
+
+		srv = &srv6;
+	}
+
+	err = turnconn_alloc(NULL, &ps->connl, srv, IPPROTO_UDP, false,
+			     ps->username, ps->password, ps->pool->af, NULL,
+			     ps->pool->layer_stun, ps->pool->layer_turn,
+			     spare_estab_handler, NULL,
+			     spare_error_handler, ps);
+	if (err) {
+		warning("turnpool: %s: turnconn_alloc failed (%m)\n",
+			ps->url, err);
+	}
+}
+
+
+static void refill(struct pool_srv *ps, uint32_t delay)
+{
+	if (!sa_isset(&ps->srv, SA_ALL))
+		return;
+
+	tmr_start(&ps->tmr, delay, tmr_handler, ps);
+}
+
+
+static void dns_handler(int err, const struct sa *srv, void *arg)
+{
+	struct pool_srv *ps = arg;
+
+	ps->resolving = false;
+
+	if (err) {
+		warning("turnpool: %s: dns lookup failed (%m)\n",
+			ps->url, err);
+		goto out;
+	}
+
+	sa_cpy(&ps->srv, srv);
+	sa_set_port(&ps->srv, ps->uri.port);
+
+	if (ps->pool && ps->pool->running)
+		refill(ps, 0);
+
+ out:
+	mem_deref(ps);
+}
+
+
+static void srv_start(struct pool_srv *ps)
+{
+	int err;
+
+	if (sa_isset(&ps->srv, SA_ALL)) {
+		refill(ps, 0);
+		return;
+	}
+
+	if (ps->resolving)
+		return;
+
+	ps->resolving = true;
+	mem_ref(ps);
+
+	err = dns_lookup(ps->uri.host, dns_handler, ps);
+	if (err) {
+		warning("turnpool: %s: dns_lookup failed (%m)\n",
+			ps->url, err);
+		ps->resolving = false;
+		mem_deref(ps);
+	}
+}
+
+
+/*
+ * Add a TURN server to the pool. Only TURN over UDP is pooled,
+ * other servers are ignored.
+ */
+int turnpool_add(struct turn_pool *pool, const char *url,
+		 const char *username, const char *password)
+{
+	struct pool_srv *ps;
+	struct stun_uri uri;
+	int err;
+
+	if (!pool || !url)
+		return EINVAL;
+
+	/* fails with a host name, that is resolved when started */
+	memset(&uri, 0, sizeof(uri));
+	err = stun_uri_decode(&uri, url);
+	if (err && !str_isset(uri.host))
+		return err;
+
+	if (uri.scheme != STUN_SCHEME_TURN ||
+	    uri.proto != IPPROTO_UDP || uri.secure)
+		return 0;
+
+	if (turnpool_find(pool, url))
+		return 0;
+
+	ps = mem_zalloc(sizeof(*ps), srv_destructor);
+	if (!ps)
+		return ENOMEM;
+
+	ps->pool = pool;
+	ps->uri = uri;
+	if (!err)
+		sa_cpy(&ps->srv, &uri.addr);
+
+	err  = str_dup(&ps->url, url);
+	err |= str_dup(&ps->username, username);
+	err |= str_dup(&ps->password, password);
+	if (err)
+		goto out;
+
+	list_init(&ps->connl);
+	tmr_init(&ps->tmr);
+
+	list_append(&pool->srvl, &ps->le, ps);
+
+	if (pool->running)
+		srv_start(ps);
+
+ out:
+	if (err)
+		mem_deref(ps);
+
+	return err;
+}
+
+
+bool turnpool_find(const struct turn_pool *pool, const char *url)
+{
+	struct le *le;
+
+	if (!pool || !url)
+		return false;
+
+	for (le = pool->srvl.head; le; le = le->next) {
+		struct pool_srv *ps = le->data;
+
+		if (0 == str_cmp(ps->url, url))
+			return true;
+	}
+
+	return false;
+}
+
+
+/* Start keeping spare allocations, for local addresses of family af */
+void turnpool_start(struct turn_pool *pool, int af)
+{
+	struct le *le;
+
+	if (!pool || pool->running)
+		return;
+
+	pool->running = true;
+	pool->af = af;
+
+	for (le = pool->srvl.head; le; le = le->next)
+		srv_start(le->data);
+}
+
+
+/* Release the spare allocations */
+void turnpool_stop(struct turn_pool *pool)
+{
+	struct le *le;
+
+	if (!pool || !pool->running)
+		return;
+
+	pool->running = false;
+
+	for (le = pool->srvl.head; le; le = le->next) {
+		struct pool_srv *ps = le->data;
+
+		tmr_cancel(&ps->tmr);
+		list_flush(&ps->connl);
+	}
+}
+
+
+/*
+ * Take over the spare allocation for a TURN server. The connection is
+ * moved to connl, and estabh is called for the new owner with the
+ * relay and mapped addresses, as for a new allocation.
+ *
+ * Returns ENOENT if there is no allocation ready.
+ */
+int turnpool_take(struct turn_pool *pool, struct turn_conn **connp,
+		  struct list *connl, const char *url, int af,
+		  turnconn_estab_h *estabh, turnconn_data_h *datah,
+		  turnconn_error_h *errorh, void *arg)
+{
+	struct turn_conn *conn = NULL;
+	struct pool_srv *ps = NULL;
+	struct le *le;
+	int err;
+
+	if (!pool || !url || !connl)
+		return EINVAL;
+
+	for (le = pool->srvl.head; le; le = le->next) {
+		ps = le->data;
+
+		if (0 == str_cmp(ps->url, url))
+			break;
+	}
+
+	if (le)
+		conn = list_ledata(list_head(&ps->connl));
+
+	if (!conn || !conn->turn_allocated || conn->failed || conn->af != af) {
+		++pool->stats.misses;
+		return ENOENT;
+	}
+
+	err = turnconn_handover(conn, connl, estabh, datah, errorh, arg);
+	if (err)
+		return err;
+
+	++pool->stats.hits;
+
+	info("turnpool: %s: handing over allocation %J\n",
+	     ps->url, &conn->relay_addr);
+
+	refill(ps, POOL_REFILL_DELAY);
+
+	if (connp)
+		*connp = conn;
+
+	return 0;
+}
+
+
+int turnpool_debug(struct re_printf *pf, const struct turn_pool *pool)
+{
+	struct le *le;
+	int err = 0;
+
+	if (!pool)
+		return 0;
+
+	err |= re_hprintf(pf, "turnpool: running=%d hits=%u misses=%u\n",
+			  pool->running, pool->stats.hits,
+			  pool->stats.misses);
+
+	for (le = pool->srvl.head; le; le = le->next) {
+		const struct pool_srv *ps = le->data;
+
+		err |= re_hprintf(pf, "..%s (%J) failures=%u\n",
+				  ps->url, &ps->srv, ps->failures);
+		err |= re_hprintf(pf, "%H",
+				  turnconn_debug,
+				  list_ledata(list_head(&ps->connl)));
+	}
+
+	return err;
+}
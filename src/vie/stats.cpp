@@ -16,6 +16,7 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
+#include <string.h>
 #include <re.h>
 
 #include <avs.h>
@@ -38,34 +39,55 @@ void stats_rtp_add_packet(struct transp_stats *stats,
 }
 
 
-int stats_rtcp_add_packet(struct transp_stats *stats,
-			  const uint8_t *data, size_t len)
+/* Parse the bandwidth allocation from REMB info */
+static void remb_handler(struct transp_stats *stats,
+			 const uint8_t *fci, size_t len)
 {
-	struct mbuf *mb;
-	int err = 0;
+	uint32_t b, bitrate;
+	uint8_t num_ssrcs, s;
+
+	if (len < 8 || memcmp(fci, "REMB", 4))
+		return;
 
-	mb = mbuf_alloc(len);
-	if (!mb)
-		return ENOMEM;
+	num_ssrcs = fci[4];
+	b = fci[5] << 16 | fci[6] << 8 | fci[7];
 
-	mbuf_write_mem(mb, data, len);
-	mb->pos = 0;
+	bitrate = (b & 0x3FFFF) << ((b >> 18) & 3);
 
-	while (mbuf_get_left(mb) > 8) {
+	fci += 8;
+	len -= 8;
 
-		struct rtcp_msg *msg = 0;
+	for (s = 0; s < num_ssrcs && len >= 4; s++) {
+		uint32_t ssrc = (uint32_t)fci[0] << 24 | fci[1] << 16 |
+			fci[2] << 8 | fci[3];
 
-		err = rtcp_decode(&msg, mb);
-		if (err) {
-			warning("could not decode RTCP packet "
-				"(%zu bytes) (%m)\n",
-				mbuf_get_left(mb), err);
-			break;
+		if (ssrc == stats->rtcp.ssrc) {
+			stats->rtcp.bitrate_limit = bitrate;
 		}
 
+		fci += 4;
+		len -= 4;
+	}
+}
+
+
+int stats_rtcp_add_packet(struct transp_stats *stats,
+			  const uint8_t *data, size_t len)
+{
+	struct rtcp_iter it;
+	struct rtcp_iter_pkt pkt;
+
+	if (!stats)
+		return EINVAL;
+
+	/* only the header is looked at, no decoding */
+	rtcp_iter_init(&it, data, len);
+
+	while (rtcp_iter_next(&it, &pkt)) {
+
 		++stats->rtcp.pkt;
 
-		switch (msg->hdr.pt) {
+		switch (pkt.pt) {
 
 		case RTCP_SR:
 			++stats->rtcp.sr;
@@ -81,9 +103,22 @@ int stats_rtcp_add_packet(struct transp_stats *stats,
 
 		case RTCP_RTPFB:
 #if defined(VIE_DEBUG_RTX)
-			info("vie:RTCP_RTPFB ssrc_packet = %u ssrc_media = %u n = %u \n", msg->r.fb.ssrc_packet, msg->r.fb.ssrc_media, msg->r.fb.n);
-			for(int i = 0; i < msg->r.fb.n; i++){
-				info("    pid = %u bitmask = %u \n", msg->r.fb.fci.gnackv[i].pid,  msg->r.fb.fci.gnackv[i].blp);
+			{
+				struct rtcp_msg *msg = NULL;
+				struct mbuf mb;
+
+				mb.buf  = (uint8_t *)pkt.body - 4;
+				mb.size = pkt.body_len + 4;
+				mb.pos  = 0;
+				mb.end  = mb.size;
+
+				if (0 == rtcp_decode(&msg, &mb)) {
+					info("vie:RTCP_RTPFB ssrc_packet = %u ssrc_media = %u n = %u \n", msg->r.fb.ssrc_packet, msg->r.fb.ssrc_media, msg->r.fb.n);
+					for(int i = 0; i < msg->r.fb.n; i++){
+						info("    pid = %u bitmask = %u \n", msg->r.fb.fci.gnackv[i].pid,  msg->r.fb.fci.gnackv[i].blp);
+					}
+				}
+				mem_deref(msg);
 			}
 #endif
 			++stats->rtcp.rtpfb;
@@ -92,42 +127,23 @@ int stats_rtcp_add_packet(struct transp_stats *stats,
 		case RTCP_PSFB:
 			++stats->rtcp.psfb;
 
-			if (msg->hdr.count == RTCP_PSFB_PLI) {
+			if (pkt.count == RTCP_PSFB_PLI) {
 				warning("vie: RTCP PLI\n");
 			}
-			else if (msg->hdr.count == RTCP_PSFB_SLI) {
+			else if (pkt.count == RTCP_PSFB_SLI) {
 				warning("vie: RTCP SLI\n");
 			}
-			else if (msg->hdr.count == RTCP_PSFB_AFB) {
+			else if (pkt.count == RTCP_PSFB_AFB) {
 				//info("** RTCP_PSFB_AFB (REMB) **\n");
 
-				// Parse bandwidth allocation from REMB info
-				struct mbuf* mb = msg->r.fb.fci.afb; 
-				if (mbuf_read_u8(mb) == 'R' && mbuf_read_u8(mb) == 'E' &&
-					mbuf_read_u8(mb) == 'M' && mbuf_read_u8(mb) == 'B') {
-				
-					uint8_t num_ssrcs = mbuf_read_u8(mb);
-					uint32_t b = mbuf_read_u8(mb) << 16 |
-						mbuf_read_u8(mb) <<  8 |
-						mbuf_read_u8(mb);
-
-					uint32_t bitrate = (b & 0x3FFFF) << ((b >> 18) & 3);
-
-					uint8_t s;
-					for (s = 0; s < num_ssrcs; s++) {
-						uint32_t ssrc = mbuf_read_u8(mb) << 24 |
-							mbuf_read_u8(mb) <<  16 |
-							mbuf_read_u8(mb) <<  8 |
-							mbuf_read_u8(mb);
-
-						if(ssrc == stats->rtcp.ssrc) {
-							stats->rtcp.bitrate_limit = bitrate;
-						}
-					}
+				/* FCI follows the two SSRCs */
+				if (pkt.body_len >= 8) {
+					remb_handler(stats, pkt.body + 8,
+						     pkt.body_len - 8);
 				}
 			}
 			else {
-				warning("** ??? (%d) ***\n", msg->hdr.count);
+				warning("** ??? (%d) ***\n", pkt.count);
 			}
 
 			break;
@@ -139,16 +155,18 @@ int stats_rtcp_add_packet(struct transp_stats *stats,
 		default:
 			++stats->rtcp.unknown;
 			warning("*** RTCP: unknown PT (%s) ***\n",
-				rtcp_type_name((enum rtcp_type)msg->hdr.pt));
+				rtcp_type_name((enum rtcp_type)pkt.pt));
 			break;
 		}
-
-		mem_deref(msg);
 	}
 
-	mem_deref(mb);
+	if (it.err) {
+		warning("could not decode RTCP packet "
+			"(%zu bytes) (%m)\n",
+			it.left, it.err);
+	}
 
-	return err;
+	return it.err;
 }
 
 
@@ -15,16 +15,32 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
-
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
 #include <re.h>
 
 #include <avs.h>
 #include "avs_wcall.h"
 #include "wcall.h"
 
-struct wcall_marshal {
-	struct mqueue *mq;
-	struct list mdl;
+
+/*
+ * API calls are marshalled to the re thread through a ring of
+ * preallocated command slots. IDs are kept inline in the command, so a
+ * call does not allocate. The re thread is woken up once, and drains
+ * all commands that are queued by then.
+ *
+ * When the app thread gets too far ahead and the ring is full, commands
+ * go to an overflow list on the heap, in order, until the re thread has
+ * caught up. This is counted in the stats.
+ */
+
+
+enum {
+	MARSHAL_RING_SIZE = 256,   /* power of two */
+	MSTR_SIZE         = 64,
+	WAKEUP_TRIES      = 3,
 };
 
 
@@ -43,6 +59,16 @@ enum mq_event {
 	WCALL_MEV_NETWORK_CHANGED,
 	WCALL_MEV_INCOMING,
 	WCALL_MEV_DESTROY,
+
+	WCALL_MEV_DRAIN,
+};
+
+
+/* a string stored inline, or on the heap if it is too long */
+struct mstr {
+	char buf[MSTR_SIZE];
+	char *heap;
+	bool null;           /* NULL was given, and is passed on */
 };
 
 
@@ -50,8 +76,7 @@ struct mq_data {
 	enum mq_event event;
 	void *wuser;
 	struct wcall *wcall;
-	struct le le; /* member of marshaling list */
-	
+
 	union {
 		struct {
 			int call_type;
@@ -66,12 +91,6 @@ struct mq_data {
 			void *extcodec_arg;
 		} answer;
 
-		struct {
-		} reject;
-		
-		struct {
-		} end;
-
 		struct {
 			int state;
 		} video_set_state;
@@ -83,17 +102,16 @@ struct mq_data {
 		struct {
 			enum mediamgr_auplay new_route;
 		} route_changed;
-                    
+
 		struct {
 			struct econn_message *msg;
 			uint32_t curr_time; /* timestamp in seconds */
 			uint32_t msg_time;  /* timestamp in seconds */
-			char *convid;
-			char *userid;
-			char *clientid;
+			struct mstr convid;
+			struct mstr userid;
+			struct mstr clientid;
 		} recv_msg;
 
-
 		struct {
 			int err;
 			char *json_str;
@@ -101,32 +119,109 @@ struct mq_data {
 
 		struct {
 			int status;
-			char *reason;
+			struct mstr reason;
 			void *arg;
 		} resp;
 
 		struct {
-			char *convid;
+			struct mstr convid;
 			uint32_t msg_time;
-			char *userid;
+			struct mstr userid;
 			int video_call;
 			int should_ring;
 		} incoming;
 	} u;
 };
 
-static void md_destructor(void *arg)
+struct mq_slot {
+	size_t seq;          /* see packet_queue */
+	struct mq_data md;
+};
+
+/* a command that did not fit in the ring */
+struct mq_elem {
+	struct le le;
+	struct mq_data md;
+};
+
+struct wcall_marshal {
+	struct mqueue *mq;
+
+	struct mq_slot slotv[MARSHAL_RING_SIZE];
+	size_t head;         /* re thread */
+	size_t tail;         /* API threads */
+	int signalled;       /* a drain is pending in the mqueue */
+
+	pthread_mutex_t mutex;
+	struct list overflowl;
+	int overflow;
+
+	struct {
+		uint64_t cmds;
+		uint64_t handled;     /* re thread */
+		uint64_t drains;
+		uint64_t overflows;
+		uint64_t wakeup_errors;
+		size_t max_depth;
+	} stats;
+};
+
+
+static int mstr_set(struct mstr *ms, const char *str)
 {
-	struct mq_data *md = arg;
+	const size_t len = str_len(str);
 
-	list_unlink(&md->le);
-	
+	ms->heap = NULL;
+	ms->null = !str;
+
+	if (len < sizeof(ms->buf)) {
+		if (str)
+			memcpy(ms->buf, str, len + 1);
+		else
+			ms->buf[0] = '\0';
+
+		return 0;
+	}
+
+	return str_dup(&ms->heap, str);
+}
+
+
+static const char *mstr_get(const struct mstr *ms)
+{
+	if (ms->null)
+		return NULL;
+
+	return ms->heap ? ms->heap : ms->buf;
+}
+
+
+static void mstr_reset(struct mstr *ms)
+{
+	ms->heap = mem_deref(ms->heap);
+}
+
+
+static void md_init(struct mq_data *md, void *wuser, struct wcall *wcall,
+		    enum mq_event event)
+{
+	memset(md, 0, sizeof(*md));
+
+	md->wuser = wuser;
+	md->wcall = mem_ref(wcall);
+	md->event = event;
+}
+
+
+static void md_reset(struct mq_data *md)
+{
 	switch (md->event) {
+
 	case WCALL_MEV_RECV_MSG:
 		mem_deref(md->u.recv_msg.msg);
-		mem_deref(md->u.recv_msg.convid);
-		mem_deref(md->u.recv_msg.userid);
-		mem_deref(md->u.recv_msg.clientid);
+		mstr_reset(&md->u.recv_msg.convid);
+		mstr_reset(&md->u.recv_msg.userid);
+		mstr_reset(&md->u.recv_msg.clientid);
 		break;
 
 	case WCALL_MEV_CONFIG_UPDATE:
@@ -134,55 +229,36 @@ static void md_destructor(void *arg)
 		break;
 
 	case WCALL_MEV_RESP:
-		mem_deref(md->u.resp.reason);
+		mstr_reset(&md->u.resp.reason);
 		break;
 
 	case WCALL_MEV_INCOMING:
-		mem_deref(md->u.incoming.convid);
-		mem_deref(md->u.incoming.userid);
+		mstr_reset(&md->u.incoming.convid);
+		mstr_reset(&md->u.incoming.userid);
 		break;
 
 	default:
 		break;
 	}
 
-	md->wcall = mem_deref(md->wcall);	
+	md->wcall = mem_deref(md->wcall);
 }
 
 
-static struct mq_data *md_new(void *wuser, struct wcall *wcall,
-			     enum mq_event event)
-{
-	struct mq_data *md;
-
-	md = mem_zalloc(sizeof(*md), md_destructor);
-	if (!md)
-		return NULL;
-
-	md->wuser = wuser;
-	md->wcall = mem_ref(wcall);
-	md->event = event;
-
-	return md;
-}
-
-static void mqueue_handler(int id, void *data, void *arg)
+static void md_handle(struct mq_data *md)
 {
-	struct mq_data *md = data;
 	int err;
 
-	(void)arg;
-
-	switch (id) {
+	switch (md->event) {
 
 	case WCALL_MEV_RECV_MSG:
 		wcall_i_recv_msg(md->wuser,
 				 md->u.recv_msg.msg,
 				 md->u.recv_msg.curr_time,
 				 md->u.recv_msg.msg_time,
-				 md->u.recv_msg.convid,
-				 md->u.recv_msg.userid,
-				 md->u.recv_msg.clientid);
+				 mstr_get(&md->u.recv_msg.convid),
+				 mstr_get(&md->u.recv_msg.userid),
+				 mstr_get(&md->u.recv_msg.clientid));
 		break;
 
 	case WCALL_MEV_CONFIG_UPDATE:
@@ -194,7 +270,7 @@ static void mqueue_handler(int id, void *data, void *arg)
 	case WCALL_MEV_RESP:
 		wcall_i_resp(md->wuser,
 			     md->u.resp.status,
-			     md->u.resp.reason,
+			     mstr_get(&md->u.resp.reason),
 			     md->u.resp.arg);
 		break;
 
@@ -247,9 +323,10 @@ static void mqueue_handler(int id, void *data, void *arg)
 		break;
 
 	case WCALL_MEV_INCOMING:
-		wcall_i_invoke_incoming_handler(md->u.incoming.convid,
+		wcall_i_invoke_incoming_handler(
+				    mstr_get(&md->u.incoming.convid),
 				    md->u.incoming.msg_time,
-				    md->u.incoming.userid,
+				    mstr_get(&md->u.incoming.userid),
 				    md->u.incoming.video_call,
 				    md->u.incoming.should_ring,
 				    md->wuser);
@@ -261,55 +338,307 @@ static void mqueue_handler(int id, void *data, void *arg)
 		break;
 
 	default:
-		warning("wcall: marshal: unknown event: %d\n", id);
+		warning("wcall: marshal: unknown event: %d\n", md->event);
 		break;
 	}
+}
+
+
+static bool slot_ready(const struct wcall_marshal *wm, size_t pos)
+{
+	const struct mq_slot *slot = &wm->slotv[pos % MARSHAL_RING_SIZE];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+
+static void slot_release(struct wcall_marshal *wm)
+{
+	const size_t pos = wm->head;
+
+	__atomic_store_n(&wm->slotv[pos % MARSHAL_RING_SIZE].seq,
+			 pos + MARSHAL_RING_SIZE, __ATOMIC_RELEASE);
+	__atomic_store_n(&wm->head, pos + 1, __ATOMIC_RELAXED);
+}
+
+
+/* run the commands that are queued, in order */
+static void drain(struct wcall_marshal *wm)
+{
+	struct list overflowl = LIST_INIT;
+	struct le *le;
+
+	/* a handler might destroy the calling instance */
+	mem_ref(wm);
+
+	__atomic_store_n(&wm->signalled, 0, __ATOMIC_SEQ_CST);
+	++wm->stats.drains;
+
+	while (slot_ready(wm, wm->head) && mem_nrefs(wm) > 1) {
+
+		struct mq_data *md;
+
+		md = &wm->slotv[wm->head % MARSHAL_RING_SIZE].md;
+
+		md_handle(md);
+		md_reset(md);
+		++wm->stats.handled;
+
+		slot_release(wm);
+	}
 
-	mem_deref(md);
+	/* the overflow came after everything in the ring */
+	pthread_mutex_lock(&wm->mutex);
+	overflowl = wm->overflowl;
+	list_init(&wm->overflowl);
+	for (le = overflowl.head; le; le = le->next)
+		le->list = &overflowl;
+	__atomic_store_n(&wm->overflow, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&wm->mutex);
+
+	while ((le = list_head(&overflowl))) {
+
+		struct mq_elem *me = le->data;
+
+		list_unlink(&me->le);
+
+		if (mem_nrefs(wm) > 1) {
+			md_handle(&me->md);
+			++wm->stats.handled;
+		}
+		md_reset(&me->md);
+		mem_deref(me);
+	}
+
+	mem_deref(wm);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct wcall_marshal *wm = arg;
+	(void)data;
+
+	if (id == WCALL_MEV_DRAIN)
+		drain(wm);
 }
 
 
 static void wm_destructor(void *arg)
 {
-	struct wcall_marshal *wmarsh = arg;
-	size_t n;
-	
-	wmarsh->mq = mem_deref(wmarsh->mq);
-	
-	n = list_count(&wmarsh->mdl);
-	if (!list_isempty(&wmarsh->mdl)) {
-		debug("wcall: marshal(%p): flush pending events: %u\n",
-		      wmarsh, list_count(&wmarsh->mdl));
-		list_flush(&wmarsh->mdl);
+	struct wcall_marshal *wm = arg;
+	struct le *le;
+	size_t n = 0;
+
+	wm->mq = mem_deref(wm->mq);
+
+	/* the commands that were never run */
+	while (slot_ready(wm, wm->head)) {
+		md_reset(&wm->slotv[wm->head % MARSHAL_RING_SIZE].md);
+		slot_release(wm);
+		++n;
+	}
+
+	while ((le = list_head(&wm->overflowl))) {
+
+		struct mq_elem *me = le->data;
+
+		list_unlink(&me->le);
+		md_reset(&me->md);
+		mem_deref(me);
+		++n;
+	}
+
+	if (n) {
+		debug("wcall: marshal(%p): flushed pending events: %zu\n",
+		      wm, n);
 	}
+
+	info("wcall: marshal(%p): %H\n", wm, wcall_marshal_debug, wm);
+
+	pthread_mutex_destroy(&wm->mutex);
 }
 
 
 int wcall_marshal_alloc(struct wcall_marshal **wmp)
 {
-	struct wcall_marshal *wmarsh;
+	struct wcall_marshal *wm;
+	size_t i;
 	int err;
 
-	wmarsh = mem_zalloc(sizeof(*wmarsh), wm_destructor);
-	if (!wmarsh)
+	wm = mem_zalloc(sizeof(*wm), wm_destructor);
+	if (!wm)
 		return ENOMEM;
 
-	err = mqueue_alloc(&wmarsh->mq, mqueue_handler, NULL);
+	for (i = 0; i < MARSHAL_RING_SIZE; i++)
+		wm->slotv[i].seq = i;
+
+	list_init(&wm->overflowl);
+
+	err = pthread_mutex_init(&wm->mutex, NULL);
 	if (err)
 		goto out;
 
-	list_init(&wmarsh->mdl);
+	err = mqueue_alloc(&wm->mq, mqueue_handler, wm);
+	if (err)
+		goto out;
 
  out:
 	if (err)
-		mem_deref(wmarsh);
+		mem_deref(wm);
 	else
-		*wmp = wmarsh;
+		*wmp = wm;
 
 	return err;
 }
 
 
+int wcall_marshal_debug(struct re_printf *pf, const struct wcall_marshal *wm)
+{
+	if (!wm)
+		return 0;
+
+	return re_hprintf(pf, "cmds=%llu handled=%llu drains=%llu"
+			  " overflows=%llu wakeup_errors=%llu max_depth=%zu/%u",
+			  (unsigned long long)wm->stats.cmds,
+			  (unsigned long long)wm->stats.handled,
+			  (unsigned long long)wm->stats.drains,
+			  (unsigned long long)wm->stats.overflows,
+			  (unsigned long long)wm->stats.wakeup_errors,
+			  wm->stats.max_depth, MARSHAL_RING_SIZE);
+}
+
+
+static struct mq_slot *claim_slot(struct wcall_marshal *wm, size_t *posp)
+{
+	struct mq_slot *slot;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&wm->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		slot = &wm->slotv[pos % MARSHAL_RING_SIZE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&wm->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				*posp = pos;
+				return slot;
+			}
+		}
+		else if ((ssize_t)(seq - pos) < 0) {
+			return NULL;  /* full */
+		}
+		else {
+			pos = __atomic_load_n(&wm->tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+/* must be called with the mutex held */
+static int overflow_append(struct wcall_marshal *wm, const struct mq_data *md)
+{
+	struct mq_elem *me;
+
+	me = mem_zalloc(sizeof(*me), NULL);
+	if (!me)
+		return ENOMEM;
+
+	me->md = *md;
+	list_append(&wm->overflowl, &me->le, me);
+
+	if (!wm->overflow) {
+		warning("wcall: marshal(%p): ring full, re thread is"
+			" behind\n", wm);
+	}
+
+	__atomic_store_n(&wm->overflow, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&wm->stats.overflows, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+/* only for the stats, API threads race to raise it */
+static void update_max_depth(struct wcall_marshal *wm, size_t depth)
+{
+	size_t max = __atomic_load_n(&wm->stats.max_depth, __ATOMIC_RELAXED);
+
+	while (depth > max) {
+		if (__atomic_compare_exchange_n(&wm->stats.max_depth, &max,
+						depth, true,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+}
+
+
+static int md_push(struct wcall_marshal *wm, const struct mq_data *md)
+{
+	struct mq_slot *slot;
+	size_t pos;
+	int err = 0;
+
+	/* keep the order while the overflow list is in use */
+	if (__atomic_load_n(&wm->overflow, __ATOMIC_ACQUIRE)) {
+
+		pthread_mutex_lock(&wm->mutex);
+		if (wm->overflow) {
+			err = overflow_append(wm, md);
+			pthread_mutex_unlock(&wm->mutex);
+			return err;
+		}
+		pthread_mutex_unlock(&wm->mutex);
+	}
+
+	slot = claim_slot(wm, &pos);
+	if (!slot) {
+		pthread_mutex_lock(&wm->mutex);
+		err = overflow_append(wm, md);
+		pthread_mutex_unlock(&wm->mutex);
+		return err;
+	}
+
+	slot->md = *md;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* approximate, the head moves on meanwhile */
+	update_max_depth(wm, pos + 1 - __atomic_load_n(&wm->head,
+						       __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+
+static void wakeup(struct wcall_marshal *wm)
+{
+	int i, err = 0;
+
+	for (i = 0; i < WAKEUP_TRIES; i++) {
+
+		err = mqueue_push(wm->mq, WCALL_MEV_DRAIN, NULL);
+		if (!err)
+			return;
+
+		sched_yield();
+	}
+
+	/* the command stays queued, the next one tries again */
+	warning("wcall: marshal(%p): mqueue_push failed (%m)\n", wm, err);
+	__atomic_fetch_add(&wm->stats.wakeup_errors, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&wm->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Queue a command for the re thread. The command is copied, and on
+ * error its resources are released.
+ */
 static int md_enqueue(struct mq_data *md)
 {
 	struct wcall_marshal *wm;
@@ -321,15 +650,22 @@ static int md_enqueue(struct mq_data *md)
 		goto out;
 	}
 
-	list_append(&wm->mdl, &md->le, md);
-	err = mqueue_push(wm->mq, md->event, md);
+	err = md_push(wm, md);
 	if (err)
 		goto out;
 
+	__atomic_fetch_add(&wm->stats.cmds, 1, __ATOMIC_RELAXED);
+
+	/* one wakeup for everything queued until the re thread runs */
+	if (!__atomic_exchange_n(&wm->signalled, 1, __ATOMIC_SEQ_CST))
+		wakeup(wm);
+
+	return 0;
+
  out:
+	md_reset(md);
+
 	return err;
-	
-	
 }
 
 
@@ -342,7 +678,7 @@ void wcall_recv_msg(void *wuser, const uint8_t *buf, size_t len,
 		    const char *clientid)
 {
 	struct econn_message *msg;
-	struct mq_data *md = NULL;
+	struct mq_data md;
 	int err = 0;
 
 	if (!buf || len == 0 || !convid || !userid || !clientid)
@@ -355,53 +691,43 @@ void wcall_recv_msg(void *wuser, const uint8_t *buf, size_t len,
 		return;
 	}
 
-	md = md_new(wuser, NULL, WCALL_MEV_RECV_MSG);
-	if (!md)
-		return;
+	md_init(&md, wuser, NULL, WCALL_MEV_RECV_MSG);
 
-	md->u.recv_msg.msg = msg;
-	md->u.recv_msg.curr_time = curr_time;
-	md->u.recv_msg.msg_time = msg_time;
-	err = str_dup(&md->u.recv_msg.convid, convid);
-	err |= str_dup(&md->u.recv_msg.userid, userid);
-	err |= str_dup(&md->u.recv_msg.clientid, clientid);
-
-	if (err)
-		goto out;
-
-	err = md_enqueue(md);
-	if (err)
-		goto out;
-			    
+	md.u.recv_msg.msg = msg;
+	md.u.recv_msg.curr_time = curr_time;
+	md.u.recv_msg.msg_time = msg_time;
+	err  = mstr_set(&md.u.recv_msg.convid, convid);
+	err |= mstr_set(&md.u.recv_msg.userid, userid);
+	err |= mstr_set(&md.u.recv_msg.clientid, clientid);
+	if (err) {
+		md_reset(&md);
+		return;
+	}
 
- out:
-	if (err)
-		mem_deref(md);
+	md_enqueue(&md);
 }
 
 AVS_EXPORT
 void wcall_config_update(void *wuser, int err, const char *json_str)
 {
-	struct mq_data *md = NULL;
+	struct mq_data md;
 
 	info("wcall(%p): config_update: err=%d json=%zu bytes\n",
 	     wuser, err, str_len(json_str));
 
-	md = md_new(wuser, NULL, WCALL_MEV_CONFIG_UPDATE); 
-	if (!md)
-		return;
+	md_init(&md, wuser, NULL, WCALL_MEV_CONFIG_UPDATE);
 
-	str_dup(&md->u.config_update.json_str, json_str);
-	md->u.config_update.err = err;
+	str_dup(&md.u.config_update.json_str, json_str);
+	md.u.config_update.err = err;
 
-	md_enqueue(md);
+	md_enqueue(&md);
 }
 
 
 AVS_EXPORT
 void wcall_resp(void *wuser, int status, const char *reason, void *arg)
 {
-	struct mq_data *md = NULL;
+	struct mq_data md;
 	int err = 0;
 
 	if (!wuser) {
@@ -409,21 +735,15 @@ void wcall_resp(void *wuser, int status, const char *reason, void *arg)
 		return;
 	}
 	
-	md = md_new(wuser, NULL, WCALL_MEV_RESP);
-	if (!md) {
-		err = ENOMEM;
-		return;
-	}
+	md_init(&md, wuser, NULL, WCALL_MEV_RESP);
 
-	md->u.resp.arg = arg;
-	md->u.resp.status = status;
-	err = str_dup(&md->u.resp.reason, reason);
+	md.u.resp.arg = arg;
+	md.u.resp.status = status;
+	err = mstr_set(&md.u.resp.reason, reason);
 	if (err)
-		md->u.resp.reason = NULL;
+		md.u.resp.reason.null = true;
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
+	md_enqueue(&md);
 }
 
 
@@ -435,7 +755,7 @@ int wcall_start_ex(void *wuser, const char *convid,
 		   void *extcodec_arg)
 {
 	struct wcall *wcall;
-	struct mq_data *md = NULL;
+	struct mq_data md;
 	bool added = false;
 	int err = 0;
 
@@ -449,20 +769,15 @@ int wcall_start_ex(void *wuser, const char *convid,
 			goto out;
 		added = true;
 	}
-	md = md_new(wuser, wcall, WCALL_MEV_START);
-	if (!md) {
-		err = ENOMEM;
-		goto out;
-	}
 
-	md->u.start.call_type = call_type;
-	md->u.start.conv_type = conv_type;
-	md->u.start.audio_cbr = (bool)audio_cbr;
-	md->u.start.extcodec_arg = extcodec_arg;
+	md_init(&md, wuser, wcall, WCALL_MEV_START);
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
+	md.u.start.call_type = call_type;
+	md.u.start.conv_type = conv_type;
+	md.u.start.audio_cbr = (bool)audio_cbr;
+	md.u.start.extcodec_arg = extcodec_arg;
+
+	err = md_enqueue(&md);
 
  out:
 	if (err) {
@@ -492,8 +807,7 @@ int wcall_answer_ex(void *wuser, const char *convid,
 		    void *extcodec_arg)
 {
 	struct wcall *wcall;
-	struct mq_data *md = NULL;
-	int err = 0;
+	struct mq_data md;
 
 	if (!convid)
 		return EINVAL;
@@ -502,18 +816,13 @@ int wcall_answer_ex(void *wuser, const char *convid,
 	if (!wcall)
 		return EPROTO;
 
-	md = md_new(wuser, wcall, WCALL_MEV_ANSWER);
-
-	md->wuser = wuser;
-	md->u.answer.call_type = call_type;
-	md->u.answer.audio_cbr = audio_cbr;
-	md->u.answer.extcodec_arg = extcodec_arg;
+	md_init(&md, wuser, wcall, WCALL_MEV_ANSWER);
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
+	md.u.answer.call_type = call_type;
+	md.u.answer.audio_cbr = audio_cbr;
+	md.u.answer.extcodec_arg = extcodec_arg;
 
-	return err;
+	return md_enqueue(&md);
 }
 
 
@@ -529,24 +838,16 @@ AVS_EXPORT
 void wcall_end(void *wuser, const char *convid)
 {
 	struct wcall *wcall;
-	struct mq_data *md = NULL;
+	struct mq_data md;
 	int err = 0;
 
 	wcall = wcall_lookup(wuser, convid);	
 	if (!wcall)
 		return;
 
-	md = md_new(wuser, wcall, WCALL_MEV_END);
-	if (!md) {
-		err = ENOMEM;
-		goto out;
-	}
+	md_init(&md, wuser, wcall, WCALL_MEV_END);
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
-
- out:
+	err = md_enqueue(&md);
 	if (err)
 		warning("wcall: end failed err=%m\n", err);
 }
@@ -556,24 +857,16 @@ AVS_EXPORT
 int wcall_reject(void *wuser, const char *convid)
 {
 	struct wcall *wcall;
-	struct mq_data *md = NULL;
+	struct mq_data md;
 	int err = 0;
 
 	wcall = wcall_lookup(wuser, convid);	
 	if (!wcall)
 		return EPROTO;
 
-	md = md_new(wuser, wcall, WCALL_MEV_REJECT);
-	if (!md) {
-		err = ENOMEM;
-		goto out;
-	}
+	md_init(&md, wuser, wcall, WCALL_MEV_REJECT);
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
-
- out:
+	err = md_enqueue(&md);
 	if (err)
 		warning("wcall: end failed err=%m\n", err);
 
@@ -585,8 +878,7 @@ AVS_EXPORT
 void wcall_set_video_send_state(void *wuser, const char *convid, int state)
 {
 	struct wcall *wcall;
-	struct mq_data *md = NULL;
-	int err = 0;
+	struct mq_data md;
 
 	if (!convid)
 		return;
@@ -595,65 +887,46 @@ void wcall_set_video_send_state(void *wuser, const char *convid, int state)
 	if (!wcall)
 		return;
 
-	md = md_new(wuser, wcall, WCALL_MEV_VIDEO_SET_STATE);
-	if (!md)
-		return;
+	md_init(&md, wuser, wcall, WCALL_MEV_VIDEO_SET_STATE);
 
-	md->u.video_set_state.state = state;
+	md.u.video_set_state.state = state;
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);	
+	md_enqueue(&md);
 }
 
 void wcall_mcat_changed(void *wuser, enum mediamgr_state state)
 {
-	struct mq_data *md = NULL;
-	int err = 0;
+	struct mq_data md;
     
-	md = md_new(wuser, NULL, WCALL_MEV_MCAT_CHANGED);
-	if (!md)
-		return;
+	md_init(&md, wuser, NULL, WCALL_MEV_MCAT_CHANGED);
     
-	md->u.mcat_changed.state = state;
+	md.u.mcat_changed.state = state;
 
 	info("wcall_mcat_changed: wuser=%p state=%d\n", wuser, (int)state);
 	
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
+	md_enqueue(&md);
 }
 
 void wcall_audio_route_changed(void *wuser, enum mediamgr_auplay new_route)
 {
-	struct mq_data *md = NULL;
-	int err = 0;
+	struct mq_data md;
 
-	md = md_new(wuser, NULL, WCALL_MEV_AUDIO_ROUTE_CHANGED);
-	if (!md)
-		return;
+	md_init(&md, wuser, NULL, WCALL_MEV_AUDIO_ROUTE_CHANGED);
 
-	md->u.route_changed.new_route = new_route;
+	md.u.route_changed.new_route = new_route;
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);
+	md_enqueue(&md);
 }
 
 
 AVS_EXPORT
 void wcall_network_changed(void *wuser)
 {
-	struct mq_data *md = NULL;
-	int err = 0;
+	struct mq_data md;
 
-	md = md_new(wuser, NULL, WCALL_MEV_NETWORK_CHANGED);
-	if (!md)
-		return;
+	md_init(&md, wuser, NULL, WCALL_MEV_NETWORK_CHANGED);
 
-	err = md_enqueue(md);
-	if (err)
-		mem_deref(md);	
+	md_enqueue(&md);
 }
 
 
@@ -665,47 +938,32 @@ void wcall_invoke_incoming_handler(const char *convid,
 			           int should_ring,
 			           void *wuser)
 {
-	struct mq_data *md = NULL;
+	struct mq_data md;
 	int err = 0;
 
 	if (!convid || !userid)
 		return;
 
-	md = md_new(wuser, NULL, WCALL_MEV_INCOMING);
-	if (!md)
-		return;
-
-	md->u.incoming.msg_time = msg_time;
-	md->u.incoming.video_call = video_call;
-	md->u.incoming.should_ring = should_ring;
-	err = str_dup(&md->u.incoming.convid, convid);
-	err |= str_dup(&md->u.incoming.userid, userid);
-
-	if (err)
-		goto out;
+	md_init(&md, wuser, NULL, WCALL_MEV_INCOMING);
 
-	err = md_enqueue(md);
-	if (err)
-		goto out;
+	md.u.incoming.msg_time = msg_time;
+	md.u.incoming.video_call = video_call;
+	md.u.incoming.should_ring = should_ring;
+	err  = mstr_set(&md.u.incoming.convid, convid);
+	err |= mstr_set(&md.u.incoming.userid, userid);
+	if (err) {
+		md_reset(&md);
+		return;
+	}
 
- out:
-	if (err)
-		mem_deref(md);
+	md_enqueue(&md);
 }
 
 void wcall_marshal_destroy(void *id)
 {
-	struct mq_data *md = NULL;
-	int err = 0;
+	struct mq_data md;
 
-	md = md_new(id, NULL, WCALL_MEV_DESTROY);
-	if (!md)
-		return;
+	md_init(&md, id, NULL, WCALL_MEV_DESTROY);
 
-	err = md_enqueue(md);
-	if (err)
-		goto out;
-
- out:
-	return;
+	md_enqueue(&md);
 }
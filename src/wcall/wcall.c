@@ -41,6 +41,8 @@ static struct {
 	struct list instances;
 	struct list logl;
 	struct lock *lock;	
+	bool lazy_init;
+	bool prewarm;
 } calling = {
 	.initialized = false,
 	.instances = LIST_INIT,
@@ -72,6 +74,7 @@ struct calling_instance {
 
 	struct list ecalls;
 	struct list wcalls;
+	struct hash *wcallh;   /* by convid */
 	struct list ctxl;
 
 	pthread_t tid;
@@ -135,6 +138,7 @@ struct wcall {
 	bool disable_audio;
 	
 	struct le le;
+	struct le hle;  /* member of wcallh */
 };
 
 
@@ -155,7 +159,7 @@ static bool instance_valid(struct calling_instance *inst)
 	bool found = false;
 	struct le *le;
 
-	lock_write_get(calling.lock);
+	lock_read_get(calling.lock);
 	for (le = calling.instances.head; le && !found; le = le->next)
 		found = le->data == inst;
 	lock_rel(calling.lock);
@@ -178,7 +182,7 @@ static bool wcall_valid(const struct wcall *wcall)
 	if (!instance_valid(inst))
 		return false;
 	
-	lock_write_get(inst->lock);
+	lock_read_get(inst->lock);
 	for (le = inst->wcalls.head; le && !found; le = le->next)
 		found = wcall == le->data;
 	lock_rel(inst->lock);
@@ -317,29 +321,29 @@ static int async_cfg_wait(struct calling_instance *inst)
 }
 
 
+static bool convid_cmp_handler(struct le *le, void *arg)
+{
+	const struct wcall *wcall = le->data;
+	const char *convid = arg;
+
+	return streq(convid, wcall->convid);
+}
+
+
 struct wcall *wcall_lookup(void *id, const char *convid)
 {
 	struct calling_instance *inst = id;
-	struct wcall *wcall;
-	bool found = false;
 	struct le *le;
 
 	if (!id || !convid)
 		return NULL;
 	
-	lock_write_get(inst->lock);
-	for (le = inst->wcalls.head;
-	     le != NULL && !found;
-	     le = le->next) { 
-		wcall = le->data;
-
-		if (streq(convid, wcall->convid)) {
-			found = true;
-		}
-	}
+	lock_read_get(inst->lock);
+	le = hash_lookup(inst->wcallh, hash_joaat_str(convid),
+			 convid_cmp_handler, (void *)convid);
 	lock_rel(inst->lock);
 	
-	return found ? wcall : NULL;
+	return le ? le->data : NULL;
 }
 
 
@@ -987,6 +991,7 @@ static void destructor(void *arg)
 	
 	lock_write_get(inst->lock);
 	list_unlink(&wcall->le);
+	hash_unlink(&wcall->hle);
 	has_calls = inst->wcalls.head != NULL;
 	lock_rel(inst->lock);
 
@@ -1169,6 +1174,8 @@ int wcall_add(void *id,
 	wcall->audio.cbr_state = AUDIO_CBR_STATE_UNSET;
 
 	list_append(&inst->wcalls, &wcall->le, wcall);
+	hash_append(inst->wcallh, hash_joaat_str(wcall->convid),
+		    &wcall->hle, wcall);
 
  out:
 	lock_rel(inst->lock);
@@ -1473,6 +1480,7 @@ static void instance_destroy(struct calling_instance *inst)
 	lock_rel(inst->lock);
 
 	inst->lock = mem_deref(inst->lock);
+	inst->wcallh = mem_deref(inst->wcallh);
 	inst->netprobe = mem_deref(inst->netprobe);
 
 	{
@@ -1524,6 +1532,7 @@ void *wcall_create_ex(const char *userid,
 	char userid_anon[ANON_ID_LEN];
 	char clientid_anon[ANON_CLIENT_LEN];
 	struct calling_instance *inst = NULL;
+	struct msystem_config msys_config;
 	int err;
 
 	if (!str_isset(userid) || !str_isset(clientid))
@@ -1583,12 +1592,20 @@ void *wcall_create_ex(const char *userid,
 	inst->conf.econf.timeout_setup = 60000;
 	inst->conf.econf.timeout_term  =  5000;
 	inst->conf.trace = 0;
+	inst->conf.prewarm = calling.prewarm;
 	
 	err = lock_alloc(&inst->lock);
 	if (err)
 		goto out;
 
-	err = msystem_get(&inst->msys, "voe", NULL);
+	err = hash_alloc(&inst->wcallh, 32);
+	if (err)
+		goto out;
+
+	memset(&msys_config, 0, sizeof(msys_config));
+	msys_config.lazy_init = calling.lazy_init;
+
+	err = msystem_get(&inst->msys, "voe", &msys_config);
 	if (err) {
 		warning("wcall(%p): create, cannot init msystem: %m\n",
 			inst, err);
@@ -1946,6 +1963,7 @@ static void wcall_end_internal(struct wcall *wcall)
 	}
 
 	wcall->disable_audio = true;
+
 	if (!wcall_has_calls(wcall->inst)) {
 		if (wcall->inst->mm) {
 			mediamgr_set_call_state(wcall->inst->mm,
@@ -1958,6 +1976,7 @@ static void wcall_end_internal(struct wcall *wcall)
 int wcall_i_reject(struct wcall *wcall)
 {
 	struct calling_instance *inst;
+	struct ecall *ecall;
 	char convid_anon[ANON_ID_LEN];
 
 	info(APITAG "wcall(%p): reject convid=%s\n", wcall,
@@ -1970,6 +1989,12 @@ int wcall_i_reject(struct wcall *wcall)
 
 	info("wcall(%p): reject: convid=%s\n", wcall, anon_id(convid_anon, wcall->convid));
 
+	/* drop the media that was prewarmed while ringing */
+	if (inst->conf.prewarm) {
+		ecall = ecall_find_convid(&inst->ecalls, wcall->convid);
+		if (ecall)
+			ecall_reject(ecall);
+	}
 
 	wcall->disable_audio = true;
 	if (!wcall_has_calls(wcall->inst)) {
@@ -2183,6 +2208,8 @@ int wcall_debug(struct re_printf *pf, const void *id)
 	}
 
 	err = re_hprintf(pf, "# calls=%d\n", list_count(&inst->wcalls));
+	err |= re_hprintf(pf, "marshal: %H\n",
+			  wcall_marshal_debug, inst->marshal);
 	LIST_FOREACH(&inst->wcalls, le) {
 		struct wcall *wcall = le->data;
 
@@ -2199,6 +2226,31 @@ int wcall_debug(struct re_printf *pf, const void *id)
 }
 
 
+/*
+ * Bring up the audio and video engines, DTLS and the data channel on
+ * the first call instead of in wcall_create(). Must be set before
+ * the first wcall_create().
+ */
+AVS_EXPORT
+void wcall_enable_lazy_init(int enabled)
+{
+	calling.lazy_init = !!enabled;
+}
+
+
+/*
+ * Take the remote ICE candidates of an incoming 1:1 call while it is
+ * ringing, so the TURN permissions are in place when it is answered,
+ * and release that media again when it is rejected. Must be set
+ * before wcall_create().
+ */
+AVS_EXPORT
+void wcall_enable_prewarm(int enabled)
+{
+	calling.prewarm = !!enabled;
+}
+
+
 AVS_EXPORT
 void wcall_set_trace(void *id, int trace)
 {
@@ -2236,7 +2288,7 @@ void wcall_iterate_state(void *id, wcall_state_change_h *stateh, void *arg)
 		return;
 	}
 
-	lock_write_get(inst->lock);
+	lock_read_get(inst->lock);
 	LIST_FOREACH(&inst->wcalls, le) {
 		wcall = le->data;
 
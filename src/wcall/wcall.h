@@ -2,6 +2,7 @@
 struct wcall_marshal;
 int wcall_marshal_alloc(struct wcall_marshal **wmp); 
 struct wcall_marshal *wcall_get_marshal(void *wuser);
+int wcall_marshal_debug(struct re_printf *pf, const struct wcall_marshal *wm);
 
 struct wcall *wcall_lookup(void *id, const char *convid);
 int  wcall_add(void *id, struct wcall **wcallp, const char *convid, int conv_type);
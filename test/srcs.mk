@@ -24,10 +24,13 @@ TEST_SRCS	+= test_dtls.cpp
 TEST_SRCS	+= test_ecall.cpp
 TEST_SRCS	+= test_econn.cpp
 TEST_SRCS	+= test_engine.cpp
+TEST_SRCS	+= test_filesink.cpp
+TEST_SRCS	+= test_flowmgr.cpp
 TEST_SRCS	+= test_http.cpp
 TEST_SRCS	+= test_jzon.cpp
 TEST_SRCS	+= test_kase.cpp
 TEST_SRCS	+= test_libre.cpp
+TEST_SRCS	+= test_log.cpp
 TEST_SRCS	+= test_login.cpp
 TEST_SRCS	+= test_media.cpp
 TEST_SRCS	+= test_media_crypto.cpp
@@ -19,6 +19,8 @@
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
 
 
 class cert_test : public ::testing::Test {
@@ -70,3 +72,69 @@ TEST_F(cert_test, generate_selfsigned_ecdsa_secp521r1)
 	err = cert_tls_set_selfsigned_ecdsa(tls, "secp521r1");
 	ASSERT_EQ(0, err);
 }
+
+
+TEST_F(cert_test, ecdsa_presign)
+{
+	struct cert_presign *ps = NULL;
+	static const unsigned char msg[] = "hello presigned world";
+	unsigned char sig[128];
+	size_t siglen;
+	size_t ready = 0;
+	uint64_t used = 0, miss = 0;
+	EVP_MD_CTX *mdctx;
+	SSL_CTX *ctx;
+	EVP_PKEY *pubkey;
+	int i, err;
+
+	err = cert_tls_set_selfsigned_ecdsa(tls, "prime256v1");
+	ASSERT_EQ(0, err);
+
+	err = cert_presign_alloc(&ps, "prime256v1", 4);
+	ASSERT_EQ(0, err);
+
+	err = cert_tls_set_presign(tls, ps);
+	ASSERT_EQ(0, err);
+
+	/* wait for the pool to fill up */
+	for (i = 0; i < 500 && ready < 4; i++) {
+		cert_presign_stats(ps, &ready, NULL, NULL);
+		if (ready < 4)
+			sys_msleep(10);
+	}
+	ASSERT_EQ(4, ready);
+
+	ctx = tls_openssl_context(tls);
+	pubkey = X509_get0_pubkey(SSL_CTX_get0_certificate(ctx));
+	ASSERT_TRUE(pubkey != NULL);
+
+	/* more signatures than nonces, the rest are done the normal way */
+	for (i = 0; i < 8; i++) {
+
+		mdctx = EVP_MD_CTX_new();
+		ASSERT_TRUE(mdctx != NULL);
+
+		siglen = sizeof(sig);
+		ASSERT_EQ(1, EVP_DigestSignInit(mdctx, NULL, EVP_sha256(),
+						NULL,
+						SSL_CTX_get0_privatekey(ctx)));
+		ASSERT_EQ(1, EVP_DigestSign(mdctx, sig, &siglen,
+					    msg, sizeof(msg)));
+		EVP_MD_CTX_free(mdctx);
+
+		mdctx = EVP_MD_CTX_new();
+		ASSERT_TRUE(mdctx != NULL);
+
+		ASSERT_EQ(1, EVP_DigestVerifyInit(mdctx, NULL, EVP_sha256(),
+						  NULL, pubkey));
+		ASSERT_EQ(1, EVP_DigestVerify(mdctx, sig, siglen,
+					      msg, sizeof(msg)));
+		EVP_MD_CTX_free(mdctx);
+	}
+
+	cert_presign_stats(ps, NULL, &used, &miss);
+	ASSERT_GE(used, 4);
+	ASSERT_EQ(8, used + miss);
+
+	mem_deref(ps);
+}
@@ -16,6 +16,7 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -141,3 +142,145 @@ TEST(confpos, sorted_participants)
 
 	list_flush(&partl);
 }
+
+
+static void make_uid(char *buf, size_t sz, unsigned i)
+{
+	re_snprintf(buf, sz, "%08x-6b85-435f-bad4-%012x", i * 2654435761u, i);
+}
+
+
+TEST(confpos, roster)
+{
+	struct conf_roster *roster = NULL;
+	struct conf_part *a, *b, *c, *part;
+	int err;
+
+	err = conf_roster_alloc(&roster);
+	ASSERT_EQ(0, err);
+
+	err  = conf_roster_add(&a, roster,
+			       "60fcea5b-6b85-435f-bad4-b002e7df9792", NULL);
+	err |= conf_roster_add(&b, roster,
+			       "3e2e9ea3-ec0f-49a1-bc5a-cb829050dada", NULL);
+	err |= conf_roster_add(&c, roster,
+			       "eabf0c4f-d8c4-4508-90c2-06565de7d3d7", NULL);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(3, conf_roster_count(roster));
+	ASSERT_EQ(3, list_count(conf_roster_list(roster)));
+	ASSERT_TRUE(is_sorted(conf_roster_list(roster)));
+
+	/* lookup is case insensitive */
+	part = conf_roster_find(roster,
+				"3E2E9EA3-EC0F-49A1-BC5A-CB829050DADA");
+	ASSERT_TRUE(part == b);
+	ASSERT_TRUE(conf_roster_find(roster, "nobody") == NULL);
+
+	mem_deref(b);
+	ASSERT_EQ(2, conf_roster_count(roster));
+	ASSERT_TRUE(is_sorted(conf_roster_list(roster)));
+	ASSERT_TRUE(conf_roster_find(roster,
+			"3e2e9ea3-ec0f-49a1-bc5a-cb829050dada") == NULL);
+
+	/* the parts can outlive the roster */
+	mem_deref(roster);
+	ASSERT_TRUE(a->roster == NULL);
+
+	mem_deref(c);
+	mem_deref(a);
+}
+
+
+#define CHURN_PARTS   200
+#define CHURN_ROUNDS 2000
+
+
+/*
+ * Participants joining and leaving a large group call, with the
+ * position order updated after every change.
+ */
+TEST(confpos, roster_churn)
+{
+	struct conf_part *partv[CHURN_PARTS];
+	struct conf_roster *roster = NULL;
+	struct list partl = LIST_INIT;
+	struct timeval start, now, res;
+	char uid[64];
+	double ms_list, ms_roster;
+	unsigned i, k;
+	int err;
+
+	/* list with a full sort per change */
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < CHURN_PARTS; i++) {
+		make_uid(uid, sizeof(uid), i);
+		err = conf_part_add(&partv[i], &partl, uid, NULL);
+		ASSERT_EQ(0, err);
+		conf_pos_sort(&partl);
+	}
+
+	for (i = 0; i < CHURN_ROUNDS; i++) {
+
+		k = (i * 7919) % CHURN_PARTS;
+
+		mem_deref(partv[k]);
+		conf_pos_sort(&partl);
+
+		make_uid(uid, sizeof(uid), CHURN_PARTS + i);
+		err = conf_part_add(&partv[k], &partl, uid, NULL);
+		ASSERT_EQ(0, err);
+		conf_pos_sort(&partl);
+
+		ASSERT_TRUE(conf_part_find(&partl, uid) == partv[k]);
+	}
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &res);
+	ms_list = res.tv_sec * 1000.0 + res.tv_usec / 1000.0;
+
+	ASSERT_TRUE(is_sorted(&partl));
+	list_flush(&partl);
+
+	/* roster */
+	err = conf_roster_alloc(&roster);
+	ASSERT_EQ(0, err);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < CHURN_PARTS; i++) {
+		make_uid(uid, sizeof(uid), i);
+		err = conf_roster_add(&partv[i], roster, uid, NULL);
+		ASSERT_EQ(0, err);
+	}
+
+	for (i = 0; i < CHURN_ROUNDS; i++) {
+
+		k = (i * 7919) % CHURN_PARTS;
+
+		mem_deref(partv[k]);
+
+		make_uid(uid, sizeof(uid), CHURN_PARTS + i);
+		err = conf_roster_add(&partv[k], roster, uid, NULL);
+		ASSERT_EQ(0, err);
+
+		ASSERT_TRUE(conf_roster_find(roster, uid) == partv[k]);
+	}
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &res);
+	ms_roster = res.tv_sec * 1000.0 + res.tv_usec / 1000.0;
+
+	ASSERT_EQ(CHURN_PARTS, conf_roster_count(roster));
+	ASSERT_TRUE(is_sorted(conf_roster_list(roster)));
+
+	for (i = 0; i < CHURN_PARTS; i++)
+		mem_deref(partv[i]);
+	ASSERT_EQ(0, conf_roster_count(roster));
+	mem_deref(roster);
+
+	printf("confpos: %u participants, %u leave/join:"
+	       " list+sort %.1f ms, roster %.1f ms\n",
+	       CHURN_PARTS, CHURN_ROUNDS, ms_list, ms_roster);
+}
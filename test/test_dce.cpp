@@ -780,3 +780,155 @@ TEST_F(Dce, alloc_after_close)
 	ASSERT_EQ(0, B.co[0].n_received);
 
 }
+
+
+#define THROUGHPUT_MSGS 5000
+#define THROUGHPUT_SIZE 1024
+
+static struct {
+	struct tmr tmr;
+	char buf[THROUGHPUT_SIZE];
+	bool opened;
+	unsigned sent;
+	struct timeval start;
+	double ms;
+} tput;
+
+
+static double time_diff_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0
+		+ (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+static void tput_rcv_handler(int chid, uint8_t *data, size_t len,
+			     void *arg)
+{
+	struct channel_owner *c = (struct channel_owner *)arg;
+
+	if (len != THROUGHPUT_SIZE)
+		return;
+
+	/* messages must arrive in the order they were sent */
+	if (0 != memcmp(data, &c->n_received, sizeof(c->n_received)))
+		return;
+
+	++c->n_received;
+
+	if (c->n_received == THROUGHPUT_MSGS) {
+		tput.ms = time_diff_ms(&tput.start);
+		re_cancel();
+	}
+}
+
+
+static void tput_tmr_handler(void *arg)
+{
+	(void)arg;
+
+	if (!A.n_established || !B.n_established)
+		goto out;
+
+	if (!tput.opened) {
+		dce_open_chan(A.dce, A.co[0].dce_ch);
+		tput.opened = true;
+		goto out;
+	}
+
+	if (!dce_is_chan_open(A.co[0].dce_ch))
+		goto out;
+
+	if (tput.sent == 0)
+		gettimeofday(&tput.start, NULL);
+
+	while (tput.sent < THROUGHPUT_MSGS) {
+
+		memcpy(tput.buf, &tput.sent, sizeof(tput.sent));
+
+		/* the send buffer is full, wait for the peer */
+		if (dce_send(A.dce, A.co[0].dce_ch,
+			     tput.buf, sizeof(tput.buf)))
+			break;
+
+		++tput.sent;
+	}
+
+	if (tput.sent == THROUGHPUT_MSGS)
+		return;
+
+ out:
+	tmr_start(&tput.tmr, 1, tput_tmr_handler, NULL);
+}
+
+
+TEST_F(Dce, throughput)
+{
+	struct dce_rx_stats before, stats;
+	uint64_t events, drains;
+	int err;
+
+	/* sending to a full buffer is logged as a warning */
+	log_set_min_level(LOG_LEVEL_ERROR);
+
+	memset(&tput, 0, sizeof(tput));
+	tmr_init(&tput.tmr);
+
+	init_client(&A, this, true, 0);
+	init_client(&B, this, false, 0);
+
+	err = dce_alloc(&A.dce, dce_send_handler, dce_estab_handler, &A);
+	ASSERT_EQ(0, err);
+	err = dce_channel_alloc(&A.co[0].dce_ch, A.dce, "tput", "",
+				NULL, dce_open_handler, dce_close_handler,
+				tput_rcv_handler, &A.co[0]);
+	ASSERT_EQ(0, err);
+
+	err = dce_alloc(&B.dce, dce_send_handler, dce_estab_handler, &B);
+	ASSERT_EQ(0, err);
+	err = dce_channel_alloc(&B.co[0].dce_ch, B.dce, "tput", "",
+				NULL, dce_open_handler, dce_close_handler,
+				tput_rcv_handler, &B.co[0]);
+	ASSERT_EQ(0, err);
+
+	err = dce_connect(A.dce, A.dtls_role);
+	ASSERT_EQ(0, err);
+	err = dce_connect(B.dce, B.dtls_role);
+	ASSERT_EQ(0, err);
+
+	dce_rx_stats(&before);
+
+	tmr_start(&tput.tmr, 1, tput_tmr_handler, NULL);
+
+	err = re_main_wait(20000);
+	tmr_cancel(&tput.tmr);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(THROUGHPUT_MSGS, B.co[0].n_received);
+
+	dce_rx_stats(&stats);
+	events = stats.events - before.events;
+	drains = stats.drains - before.drains;
+
+	/* every message went through the ring or the mqueue, and the
+	 * re thread was woken up for batches, not for every event */
+	ASSERT_GE(events, (uint64_t)THROUGHPUT_MSGS);
+	ASSERT_GE(drains, 1u);
+	ASSERT_LT(drains, events);
+	ASSERT_EQ(before.push_errors, stats.push_errors);
+
+	printf("dce: %u messages of %u bytes in %.1f ms"
+	       " (%.0f msgs/sec), %.1f events per wakeup,"
+	       " %llu overflowed\n",
+	       THROUGHPUT_MSGS, THROUGHPUT_SIZE, tput.ms,
+	       tput.ms > 0 ? 1000.0 * THROUGHPUT_MSGS / tput.ms : 0,
+	       (double)events / drains,
+	       (unsigned long long)(stats.overflow - before.overflow));
+
+	mem_deref(A.dce);
+	mem_deref(B.dce);
+}
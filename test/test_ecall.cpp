@@ -19,6 +19,8 @@
 #define _GNU_SOURCE 1
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <unistd.h>
+#include <openssl/sha.h>
 
 #include <re.h>
 #include <avs.h>
@@ -60,6 +62,7 @@ enum action {
 	ACTION_NOTHING = 0,
 	ACTION_ANSWER,
 	ACTION_ANSWER_AND_END,
+	ACTION_REJECT_AND_ANSWER,
 	ACTION_END,
 	ACTION_TEST_COMPLETE,
 	ACTION_DELAY_COMPLETE,
@@ -561,6 +564,17 @@ public:
 			ecall_end(cli->ecall);
 			break;
 
+		case ACTION_REJECT_AND_ANSWER:
+			ASSERT_TRUE(ecall_mediaflow(cli->ecall) != NULL);
+			err = ecall_reject(cli->ecall);
+			ASSERT_EQ(0, err);
+			ASSERT_TRUE(ecall_mediaflow(cli->ecall) == NULL);
+
+			err = ecall_answer(cli->ecall, ICALL_CALL_TYPE_NORMAL, false, NULL);
+			ASSERT_EQ(0, err);
+			ASSERT_TRUE(ecall_mediaflow(cli->ecall) != NULL);
+			break;
+
 		case ACTION_TEST_COMPLETE:
 			test_complete(cli->loop, 0);
 			break;
@@ -1427,6 +1441,39 @@ TEST_F(Ecall, a_calling_b_and_b1_answer)
 }
 
 
+TEST_F(Ecall, a_calling_b_and_b1_reject_then_answer)
+{
+	prepare_loops(1, 4);
+
+	struct conv_loop *conv = loopv[0];
+
+	prepare_clients(conv);
+
+	exp_total_conn = 2;
+	conv->clients[3].action_conn = ACTION_REJECT_AND_ANSWER;
+
+	exp_total_datachan_estab = 2;
+	conv->clients[0].action_destab = ACTION_TEST_COMPLETE;
+
+	test_base(conv);
+
+	/* Wait .. */
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+
+	/* A1 */
+	ASSERT_EQ(1, conv->clients[0].n_datachan_estab);
+	ASSERT_EQ(0, conv->clients[0].n_close);
+	ASSERT_TRUE(ecall_is_answered(conv->clients[0].ecall));
+
+	/* B6 */
+	ASSERT_EQ(1, conv->clients[3].n_conn);
+	ASSERT_EQ(1, conv->clients[3].n_datachan_estab);
+	ASSERT_EQ(0, conv->clients[3].n_close);
+	ASSERT_TRUE(ecall_is_answered(conv->clients[3].ecall));
+}
+
+
 /* test forking */
 TEST_F(Ecall, a_calling_b_and_both_answer)
 {
@@ -2448,3 +2495,351 @@ TEST_F(Ecall, restart)
 	ASSERT_EQ(2, b2->n_datachan_estab);
 }
 
+
+
+/* The file transfer of the user data channel, as the receiver sees it */
+
+enum {
+	UD_FILE_START   = 1,
+	UD_FILE         = 2,
+	UD_FILE_END     = 5,
+	UD_FILE_CHUNK   = 7,
+	UD_FILE_CAPS    = 8,
+};
+
+#define UD_NAME_SIZE   128
+#define UD_CHUNK_SIZE 1000
+#define UD_NBLOCKS       4
+
+
+class UserData : public ::testing::Test {
+
+public:
+	virtual void SetUp() override
+	{
+		struct msystem_config config;
+		char tmp[256] = "/tmp/ztest_usrd_XXXXXX";
+		int err;
+
+		/* the broken transfers are logged as warnings */
+		log_set_min_level(LOG_LEVEL_ERROR);
+
+		ASSERT_TRUE(mkdtemp(tmp) != NULL);
+		dir = tmp;
+		path = dir + "/file";
+
+		for (size_t i = 0; i < sizeof(data); i++)
+			data[i] = (uint8_t)(i * 7 + 3);
+		SHA256(data, sizeof(data), sha);
+
+		memset(&config, 0, sizeof(config));
+		err = msystem_get(&msys, "audummy", &config);
+		ASSERT_EQ(0, err);
+
+		list_init(&ecalls);
+		err = ecall_alloc(&ecall, &ecalls, ICALL_CONV_TYPE_ONEONONE,
+				  NULL, msys, "conv", "A", "1");
+		ASSERT_EQ(0, err);
+
+		err = ecall_add_user_data(ecall, NULL, NULL, this);
+		ASSERT_EQ(0, err);
+		err = ecall_user_data_register_ft_handlers(ecall, dir.c_str(),
+							   file_rcv_handler,
+							   NULL);
+		ASSERT_EQ(0, err);
+	}
+
+	virtual void TearDown() override
+	{
+		mem_deref(ecall);
+		mem_deref(msys);
+		unlink(path.c_str());
+		rmdir(dir.c_str());
+	}
+
+	static void file_rcv_handler(const char *location, void *arg)
+	{
+		UserData *ud = static_cast<UserData *>(arg);
+
+		ud->location = location;
+		++ud->n_rcv_files;
+		re_cancel();
+	}
+
+	/* as the sender puts it on the wire */
+	static uint8_t *put_u32(uint8_t *p, uint32_t v)
+	{
+		v = htonl(v);
+		*p++ = v >> 24;
+		*p++ = v >> 16;
+		*p++ = v >> 8;
+		*p++ = v;
+
+		return p;
+	}
+
+	void recv(const uint8_t *msg, size_t len)
+	{
+		ASSERT_EQ(0, ecall_user_data_recv(ecall, msg, len));
+	}
+
+	/* the old FILE_START also has the first chunk */
+	void recv_start(bool with_data = false)
+	{
+		uint8_t *p = msg;
+
+		*p++ = UD_FILE_START;
+		p = put_u32(p, UD_NBLOCKS);
+		memset(p, 0, UD_NAME_SIZE);
+		strcpy((char *)p, "file");
+		p += UD_NAME_SIZE;
+		if (with_data) {
+			memcpy(p, data, UD_CHUNK_SIZE);
+			p += UD_CHUNK_SIZE;
+		}
+
+		recv(msg, p - msg);
+	}
+
+	/* block k has chunk k-1 */
+	void recv_chunk(uint32_t k, bool corrupt = false)
+	{
+		const uint8_t *chunk = data + (k - 1) * UD_CHUNK_SIZE;
+		uint8_t *p = msg;
+
+		*p++ = UD_FILE_CHUNK;
+		p = put_u32(p, k);
+		p = put_u32(p, crc32(0, chunk, UD_CHUNK_SIZE));
+		memcpy(p, chunk, UD_CHUNK_SIZE);
+		if (corrupt)
+			p[UD_CHUNK_SIZE / 2] ^= 0x40;
+		p += UD_CHUNK_SIZE;
+
+		recv(msg, p - msg);
+	}
+
+	/* the old framing, the chunks in order without a header */
+	void recv_file(uint32_t i)
+	{
+		msg[0] = UD_FILE;
+		memcpy(msg + 1, data + i * UD_CHUNK_SIZE, UD_CHUNK_SIZE);
+
+		recv(msg, 1 + UD_CHUNK_SIZE);
+	}
+
+	/* FILE_END has the last chunk */
+	void recv_end()
+	{
+		uint8_t *p = msg;
+
+		*p++ = UD_FILE_END;
+		memcpy(p, sha, sizeof(sha));
+		p += sizeof(sha);
+		memcpy(p, data + (UD_NBLOCKS - 1) * UD_CHUNK_SIZE,
+		       UD_CHUNK_SIZE);
+		p += UD_CHUNK_SIZE;
+
+		recv(msg, p - msg);
+	}
+
+	bool debug_has(const char *str)
+	{
+		char buf[512];
+
+		re_snprintf(buf, sizeof(buf), "%H",
+			    ecall_user_data_debug, ecall);
+
+		if (!strstr(buf, str)) {
+			re_fprintf(stderr, "'%s' not in: %s\n", str, buf);
+			return false;
+		}
+
+		return true;
+	}
+
+	void verify_file()
+	{
+		uint8_t buf[sizeof(data) + 1];
+		FILE *fp;
+		size_t n;
+
+		ASSERT_EQ(1, n_rcv_files);
+		ASSERT_STREQ(path.c_str(), location.c_str());
+
+		fp = fopen(path.c_str(), "rb");
+		ASSERT_TRUE(fp != NULL);
+		n = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+
+		ASSERT_EQ(sizeof(data), n);
+		ASSERT_EQ(0, memcmp(data, buf, sizeof(data)));
+	}
+
+protected:
+	std::string dir;
+	std::string path;
+	std::string location;
+	struct msystem *msys = nullptr;
+	struct list ecalls;
+	struct ecall *ecall = nullptr;
+	int n_rcv_files = 0;
+
+	uint8_t data[UD_NBLOCKS * UD_CHUNK_SIZE];
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	uint8_t msg[1 + SHA256_DIGEST_LENGTH + UD_NAME_SIZE + UD_CHUNK_SIZE];
+};
+
+
+TEST_F(UserData, file_chunks_in_order)
+{
+	int err;
+
+	recv_start();
+	for (uint32_t k = 1; k < UD_NBLOCKS; k++)
+		recv_chunk(k);
+	ASSERT_TRUE(debug_has("rcv=on block=4/4 bytes=3000 "));
+
+	recv_end();
+
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	verify_file();
+
+	/* the end is acked with the number of messages */
+	ASSERT_TRUE(debug_has("rcv=off block=5/4 "));
+	ASSERT_TRUE(debug_has("ctl=[6:5]"));
+}
+
+
+TEST_F(UserData, file_chunk_duplicates)
+{
+	int err;
+
+	recv_start();
+	recv_chunk(1);
+	recv_chunk(2);
+	recv_chunk(2);
+	recv_chunk(1);
+	ASSERT_TRUE(debug_has("rcv=on block=3/4 bytes=2000 "));
+
+	recv_chunk(3);
+	recv_end();
+
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	verify_file();
+	ASSERT_TRUE(debug_has("ctl=[6:5]"));
+}
+
+
+TEST_F(UserData, file_chunk_corrupt)
+{
+	recv_start();
+	recv_chunk(1);
+	recv_chunk(2, true);
+
+	/* aborted, the block count tells the sender where it failed */
+	ASSERT_TRUE(debug_has("rcv=off block=2/4 bytes=1000 "));
+	ASSERT_TRUE(debug_has("ctl=[6:2]"));
+
+	/* the rest is ignored */
+	recv_chunk(3);
+	recv_end();
+	ASSERT_TRUE(debug_has("rcv=off block=2/4 bytes=1000 "));
+	ASSERT_TRUE(debug_has("ctl=[6:2]"));
+	ASSERT_EQ(0, n_rcv_files);
+}
+
+
+TEST_F(UserData, file_chunk_gap)
+{
+	recv_start();
+	recv_chunk(1);
+	recv_chunk(3);
+
+	ASSERT_TRUE(debug_has("rcv=off block=2/4 bytes=1000 "));
+	ASSERT_TRUE(debug_has("ctl=[6:2]"));
+	ASSERT_EQ(0, n_rcv_files);
+}
+
+
+TEST_F(UserData, file_end_corrupt)
+{
+	recv_start();
+	for (uint32_t k = 1; k < UD_NBLOCKS; k++)
+		recv_chunk(k);
+
+	sha[0] ^= 0x01;
+	recv_end();
+
+	/* acked with the block count it failed at */
+	ASSERT_TRUE(debug_has("rcv=off block=4/4 bytes=4000 "));
+	ASSERT_TRUE(debug_has("ctl=[6:4]"));
+	ASSERT_EQ(0, n_rcv_files);
+}
+
+
+TEST_F(UserData, file_resume)
+{
+	int err;
+
+	/* the capabilities go out when the channel opens, there is no
+	 * data channel here so the control messages stay queued */
+	ASSERT_EQ(0, ecall_user_data_channel_changed(ecall, true));
+	ASSERT_TRUE(debug_has("open=1 "));
+	ASSERT_TRUE(debug_has("ctl=[8:1]"));
+
+	recv_start();
+	recv_chunk(1);
+	recv_chunk(2);
+
+	ASSERT_EQ(0, ecall_user_data_channel_changed(ecall, false));
+	ASSERT_TRUE(debug_has("open=0 "));
+	ASSERT_EQ(0, ecall_user_data_channel_changed(ecall, true));
+
+	/* tells the sender to go on from block 3 */
+	ASSERT_TRUE(debug_has("ctl=[8:1 8:1 3:3]"));
+
+	/* block 2 was still on its way */
+	recv_chunk(2);
+	recv_chunk(3);
+	recv_end();
+
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	verify_file();
+	ASSERT_TRUE(debug_has("ctl=[8:1 8:1 3:3 6:5]"));
+}
+
+
+TEST_F(UserData, file_caps)
+{
+	uint8_t *p = msg;
+
+	ASSERT_TRUE(debug_has("caps=0x0 "));
+
+	*p++ = UD_FILE_CAPS;
+	p = put_u32(p, 1);
+	recv(msg, p - msg);
+
+	ASSERT_TRUE(debug_has("caps=0x1 "));
+}
+
+
+TEST_F(UserData, file_old_framing)
+{
+	int err;
+
+	recv_start(true);
+	recv_file(1);
+	recv_file(2);
+	recv_end();
+
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	verify_file();
+}
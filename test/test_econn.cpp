@@ -16,6 +16,7 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -1343,3 +1344,330 @@ TEST(econn, transp_resolve)
 	ASSERT_EQ(ECONN_TRANSP_BACKEND, econn_transp_resolve(ECONN_CANCEL));
 	ASSERT_EQ(ECONN_TRANSP_DIRECT, econn_transp_resolve(ECONN_HANGUP));
 }
+
+
+#define CODEC_SDP_LINES 120
+#define CODEC_ROUNDS    2000
+
+
+static void codec_setup(struct econn_message *msg, char **sdpp)
+{
+	struct mbuf *mb = mbuf_alloc(8192);
+	int err;
+
+	ASSERT_TRUE(mb != NULL);
+
+	err = mbuf_printf(mb, "v=0\r\no=- 42 2 IN IP4 127.0.0.1\r\n");
+	for (int i = 0; i < CODEC_SDP_LINES; i++) {
+		err |= mbuf_printf(mb, "a=candidate:%d 1 udp 2122260223 "
+				   "10.0.0.%d 5%04d typ host\r\n",
+				   i, i % 250, i);
+	}
+	err |= mbuf_printf(mb, "a=x-\"quoted\"\\back\\slash/\r\n");
+	ASSERT_EQ(0, err);
+
+	mb->pos = 0;
+	err = mbuf_strdup(mb, sdpp, mb->end);
+	ASSERT_EQ(0, err);
+	mem_deref(mb);
+
+	err = econn_message_init(msg, ECONN_SETUP, "7e5f2b1c");
+	ASSERT_EQ(0, err);
+
+	str_ncpy(msg->dest_userid, "193ac375-d7f0-4a0e-a237-e409297c7c9f",
+		 sizeof(msg->dest_userid));
+	str_ncpy(msg->dest_clientid, "fcf510876f3349e4",
+		 sizeof(msg->dest_clientid));
+	msg->resp = true;
+	msg->u.setup.sdp_msg = *sdpp;
+
+	err = econn_props_alloc(&msg->u.setup.props, NULL);
+	ASSERT_EQ(0, err);
+	err  = econn_props_add(msg->u.setup.props, "videosend", "true");
+	err |= econn_props_add(msg->u.setup.props, "screensend", "false");
+	ASSERT_EQ(0, err);
+}
+
+
+/* Decode with both codecs, the common part must be the same */
+static void codec_decode_both(const char *str,
+			      struct econn_message **ap,
+			      struct econn_message **bp)
+{
+	struct econn_message *a, *b;
+	int err;
+
+	err = econn_message_decode(ap, 100, 90, str, str_len(str));
+	ASSERT_EQ(0, err);
+	err = econn_message_decode_jzon(bp, 100, 90, str, str_len(str));
+	ASSERT_EQ(0, err);
+
+	a = *ap;
+	b = *bp;
+
+	ASSERT_EQ(b->msg_type, a->msg_type);
+	ASSERT_STREQ(b->sessid_sender, a->sessid_sender);
+	ASSERT_STREQ(b->dest_userid, a->dest_userid);
+	ASSERT_STREQ(b->dest_clientid, a->dest_clientid);
+	ASSERT_EQ(b->resp, a->resp);
+	ASSERT_EQ(b->age, a->age);
+}
+
+
+/* Both codecs must encode msg to the same string, and decode it alike */
+static void codec_both(const struct econn_message *msg,
+		       struct econn_message **ap,
+		       struct econn_message **bp)
+{
+	char *str_a = NULL, *str_b = NULL;
+	int err;
+
+	err = econn_message_encode(&str_a, msg);
+	ASSERT_EQ(0, err);
+	err = econn_message_encode_jzon(&str_b, msg);
+	ASSERT_EQ(0, err);
+	ASSERT_STREQ(str_b, str_a);
+
+	ASSERT_NO_FATAL_FAILURE(codec_decode_both(str_a, ap, bp));
+
+	mem_deref(str_a);
+	mem_deref(str_b);
+}
+
+
+static double codec_time_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0
+		+ (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+TEST(econn, codec_same_as_jzon)
+{
+	struct econn_message msg;
+	struct econn_message *a = NULL, *b = NULL;
+	char *sdp = NULL, *str_a = NULL, *str_b = NULL;
+	int err;
+
+	ASSERT_NO_FATAL_FAILURE(codec_setup(&msg, &sdp));
+
+	err = econn_message_encode(&str_a, &msg);
+	ASSERT_EQ(0, err);
+	err = econn_message_encode_jzon(&str_b, &msg);
+	ASSERT_EQ(0, err);
+	ASSERT_STREQ(str_b, str_a);
+
+	err = econn_message_decode(&a, 100, 90, str_a, str_len(str_a));
+	ASSERT_EQ(0, err);
+	err = econn_message_decode_jzon(&b, 100, 90, str_a, str_len(str_a));
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(ECONN_SETUP, a->msg_type);
+	ASSERT_EQ(b->msg_type, a->msg_type);
+	ASSERT_STREQ(b->sessid_sender, a->sessid_sender);
+	ASSERT_STREQ(b->dest_userid, a->dest_userid);
+	ASSERT_STREQ(b->dest_clientid, a->dest_clientid);
+	ASSERT_EQ(b->resp, a->resp);
+	ASSERT_EQ(b->age, a->age);
+	ASSERT_STREQ(sdp, a->u.setup.sdp_msg);
+	ASSERT_STREQ(b->u.setup.sdp_msg, a->u.setup.sdp_msg);
+	ASSERT_STREQ("true", econn_props_get(a->u.setup.props, "videosend"));
+	ASSERT_STREQ("false",
+		     econn_props_get(a->u.setup.props, "screensend"));
+
+	/* whatever the streaming codec does not take goes through jzon */
+	mem_deref(a);
+	a = NULL;
+	err = econn_message_decode(&a, 0, 0, "{\"version\":\"2.0\"}", 17);
+	ASSERT_EQ(EPROTO, err);
+	ASSERT_TRUE(a == NULL);
+
+	mem_deref(b);
+	mem_deref(str_a);
+	mem_deref(str_b);
+	econn_message_reset(&msg);
+}
+
+
+TEST(econn, codec_same_as_jzon_propsync)
+{
+	struct econn_message msg;
+	struct econn_message *a = NULL, *b = NULL;
+	int err;
+
+	err = econn_message_init(&msg, ECONN_PROPSYNC, "7e5f2b1c");
+	ASSERT_EQ(0, err);
+	msg.resp = true;
+
+	err = econn_props_alloc(&msg.u.propsync.props, NULL);
+	ASSERT_EQ(0, err);
+	err  = econn_props_add(msg.u.propsync.props, "videosend", "paused");
+	err |= econn_props_add(msg.u.propsync.props, "audiocbr", "true");
+	err |= econn_props_add(msg.u.propsync.props, "note",
+			       "caf\xc3\xa9 \"x\"/y");
+	ASSERT_EQ(0, err);
+
+	ASSERT_NO_FATAL_FAILURE(codec_both(&msg, &a, &b));
+
+	ASSERT_EQ(ECONN_PROPSYNC, a->msg_type);
+	for (const char *key : {"videosend", "audiocbr", "note"}) {
+		ASSERT_STREQ(econn_props_get(msg.u.propsync.props, key),
+			     econn_props_get(a->u.propsync.props, key));
+		ASSERT_STREQ(econn_props_get(b->u.propsync.props, key),
+			     econn_props_get(a->u.propsync.props, key));
+	}
+
+	mem_deref(a);
+	mem_deref(b);
+	econn_message_reset(&msg);
+}
+
+
+TEST(econn, codec_same_as_jzon_alert)
+{
+	struct econn_message msg;
+	struct econn_message *a = NULL, *b = NULL;
+	int err;
+
+	err = econn_message_init(&msg, ECONN_ALERT, "7e5f2b1c");
+	ASSERT_EQ(0, err);
+
+	/* escaped as \u00XX on the wire */
+	msg.u.alert.level = 2;
+	err = str_dup(&msg.u.alert.descr,
+		      "caf\xc3\xa9 \"quoted\" a/b\\c\ttab\x01\x1f");
+	ASSERT_EQ(0, err);
+
+	ASSERT_NO_FATAL_FAILURE(codec_both(&msg, &a, &b));
+
+	ASSERT_EQ(ECONN_ALERT, a->msg_type);
+	ASSERT_EQ(2u, a->u.alert.level);
+	ASSERT_EQ(b->u.alert.level, a->u.alert.level);
+	ASSERT_STREQ(msg.u.alert.descr, a->u.alert.descr);
+	ASSERT_STREQ(b->u.alert.descr, a->u.alert.descr);
+
+	mem_deref(a);
+	mem_deref(b);
+	econn_message_reset(&msg);
+}
+
+
+TEST(econn, codec_same_as_jzon_groupstart)
+{
+	struct econn_message msg;
+	struct econn_message *a = NULL, *b = NULL;
+	int err;
+
+	/* props are optional for GROUPSTART */
+	err = econn_message_init(&msg, ECONN_GROUP_START, "7e5f2b1c");
+	ASSERT_EQ(0, err);
+
+	ASSERT_NO_FATAL_FAILURE(codec_both(&msg, &a, &b));
+
+	ASSERT_EQ(ECONN_GROUP_START, a->msg_type);
+	ASSERT_TRUE(a->u.groupstart.props == NULL);
+	ASSERT_TRUE(b->u.groupstart.props == NULL);
+
+	mem_deref(a);
+	mem_deref(b);
+	econn_message_reset(&msg);
+}
+
+
+TEST(econn, codec_unicode_escapes)
+{
+	struct econn_message *a = NULL, *b = NULL;
+	char str[512];
+
+	/* \u escapes in the content, and in a field the streaming codec
+	 * leaves to jzon */
+	re_snprintf(str, sizeof(str),
+		    "{\"version\":\"%s\",\"type\":\"ALERT\","
+		    "\"sessid\":\"7e5f2b1c\","
+		    "\"dest_userid\":\"a\\u0062c\","
+		    "\"resp\":false,\"level\":1,"
+		    "\"descr\":\"caf\\u00e9 \\u20ac \\u0001\\/\\n\"}",
+		    econn_proto_version);
+
+	ASSERT_NO_FATAL_FAILURE(codec_decode_both(str, &a, &b));
+
+	ASSERT_EQ(ECONN_ALERT, a->msg_type);
+	ASSERT_STREQ("abc", a->dest_userid);
+	ASSERT_STREQ("caf\xc3\xa9 \xe2\x82\xac \x01/\n", a->u.alert.descr);
+	ASSERT_STREQ(b->u.alert.descr, a->u.alert.descr);
+
+	mem_deref(a);
+	mem_deref(b);
+
+	/* and in the SDP of a SETUP */
+	re_snprintf(str, sizeof(str),
+		    "{\"version\":\"%s\",\"type\":\"SETUP\","
+		    "\"sessid\":\"7e5f2b1c\",\"resp\":true,"
+		    "\"sdp\":\"v=0\\r\\ns=\\u00c5se\\r\\n\","
+		    "\"props\":{\"videosend\":\"true\"}}",
+		    econn_proto_version);
+
+	ASSERT_NO_FATAL_FAILURE(codec_decode_both(str, &a, &b));
+
+	ASSERT_EQ(ECONN_SETUP, a->msg_type);
+	ASSERT_STREQ("v=0\r\ns=\xc3\x85se\r\n", a->u.setup.sdp_msg);
+	ASSERT_STREQ(b->u.setup.sdp_msg, a->u.setup.sdp_msg);
+	ASSERT_STREQ("true", econn_props_get(a->u.setup.props, "videosend"));
+
+	mem_deref(a);
+	mem_deref(b);
+}
+
+
+TEST(econn, codec_benchmark)
+{
+	struct econn_message msg;
+	char *sdp = NULL, *str = NULL;
+	struct timeval start;
+	double ms_stream, ms_jzon;
+	int err;
+
+	ASSERT_NO_FATAL_FAILURE(codec_setup(&msg, &sdp));
+
+	err = econn_message_encode(&str, &msg);
+	ASSERT_EQ(0, err);
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < CODEC_ROUNDS; i++) {
+		struct econn_message *m = NULL;
+		char *s = NULL;
+
+		err  = econn_message_decode(&m, 0, 0, str, str_len(str));
+		err |= econn_message_encode(&s, m);
+		ASSERT_EQ(0, err);
+
+		mem_deref(m);
+		mem_deref(s);
+	}
+	ms_stream = codec_time_ms(&start);
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < CODEC_ROUNDS; i++) {
+		struct econn_message *m = NULL;
+		char *s = NULL;
+
+		err  = econn_message_decode_jzon(&m, 0, 0, str, str_len(str));
+		err |= econn_message_encode_jzon(&s, m);
+		ASSERT_EQ(0, err);
+
+		mem_deref(m);
+		mem_deref(s);
+	}
+	ms_jzon = codec_time_ms(&start);
+
+	re_printf("econn codec: %zu bytes, %d rounds: "
+		  "stream %.1f ms, jzon %.1f ms\n",
+		  str_len(str), CODEC_ROUNDS, ms_stream, ms_jzon);
+
+	mem_deref(str);
+	econn_message_reset(&msg);
+}
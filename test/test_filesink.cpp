@@ -0,0 +1,202 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <re.h>
+#include <avs.h>
+#include <gtest/gtest.h>
+#include "ztest.h"
+
+
+#define CHUNK_SIZE 4096
+#define NUM_CHUNKS 64
+
+
+class FileSink : public ::testing::Test {
+
+public:
+	virtual void SetUp() override
+	{
+		char tmp[256] = "/tmp/ztest_sink_XXXXXX";
+
+		ASSERT_TRUE(mkdtemp(tmp) != NULL);
+		dir = tmp;
+		path = dir + "/file";
+	}
+
+	virtual void TearDown() override
+	{
+		mem_deref(sink);
+		unlink(path.c_str());
+		rmdir(dir.c_str());
+	}
+
+	static void sink_handler(uint64_t written, bool done, int err,
+				 void *arg)
+	{
+		FileSink *fs = static_cast<FileSink *>(arg);
+
+		++fs->n_calls;
+		fs->written = written;
+		fs->err = err;
+
+		if (done)
+			fs->done = true;
+		if (done || err)
+			re_cancel();
+	}
+
+	/* wait for the writer thread, without running the re thread */
+	void wait_written(uint64_t total)
+	{
+		char expect[64];
+		char buf[256];
+
+		re_snprintf(expect, sizeof(expect), "written=%llu queued=0 ",
+			    (unsigned long long)total);
+
+		for (int i = 0; i < 1000; i++) {
+			re_snprintf(buf, sizeof(buf), "%H",
+				    file_sink_debug, sink);
+			if (strstr(buf, expect))
+				break;
+			usleep(10000);
+		}
+
+		/* and for it to close the file */
+		usleep(50000);
+	}
+
+protected:
+	std::string dir;
+	std::string path;
+	struct file_sink *sink = nullptr;
+
+	unsigned n_calls = 0;
+	uint64_t written = 0;
+	int err = 0;
+	bool done = false;
+};
+
+
+static void fill_chunk(uint8_t *buf, unsigned i)
+{
+	for (size_t j = 0; j < CHUNK_SIZE; j++)
+		buf[j] = (uint8_t)(i * 31 + j);
+}
+
+
+TEST_F(FileSink, out_of_order)
+{
+	uint8_t buf[CHUNK_SIZE];
+	uint8_t ref[CHUNK_SIZE];
+	FILE *fp;
+	int r;
+
+	r = file_sink_alloc(&sink, path.c_str(), sink_handler, this);
+	ASSERT_EQ(0, r);
+
+	/* odd chunks first, then the even ones */
+	for (unsigned i = 1; i < NUM_CHUNKS; i += 2) {
+		fill_chunk(buf, i);
+		r = file_sink_write(sink, (uint64_t)i * CHUNK_SIZE,
+				    buf, sizeof(buf));
+		ASSERT_EQ(0, r);
+	}
+	for (unsigned i = 0; i < NUM_CHUNKS; i += 2) {
+		fill_chunk(buf, i);
+		r = file_sink_write(sink, (uint64_t)i * CHUNK_SIZE,
+				    buf, sizeof(buf));
+		ASSERT_EQ(0, r);
+	}
+
+	r = file_sink_finish(sink);
+	ASSERT_EQ(0, r);
+
+	wait_written((uint64_t)NUM_CHUNKS * CHUNK_SIZE);
+	ASSERT_EQ(0u, n_calls);
+	ASSERT_EQ(0u, file_sink_queued(sink));
+
+	r = re_main_wait(10000);
+	ASSERT_EQ(0, r);
+
+	ASSERT_TRUE(done);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ((uint64_t)NUM_CHUNKS * CHUNK_SIZE, written);
+
+	/* the writes done while the re thread was busy come as one call,
+	 * and another one if the file was not closed yet */
+	ASSERT_GE(n_calls, 1u);
+	ASSERT_LE(n_calls, 2u);
+
+	ASSERT_EQ(EALREADY, file_sink_write(sink, 0, buf, sizeof(buf)));
+
+	fp = fopen(path.c_str(), "rb");
+	ASSERT_TRUE(fp != NULL);
+
+	for (unsigned i = 0; i < NUM_CHUNKS; i++) {
+		fill_chunk(ref, i);
+		ASSERT_EQ(sizeof(buf), fread(buf, 1, sizeof(buf), fp));
+		ASSERT_EQ(0, memcmp(ref, buf, sizeof(buf)));
+	}
+	ASSERT_EQ(0u, fread(buf, 1, sizeof(buf), fp));
+
+	fclose(fp);
+}
+
+
+TEST_F(FileSink, no_directory)
+{
+	std::string bad = dir + "/none/file";
+	int r;
+
+	r = file_sink_alloc(&sink, bad.c_str(), sink_handler, this);
+	ASSERT_EQ(ENOENT, r);
+	ASSERT_TRUE(sink == NULL);
+}
+
+
+TEST_F(FileSink, write_error)
+{
+	uint8_t buf[CHUNK_SIZE];
+	int r;
+
+	/* every write fails with ENOSPC */
+	if (access("/dev/full", W_OK) != 0) {
+		printf("no /dev/full, skipping\n");
+		return;
+	}
+
+	r = file_sink_alloc(&sink, "/dev/full", sink_handler, this);
+	ASSERT_EQ(0, r);
+
+	fill_chunk(buf, 0);
+	r = file_sink_write(sink, 0, buf, sizeof(buf));
+	ASSERT_EQ(0, r);
+
+	r = re_main_wait(10000);
+	ASSERT_EQ(0, r);
+
+	ASSERT_EQ(ENOSPC, err);
+	ASSERT_FALSE(done);
+	ASSERT_EQ(0u, written);
+
+	/* nothing more is taken */
+	r = file_sink_write(sink, CHUNK_SIZE, buf, sizeof(buf));
+	ASSERT_EQ(ENOSPC, r);
+}
@@ -0,0 +1,122 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <re.h>
+#include <avs.h>
+#include <gtest/gtest.h>
+
+
+#define MARSHAL_CALLS 500
+
+
+struct marshal_bench {
+	pthread_t tid;
+	volatile bool done;
+	double total_ms;
+	double max_ms;
+	unsigned n;
+	struct tmr tmr;
+};
+
+
+static double time_diff_ms(const struct timeval *start)
+{
+	struct timeval now, res;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &res);
+
+	return (double)res.tv_sec * 1000.0 + (double)res.tv_usec / 1000.0;
+}
+
+
+static void *caller_thread(void *arg)
+{
+	struct marshal_bench *mb = (struct marshal_bench *)arg;
+	unsigned i;
+
+	for (i = 0; i < MARSHAL_CALLS; i++) {
+
+		struct timeval start;
+		double ms;
+
+		gettimeofday(&start, NULL);
+
+		/* a call that does nothing on the main thread */
+		(void)marshal_flowmgr_can_send_video(NULL, "conv");
+
+		ms = time_diff_ms(&start);
+
+		mb->total_ms += ms;
+		if (ms > mb->max_ms)
+			mb->max_ms = ms;
+		++mb->n;
+	}
+
+	mb->done = true;
+
+	return NULL;
+}
+
+
+static void done_poll(void *arg)
+{
+	struct marshal_bench *mb = (struct marshal_bench *)arg;
+
+	if (mb->done)
+		re_cancel();
+	else
+		tmr_start(&mb->tmr, 5, done_poll, mb);
+}
+
+
+TEST(flowmgr, marshal_latency)
+{
+	struct marshal_bench mb;
+	double avg;
+	int err;
+
+	memset(&mb, 0, sizeof(mb));
+	tmr_init(&mb.tmr);
+
+	err = flowmgr_init("audummy");
+	ASSERT_EQ(0, err);
+
+	tmr_start(&mb.tmr, 5, done_poll, &mb);
+	pthread_create(&mb.tid, NULL, caller_thread, &mb);
+
+	err = re_main(NULL);
+	ASSERT_EQ(0, err);
+
+	pthread_join(mb.tid, NULL);
+	tmr_cancel(&mb.tmr);
+
+	flowmgr_close();
+
+	ASSERT_EQ(MARSHAL_CALLS, mb.n);
+
+	avg = mb.total_ms / mb.n;
+
+	printf("flowmgr marshal: %u calls, avg %.3f ms, max %.3f ms\n",
+	       mb.n, avg, mb.max_ms);
+
+	/* used to be at least 40 ms per call */
+	ASSERT_LT(avg, 5.0);
+}
@@ -0,0 +1,328 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <re.h>
+#include <avs.h>
+#include <gtest/gtest.h>
+
+
+struct log_test {
+	struct log logger;
+	unsigned n_msg;
+	unsigned n_test;
+	enum log_level last_level;
+	size_t last_len;
+	volatile bool hold;
+};
+
+static unsigned n_print;
+
+
+static void log_handler(uint32_t level, const char *msg, void *arg)
+{
+	struct log_test *lt = (struct log_test *)arg;
+
+	while (lt->hold)
+		usleep(1000);
+
+	++lt->n_msg;
+	if (0 == strncmp(msg, "test", 4))
+		++lt->n_test;
+	lt->last_level = (enum log_level)level;
+	lt->last_len = str_len(msg);
+}
+
+
+static int counting_print(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	++n_print;
+
+	return re_hprintf(pf, "x");
+}
+
+
+class Log : public ::testing::Test {
+
+public:
+	virtual void SetUp() override
+	{
+		memset(&lt, 0, sizeof(lt));
+		lt.logger.h = log_handler;
+		lt.logger.arg = &lt;
+
+		n_print = 0;
+		saved_level = log_get_min_level();
+
+		log_register_handler(&lt.logger);
+		log_enable_stderr(false);
+	}
+
+	virtual void TearDown() override
+	{
+		lt.hold = false;
+		log_async_stop();
+		log_set_file(NULL, 0, 0);
+		log_unregister_handler(&lt.logger);
+		log_reset_module_levels();
+		log_set_min_level(saved_level);
+		log_enable_stderr(true);
+	}
+
+protected:
+	struct log_test lt;
+	enum log_level saved_level;
+};
+
+
+TEST_F(Log, disabled_level_is_not_formatted)
+{
+	log_set_min_level(LOG_LEVEL_WARN);
+
+	debug("test(%p): %H\n", this, counting_print, NULL);
+	info("test(%p): %H\n", this, counting_print, NULL);
+	loglv(LOG_LEVEL_INFO, "test: %H\n", counting_print, NULL);
+	info_hot("test: %H\n", counting_print, NULL);
+
+	ASSERT_EQ(0, n_print);
+	ASSERT_EQ(0, lt.n_msg);
+
+	warning("test(%p): %H\n", this, counting_print, NULL);
+
+	ASSERT_EQ(1, n_print);
+	ASSERT_EQ(1, lt.n_msg);
+	ASSERT_EQ(LOG_LEVEL_WARN, lt.last_level);
+}
+
+
+TEST_F(Log, module_levels)
+{
+	log_set_min_level(LOG_LEVEL_WARN);
+
+	ASSERT_EQ(0, log_set_module_level("mediaflow", LOG_LEVEL_DEBUG));
+	ASSERT_EQ(0, log_set_module_level("econn", LOG_LEVEL_ERROR));
+	ASSERT_EQ(EINVAL, log_set_module_level("", LOG_LEVEL_DEBUG));
+
+	ASSERT_TRUE(log_level_enabled(LOG_LEVEL_DEBUG));
+
+	debug("mediaflow(%p): debug\n", this);
+	ASSERT_EQ(1, lt.n_msg);
+
+	/* prefix of another module does not match */
+	debug("mediaflowx(%p): debug\n", this);
+	info("ecall(%p): info\n", this);
+	warning("econn: warning\n");
+	ASSERT_EQ(1, lt.n_msg);
+
+	error("econn: error\n");
+	warning("ecall(%p): warning\n", this);
+	ASSERT_EQ(3, lt.n_msg);
+
+	log_reset_module_levels();
+	ASSERT_FALSE(log_level_enabled(LOG_LEVEL_INFO));
+
+	debug("mediaflow(%p): debug\n", this);
+	ASSERT_EQ(3, lt.n_msg);
+}
+
+
+static void call_vlog(enum log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vlog(level, fmt, ap);
+	va_end(ap);
+}
+
+
+/* vlog() is not filtered, dce and usrsctp call it directly */
+TEST_F(Log, vlog_is_not_filtered)
+{
+	log_set_min_level(LOG_LEVEL_WARN);
+
+	call_vlog(LOG_LEVEL_DEBUG, "test: %H\n", counting_print, NULL);
+
+	ASSERT_EQ(1, n_print);
+	ASSERT_EQ(1, lt.n_msg);
+	ASSERT_EQ(LOG_LEVEL_DEBUG, lt.last_level);
+}
+
+
+TEST_F(Log, long_line)
+{
+	char buf[3000];
+
+	memset(buf, 'a', sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	warning("%s", buf);
+
+	ASSERT_EQ(1, lt.n_msg);
+	ASSERT_EQ(sizeof(buf) - 1, lt.last_len);
+}
+
+
+#define ASYNC_THREADS 4
+#define ASYNC_LINES   250
+
+
+static void *log_thread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < ASYNC_LINES; i++)
+		warning("test(%p): line %d\n", arg, i);
+
+	return NULL;
+}
+
+
+TEST_F(Log, async)
+{
+	pthread_t tidv[ASYNC_THREADS];
+	int i;
+
+	log_set_min_level(LOG_LEVEL_WARN);
+
+	ASSERT_EQ(0, log_async_start(ASYNC_THREADS * ASYNC_LINES));
+	ASSERT_EQ(EALREADY, log_async_start(0));
+
+	for (i = 0; i < ASYNC_THREADS; i++)
+		pthread_create(&tidv[i], NULL, log_thread, &tidv[i]);
+	for (i = 0; i < ASYNC_THREADS; i++)
+		pthread_join(tidv[i], NULL);
+
+	/* all lines are written out on stop */
+	log_async_stop();
+
+	ASSERT_EQ(ASYNC_THREADS * ASYNC_LINES, lt.n_test);
+	ASSERT_EQ(0, log_async_dropped());
+}
+
+
+struct stop_logger {
+	pthread_t tid;
+	unsigned n;
+};
+
+
+static void *stop_log_thread(void *arg)
+{
+	struct stop_logger *sl = (struct stop_logger *)arg;
+	int i;
+
+	for (i = 0; i < ASYNC_LINES; i++) {
+		warning("test(%p): line %d\n", arg, i);
+		__atomic_add_fetch(&sl->n, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+
+/* other threads go on logging while async logging is stopped */
+TEST_F(Log, async_stop_while_logging)
+{
+	struct stop_logger slv[ASYNC_THREADS];
+	int i;
+
+	log_set_min_level(LOG_LEVEL_WARN);
+
+	ASSERT_EQ(0, log_async_start(ASYNC_THREADS * ASYNC_LINES));
+
+	memset(slv, 0, sizeof(slv));
+	for (i = 0; i < ASYNC_THREADS; i++)
+		pthread_create(&slv[i].tid, NULL, stop_log_thread, &slv[i]);
+
+	while (!__atomic_load_n(&slv[0].n, __ATOMIC_RELAXED))
+		usleep(100);
+
+	log_async_stop();
+
+	for (i = 0; i < ASYNC_THREADS; i++)
+		pthread_join(slv[i].tid, NULL);
+
+	/* no line is lost, queued or written synchronously */
+	ASSERT_EQ(0, log_async_dropped());
+	ASSERT_EQ(ASYNC_THREADS * ASYNC_LINES, lt.n_test);
+}
+
+
+TEST_F(Log, async_overflow_drops)
+{
+	int i;
+
+	log_set_min_level(LOG_LEVEL_WARN);
+
+	ASSERT_EQ(0, log_async_start(8));
+
+	/* the writer is stuck in the handler with the first line */
+	lt.hold = true;
+
+	for (i = 0; i < 100; i++)
+		warning("test: line %d\n", i);
+
+	ASSERT_GT(log_async_dropped(), 0);
+
+	lt.hold = false;
+	log_async_stop();
+
+	/* the lines that did not fit are counted, and reported */
+	ASSERT_EQ(100, lt.n_test + log_async_dropped());
+	ASSERT_EQ(lt.n_test + 1, lt.n_msg);
+}
+
+
+TEST_F(Log, file_rotation)
+{
+	char path[256], old[256];
+	FILE *f;
+	int i;
+
+	re_snprintf(path, sizeof(path), "/tmp/avs_test_log_%d.log",
+		    (int)getpid());
+	re_snprintf(old, sizeof(old), "%s.1", path);
+	unlink(path);
+	unlink(old);
+
+	log_set_min_level(LOG_LEVEL_WARN);
+	ASSERT_EQ(0, log_set_file(path, 1000, 1));
+
+	for (i = 0; i < 100; i++)
+		warning("test: line %d\n", i);
+
+	ASSERT_EQ(0, log_set_file(NULL, 0, 0));
+
+	f = fopen(old, "r");
+	ASSERT_TRUE(f != NULL);
+	fclose(f);
+
+	f = fopen(path, "r");
+	ASSERT_TRUE(f != NULL);
+	fseek(f, 0, SEEK_END);
+	ASSERT_LT(ftell(f), 1000);
+	fclose(f);
+
+	unlink(path);
+	unlink(old);
+}
@@ -128,6 +128,18 @@ TEST_F(TestMedia, alloc_and_not_ready)
 }
 
 
+TEST_F(TestMedia, send_reserve_not_ready)
+{
+	struct mbuf *mb = NULL;
+
+	ASSERT_EQ(EINTR, mediaflow_send_reserve(mf, &mb));
+	ASSERT_TRUE(mb == NULL);
+
+	ASSERT_EQ(EINVAL, mediaflow_send_reserve(NULL, &mb));
+	ASSERT_EQ(EINVAL, mediaflow_send_reserve(mf, NULL));
+}
+
+
 TEST_F(TestMedia, init)
 {
 	ASSERT_EQ(0, n_gather);
@@ -176,6 +188,197 @@ TEST(media, ice_cand_decode)
 }
 
 
+TEST(media, rtcp_iter_compound)
+{
+	static const uint8_t app_data[8] = "abcdefg";
+	struct mbuf *mb = mbuf_alloc(256);
+	struct rtcp_iter it;
+	struct rtcp_iter_pkt pkt;
+	const uint8_t *name, *data;
+	size_t len;
+	int err;
+
+	ASSERT_TRUE(mb != NULL);
+
+	err  = rtcp_encode(mb, RTCP_RR, 0, (uint32_t)0x1234, NULL, NULL);
+	err |= rtcp_encode(mb, RTCP_APP, 0, (uint32_t)0x1234, "DATA",
+			   app_data, sizeof(app_data));
+	ASSERT_EQ(0, err);
+
+	rtcp_iter_init(&it, mb->buf, mb->end);
+
+	ASSERT_TRUE(rtcp_iter_next(&it, &pkt));
+	ASSERT_EQ(RTCP_RR, pkt.pt);
+	ASSERT_EQ(0, pkt.count);
+	ASSERT_EQ(4, pkt.body_len);
+	ASSERT_FALSE(rtcp_iter_app(&pkt, &name, &data, &len));
+
+	ASSERT_TRUE(rtcp_iter_next(&it, &pkt));
+	ASSERT_EQ(RTCP_APP, pkt.pt);
+	ASSERT_TRUE(rtcp_iter_app(&pkt, &name, &data, &len));
+	ASSERT_EQ(0, memcmp(name, "DATA", 4));
+	ASSERT_EQ(sizeof(app_data), len);
+	ASSERT_EQ(0, memcmp(data, app_data, len));
+
+	ASSERT_FALSE(rtcp_iter_next(&it, &pkt));
+	ASSERT_EQ(0, it.err);
+
+	/* truncated compound packet */
+	rtcp_iter_init(&it, mb->buf, mb->end - 4);
+
+	ASSERT_TRUE(rtcp_iter_next(&it, &pkt));
+	ASSERT_FALSE(rtcp_iter_next(&it, &pkt));
+	ASSERT_EQ(EBADMSG, it.err);
+
+	mem_deref(mb);
+}
+
+
+
+struct mux_peer {
+	struct udp_mux_peer *peer;
+	struct sa match;       /* the one sender we know about */
+	bool confirm;          /* packets pass authentication */
+	unsigned n_rx;
+	unsigned *n_total;
+	unsigned n_wait;
+};
+
+
+static bool mux_match_handler(const struct sa *src, struct mbuf *mb,
+			      void *arg)
+{
+	struct mux_peer *mp = (struct mux_peer *)arg;
+
+	return sa_cmp(src, &mp->match, SA_ALL);
+}
+
+
+static void mux_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	struct mux_peer *mp = (struct mux_peer *)arg;
+
+	++mp->n_rx;
+
+	if (mp->confirm)
+		udp_mux_confirm(mp->peer, src, mb);
+
+	if (++*mp->n_total >= mp->n_wait)
+		re_cancel();
+}
+
+
+static void mux_send_rtp(struct udp_sock *us, const struct sa *dst,
+			 uint32_t ssrc)
+{
+	struct mbuf *mb = mbuf_alloc(64);
+	int err;
+
+	ASSERT_TRUE(mb != NULL);
+
+	err  = mbuf_write_u8(mb, 0x80);
+	err |= mbuf_write_u8(mb, 96);
+	err |= mbuf_write_u16(mb, htons(1));
+	err |= mbuf_write_u32(mb, htonl(160));
+	err |= mbuf_write_u32(mb, htonl(ssrc));
+	err |= mbuf_fill(mb, 0, 20);
+	ASSERT_EQ(0, err);
+
+	mb->pos = 0;
+
+	err = udp_send(us, dst, mb);
+	ASSERT_EQ(0, err);
+
+	mem_deref(mb);
+}
+
+
+TEST(media, udp_mux_demux)
+{
+	struct udp_mux *mux = NULL;
+	struct udp_sock *us, *us2 = NULL;
+	struct udp_sock *cli[4] = {NULL, NULL, NULL, NULL};
+	struct mux_peer a, b;
+	const struct udp_mux_stats *stats;
+	struct sa laddr, mux_addr;
+	unsigned n_total = 0;
+	size_t i;
+	int err;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.n_total = b.n_total = &n_total;
+	a.confirm = true;
+
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	err = udp_mux_alloc(&mux);
+	ASSERT_EQ(0, err);
+
+	err = udp_mux_sock(&us, mux, &laddr);
+	ASSERT_EQ(0, err);
+	err = udp_local_get(us, &mux_addr);
+	ASSERT_EQ(0, err);
+
+	/* one socket per local address */
+	err = udp_mux_sock(&us2, mux, &laddr);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(us == us2);
+
+	for (i = 0; i < ARRAY_SIZE(cli); i++) {
+		err = udp_listen(&cli[i], &laddr, NULL, NULL);
+		ASSERT_EQ(0, err);
+	}
+
+	udp_local_get(cli[0], &a.match);
+	udp_local_get(cli[1], &b.match);
+
+	err  = udp_mux_attach(&a.peer, mux, us, mux_match_handler,
+			      mux_recv_handler, &a);
+	err |= udp_mux_attach(&b.peer, mux, us, mux_match_handler,
+			      mux_recv_handler, &b);
+	ASSERT_EQ(0, err);
+
+	/* nobody knows cli[3] or its SSRC */
+	mux_send_rtp(cli[3], &mux_addr, 3333);
+
+	/* found by asking the peers */
+	mux_send_rtp(cli[0], &mux_addr, 1111);
+	mux_send_rtp(cli[1], &mux_addr, 2222);
+
+	/* b never authenticated 2222, so it is not routed by it */
+	mux_send_rtp(cli[3], &mux_addr, 2222);
+
+	/* by address */
+	mux_send_rtp(cli[0], &mux_addr, 1111);
+
+	/* peer a from a new address, found by its SSRC */
+	mux_send_rtp(cli[2], &mux_addr, 1111);
+	mux_send_rtp(cli[2], &mux_addr, 1111);
+
+	a.n_wait = b.n_wait = 5;
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(4, a.n_rx);
+	ASSERT_EQ(1, b.n_rx);
+
+	stats = udp_mux_stats(mux);
+	ASSERT_EQ(7, stats->rx);
+	ASSERT_EQ(2, stats->by_match);
+	ASSERT_EQ(2, stats->by_addr);
+	ASSERT_EQ(1, stats->by_ssrc);
+	ASSERT_EQ(2, stats->dropped);
+
+	for (i = 0; i < ARRAY_SIZE(cli); i++)
+		mem_deref(cli[i]);
+	mem_deref(a.peer);
+	mem_deref(b.peer);
+	mem_deref(mux);
+}
+
+
 TEST_F(TestMedia, gather_stun)
 {
 	StunServer srv;
@@ -15,6 +15,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <pthread.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -34,6 +35,8 @@
 struct test {
 	struct list aucodecl;
 	struct tmr tmr;
+	struct media_thread *mt;    /* receive media here, optional */
+	pthread_t main_tid;
 };
 
 
@@ -48,6 +51,7 @@ struct agent {
 
 	unsigned n_estab;
 	unsigned n_rtp_started;
+	unsigned n_off_main;        /* handlers called on another thread */
 };
 
 
@@ -104,6 +108,9 @@ static void rtp_start_handler(bool started, bool video_started, void *arg)
 	struct agent *ag = static_cast<struct agent *>(arg);
     
 	++ag->n_rtp_started;
+
+	if (!pthread_equal(pthread_self(), ag->test->main_tid))
+		++ag->n_off_main;
     
 	/* wait until both agents have RTP ( rcv + snd ) */
 	if (agents_have_rtp(ag)) {
@@ -252,6 +259,9 @@ static void agent_alloc(struct agent **agp, struct test *test, bool offerer,
 	mediaflow_set_tag(ag->mf, ag->name);
 
 	mediaflow_set_rtpstate_handler(ag->mf, rtp_start_handler);
+
+	if (test->mt)
+		mediaflow_set_media_thread(ag->mf, test->mt);
     
 	err = mediaflow_add_local_host_candidate(ag->mf, "en0", &laddr);
 	ASSERT_EQ(0, err);
@@ -267,6 +277,96 @@ static void agent_alloc(struct agent **agp, struct test *test, bool offerer,
 }
 
 
+static uint64_t agent_rx_bytes(const struct agent *ag)
+{
+	char buf[512];
+	struct pl pl;
+
+	re_snprintf(buf, sizeof(buf), "%H", mediaflow_debug, ag->mf);
+
+	if (re_regex(buf, strlen(buf), " rx=[0-9]+", &pl))
+		return 0;
+
+	return pl_u64(&pl);
+}
+
+
+static uint64_t agent_srtp_errors(const struct agent *ag)
+{
+	char buf[8192];
+	struct pl pl;
+
+	re_snprintf(buf, sizeof(buf), "%H", mediaflow_summary, ag->mf);
+
+	if (re_regex(buf, strlen(buf), "SRTP errors:[ ]+[0-9]+", NULL, &pl))
+		return ~0ULL;
+
+	return pl_u64(&pl);
+}
+
+
+static void stop_main(void *arg)
+{
+	(void)arg;
+	re_cancel();
+}
+
+
+/*
+ * Send one RTP packet from A through the reserved buffer, and check that
+ * B gets it. The audio of the audummy codec is 112 bytes per packet, so
+ * a 1000 byte packet can be told apart in the received byte count.
+ */
+static void send_reserved(struct agent *a, struct agent *b)
+{
+	struct rtp_header hdr;
+	static uint8_t pld[1000 - RTP_HEADER_SIZE];
+	struct mbuf *mb = NULL;
+	struct tmr tmr;
+	uint64_t rx, delta;
+	int err;
+
+	/* nothing reserved, nothing to cancel or commit */
+	mediaflow_send_cancel(a->mf);
+	ASSERT_EQ(EINVAL, mediaflow_send_commit(a->mf, NULL));
+
+	err = mediaflow_send_reserve(a->mf, &mb);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(mb != NULL);
+	mediaflow_send_cancel(a->mf);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ver  = RTP_VERSION;
+	hdr.pt   = 96;
+	hdr.ssrc = 0x5e1f;
+
+	rx = agent_rx_bytes(b);
+
+	err = mediaflow_send_reserve(a->mf, &mb);
+	ASSERT_EQ(0, err);
+
+	err  = rtp_hdr_encode(mb, &hdr);
+	err |= mbuf_write_mem(mb, pld, sizeof(pld));
+	ASSERT_EQ(0, err);
+
+	err = mediaflow_send_commit(a->mf, mb);
+	ASSERT_EQ(0, err);
+
+	tmr_init(&tmr);
+	tmr_start(&tmr, 100, stop_main, NULL);
+	err = re_main_wait(5000);
+	tmr_cancel(&tmr);
+	ASSERT_EQ(0, err);
+
+	delta = agent_rx_bytes(b) - rx;
+	ASSERT_GE(delta, 1000u);
+	ASSERT_EQ(0u, (delta - 1000) % 112);
+
+	/* anything sent in plain text would fail to decrypt */
+	ASSERT_EQ(0u, agent_srtp_errors(b));
+}
+
+
 static void test_b2b_base(enum tls_keytype a_cert,
 			  enum tls_keytype b_cert,
 			  enum media_crypto a_cryptos,
@@ -275,7 +375,9 @@ static void test_b2b_base(enum tls_keytype a_cert,
 			  enum media_setup a_setup,
 			  enum media_setup b_setup,
 			  enum media_setup a_setup_expect,
-			  enum media_setup b_setup_expect)
+			  enum media_setup b_setup_expect,
+			  bool media_thread,
+			  bool send_rtp = false)
 {
 	struct test test;
 	struct agent *a = NULL, *b = NULL;
@@ -287,10 +389,16 @@ static void test_b2b_base(enum tls_keytype a_cert,
 #endif
 
 	memset(&test, 0, sizeof(test));
+	test.main_tid = pthread_self();
 
 	err = audummy_init(&test.aucodecl);
 	ASSERT_EQ(0, err);
 
+	if (media_thread) {
+		err = media_thread_alloc(&test.mt, "b2b");
+		ASSERT_EQ(0, err);
+	}
+
 	/* initialization */
 	agent_alloc(&a, &test, true, a_cryptos, "A", a_cert);
 	agent_alloc(&b, &test, false, b_cryptos, "B", b_cert);
@@ -346,8 +454,23 @@ static void test_b2b_base(enum tls_keytype a_cert,
 	ASSERT_TRUE(mediaflow_is_rtpstarted(a->mf));
 	ASSERT_TRUE(mediaflow_is_rtpstarted(b->mf));
 
+	/* received on the media thread, reported on this one */
+	ASSERT_EQ(0u, a->n_off_main);
+	ASSERT_EQ(0u, b->n_off_main);
+
+	if (send_rtp) {
+		ASSERT_NO_FATAL_FAILURE(send_reserved(a, b));
+
+		/* and with batched I/O turned on, then off again */
+		mediaflow_enable_batch_io(a->mf, true);
+		ASSERT_NO_FATAL_FAILURE(send_reserved(a, b));
+		mediaflow_enable_batch_io(a->mf, false);
+		ASSERT_NO_FATAL_FAILURE(send_reserved(a, b));
+	}
+
 	mem_deref(a);
 	mem_deref(b);
+	mem_deref(test.mt);
 
 	tmr_cancel(&test.tmr);
 	audummy_close();
@@ -362,7 +485,7 @@ static void test_b2b(enum tls_keytype a_cert,
 {
 	test_b2b_base(a_cert, b_cert, a_cryptos, b_cryptos, mode_expect,
 		      SETUP_ACTPASS, SETUP_ACTPASS,
-		      SETUP_PASSIVE, SETUP_ACTIVE);
+		      SETUP_PASSIVE, SETUP_ACTIVE, false);
 }
 
 
@@ -373,7 +496,7 @@ static void test_setup(enum media_setup a_setup,
 {
 	test_b2b_base(TLS_KEYTYPE_EC, TLS_KEYTYPE_EC,
 		      CRYPTO_DTLS_SRTP, CRYPTO_DTLS_SRTP, CRYPTO_DTLS_SRTP,
-		      a_setup, b_setup, a_setup_expect, b_setup_expect);
+		      a_setup, b_setup, a_setup_expect, b_setup_expect, false);
 }
 
 
@@ -450,3 +573,21 @@ TEST(media_crypto, setup_active_passive)
 {
 	test_setup(SETUP_ACTIVE, SETUP_PASSIVE, SETUP_ACTIVE, SETUP_PASSIVE);
 }
+
+
+TEST(media_crypto, dtlssrtp_on_media_thread)
+{
+	test_b2b_base(TLS_KEYTYPE_EC, TLS_KEYTYPE_EC,
+		      CRYPTO_DTLS_SRTP, CRYPTO_DTLS_SRTP, CRYPTO_DTLS_SRTP,
+		      SETUP_ACTPASS, SETUP_ACTPASS,
+		      SETUP_PASSIVE, SETUP_ACTIVE, true);
+}
+
+
+TEST(media_crypto, dtlssrtp_send_reserved)
+{
+	test_b2b_base(TLS_KEYTYPE_EC, TLS_KEYTYPE_EC,
+		      CRYPTO_DTLS_SRTP, CRYPTO_DTLS_SRTP, CRYPTO_DTLS_SRTP,
+		      SETUP_ACTPASS, SETUP_ACTPASS,
+		      SETUP_PASSIVE, SETUP_ACTIVE, false, true);
+}
@@ -16,6 +16,11 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -35,3 +40,411 @@ TEST(msystem, 1)
 
 	mem_deref(msys);
 }
+
+
+static int thread_handler(void *arg)
+{
+	pthread_t *tid = (pthread_t *)arg;
+
+	*tid = pthread_self();
+
+	return 42;
+}
+
+
+TEST(msystem, media_threads)
+{
+	struct msystem *msys = NULL;
+	struct media_thread *mt1, *mt2, *mt3;
+	pthread_t tid;
+	int err;
+
+	err = msystem_get(&msys, "audummy", NULL);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(NULL == msystem_media_thread(msys));
+
+	err = msystem_enable_media_threads(msys, 2);
+	ASSERT_EQ(0, err);
+
+	/* calls are spread over the threads */
+	mt1 = msystem_media_thread(msys);
+	mt2 = msystem_media_thread(msys);
+	mt3 = msystem_media_thread(msys);
+	ASSERT_TRUE(mt1 != NULL);
+	ASSERT_TRUE(mt2 != NULL);
+	ASSERT_TRUE(mt1 != mt2);
+	ASSERT_TRUE(mt1 == mt3);
+
+	memset(&tid, 0, sizeof(tid));
+	err = media_thread_call(mt1, thread_handler, &tid);
+	ASSERT_EQ(42, err);
+	ASSERT_FALSE(pthread_equal(tid, pthread_self()));
+	ASSERT_FALSE(media_thread_is_current(mt1));
+
+	err = msystem_enable_media_threads(msys, 0);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(NULL == msystem_media_thread(msys));
+
+	mem_deref(msys);
+}
+
+
+/*
+ * Receive UDP packets while the main thread is busy with other work,
+ * on the main thread and on a media thread. The latencies are only
+ * printed, the test checks where the packets were handled.
+ */
+
+#define LAT_PACKETS   400
+#define LAT_BUCKETS   7
+
+static const uint64_t lat_limits[LAT_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2500, 5000
+};
+
+struct lat_test {
+	struct udp_sock *us;
+	struct sa addr;
+	struct media_thread *mt;
+	struct tmr tmr_busy;
+	uint64_t hist[LAT_BUCKETS];
+	unsigned n;
+	unsigned n_on_mt;          /* handled on the media thread */
+	unsigned n_while_busy;     /* handled while the main thread was busy */
+	volatile bool busy;
+	volatile bool done;
+};
+
+
+static uint64_t now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void lat_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	struct lat_test *lt = (struct lat_test *)arg;
+	uint64_t ts, lat;
+	size_t b;
+	(void)src;
+
+	if (mbuf_get_left(mb) < sizeof(ts))
+		return;
+
+	memcpy(&ts, mbuf_buf(mb), sizeof(ts));
+	lat = now_usec() - ts;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		if (lat < lat_limits[b])
+			break;
+	}
+
+	++lt->hist[b];
+	++lt->n;
+
+	if (lt->mt && media_thread_is_current(lt->mt))
+		++lt->n_on_mt;
+	if (lt->busy)
+		++lt->n_while_busy;
+}
+
+
+static void *lat_sender(void *arg)
+{
+	struct lat_test *lt = (struct lat_test *)arg;
+	int fd, i;
+
+	/* not a libre socket, this thread has no main-loop */
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		goto out;
+
+	for (i = 0; i < LAT_PACKETS; i++) {
+
+		uint8_t pkt[200] = {0};
+		uint64_t ts = now_usec();
+
+		memcpy(pkt, &ts, sizeof(ts));
+
+		(void)sendto(fd, pkt, sizeof(pkt), 0,
+			     &lt->addr.u.sa, lt->addr.len);
+
+		usleep(1000);
+	}
+
+	close(fd);
+ out:
+	lt->done = true;
+
+	return NULL;
+}
+
+
+/* simulated signaling work on the main thread */
+static void busy_handler(void *arg)
+{
+	struct lat_test *lt = (struct lat_test *)arg;
+	uint64_t t0 = now_usec();
+
+	lt->busy = true;
+	while (now_usec() - t0 < 4000)
+		;
+	lt->busy = false;
+
+	if (lt->done)
+		re_cancel();
+	else
+		tmr_start(&lt->tmr_busy, 6, busy_handler, lt);
+}
+
+
+static int lat_listen(void *arg)
+{
+	struct lat_test *lt = (struct lat_test *)arg;
+	int err;
+
+	sa_set_str(&lt->addr, "127.0.0.1", 0);
+
+	err = udp_listen(&lt->us, &lt->addr, lat_recv_handler, lt);
+	if (err)
+		return err;
+
+	return udp_local_get(lt->us, &lt->addr);
+}
+
+
+static int lat_close(void *arg)
+{
+	struct lat_test *lt = (struct lat_test *)arg;
+
+	lt->us = (struct udp_sock *)mem_deref(lt->us);
+
+	return 0;
+}
+
+
+static void lat_run(struct lat_test *lt)
+{
+	pthread_t tid;
+	int err;
+
+	if (lt->mt)
+		err = media_thread_call(lt->mt, lat_listen, lt);
+	else
+		err = lat_listen(lt);
+	ASSERT_EQ(0, err);
+
+	tmr_init(&lt->tmr_busy);
+	tmr_start(&lt->tmr_busy, 1, busy_handler, lt);
+
+	pthread_create(&tid, NULL, lat_sender, lt);
+	err = re_main(NULL);
+	pthread_join(tid, NULL);
+
+	tmr_cancel(&lt->tmr_busy);
+
+	if (lt->mt)
+		media_thread_call(lt->mt, lat_close, lt);
+	else
+		lat_close(lt);
+
+	ASSERT_EQ(0, err);
+}
+
+
+static void lat_print(const char *name, const struct lat_test *lt)
+{
+	size_t b;
+
+	printf("%-12s %3u pkts:", name, lt->n);
+	for (b = 0; b < LAT_BUCKETS - 1; b++)
+		printf(" <%lluus:%llu", (unsigned long long)lat_limits[b],
+		       (unsigned long long)lt->hist[b]);
+	printf(" >=%lluus:%llu\n",
+	       (unsigned long long)lat_limits[LAT_BUCKETS - 2],
+	       (unsigned long long)lt->hist[LAT_BUCKETS - 1]);
+}
+
+
+TEST(msystem, media_thread_receive)
+{
+	struct lat_test main_lt, mt_lt;
+	int err;
+
+	memset(&main_lt, 0, sizeof(main_lt));
+	memset(&mt_lt, 0, sizeof(mt_lt));
+
+	err = media_thread_alloc(&mt_lt.mt, "test");
+	ASSERT_EQ(0, err);
+
+	lat_run(&main_lt);
+	lat_run(&mt_lt);
+
+	lat_print("main thread", &main_lt);
+	lat_print("media thread", &mt_lt);
+
+	ASSERT_GT(main_lt.n, 0u);
+	ASSERT_GT(mt_lt.n, 0u);
+
+	/* the main thread only reads its socket when it is idle */
+	ASSERT_EQ(0u, main_lt.n_on_mt);
+	ASSERT_EQ(0u, main_lt.n_while_busy);
+
+	/* every packet was handed to the media thread, which reads them
+	 * while the main thread is busy */
+	ASSERT_EQ(mt_lt.n, mt_lt.n_on_mt);
+	ASSERT_GT(mt_lt.n_while_busy, 0u);
+
+	mem_deref(mt_lt.mt);
+}
+
+
+static uint64_t init_once(struct msystem_config *config, uint8_t *fp)
+{
+	struct msystem *msys = NULL;
+	uint64_t t;
+	int err;
+
+	t = now_usec();
+	err = msystem_get(&msys, "audummy", config);
+	t = now_usec() - t;
+	if (err)
+		return 0;
+
+	err = tls_fingerprint(msystem_dtls(msys), TLS_FINGERPRINT_SHA256,
+			      fp, 32);
+	mem_deref(msys);
+
+	return err ? 0 : t;
+}
+
+
+/* startup time of msystem, with and without a cached certificate */
+TEST(msystem, init_time)
+{
+#define INIT_RUNS 10
+	struct msystem_config config;
+	struct store *st = NULL;
+	struct sobject *so = NULL;
+	struct tls *tls = NULL;
+	char tmp[256] = "/tmp/ztest_msys_XXXXXX";
+	char path[512];
+	struct stat sb;
+	uint8_t fp_first[32], fp[32];
+	uint64_t t, t_gen = 0, t_cached = 0;
+	size_t len;
+	char *dir;
+	int i, err;
+
+	dir = mkdtemp(tmp);
+	ASSERT_TRUE(dir != NULL);
+
+	err = store_alloc(&st, dir);
+	ASSERT_EQ(0, err);
+
+	memset(&config, 0, sizeof(config));
+
+	/* a new certificate every time */
+	for (i = 0; i < INIT_RUNS; i++) {
+		t = init_once(NULL, fp);
+		ASSERT_GT(t, 0u);
+		t_gen += t;
+	}
+
+	/* the first one generates and saves it */
+	config.cert_store = st;
+	ASSERT_GT(init_once(&config, fp_first), 0u);
+
+	for (i = 0; i < INIT_RUNS; i++) {
+		t = init_once(&config, fp);
+		ASSERT_GT(t, 0u);
+		t_cached += t;
+
+		ASSERT_EQ(0, memcmp(fp_first, fp, sizeof(fp)));
+	}
+
+	printf("msystem init: generated cert %lluus,"
+	       " cached cert %lluus (average of %d)\n",
+	       (unsigned long long)t_gen / INIT_RUNS,
+	       (unsigned long long)t_cached / INIT_RUNS, INIT_RUNS);
+
+	/* the key is only readable by the user */
+	re_snprintf(path, sizeof(path), "%s/global/cert/dtls", dir);
+	ASSERT_EQ(0, stat(path, &sb));
+	ASSERT_EQ(0600, sb.st_mode & 0777);
+
+	/* without the store, it is a different one */
+	ASSERT_GT(init_once(NULL, fp), 0u);
+	ASSERT_NE(0, memcmp(fp_first, fp, sizeof(fp)));
+
+	/* a length longer than the file is not allocated */
+	err = store_global_open(&so, st, "cert", "dtls", "wb");
+	ASSERT_EQ(0, err);
+	len = (size_t)1 << 40;
+	err  = sobject_write_u32(so, 1);
+	err |= sobject_write_u64(so, (uint64_t)time(NULL));
+	err |= sobject_write(so, (uint8_t *)&len, sizeof(len));
+	ASSERT_EQ(0, err);
+	so = (struct sobject *)mem_deref(so);
+
+	err = tls_alloc(&tls, TLS_METHOD_DTLS, NULL, NULL);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(EPROTO, cert_tls_load(tls, st, "dtls", 0, NULL));
+	mem_deref(tls);
+
+	mem_deref(st);
+	store_remove_pathf("%s", dir);
+}
+
+
+TEST(msystem, lazy_init)
+{
+	struct msystem_config config;
+	struct msystem *msys = NULL;
+	const struct msystem_trace *trace;
+	char buf[256];
+	int err;
+
+	memset(&config, 0, sizeof(config));
+	config.lazy_init = true;
+
+	err = msystem_get(&msys, "audummy", &config);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(msystem_is_initialized(msys));
+	ASSERT_FALSE(msystem_is_prepared(msys));
+	ASSERT_TRUE(msystem_dtls(msys) == NULL);
+	ASSERT_EQ(0, list_count(msystem_aucodecl(msys)));
+
+	trace = msystem_trace(msys);
+	ASSERT_EQ(1, trace->stepc);
+
+	/* the first call brings up the rest */
+	err = msystem_prepare(msys);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(msystem_is_prepared(msys));
+	ASSERT_TRUE(msystem_dtls(msys) != NULL);
+	ASSERT_GT(list_count(msystem_aucodecl(msys)), 0u);
+
+	ASSERT_EQ(3, trace->stepc);
+	ASSERT_STREQ("dtls", trace->stepv[1].name);
+	ASSERT_STREQ("engines", trace->stepv[2].name);
+
+	/* only once */
+	err = msystem_prepare(msys);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(3, trace->stepc);
+
+	re_snprintf(buf, sizeof(buf), "%H", msystem_trace_debug, msys);
+	printf("msystem startup: %s\n", buf);
+
+	mem_deref(msys);
+}
@@ -15,8 +15,11 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <pthread.h>
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
+#include <avs_lockedqueue.h>
 #include <gtest/gtest.h>
 
 
@@ -63,3 +66,410 @@ TEST(packetqueue, 1)
 
 	mem_deref(pq);
 }
+
+
+TEST(packetqueue, full_and_batch)
+{
+	packet_queue_t *pq = 0;
+	const struct packet_queue_item_t *itemv[8];
+	uint8_t pkt[PACKET_QUEUE_SLOT_SIZE + 1];
+	size_t i, n;
+	int err;
+
+	err = packet_queue_alloc_ext(&pq, PACKET_QUEUE_SPSC, 3, false);
+	ASSERT_EQ(0, err);
+
+	err = packet_queue_push(pq, PACKET_TYPE_RTP, pkt, sizeof(pkt));
+	ASSERT_EQ(EOVERFLOW, err);
+
+	// capacity is rounded up to 4
+	for (i = 0; i < 4; i++) {
+		pkt[0] = i;
+		err = packet_queue_push(pq, PACKET_TYPE_RTP, pkt, 1 + i);
+		ASSERT_EQ(0, err);
+	}
+	err = packet_queue_push(pq, PACKET_TYPE_RTP, pkt, 1);
+	ASSERT_EQ(ENOSPC, err);
+	ASSERT_EQ(1, packet_queue_dropped(pq));
+	ASSERT_EQ(4, packet_queue_count(pq));
+
+	n = packet_queue_pop_batch(pq, itemv, 3);
+	ASSERT_EQ(3, n);
+	for (i = 0; i < n; i++) {
+		ASSERT_EQ(i + 1, itemv[i]->packet_size);
+		ASSERT_EQ(i, itemv[i]->packet_data[0]);
+	}
+
+	// not released yet, still full
+	err = packet_queue_push(pq, PACKET_TYPE_RTP, pkt, 1);
+	ASSERT_EQ(ENOSPC, err);
+
+	packet_queue_release(pq, n);
+	ASSERT_EQ(1, packet_queue_count(pq));
+
+	pkt[0] = 42;
+	err = packet_queue_push(pq, PACKET_TYPE_RTCP, pkt, 1);
+	ASSERT_EQ(0, err);
+
+	n = packet_queue_pop_batch(pq, itemv, 8);
+	ASSERT_EQ(2, n);
+	ASSERT_EQ(3, itemv[0]->packet_data[0]);
+	ASSERT_EQ(PACKET_TYPE_RTCP, itemv[1]->packet_type);
+	ASSERT_EQ(42, itemv[1]->packet_data[0]);
+	packet_queue_release(pq, n);
+
+	ASSERT_EQ(0, packet_queue_pop_batch(pq, itemv, 8));
+
+	mem_deref(pq);
+}
+
+
+#define BENCH_PACKETS   200000
+#define BENCH_PKT_SIZE  200
+
+struct bench_item {
+	struct le le;
+	uint8_t data[BENCH_PKT_SIZE];
+};
+
+struct producer {
+	pthread_t tid;
+	packet_queue_t *pq;
+	struct locked_queue_t *lq;
+	size_t npkts;
+};
+
+static void *producer_thread(void *arg)
+{
+	struct producer *p = (struct producer *)arg;
+	uint8_t pkt[BENCH_PKT_SIZE];
+	size_t i;
+
+	memset(pkt, 0xa5, sizeof(pkt));
+
+	for (i = 0; i < p->npkts; i++) {
+
+		uint32_t seq = (uint32_t)i;
+
+		memcpy(pkt, &seq, sizeof(seq));
+
+		if (p->pq) {
+			while (packet_queue_push(p->pq, PACKET_TYPE_RTP,
+						 pkt, sizeof(pkt)) == ENOSPC)
+				sched_yield();
+		}
+		else {
+			struct bench_item *item;
+
+			/* what packet_queue used to do per packet */
+			item = (struct bench_item *)
+				mem_zalloc(sizeof(*item), NULL);
+			memcpy(item->data, pkt, sizeof(pkt));
+			locked_queue_push(p->lq, &item->le, item);
+		}
+	}
+
+	return NULL;
+}
+
+static double time_diff_ms(const struct timeval *start)
+{
+	struct timeval now, res;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &res);
+
+	return (double)res.tv_sec * 1000.0 + (double)res.tv_usec / 1000.0;
+}
+
+static void packetqueue_bench(enum packet_queue_mode mode, size_t nprod)
+{
+	packet_queue_t *pq = 0;
+	struct producer prodv[4];
+	struct timeval start;
+	size_t i, total = 0;
+	size_t bad_size = 0, bad_order = 0;
+	uint32_t last_seq = 0;
+	double ms;
+	int err;
+
+	ASSERT_TRUE(nprod <= 4);
+
+	err = packet_queue_alloc_ext(&pq, mode, 1024, true);
+	ASSERT_EQ(0, err);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nprod; i++) {
+		prodv[i].pq = pq;
+		prodv[i].lq = NULL;
+		prodv[i].npkts = BENCH_PACKETS / nprod;
+		pthread_create(&prodv[i].tid, NULL, producer_thread, &prodv[i]);
+	}
+
+	/* the producers use pq until they are joined, so keep on
+	 * draining and only count the errors until then */
+	while (total < (BENCH_PACKETS / nprod) * nprod) {
+		const struct packet_queue_item_t *itemv[32];
+		size_t n;
+
+		n = packet_queue_pop_batch(pq, itemv, 32);
+		for (i = 0; i < n; i++) {
+			if (itemv[i]->packet_size != BENCH_PKT_SIZE)
+				++bad_size;
+
+			/* single producer must be in order */
+			if (nprod == 1) {
+				uint32_t seq;
+
+				memcpy(&seq, itemv[i]->packet_data,
+				       sizeof(seq));
+				if (total + i != 0 && seq != last_seq + 1)
+					++bad_order;
+				last_seq = seq;
+			}
+		}
+		packet_queue_release(pq, n);
+		total += n;
+	}
+
+	ms = time_diff_ms(&start);
+
+	for (i = 0; i < nprod; i++)
+		pthread_join(prodv[i].tid, NULL);
+
+	EXPECT_EQ(0u, bad_size);
+	EXPECT_EQ(0u, bad_order);
+
+	printf("packetqueue(%s, %zu producers): %zu packets in %.1f ms"
+	       " (%.0f packets/sec)\n",
+	       mode == PACKET_QUEUE_SPSC ? "spsc" : "mpsc", nprod,
+	       total, ms, ms > 0 ? 1000.0 * total / ms : 0);
+
+	mem_deref(pq);
+}
+
+
+TEST(packetqueue, throughput_spsc)
+{
+	packetqueue_bench(PACKET_QUEUE_SPSC, 1);
+}
+
+
+TEST(packetqueue, throughput_mpsc)
+{
+	packetqueue_bench(PACKET_QUEUE_MPSC, 4);
+}
+
+
+TEST(packetqueue, throughput_locked_queue)
+{
+	struct locked_queue_t *lq = 0;
+	struct producer prod;
+	struct timeval start;
+	size_t total = 0;
+	double ms;
+	int err;
+
+	err = locked_queue_alloc(&lq, true);
+	ASSERT_EQ(0, err);
+
+	gettimeofday(&start, NULL);
+
+	prod.pq = NULL;
+	prod.lq = lq;
+	prod.npkts = BENCH_PACKETS;
+	pthread_create(&prod.tid, NULL, producer_thread, &prod);
+
+	while (total < BENCH_PACKETS) {
+		struct le *le;
+
+		err = locked_queue_pop(lq, &le);
+		if (err)
+			break;
+		mem_deref(le->data);
+		++total;
+	}
+
+	ms = time_diff_ms(&start);
+
+	/* the producer is done with lq only when joined */
+	pthread_join(prod.tid, NULL);
+
+	EXPECT_EQ(0, err);
+
+	printf("locked_queue: %zu packets in %.1f ms (%.0f packets/sec)\n",
+	       total, ms, ms > 0 ? 1000.0 * total / ms : 0);
+
+	mem_deref(lq);
+}
+
+
+TEST(packetpool, get_and_recycle)
+{
+	struct packet_pool *pool = NULL;
+	struct packet_pool_stats stats;
+	struct mbuf *mb1, *mb2, *mb3;
+	uint8_t *buf1;
+	int err;
+
+	err = packet_pool_alloc(&pool, 2, 1500);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(pool != NULL);
+
+	mb1 = packet_pool_get(pool, 36);
+	ASSERT_TRUE(mb1 != NULL);
+	ASSERT_EQ(36, mb1->pos);
+	ASSERT_EQ(36, mb1->end);
+	ASSERT_TRUE(mb1->size >= 1500);
+
+	mb2 = packet_pool_get(pool, 0);
+	ASSERT_TRUE(mb2 != NULL);
+	ASSERT_TRUE(mb1 != mb2);
+
+	// pool is empty, should allocate a new buffer
+	mb3 = packet_pool_get(pool, 0);
+	ASSERT_TRUE(mb3 != NULL);
+	ASSERT_TRUE(mb3 != mb1 && mb3 != mb2);
+
+	packet_pool_stats(pool, &stats);
+	ASSERT_EQ(2, stats.hits);
+	ASSERT_EQ(1, stats.misses);
+
+	// releasing the buffer returns its data to the pool
+	buf1 = mb1->buf;
+	mem_deref(mb3);
+	mem_deref(mb1);
+	mb3 = packet_pool_get(pool, 0);
+	ASSERT_TRUE(mb3->buf == buf1);
+
+	packet_pool_stats(pool, &stats);
+	ASSERT_EQ(3, stats.hits);
+	ASSERT_EQ(1, stats.misses);
+
+	// buffers in use outlive the pool
+	mem_deref(pool);
+	ASSERT_EQ(0, mbuf_write_u32(mb2, 0x01020304));
+	mem_deref(mb2);
+	mem_deref(mb3);
+}
+
+
+TEST(packetpool, no_allocation_per_packet)
+{
+	struct packet_pool *pool = NULL;
+	struct packet_pool_stats stats;
+	struct mbuf *mb, *first;
+	int err;
+
+	err = packet_pool_alloc(&pool, 1, 1500);
+	ASSERT_EQ(0, err);
+
+	first = packet_pool_get(pool, 0);
+	ASSERT_TRUE(first != NULL);
+	mem_deref(first);
+
+	/* the same mbuf comes back every time */
+	for (int i = 0; i < 1000; i++) {
+		mb = packet_pool_get(pool, 36);
+		ASSERT_TRUE(mb == first);
+		ASSERT_EQ(36, mb->pos);
+		ASSERT_EQ(36, mb->end);
+		ASSERT_EQ(0, mbuf_write_u32(mb, i));
+		mem_deref(mb);
+	}
+
+	packet_pool_stats(pool, &stats);
+	ASSERT_EQ(1001u, stats.hits);
+	ASSERT_EQ(0u, stats.misses);
+	ASSERT_EQ(0u, stats.allocs);
+
+	/* only a miss allocates */
+	first = packet_pool_get(pool, 0);
+	mb = packet_pool_get(pool, 0);
+	ASSERT_TRUE(mb != NULL);
+	packet_pool_stats(pool, &stats);
+	ASSERT_EQ(1u, stats.misses);
+	ASSERT_EQ(1u, stats.allocs);
+
+	mem_deref(mb);
+	mem_deref(first);
+	mem_deref(pool);
+}
+
+
+#define POOL_THREADS 4
+#define POOL_ROUNDS 20000
+
+
+struct pool_user {
+	pthread_t tid;
+	struct packet_pool *pool;
+	uint8_t id;
+	unsigned errors;
+};
+
+
+static void *pool_user_thread(void *arg)
+{
+	struct pool_user *pu = (struct pool_user *)arg;
+
+	for (unsigned i = 0; i < POOL_ROUNDS; i++) {
+
+		struct mbuf *mb = packet_pool_get(pu->pool, 0);
+		size_t j;
+
+		if (!mb) {
+			++pu->errors;
+			continue;
+		}
+
+		memset(mb->buf, pu->id, 64);
+		sched_yield();
+
+		/* nobody else may have been given the same buffer */
+		for (j = 0; j < 64; j++) {
+			if (mb->buf[j] != pu->id) {
+				++pu->errors;
+				break;
+			}
+		}
+
+		mem_deref(mb);
+	}
+
+	return NULL;
+}
+
+
+TEST(packetpool, threads)
+{
+	struct pool_user userv[POOL_THREADS];
+	struct packet_pool *pool = NULL;
+	struct packet_pool_stats stats;
+	int err;
+
+	err = packet_pool_alloc(&pool, 2, 1500);
+	ASSERT_EQ(0, err);
+
+	for (int i = 0; i < POOL_THREADS; i++) {
+		userv[i].pool = pool;
+		userv[i].id = i + 1;
+		userv[i].errors = 0;
+		pthread_create(&userv[i].tid, NULL, pool_user_thread,
+			       &userv[i]);
+	}
+
+	for (int i = 0; i < POOL_THREADS; i++)
+		pthread_join(userv[i].tid, NULL);
+	for (int i = 0; i < POOL_THREADS; i++)
+		ASSERT_EQ(0u, userv[i].errors);
+
+	packet_pool_stats(pool, &stats);
+	ASSERT_EQ((uint64_t)POOL_THREADS * POOL_ROUNDS,
+		  stats.hits + stats.misses);
+	ASSERT_GT(stats.hits, 0u);
+	ASSERT_EQ(stats.misses, stats.allocs);
+
+	mem_deref(pool);
+}
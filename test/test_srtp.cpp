@@ -15,6 +15,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <sys/time.h>
 #include <re.h>
 #include <gtest/gtest.h>
 #include <avs.h>
@@ -54,3 +55,209 @@ TEST(srtp, srtcp_packet)
 	mem_deref(srtp);
 	mem_deref(mb);
 }
+
+
+#define BENCH_PACKETS 32768
+#define BENCH_BATCH   32
+
+
+static double time_diff_ms(const struct timeval *start)
+{
+	struct timeval now, res;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &res);
+
+	return (double)res.tv_sec * 1000.0 + (double)res.tv_usec / 1000.0;
+}
+
+
+static void make_packets(struct mbuf **mbv, size_t n, size_t size,
+			 uint16_t seq)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct rtp_header hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.ver  = RTP_VERSION;
+		hdr.pt   = 96;
+		hdr.seq  = (uint16_t)(seq + i);
+		hdr.ts   = (uint32_t)((seq + i) * 960);
+		hdr.ssrc = 0x12345678;
+
+		mbv[i] = mbuf_alloc(size + 64);
+		ASSERT_TRUE(mbv[i] != NULL);
+		ASSERT_EQ(0, rtp_hdr_encode(mbv[i], &hdr));
+		ASSERT_EQ(0, mbuf_fill(mbv[i], (uint8_t)i,
+				       size - RTP_HEADER_SIZE));
+		mbv[i]->pos = 0;
+	}
+}
+
+
+/* reuse the decrypted packets as the next ones, with new sequence numbers */
+static void next_packets(struct mbuf **mbv, size_t n, size_t size,
+			 uint16_t seq)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		mbv[i]->pos = 0;
+		mbv[i]->end = size;
+		mbv[i]->buf[2] = (uint8_t)((seq + i) >> 8);
+		mbv[i]->buf[3] = (uint8_t)(seq + i);
+	}
+}
+
+
+/*
+ * The batch calls loop over the per-packet ones, so both should come out
+ * about the same. The packets are allocated once, outside of the timing.
+ */
+static void srtp_bench(enum srtp_suite suite, size_t keylen, size_t size)
+{
+	struct srtp *tx = NULL, *rx = NULL;
+	struct mbuf *mbv[BENCH_BATCH];
+	int errv[BENCH_BATCH];
+	struct timeval start;
+	uint8_t key[46];
+	double ms_pkt, ms_batch;
+	size_t i, j;
+	int err;
+
+	ASSERT_TRUE(keylen <= sizeof(key));
+	for (i = 0; i < keylen; i++)
+		key[i] = (uint8_t)(i * 7 + 1);
+
+	/* per packet */
+	err  = srtp_alloc(&tx, suite, key, keylen, 0);
+	err |= srtp_alloc(&rx, suite, key, keylen, 0);
+	ASSERT_EQ(0, err);
+
+	make_packets(mbv, BENCH_BATCH, size, 0);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < BENCH_PACKETS / BENCH_BATCH; i++) {
+
+		next_packets(mbv, BENCH_BATCH, size, i * BENCH_BATCH);
+
+		for (j = 0; j < BENCH_BATCH; j++) {
+			ASSERT_EQ(0, srtp_encrypt(tx, mbv[j]));
+			mbv[j]->pos = 0;
+			ASSERT_EQ(0, srtp_decrypt(rx, mbv[j]));
+			ASSERT_EQ(size, mbuf_get_left(mbv[j]));
+		}
+	}
+
+	ms_pkt = time_diff_ms(&start);
+
+	for (j = 0; j < BENCH_BATCH; j++)
+		mem_deref(mbv[j]);
+	mem_deref(tx);
+	mem_deref(rx);
+
+	/* batched */
+	err  = srtp_alloc(&tx, suite, key, keylen, 0);
+	err |= srtp_alloc(&rx, suite, key, keylen, 0);
+	ASSERT_EQ(0, err);
+
+	make_packets(mbv, BENCH_BATCH, size, 0);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < BENCH_PACKETS / BENCH_BATCH; i++) {
+
+		next_packets(mbv, BENCH_BATCH, size, i * BENCH_BATCH);
+
+		ASSERT_EQ(0, srtp_batch_encrypt(tx, mbv, BENCH_BATCH, errv));
+		for (j = 0; j < BENCH_BATCH; j++)
+			mbv[j]->pos = 0;
+		ASSERT_EQ(0, srtp_batch_decrypt(rx, mbv, BENCH_BATCH, errv));
+
+		for (j = 0; j < BENCH_BATCH; j++) {
+			ASSERT_EQ(size, mbuf_get_left(mbv[j]));
+			ASSERT_EQ((uint8_t)j, mbv[j]->buf[size - 1]);
+		}
+	}
+
+	ms_batch = time_diff_ms(&start);
+
+	for (j = 0; j < BENCH_BATCH; j++)
+		mem_deref(mbv[j]);
+	mem_deref(tx);
+	mem_deref(rx);
+
+	printf("srtp(%s, %zu bytes): %u packets, per-packet %.1f ms"
+	       " (%.0f packets/sec), batch %.1f ms (%.0f packets/sec)\n",
+	       srtp_suite_name(suite), size, BENCH_PACKETS,
+	       ms_pkt, ms_pkt > 0 ? 1000.0 * BENCH_PACKETS / ms_pkt : 0,
+	       ms_batch, ms_batch > 0 ? 1000.0 * BENCH_PACKETS / ms_batch : 0);
+}
+
+
+TEST(srtp, batch_mixed_rtp_rtcp)
+{
+	static const uint8_t rtcp[] = {
+		0x80, 0xc9, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+	};
+	struct srtp *tx = NULL, *rx = NULL;
+	struct mbuf *mbv[3];
+	int errv[3];
+	uint8_t key[30];
+	int err;
+
+	memset(key, 0x42, sizeof(key));
+
+	err  = srtp_alloc(&tx, SRTP_AES_CM_128_HMAC_SHA1_80,
+			  key, sizeof(key), 0);
+	err |= srtp_alloc(&rx, SRTP_AES_CM_128_HMAC_SHA1_80,
+			  key, sizeof(key), 0);
+	ASSERT_EQ(0, err);
+
+	make_packets(mbv, 2, 200, 0);
+
+	/* an RTCP packet in the middle */
+	mbv[2] = mbv[1];
+	mbv[1] = mbuf_alloc(64);
+	ASSERT_TRUE(mbv[1] != NULL);
+	mbuf_write_mem(mbv[1], rtcp, sizeof(rtcp));
+	mbv[1]->pos = 0;
+
+	ASSERT_EQ(0, srtp_batch_encrypt(tx, mbv, 3, errv));
+	ASSERT_EQ(22, mbuf_get_left(mbv[1]));   /* SRTCP index + tag */
+	ASSERT_EQ(210, mbuf_get_left(mbv[0]));  /* SRTP auth tag */
+
+	mbv[0]->pos = mbv[1]->pos = mbv[2]->pos = 0;
+
+	/* corrupt the first packet */
+	mbv[0]->buf[20] ^= 0x01;
+
+	ASSERT_EQ(1, srtp_batch_decrypt(rx, mbv, 3, errv));
+	ASSERT_NE(0, errv[0]);
+	ASSERT_EQ(0, errv[1]);
+	ASSERT_EQ(0, errv[2]);
+	ASSERT_EQ(sizeof(rtcp), mbuf_get_left(mbv[1]));
+	ASSERT_EQ(200, mbuf_get_left(mbv[2]));
+
+	mem_deref(mbv[0]);
+	mem_deref(mbv[1]);
+	mem_deref(mbv[2]);
+	mem_deref(tx);
+	mem_deref(rx);
+}
+
+
+TEST(srtp, batch_throughput)
+{
+	static const size_t sizev[] = {200, 1200};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(sizev); i++) {
+		srtp_bench(SRTP_AES_CM_128_HMAC_SHA1_80, 30, sizev[i]);
+		srtp_bench(SRTP_AES_128_GCM, 28, sizev[i]);
+		srtp_bench(SRTP_AES_256_GCM, 44, sizev[i]);
+	}
+}
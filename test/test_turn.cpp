@@ -388,6 +388,125 @@ TEST_F(TestTurn, allocation_failure_441)
 }
 
 
+struct pool_test {
+	struct turn_pool *pool;
+	struct list connl;
+	struct tmr tmr;
+	char url[64];
+	struct sa relayv[2];
+	unsigned n_estab;
+	unsigned n_take;
+	unsigned n_miss;
+};
+
+
+static void pool_estab_handler(struct turn_conn *conn,
+			       const struct sa *relay_addr,
+			       const struct sa *mapped_addr,
+			       const struct stun_msg *msg, void *arg)
+{
+	struct pool_test *pt = (struct pool_test *)arg;
+
+	ASSERT_TRUE(sa_isset(relay_addr, SA_ALL));
+	ASSERT_TRUE(sa_isset(mapped_addr, SA_ALL));
+	ASSERT_TRUE(msg == NULL);
+
+	/* nothing to wait for, the allocation is there */
+	ASSERT_TRUE(conn->turn_allocated);
+	ASSERT_EQ(0, turnconn_add_permission(conn, relay_addr));
+
+	pt->relayv[pt->n_estab++] = *relay_addr;
+
+	if (pt->n_estab == 2)
+		re_cancel();
+}
+
+
+static void pool_error_handler(int err, void *arg)
+{
+	(void)arg;
+
+	warning("turnpool error (%m)\n", err);
+	re_cancel();
+}
+
+
+static void pool_tmr_handler(void *arg)
+{
+	struct pool_test *pt = (struct pool_test *)arg;
+	int err;
+
+	if (pt->n_take < 2) {
+		err = turnpool_take(pt->pool, NULL, &pt->connl, pt->url,
+				    AF_INET, pool_estab_handler, NULL,
+				    pool_error_handler, pt);
+		if (err == 0) {
+			++pt->n_take;
+
+			/* taken, the next one is not ready yet */
+			err = turnpool_take(pt->pool, NULL, &pt->connl,
+					    pt->url, AF_INET,
+					    pool_estab_handler, NULL,
+					    pool_error_handler, pt);
+			ASSERT_EQ(ENOENT, err);
+		}
+		else {
+			ASSERT_EQ(ENOENT, err);
+			++pt->n_miss;
+		}
+	}
+
+	tmr_start(&pt->tmr, 5, pool_tmr_handler, pt);
+}
+
+
+TEST(turn, pool_handover)
+{
+	struct pool_test pt;
+	TurnServer srv;
+	int err;
+
+	memset(&pt, 0, sizeof(pt));
+	list_init(&pt.connl);
+	tmr_init(&pt.tmr);
+
+	err = turnpool_alloc(&pt.pool, 0, 0);
+	ASSERT_EQ(0, err);
+
+	re_snprintf(pt.url, sizeof(pt.url), "turn:%J", &srv.addr);
+
+	err = turnpool_add(pt.pool, pt.url, "user", "pass");
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(turnpool_find(pt.pool, pt.url));
+
+	/* TCP is not pooled */
+	err = turnpool_add(pt.pool, "turn:127.0.0.1:3478?transport=tcp",
+			   "user", "pass");
+	ASSERT_EQ(0, err);
+	ASSERT_FALSE(turnpool_find(pt.pool,
+				   "turn:127.0.0.1:3478?transport=tcp"));
+
+	turnpool_start(pt.pool, AF_INET);
+	tmr_start(&pt.tmr, 0, pool_tmr_handler, &pt);
+
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(2, pt.n_take);
+	ASSERT_EQ(2, pt.n_estab);
+	ASSERT_GE(pt.n_miss, 1);
+	ASSERT_EQ(2, list_count(&pt.connl));
+	ASSERT_FALSE(sa_cmp(&pt.relayv[0], &pt.relayv[1], SA_ALL));
+
+	tmr_cancel(&pt.tmr);
+	mem_deref(pt.pool);
+
+	/* the connections taken are owned by us */
+	ASSERT_EQ(2, list_count(&pt.connl));
+	list_flush(&pt.connl);
+}
+
+
 TEST(turn, uri)
 {
 	struct test {
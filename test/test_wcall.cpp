@@ -712,6 +712,46 @@ TEST(wcall, create_multiple)
 }
 
 
+/*
+ * API calls made before the re thread runs are queued in the ring, and
+ * on the overflow list when it is full. They are all handled with one
+ * wakeup.
+ */
+TEST(wcall, marshal_overflow)
+{
+#define MARSHAL_CMDS 600
+	char dbg[512];
+	void *wuser;
+	int err;
+
+	err = wcall_init();
+	ASSERT_EQ(0, err);
+
+	wuser = wcall_create("abc", "123", NULL, NULL, NULL, NULL, NULL,
+			     NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+	ASSERT_TRUE(wuser != NULL);
+
+	for (int i = 0; i < MARSHAL_CMDS; i++)
+		wcall_network_changed(wuser);
+
+	re_snprintf(dbg, sizeof(dbg), "%H", wcall_debug, wuser);
+	ASSERT_TRUE(strstr(dbg, "cmds=600 handled=0 drains=0 ") != NULL)
+		<< dbg;
+	ASSERT_TRUE(strstr(dbg, "overflows=344 ") != NULL) << dbg;
+	ASSERT_TRUE(strstr(dbg, "max_depth=256/256") != NULL) << dbg;
+
+	(void)re_main_wait(100);
+
+	re_snprintf(dbg, sizeof(dbg), "%H", wcall_debug, wuser);
+	ASSERT_TRUE(strstr(dbg, "cmds=600 handled=600 drains=1 ") != NULL)
+		<< dbg;
+
+	wcall_destroy(wuser);
+
+	wcall_close();
+}
+
+
 #define NUM_CLIENTS 3
 
 